@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <app/tests.h>
+#include <lib/bcache.h>
+#include <lib/bio.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT_EQ(a, b)                                            \
+    do {                                                           \
+        typeof(a) _a = (a);                                        \
+        typeof(b) _b = (b);                                        \
+        if (_a != _b) {                                            \
+            panic("%lu != %lu (%s:%d)\n", (ulong)a, (ulong)b, __FILE__, __LINE__); \
+        }                                                          \
+    } while (0);
+
+#define ASSERT_TRUE(a)                                             \
+    do {                                                           \
+        if (!(a)) {                                                \
+            panic("%s is false (%s:%d)\n", #a, __FILE__, __LINE__); \
+        }                                                          \
+    } while (0);
+
+#define TEST_DEV_NAME "bcache_test"
+#define TEST_BLOCK_SIZE 512
+#define TEST_DEV_BLOCKS 256
+#define TEST_CACHE_BLOCKS 8
+
+/* the mem bdev is created once and stays around for the next run */
+static uint8_t *backing;
+
+/* the device's own hooks, wrapped to count the writes reaching it */
+static status_t (*mem_submit)(struct bdev *, bio_request_t *);
+static ssize_t (*mem_write)(struct bdev *, const void *, off_t, size_t);
+static uint device_writes;
+
+static status_t counting_submit(struct bdev *dev, bio_request_t *req) {
+    if (req->op == BIO_OP_WRITE)
+        device_writes++;
+    return mem_submit(dev, req);
+}
+
+static ssize_t counting_write(struct bdev *dev, const void *buf, off_t offset, size_t len) {
+    device_writes++;
+    return mem_write(dev, buf, offset, len);
+}
+
+static bdev_t *open_test_dev(void) {
+    if (!backing) {
+        backing = malloc(TEST_DEV_BLOCKS * TEST_BLOCK_SIZE);
+        ASSERT_TRUE(backing);
+        create_membdev(TEST_DEV_NAME, backing, TEST_DEV_BLOCKS * TEST_BLOCK_SIZE);
+    }
+
+    /* every block starts out holding its own number */
+    for (uint i = 0; i < TEST_DEV_BLOCKS; i++)
+        memset(backing + i * TEST_BLOCK_SIZE, i, TEST_BLOCK_SIZE);
+
+    bdev_t *dev = bio_open(TEST_DEV_NAME);
+    ASSERT_TRUE(dev);
+
+    mem_submit = dev->submit;
+    mem_write = dev->write;
+    dev->submit = counting_submit;
+    dev->write = counting_write;
+    device_writes = 0;
+
+    return dev;
+}
+
+static void close_test_dev(bdev_t *dev) {
+    dev->submit = mem_submit;
+    dev->write = mem_write;
+    bio_close(dev);
+}
+
+static void read_expect(bcache_t cache, uint block) {
+    uint8_t buf[TEST_BLOCK_SIZE];
+
+    ASSERT_EQ(0, bcache_read_block(cache, buf, block));
+    ASSERT_EQ((uint8_t)block, buf[0]);
+    ASSERT_EQ((uint8_t)block, buf[TEST_BLOCK_SIZE - 1]);
+}
+
+static void hit_miss_tests(bdev_t *dev) {
+    struct bcache_stats stats;
+    printf("running hit and miss tests...\n");
+
+    bcache_t cache = bcache_create(dev, TEST_BLOCK_SIZE, TEST_CACHE_BLOCKS);
+    ASSERT_TRUE(cache);
+
+    read_expect(cache, 0);
+    read_expect(cache, 0);
+    read_expect(cache, 1);
+    read_expect(cache, 0);
+
+    bcache_get_stats(cache, &stats);
+    ASSERT_EQ(2U, stats.hits);
+    ASSERT_EQ(2U, stats.misses);
+    ASSERT_EQ(2U, stats.reads);
+    ASSERT_EQ(0U, stats.evictions);
+
+    /* one more block than fits evicts exactly one */
+    for (uint i = 2; i <= TEST_CACHE_BLOCKS; i++)
+        read_expect(cache, i);
+
+    bcache_get_stats(cache, &stats);
+    ASSERT_EQ((uint32_t)TEST_CACHE_BLOCKS + 1, stats.misses);
+    ASSERT_EQ(1U, stats.evictions);
+    ASSERT_EQ(0U, stats.dirty_evictions);
+    ASSERT_EQ(0U, device_writes);
+
+    bcache_destroy(cache);
+}
+
+static void scan_tests(bdev_t *dev) {
+    struct bcache_stats stats;
+    const uint hot = TEST_CACHE_BLOCKS / 2;
+    printf("running scan resistance tests...\n");
+
+    bcache_t cache = bcache_create(dev, TEST_BLOCK_SIZE, TEST_CACHE_BLOCKS);
+    ASSERT_TRUE(cache);
+
+    /* a working set that is hit after being read in */
+    for (uint i = 0; i < hot; i++)
+        read_expect(cache, i);
+    for (uint i = 0; i < hot; i++)
+        read_expect(cache, i);
+
+    /* a scan as long as the whole cache, every block read once. with LRU
+     * replacement this would push out the working set */
+    for (uint i = 0; i < TEST_CACHE_BLOCKS; i++)
+        read_expect(cache, 100 + i);
+
+    bcache_get_stats(cache, &stats);
+    uint32_t misses = stats.misses;
+    ASSERT_EQ((uint32_t)hot + TEST_CACHE_BLOCKS, misses);
+    ASSERT_EQ((uint32_t)TEST_CACHE_BLOCKS - hot, stats.evictions);
+
+    /* the evictions came out of the scan, the working set is still there */
+    for (uint i = 0; i < hot; i++)
+        read_expect(cache, i);
+
+    bcache_get_stats(cache, &stats);
+    ASSERT_EQ(misses, stats.misses);
+    ASSERT_EQ(2U * hot, stats.hits);
+
+    bcache_destroy(cache);
+}
+
+/* dirty a cached block, filling it with pattern */
+static void dirty_block(bcache_t cache, uint block, uint8_t pattern) {
+    void *ptr;
+
+    ASSERT_EQ(0, bcache_get_block(cache, &ptr, block));
+    memset(ptr, pattern, TEST_BLOCK_SIZE);
+    ASSERT_EQ(0, bcache_mark_block_dirty(cache, block));
+    ASSERT_EQ(0, bcache_put_block(cache, block));
+}
+
+static void writeback_tests(bdev_t *dev) {
+    struct bcache_stats stats;
+    printf("running write back tests...\n");
+
+    bcache_t cache = bcache_create(dev, TEST_BLOCK_SIZE, TEST_CACHE_BLOCKS);
+    ASSERT_TRUE(cache);
+
+    /* a run of three, out of order, and one on its own */
+    dirty_block(cache, 11, 0xb1);
+    dirty_block(cache, 10, 0xb0);
+    dirty_block(cache, 20, 0xc0);
+    dirty_block(cache, 12, 0xb2);
+    ASSERT_EQ(0U, device_writes);
+
+    ASSERT_EQ(0, bcache_flush(cache));
+
+    bcache_get_stats(cache, &stats);
+    ASSERT_EQ(2U, device_writes);
+    ASSERT_EQ(2U, stats.writes);
+    ASSERT_EQ(4U, stats.blocks_written);
+
+    ASSERT_EQ((uint8_t)0xb0, backing[10 * TEST_BLOCK_SIZE]);
+    ASSERT_EQ((uint8_t)0xb1, backing[11 * TEST_BLOCK_SIZE + TEST_BLOCK_SIZE - 1]);
+    ASSERT_EQ((uint8_t)0xb2, backing[12 * TEST_BLOCK_SIZE]);
+    ASSERT_EQ((uint8_t)0xc0, backing[20 * TEST_BLOCK_SIZE]);
+    ASSERT_EQ((uint8_t)13, backing[13 * TEST_BLOCK_SIZE]);
+
+    /* nothing is left dirty */
+    ASSERT_EQ(0, bcache_flush(cache));
+    ASSERT_EQ(2U, device_writes);
+
+    bcache_destroy(cache);
+}
+
+static void sizing_tests(bdev_t *dev) {
+    printf("running sizing tests...\n");
+
+    /* clamped to the bounds, then to the device */
+    ASSERT_EQ(BCACHE_MIN_SIZE / 4096, bcache_blocks_for_size(dev, 4096, 0));
+    ASSERT_EQ(TEST_DEV_BLOCKS, bcache_blocks_for_size(dev, TEST_BLOCK_SIZE, BCACHE_MAX_SIZE * 2ULL));
+    ASSERT_EQ(1, bcache_blocks_for_size(dev, TEST_BLOCK_SIZE * TEST_DEV_BLOCKS, 0));
+}
+
+int bcache_tests(int argc, const console_cmd_args *argv) {
+    bdev_t *dev = open_test_dev();
+
+    hit_miss_tests(dev);
+    scan_tests(dev);
+    writeback_tests(dev);
+    sizing_tests(dev);
+
+    close_test_dev(dev);
+
+    printf("bcache tests passed\n");
+    return 0;
+}
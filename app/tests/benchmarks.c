@@ -16,7 +16,12 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
+#include <kernel/mp.h>
 #include <platform.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 const size_t BUFSIZE = (1024*1024);
 const uint ITER = 1024;
@@ -141,6 +146,176 @@ __NO_INLINE static void bench_memcpy(void) {
     free(buf);
 }
 
+/*
+ * Word at a time copies of the generic C routines in lib/libc/string, as a baseline for the
+ * arch specific ones. The empty asm hides the pointer arithmetic so the compiler doesn't turn
+ * the loops back into calls to memcpy and memset.
+ */
+__NO_INLINE static void *c_memcpy(void *dest, const void *src, size_t count) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    if (((uintptr_t)d ^ (uintptr_t)s) & (sizeof(long) - 1)) {
+        for (; count > 0; count--) {
+            *d++ = *s++;
+            __asm__("" : "+r"(d));
+        }
+        return dest;
+    }
+
+    for (; count > 0 && ((uintptr_t)d & (sizeof(long) - 1)); count--)
+        *d++ = *s++;
+    for (; count >= sizeof(long); count -= sizeof(long)) {
+        *(long *)d = *(const long *)s;
+        d += sizeof(long);
+        s += sizeof(long);
+        __asm__("" : "+r"(d));
+    }
+    for (; count > 0; count--)
+        *d++ = *s++;
+
+    return dest;
+}
+
+__NO_INLINE static void *c_memset(void *dest, int c, size_t count) {
+    uint8_t *d = dest;
+    unsigned long cc = (c & 0xff) * (~0UL / 0xff);
+
+    for (; count > 0 && ((uintptr_t)d & (sizeof(long) - 1)); count--)
+        *d++ = c;
+    for (; count >= sizeof(long); count -= sizeof(long)) {
+        *(unsigned long *)d = cc;
+        d += sizeof(long);
+        __asm__("" : "+r"(d));
+    }
+    for (; count > 0; count--)
+        *d++ = c;
+
+    return dest;
+}
+
+__NO_INLINE static int c_memcmp(const void *s1, const void *s2, size_t count) {
+    const uint8_t *a = s1, *b = s2;
+
+    for (; count > 0; count--, a++, b++) {
+        if (*a != *b)
+            return *a - *b;
+        __asm__("" : "+r"(a));
+    }
+    return 0;
+}
+
+#define STRING_SWEEP_MAX (4 * 1024 * 1024)
+#define STRING_SWEEP_BYTES (4 * 1024 * 1024)
+#define STRING_SWEEP_MIN_USECS 2000
+
+/* Throughput of one routine over a buffer in MB/s, which is bytes per usec.
+ * Timed with the hires clock rather than arch_cycle_count(), which is not
+ * implemented everywhere. Runs in batches touching STRING_SWEEP_BYTES until
+ * enough time has passed for the clock resolution not to matter. */
+static ulong string_sweep_rate(int routine, uint8_t *dst, uint8_t *src, size_t size) {
+    uint iter = MAX(1u, STRING_SWEEP_BYTES / size);
+    volatile int res = 0;
+    uint64_t bytes = 0;
+
+    lk_bigtime_t start = current_time_hires();
+    lk_bigtime_t elapsed;
+    do {
+        for (uint i = 0; i < iter; i++) {
+            switch (routine) {
+                case 0: memcpy(dst, src, size); break;
+                case 1: c_memcpy(dst, src, size); break;
+                case 2: memset(dst, 0, size); break;
+                case 3: c_memset(dst, 0, size); break;
+                case 4: res += memcmp(dst, src, size); break;
+                case 5: res += c_memcmp(dst, src, size); break;
+            }
+        }
+        bytes += (uint64_t)iter * size;
+        elapsed = current_time_hires() - start;
+    } while (elapsed < STRING_SWEEP_MIN_USECS);
+
+    return bytes / elapsed;
+}
+
+/* memcpy/memset/memcmp against the C versions, over sizes and (mis)alignments */
+__NO_INLINE static void bench_string_sweep(void) {
+    static const struct {
+        uint src, dst;
+    } align[] = { { 0, 0 }, { 1, 0 }, { 0, 3 }, { 5, 13 } };
+    static const char *names[] = { "memcpy", "c_memcpy", "memset", "c_memset", "memcmp", "c_memcmp" };
+
+    uint8_t *src = malloc(STRING_SWEEP_MAX + 64);
+    uint8_t *dst = malloc(STRING_SWEEP_MAX + 64);
+    if (!src || !dst) {
+        printf("failed to allocate buffers\n");
+        goto out;
+    }
+    memset(src, 0x5a, STRING_SWEEP_MAX + 64);
+
+    printf("string routines, MB/s\n");
+    printf("%8s %7s", "size", "src/dst");
+    for (uint r = 0; r < countof(names); r++)
+        printf(" %9s", names[r]);
+    printf("\n");
+
+    for (size_t size = 8; size <= STRING_SWEEP_MAX; size *= 2) {
+        for (uint a = 0; a < countof(align); a++) {
+            uint8_t *s = src + align[a].src;
+            uint8_t *d = dst + align[a].dst;
+
+            printf("%8zu %3u/%-3u", size, align[a].src, align[a].dst);
+            for (uint r = 0; r < countof(names); r++) {
+                /* memcmp runs over equal buffers, the worst case */
+                if (r == 4)
+                    memcpy(d, s, size);
+                printf(" %9lu", string_sweep_rate(r, d, s, size));
+            }
+            printf("\n");
+        }
+    }
+
+out:
+    free(src);
+    free(dst);
+}
+
+#define TIMER_BENCH_COUNT 10000
+
+static enum handler_return bench_timer_cb(struct timer *t, lk_time_t now, void *arg) {
+    return INT_NO_RESCHEDULE;
+}
+
+__NO_INLINE static void bench_timers(void) {
+    timer_t *t = malloc(sizeof(timer_t) * TIMER_BENCH_COUNT);
+    if (!t) {
+        printf("failed to allocate timers\n");
+        return;
+    }
+
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++)
+        timer_initialize(&t[i]);
+
+    /* deadlines are far enough out that none of them fire during the run */
+    ulong count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_set_oneshot(&t[i], 60000 + (rand() % 10000), bench_timer_cb, NULL);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %lu cycles to arm %u timers, %lu cycles/timer\n",
+           count, TIMER_BENCH_COUNT, count / TIMER_BENCH_COUNT);
+
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_cancel(&t[i]);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %lu cycles to cancel %u timers, %lu cycles/timer\n",
+           count, TIMER_BENCH_COUNT, count / TIMER_BENCH_COUNT);
+
+    free(t);
+}
+
 #if ARCH_ARM
 __NO_INLINE static void arm_bench_cset_stm(void) {
     uint32_t *buf = malloc(BUFSIZE);
@@ -235,10 +410,133 @@ __NO_INLINE static void bench_sincos(void) {
 
 #endif // WITH_LIB_LIBM
 
+#define MALLOC_BENCH_ALLOCS 64
+#define MALLOC_BENCH_ROUNDS 1024
+
+static int malloc_bench_thread(void *arg) {
+    size_t size = (size_t)(uintptr_t)arg;
+    void *ptrs[MALLOC_BENCH_ALLOCS];
+
+    for (uint r = 0; r < MALLOC_BENCH_ROUNDS; r++) {
+        for (uint i = 0; i < MALLOC_BENCH_ALLOCS; i++) {
+            ptrs[i] = malloc(size);
+        }
+        for (uint i = 0; i < MALLOC_BENCH_ALLOCS; i++) {
+            free(ptrs[i]);
+        }
+    }
+
+    return 0;
+}
+
+/* small malloc/free pairs on an increasing number of cpus at once */
+__NO_INLINE static void bench_malloc(void) {
+    static const size_t sizes[] = { 32, 256, 4096 };
+    thread_t *t[SMP_MAX_CPUS];
+
+    for (uint s = 0; s < countof(sizes); s++) {
+        for (uint cpus = 1; cpus <= SMP_MAX_CPUS; cpus++) {
+            if (!mp_is_cpu_active(cpus - 1))
+                break;
+
+            lk_bigtime_t time = current_time_hires();
+            for (uint i = 0; i < cpus; i++) {
+                t[i] = thread_create("malloc bench", &malloc_bench_thread, (void *)(uintptr_t)sizes[s],
+                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+                thread_set_pinned_cpu(t[i], i);
+                thread_resume(t[i]);
+            }
+            for (uint i = 0; i < cpus; i++) {
+                thread_join(t[i], NULL, INFINITE_TIME);
+            }
+            time = current_time_hires() - time;
+
+            uint64_t ops = (uint64_t)cpus * MALLOC_BENCH_ROUNDS * MALLOC_BENCH_ALLOCS * 2;
+            printf("malloc %zu bytes: %u cpus, %llu malloc+free ops in %llu usecs, %llu ops/ms\n",
+                   sizes[s], cpus, ops, time, time ? ops * 1000 / time : 0);
+        }
+    }
+}
+
+#if WITH_KERNEL_VM
+#define PMM_BENCH_PAGES 64
+#define PMM_BENCH_ROUNDS 256
+
+/* single page alloc/free straight through the arena lock, bypassing the per cpu caches */
+static vm_page_t *pmm_bench_alloc_locked(void) {
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    if (pmm_alloc_pages(1, &list) != 1)
+        return NULL;
+
+    return list_remove_head_type(&list, vm_page_t, node);
+}
+
+static void pmm_bench_free_locked(vm_page_t *page) {
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    list_add_head(&list, &page->node);
+    pmm_free(&list);
+}
+
+static int pmm_bench_thread(void *arg) {
+    bool cached = (bool)(uintptr_t)arg;
+    vm_page_t *pages[PMM_BENCH_PAGES];
+
+    for (uint r = 0; r < PMM_BENCH_ROUNDS; r++) {
+        uint count;
+        for (count = 0; count < PMM_BENCH_PAGES; count++) {
+            pages[count] = cached ? pmm_alloc_page() : pmm_bench_alloc_locked();
+            if (!pages[count])
+                break;
+        }
+        for (uint i = 0; i < count; i++) {
+            if (cached)
+                pmm_free_page(pages[i]);
+            else
+                pmm_bench_free_locked(pages[i]);
+        }
+    }
+
+    return 0;
+}
+
+__NO_INLINE static void bench_pmm(void) {
+    thread_t *t[SMP_MAX_CPUS];
+
+    for (uint cpus = 1; cpus <= SMP_MAX_CPUS; cpus++) {
+        if (!mp_is_cpu_active(cpus - 1))
+            break;
+
+        for (uint pass = 0; pass < 2; pass++) {
+            bool cached = pass == 1;
+
+            lk_bigtime_t time = current_time_hires();
+            for (uint i = 0; i < cpus; i++) {
+                t[i] = thread_create("pmm bench", &pmm_bench_thread, (void *)(uintptr_t)cached,
+                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+                thread_set_pinned_cpu(t[i], i);
+                thread_resume(t[i]);
+            }
+            for (uint i = 0; i < cpus; i++) {
+                thread_join(t[i], NULL, INFINITE_TIME);
+            }
+            time = current_time_hires() - time;
+
+            uint64_t ops = (uint64_t)cpus * PMM_BENCH_ROUNDS * PMM_BENCH_PAGES * 2;
+            printf("pmm %s: %u cpus, %llu page alloc+free ops in %llu usecs, %llu ops/ms\n",
+                   cached ? "per cpu cache" : "arena lock", cpus, ops, time,
+                   time ? ops * 1000 / time : 0);
+        }
+    }
+}
+#endif // WITH_KERNEL_VM
+
 int benchmarks(int argc, const console_cmd_args *argv) {
     bench_set_overhead();
     bench_memset();
     bench_memcpy();
+    bench_string_sweep();
 
     bench_cset_uint8_t();
     bench_cset_uint16_t();
@@ -246,6 +544,13 @@ int benchmarks(int argc, const console_cmd_args *argv) {
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_timers();
+    bench_malloc();
+
+#if WITH_KERNEL_VM
+    bench_pmm();
+#endif
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
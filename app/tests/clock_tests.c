@@ -37,6 +37,14 @@ int clock_tests(int argc, const console_cmd_args *argv) {
     c = arch_cycle_count() - c;
     printf("%lu cycles per current_time_hires()\n", c / CYCLE_COUNT_TRIES);
 
+    thread_sleep(100);
+    c = arch_cycle_count();
+    for (int i = 0; i < CYCLE_COUNT_TRIES; i++) {
+        current_time_ns();
+    }
+    c = arch_cycle_count() - c;
+    printf("%lu cycles per current_time_ns()\n", c / CYCLE_COUNT_TRIES);
+
     printf("making sure time never goes backwards\n");
     {
         printf("testing current_time()\n");
@@ -87,6 +95,56 @@ int clock_tests(int argc, const console_cmd_args *argv) {
         }
     }
 
+    printf("making sure current_time_hires() and current_time_ns() are always the same base\n");
+    {
+        lk_time_t start = current_time();
+        for (;;) {
+            t2 = current_time_hires();
+            lk_time_ns_t t3 = current_time_ns();
+            if (t2 > ((t3 + 500) / 1000)) {
+                printf("WARNING: current_time_hires() ahead of current_time_ns() %llu %llu\n", t2, t3);
+            }
+            if (current_time() - start > 1000)
+                break;
+        }
+    }
+
+    printf("measuring thread_sleep_ns() overshoot\n");
+    for (lk_time_ns_t delay = 10000; delay <= 10000000; delay *= 10) {
+        lk_time_ns_t worst = 0;
+        lk_time_ns_t total = 0;
+        for (int i = 0; i < 10; i++) {
+            lk_time_ns_t start = current_time_ns();
+            thread_sleep_ns(delay);
+            lk_time_ns_t slept = current_time_ns() - start;
+            if (slept < delay) {
+                printf("WARNING: thread_sleep_ns(%llu) woke early after %llu ns\n", delay, slept);
+                continue;
+            }
+            total += slept - delay;
+            if (slept - delay > worst)
+                worst = slept - delay;
+        }
+        printf("sleep %llu ns: avg overshoot %llu ns, worst %llu ns\n", delay, total / 10, worst);
+    }
+
+    printf("testing event_wait_deadline()\n");
+    {
+        event_t e;
+        event_init(&e, false, 0);
+        lk_time_ns_t deadline = current_time_ns() + 5000000;
+        status_t err = event_wait_deadline(&e, deadline);
+        lk_time_ns_t now = current_time_ns();
+        if (err != ERR_TIMED_OUT || now < deadline)
+            printf("WARNING: event_wait_deadline() returned %d, %lld ns from the deadline\n", err, (long long)(now - deadline));
+        if (event_wait_deadline(&e, 0) != ERR_TIMED_OUT)
+            printf("WARNING: event_wait_deadline() in the past did not time out\n");
+        event_signal(&e, false);
+        if (event_wait_deadline(&e, INFINITE_TIME_NS) != NO_ERROR)
+            printf("WARNING: event_wait_deadline() on a signaled event failed\n");
+        event_destroy(&e);
+    }
+
     printf("counting to 5, in one second intervals\n");
     for (int i = 0; i < 5; i++) {
         thread_sleep(1000);
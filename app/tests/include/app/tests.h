@@ -10,7 +10,9 @@
 
 #include <lk/console_cmd.h>
 
+int bcache_tests(int argc, const console_cmd_args *argv);
 int cbuf_tests(int argc, const console_cmd_args *argv);
+int object_cache_tests(int argc, const console_cmd_args *argv);
 int fibo(int argc, const console_cmd_args *argv);
 int port_tests(int argc, const console_cmd_args *argv);
 int spinner(int argc, const console_cmd_args *argv);
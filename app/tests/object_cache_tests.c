@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <app/tests.h>
+#include <assert.h>
+#include <lib/object_cache.h>
+#include <lib/page_alloc.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if WITH_LIB_MINIP
+#include <lib/pktbuf.h>
+#endif
+
+#define ASSERT_EQ(a, b)                                            \
+    do {                                                           \
+        typeof(a) _a = (a);                                        \
+        typeof(b) _b = (b);                                        \
+        if (_a != _b) {                                            \
+            panic("%lu != %lu (%s:%d)\n", (ulong)a, (ulong)b, __FILE__, __LINE__); \
+        }                                                          \
+    } while (0);
+
+#define ASSERT_TRUE(a)                                             \
+    do {                                                           \
+        if (!(a)) {                                                \
+            panic("%s is false (%s:%d)\n", #a, __FILE__, __LINE__); \
+        }                                                          \
+    } while (0);
+
+#define OBJECT_MAGIC 0x0bca11edU
+
+struct test_object {
+    uint32_t magic;
+    uint32_t serial;
+    uint8_t payload[40];
+};
+
+struct test_ctx {
+    uint constructed;
+    uint destructed;
+    uint fail_after;
+};
+
+static status_t test_ctor(void *object, void *arg) {
+    struct test_ctx *ctx = arg;
+    struct test_object *o = object;
+
+    if (ctx->fail_after > 0 && ctx->constructed == ctx->fail_after)
+        return ERR_NO_MEMORY;
+
+    o->magic = OBJECT_MAGIC;
+    o->serial = ctx->constructed++;
+    return NO_ERROR;
+}
+
+static void test_dtor(void *object, void *arg) {
+    struct test_ctx *ctx = arg;
+    struct test_object *o = object;
+
+    ASSERT_EQ(OBJECT_MAGIC, o->magic);
+    o->magic = 0;
+    ctx->destructed++;
+}
+
+static void basic_tests(void) {
+    object_cache_t cache;
+    printf("running basic tests...\n");
+
+    TYPED_OBJECT_CACHE_INIT(struct test_object, &cache, "test basic", NULL, NULL, NULL);
+    ASSERT_EQ(0UL, cache.chunk_count);
+
+    struct test_object *a = TYPED_OBJECT_CACHE_ALLOC(struct test_object, &cache);
+    struct test_object *b = TYPED_OBJECT_CACHE_ALLOC(struct test_object, &cache);
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+    ASSERT_TRUE(a != b);
+    ASSERT_EQ(0UL, (uintptr_t)a % __alignof(struct test_object));
+    ASSERT_EQ(1UL, cache.chunk_count);
+
+    memset(a, 0x55, sizeof(*a));
+    memset(b, 0xaa, sizeof(*b));
+    ASSERT_EQ((uint8_t)0x55, a->payload[sizeof(a->payload) - 1]);
+
+    object_cache_free(&cache, a);
+    object_cache_free(&cache, b);
+
+    object_cache_destroy(&cache);
+    ASSERT_EQ(0UL, cache.chunk_count);
+}
+
+static void grow_reclaim_tests(size_t object_size) {
+    object_cache_t cache;
+    printf("running grow and reclaim tests, object size %zu...\n", object_size);
+
+    object_cache_init(&cache, "test grow", object_size, sizeof(void *), NULL, NULL, NULL);
+
+    /* a chunk is a power of two pages, aligned to its size */
+    ASSERT_EQ(0U, cache.chunk_pages & (cache.chunk_pages - 1));
+    size_t chunk_bytes = cache.chunk_pages * PAGE_SIZE;
+
+    const uint count = cache.objects_per_chunk * 3 + 1;
+    void **objects = calloc(count, sizeof(void *));
+    ASSERT_TRUE(objects);
+
+    for (uint i = 0; i < count; i++) {
+        objects[i] = object_cache_alloc(&cache);
+        ASSERT_TRUE(objects[i]);
+        memset(objects[i], i, object_size);
+
+        /* every object sits inside the chunk its address rounds down to */
+        uintptr_t chunk = ROUNDDOWN((uintptr_t)objects[i], chunk_bytes);
+        ASSERT_TRUE((uintptr_t)objects[i] + object_size <= chunk + chunk_bytes);
+    }
+    ASSERT_EQ(4UL, cache.chunk_count);
+    ASSERT_EQ(4UL, cache.grows);
+
+    /* nothing is reclaimable while every chunk has a live object */
+    ASSERT_EQ(0UL, object_cache_reclaim(&cache));
+    ASSERT_EQ(4UL, cache.chunk_count);
+
+    /* free all but one object of the last chunk, only that one has to stay */
+    for (uint i = 0; i < count - 1; i++) {
+        ASSERT_EQ((uint8_t)i, ((uint8_t *)objects[i])[object_size - 1]);
+        object_cache_free(&cache, objects[i]);
+    }
+    void *survivor = objects[count - 1];
+
+    ASSERT_EQ(3UL * cache.chunk_pages, object_cache_reclaim(&cache));
+    ASSERT_EQ(1UL, cache.chunk_count);
+    ASSERT_EQ(3UL, cache.reclaims);
+    ASSERT_EQ((uint8_t)(count - 1), ((uint8_t *)survivor)[object_size - 1]);
+
+    /* the free objects left are the ones sharing the survivor's chunk */
+    ASSERT_EQ((size_t)cache.objects_per_chunk - 1, cache.free_count);
+
+    /* the cache still works after a reclaim */
+    void *again = object_cache_alloc(&cache);
+    ASSERT_TRUE(again);
+    object_cache_free(&cache, again);
+
+    object_cache_free(&cache, survivor);
+    ASSERT_EQ((size_t)cache.chunk_pages, object_cache_reclaim(&cache));
+    ASSERT_EQ(0UL, cache.chunk_count);
+
+    object_cache_destroy(&cache);
+    free(objects);
+}
+
+static void ctor_dtor_tests(void) {
+    object_cache_t cache;
+    struct test_ctx ctx = {};
+    printf("running constructor tests...\n");
+
+    TYPED_OBJECT_CACHE_INIT(struct test_object, &cache, "test ctor", &test_ctor, &test_dtor, &ctx);
+
+    struct test_object *o = TYPED_OBJECT_CACHE_ALLOC(struct test_object, &cache);
+    ASSERT_TRUE(o);
+
+    /* the whole chunk is constructed when the cache grows, not per alloc */
+    ASSERT_EQ(cache.objects_per_chunk, ctx.constructed);
+    ASSERT_EQ(OBJECT_MAGIC, o->magic);
+
+    /* the constructed state survives the trip through the free list */
+    uint32_t serial = o->serial;
+    object_cache_free(&cache, o);
+    o = TYPED_OBJECT_CACHE_ALLOC(struct test_object, &cache);
+    ASSERT_EQ(OBJECT_MAGIC, o->magic);
+    ASSERT_EQ(serial, o->serial);
+    ASSERT_EQ(cache.objects_per_chunk, ctx.constructed);
+    ASSERT_EQ(0U, ctx.destructed);
+
+    object_cache_free(&cache, o);
+    ASSERT_EQ((size_t)cache.chunk_pages, object_cache_reclaim(&cache));
+    ASSERT_EQ(ctx.constructed, ctx.destructed);
+
+    /* a failing constructor fails the alloc and undoes the partial chunk */
+    ctx.constructed = ctx.destructed = 0;
+    ctx.fail_after = 3;
+    o = TYPED_OBJECT_CACHE_ALLOC(struct test_object, &cache);
+    ASSERT_TRUE(o == NULL);
+    ASSERT_EQ(3U, ctx.constructed);
+    ASSERT_EQ(3U, ctx.destructed);
+    ASSERT_EQ(0UL, cache.chunk_count);
+    ASSERT_EQ(1UL, cache.failures);
+
+    object_cache_destroy(&cache);
+}
+
+#if WITH_LIB_MINIP
+static void pktbuf_tests(void) {
+    printf("running pktbuf tests...\n");
+
+    /* more than fit in one chunk of the pktbuf cache */
+    enum { count = 32 };
+    pktbuf_t *p[count];
+
+    for (uint i = 0; i < count; i++) {
+        p[i] = pktbuf_alloc();
+        ASSERT_TRUE(p[i]);
+        ASSERT_EQ((size_t)PKTBUF_SIZE, (size_t)p[i]->blen);
+
+        memset(p[i]->buffer, i, p[i]->blen);
+#if WITH_KERNEL_VM
+        /* drivers hand the buffer to hardware by its physical start */
+        ASSERT_EQ(p[i]->phys_base + p[i]->blen - 1,
+                  vaddr_to_paddr(p[i]->buffer + p[i]->blen - 1));
+#endif
+    }
+
+    for (uint i = 0; i < count; i++) {
+        ASSERT_EQ((uint8_t)i, p[i]->buffer[p[i]->blen - 1]);
+        pktbuf_free(p[i], false);
+    }
+}
+#endif
+
+int object_cache_tests(int argc, const console_cmd_args *argv) {
+    basic_tests();
+    grow_reclaim_tests(sizeof(struct test_object));
+    /* big enough that chunks span several pages */
+    grow_reclaim_tests(PAGE_SIZE / 2 + 8);
+    ctor_dtor_tests();
+#if WITH_LIB_MINIP
+    pktbuf_tests();
+#endif
+
+    printf("object cache tests passed\n");
+    return 0;
+}
@@ -705,6 +705,73 @@ static int group_waiting(void) {
     return 0;
 }
 
+// keep enough ports alive at once that the buffer caches have to grow, with
+// every packet of the big buffers in use, then give them all back.
+#define MANY_PORTS 40
+
+static int many_buffers(void) {
+    port_t w_ports[MANY_PORTS];
+    port_t r_ports[MANY_PORTS];
+    status_t st;
+
+    for (uint i = 0; i < MANY_PORTS; i++) {
+        char name[PORT_NAME_LEN];
+        snprintf(name, sizeof(name), "mb_prt%u", i);
+
+        port_mode_t mode = PORT_MODE_UNICAST | ((i & 1) ? PORT_MODE_BIG_BUFFER : 0);
+        st = port_create(name, mode, &w_ports[i]);
+        if (st < 0) {
+            printf("could not create port %u, status = %d\n", i, st);
+            return __LINE__;
+        }
+
+        st = port_open(name, (void *)(uintptr_t)i, &r_ports[i]);
+        if (st < 0) {
+            printf("could not open port %u, status = %d\n", i, st);
+            return __LINE__;
+        }
+    }
+
+    for (uint i = 0; i < MANY_PORTS; i++) {
+        uint count = (i & 1) ? 64 : 8;
+        for (uint j = 0; j < count; j++) {
+            port_packet_t packet = {{i, j}};
+            st = port_write(w_ports[i], &packet, 1);
+            if (st < 0) {
+                printf("could not write port %u packet %u, status = %d\n", i, j, st);
+                return __LINE__;
+            }
+        }
+    }
+
+    for (uint i = 0; i < MANY_PORTS; i++) {
+        uint count = (i & 1) ? 64 : 8;
+        for (uint j = 0; j < count; j++) {
+            port_result_t res;
+            st = port_read(r_ports[i], 0, &res);
+            if (st < 0) {
+                printf("could not read port %u packet %u, status = %d\n", i, j, st);
+                return __LINE__;
+            }
+            if (res.ctx != (void *)(uintptr_t)i ||
+                    (uint)res.packet.value[0] != i || (uint)res.packet.value[1] != j) {
+                printf("bad packet on port %u: %u %u\n", i,
+                       res.packet.value[0], res.packet.value[1]);
+                return __LINE__;
+            }
+        }
+
+        st = port_close(r_ports[i]);
+        if (st < 0)
+            return __LINE__;
+        st = port_destroy(w_ports[i]);
+        if (st < 0)
+            return __LINE__;
+    }
+
+    return 0;
+}
+
 #define RUN_TEST(t)  result = t(); if (result) goto fail
 
 int port_tests(int argc, const console_cmd_args *argv) {
@@ -715,6 +782,7 @@ int port_tests(int argc, const console_cmd_args *argv) {
         RUN_TEST(two_threads_basic);
         RUN_TEST(group_basic);
         RUN_TEST(group_dynamic);
+        RUN_TEST(many_buffers);
     }
 
     printf("all tests passed\n");
@@ -3,6 +3,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
+    $(LOCAL_DIR)/bcache_tests.c \
     $(LOCAL_DIR)/benchmarks.c \
     $(LOCAL_DIR)/cache_tests.c \
     $(LOCAL_DIR)/cbuf_tests.c \
@@ -12,6 +13,7 @@ MODULE_SRCS += \
     $(LOCAL_DIR)/float_instructions.S \
     $(LOCAL_DIR)/float_test_vec.c \
     $(LOCAL_DIR)/mem_tests.c \
+    $(LOCAL_DIR)/object_cache_tests.c \
     $(LOCAL_DIR)/printf_tests.c \
     $(LOCAL_DIR)/tests.c \
     $(LOCAL_DIR)/thread_tests.c \
@@ -20,7 +22,9 @@ MODULE_SRCS += \
 MODULE_ARM_OVERRIDE_SRCS := \
 
 MODULE_DEPS += \
-    lib/cbuf
+    lib/bcache \
+    lib/cbuf \
+    lib/pool
 
 MODULE_COMPILEFLAGS += -fno-builtin
 
@@ -21,7 +21,9 @@ STATIC_COMMAND("clock_tests", "test clocks", &clock_tests)
 STATIC_COMMAND("bench", "miscellaneous benchmarks", &benchmarks)
 STATIC_COMMAND("fibo", "threaded fibonacci", &fibo)
 STATIC_COMMAND("spinner", "create a spinning thread", &spinner)
+STATIC_COMMAND("bcache_tests", "test lib/bcache", &bcache_tests)
 STATIC_COMMAND("cbuf_tests", "test lib/cbuf", &cbuf_tests)
+STATIC_COMMAND("object_cache_tests", "test lib/pool object caches", &object_cache_tests)
 STATIC_COMMAND_END(tests);
 
 static void tests_init(const struct app_descriptor *app) {
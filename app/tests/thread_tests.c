@@ -16,6 +16,7 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <platform.h>
 #include <arch/atomic.h>
 
@@ -369,6 +370,141 @@ static void context_switch_test(void) {
     thread_sleep(100);
 }
 
+/* scheduler benchmark: context switch throughput and wakeup latency with the
+ * work spread over 1, 2, 4 and 8 cpus */
+#define SCHED_BENCH_MAX_CPUS 8
+#define SCHED_BENCH_YIELDS 10000
+#define SCHED_BENCH_WAKEUPS 1000
+
+static event_t sched_bench_start_event;
+static semaphore_t sched_bench_wakeup_sem;
+
+struct sched_bench_wakee {
+    thread_t *t;
+    event_t event;
+    volatile lk_bigtime_t signal_time;
+    lk_bigtime_t total_latency;
+    lk_bigtime_t max_latency;
+};
+
+static int sched_bench_yielder(void *arg) {
+    event_wait(&sched_bench_start_event);
+
+    for (int i = 0; i < SCHED_BENCH_YIELDS; i++) {
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static int sched_bench_wakee_thread(void *arg) {
+    struct sched_bench_wakee *w = (struct sched_bench_wakee *)arg;
+
+    for (int i = 0; i < SCHED_BENCH_WAKEUPS; i++) {
+        event_wait(&w->event);
+
+        lk_bigtime_t latency = current_time_hires() - w->signal_time;
+        w->total_latency += latency;
+        w->max_latency = MAX(w->max_latency, latency);
+
+        sem_post(&sched_bench_wakeup_sem, false);
+    }
+
+    return 0;
+}
+
+static void sched_bench_context_switch(const uint *cpus, uint ncpus) {
+    thread_t *threads[SCHED_BENCH_MAX_CPUS * 2];
+    uint thread_count = ncpus * 2;
+
+    /* two yielding threads pinned to each cpu */
+    event_init(&sched_bench_start_event, false, 0);
+    for (uint i = 0; i < thread_count; i++) {
+        threads[i] = thread_create("sched bench yielder", &sched_bench_yielder, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[i], cpus[i % ncpus]);
+        thread_resume(threads[i]);
+    }
+    thread_sleep(100);
+
+    lk_bigtime_t start = current_time_hires();
+    event_signal(&sched_bench_start_event, true);
+    for (uint i = 0; i < thread_count; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+    lk_bigtime_t elapsed = MAX(current_time_hires() - start, 1);
+
+    event_destroy(&sched_bench_start_event);
+
+    uint64_t switches = (uint64_t)thread_count * SCHED_BENCH_YIELDS;
+    printf("%u cpus: %llu yields in %lld usecs, %llu context switches per second\n",
+           ncpus, switches, elapsed, switches * 1000000 / elapsed);
+}
+
+static void sched_bench_wakeup_latency(const uint *cpus, uint ncpus) {
+    struct sched_bench_wakee wakees[SCHED_BENCH_MAX_CPUS];
+
+    /* one waiter pinned to each cpu, all woken from this thread */
+    sem_init(&sched_bench_wakeup_sem, 0);
+    for (uint i = 0; i < ncpus; i++) {
+        memset(&wakees[i], 0, sizeof(wakees[i]));
+        event_init(&wakees[i].event, false, EVENT_FLAG_AUTOUNSIGNAL);
+        wakees[i].t = thread_create("sched bench wakee", &sched_bench_wakee_thread, &wakees[i], HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(wakees[i].t, cpus[i]);
+        thread_resume(wakees[i].t);
+    }
+    thread_sleep(100);
+
+    for (int round = 0; round < SCHED_BENCH_WAKEUPS; round++) {
+        for (uint i = 0; i < ncpus; i++) {
+            wakees[i].signal_time = current_time_hires();
+            event_signal(&wakees[i].event, false);
+        }
+        for (uint i = 0; i < ncpus; i++) {
+            sem_wait(&sched_bench_wakeup_sem);
+        }
+    }
+
+    lk_bigtime_t total_latency = 0;
+    lk_bigtime_t max_latency = 0;
+    for (uint i = 0; i < ncpus; i++) {
+        thread_join(wakees[i].t, NULL, INFINITE_TIME);
+        event_destroy(&wakees[i].event);
+        total_latency += wakees[i].total_latency;
+        max_latency = MAX(max_latency, wakees[i].max_latency);
+    }
+    sem_destroy(&sched_bench_wakeup_sem);
+
+    printf("%u cpus: %d wakeups per cpu, average latency %lld usecs, max %lld usecs\n",
+           ncpus, SCHED_BENCH_WAKEUPS, total_latency / (SCHED_BENCH_WAKEUPS * ncpus), max_latency);
+}
+
+static void sched_bench(void) {
+    static const uint cpu_counts[] = { 1, 2, 4, 8 };
+    uint cpus[SCHED_BENCH_MAX_CPUS];
+    uint active_cpus = 0;
+
+    /* the active cpus don't have to be numbered contiguously */
+    mp_cpu_mask_t active = mp_get_active_mask();
+    for (uint i = 0; i < SMP_MAX_CPUS && active_cpus < countof(cpus); i++) {
+        if (active & (1U << i))
+            cpus[active_cpus++] = i;
+    }
+
+    printf("scheduler benchmark, %d cpus active\n", __builtin_popcount(active));
+
+    for (uint i = 0; i < countof(cpu_counts); i++) {
+        uint ncpus = cpu_counts[i];
+
+        if (ncpus > active_cpus) {
+            printf("%u cpus: skipped\n", ncpus);
+            continue;
+        }
+
+        sched_bench_context_switch(cpus, ncpus);
+        sched_bench_wakeup_latency(cpus, ncpus);
+    }
+}
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -590,6 +726,7 @@ int thread_tests(int argc, const console_cmd_args *argv) {
 
     thread_sleep(200);
     context_switch_test();
+    sched_bench();
 
     preempt_test();
 
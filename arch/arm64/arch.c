@@ -42,6 +42,7 @@ static void arm64_cpu_early_init(void) {
 
 void arch_early_init(void) {
   arm64_cpu_early_init();
+  arm64_mmu_early_init();
   platform_init_mmu_mappings();
 }
 
@@ -146,6 +147,9 @@ void arm64_secondary_entry(ulong asm_cpu_num) {
   spin_lock(&arm_boot_cpu_lock);
   spin_unlock(&arm_boot_cpu_lock);
 
+  /* the boot cpu picked the ASID width before releasing us */
+  arm64_mmu_init_percpu();
+
   /* run early secondary cpu init routines up to the threading level */
   lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST,
                 LK_INIT_LEVEL_THREADING - 1);
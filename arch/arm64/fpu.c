@@ -20,12 +20,14 @@ static void arm64_fpu_load_state(struct thread *t) {
 
     if (fpstate == current_fpstate[cpu] && fpstate->current_cpu == cpu) {
         LTRACEF("cpu %d, thread %s, fpstate already valid\n", cpu, t->name);
+        fpstate->skipped_restores++;
         return;
     }
     LTRACEF("cpu %d, thread %s, load fpstate %p, last cpu %d, last fpstate %p\n",
             cpu, t->name, fpstate, fpstate->current_cpu, current_fpstate[cpu]);
     fpstate->current_cpu = cpu;
     current_fpstate[cpu] = fpstate;
+    fpstate->restores++;
 
 
     STATIC_ASSERT(sizeof(fpstate->regs) == 16 * 32);
@@ -72,18 +74,38 @@ void arm64_fpu_save_state(struct thread *t) {
                      "mrs     %1, fpsr\n"
                      : "=r"(fpstate->fpcr), "=r"(fpstate->fpsr)
                      : "r"(fpstate));
+    fpstate->used = false;
+    fpstate->saves++;
 
     LTRACEF("thread %s, fpcr %x, fpsr %x\n", t->name, fpstate->fpcr, fpstate->fpsr);
 }
 
+/*
+ * The fpu is left disabled when a thread is switched in and only enabled
+ * again when it traps on the first fpu/simd instruction, so threads that
+ * don't touch it never pay for the 512 byte save and restore.
+ */
+void arm64_fpu_pre_context_switch(struct thread *t) {
+    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
+    if ((cpacr >> 20) & 3) {
+        arm64_fpu_save_state(t);
+        cpacr &= ~(3 << 20);
+        ARM64_WRITE_SYSREG(cpacr_el1, cpacr);
+    } else {
+        t->arch.fpstate.skipped_saves++;
+    }
+}
+
 void arm64_fpu_exception(struct arm64_iframe_long *iframe) {
     uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
     if (((cpacr >> 20) & 3) != 3) {
         cpacr |= 3 << 20;
         ARM64_WRITE_SYSREG(cpacr_el1, cpacr);
         thread_t *t = get_current_thread();
-        if (likely(t))
+        if (likely(t)) {
+            t->arch.fpstate.used = true;
             arm64_fpu_load_state(t);
+        }
         return;
     }
 }
@@ -14,6 +14,14 @@ struct fpstate {
     uint32_t    fpcr;
     uint32_t    fpsr;
     uint        current_cpu;
+    bool        used; /* touched the fpu since it was last switched in */
+
+    /* context switches that saved the registers and ones that didn't have to,
+     * fpu traps that loaded them and ones that found them still live */
+    uint        saves;
+    uint        skipped_saves;
+    uint        restores;
+    uint        skipped_restores;
 };
 
 struct arch_thread {
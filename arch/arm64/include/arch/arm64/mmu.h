@@ -319,8 +319,20 @@ __BEGIN_CDECLS
     ISB; \
 })
 
+/* issue a TLBI without waiting for it, the caller does the DSB/ISB */
+#define ARM64_TLBI_NOSYNC(op, val) \
+({ \
+    __asm__ volatile("tlbi " #op ", %0" :: "r" (val) : "memory"); \
+})
+
+/* FEAT_TLBIRANGE operations, spelled as SYS so older assemblers take them */
+#define ARM64_TLBI_RVAE1IS(val) \
+    __asm__ volatile("sys #0, c8, c2, #1, %0" :: "r" (val) : "memory")
+#define ARM64_TLBI_RVAAE1IS(val) \
+    __asm__ volatile("sys #0, c8, c2, #3, %0" :: "r" (val) : "memory")
+
 #define MMU_ARM64_GLOBAL_ASID (~0U)
-#define MMU_ARM64_USER_ASID (0U)
+#define MMU_ARM64_USER_ASID (0U) /* reserved, never handed out to an aspace */
 int arm64_mmu_map(vaddr_t vaddr, paddr_t paddr, size_t size, pte_t attrs,
                   vaddr_t vaddr_base, uint top_size_shift,
                   uint top_index_shift, uint page_size_shift,
@@ -330,6 +342,10 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
                     uint top_index_shift, uint page_size_shift,
                     pte_t *top_page_table, uint asid);
 
+/* pick the ASID width on the boot cpu, and program it on the others */
+void arm64_mmu_early_init(void);
+void arm64_mmu_init_percpu(void);
+
 __END_CDECLS
 #endif /* ASSEMBLY */
 
@@ -20,6 +20,10 @@ struct arch_aspace {
 
     uint flags;
 
+    /* ASID in the low bits, tagged with the allocator generation it was
+     * handed out in above them. 0 until the aspace is first switched to. */
+    uint64_t asid;
+
     /* range of address space */
     vaddr_t base;
     size_t size;
@@ -24,6 +24,9 @@
 #define PAGE_SIZE (1UL << PAGE_SIZE_SHIFT)
 #define USER_PAGE_SIZE (1UL << USER_PAGE_SIZE_SHIFT)
 
+/* smallest block descriptor (2MB with 4K pages), the vmm lines big allocations up on it */
+#define ARCH_MMU_LARGE_PAGE_SHIFT (PAGE_SIZE_SHIFT * 2 - 3)
+
 #if ARM64_CPU_CORTEX_A53 || ARM64_CPU_CORTEX_A57 || ARM64_CPU_CORTEX_A72
 #define CACHE_LINE 64
 #else
@@ -7,9 +7,12 @@
  */
 
 #include <arch/arm64/mmu.h>
+#include <arch/ops.h>
 #include <assert.h>
+#include <lk/bits.h>
 #include <lk/debug.h>
 #include <lk/err.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/heap.h>
 #include <stdlib.h>
@@ -30,6 +33,144 @@ pte_t arm64_kernel_translation_table[MMU_KERNEL_PAGE_TABLE_ENTRIES_TOP]
 __ALIGNED(MMU_KERNEL_PAGE_TABLE_ENTRIES_TOP * 8)
 __SECTION(".bss.prebss.translation_table");
 
+/*
+ * ASID allocator
+ *
+ * User aspaces get an ASID out of a bitmap the first time they are switched
+ * to, tagged with the current generation in the bits above it. When the
+ * bitmap runs out the generation is bumped, the TLBs of all cpus are flushed
+ * once and aspaces pick up a new ASID the next time they are switched to.
+ * The ASIDs live on the cpus at the time of the rollover are carried over.
+ *
+ * Switching to an aspace whose ASID is of the current generation doesn't take
+ * the lock, it only swaps the ASID into the cpu's active slot. A rollover
+ * swaps every active slot to zero, so a cpu racing with it sees the swap fail
+ * and takes the locked path.
+ */
+#define ASID_MAX_BITS 16
+#define ASID_FIRST (MMU_ARM64_USER_ASID + 1)
+
+static spin_lock_t asid_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint asid_bits;
+static uint64_t asid_generation; /* written with asid_lock held */
+static unsigned long asid_map[BITMAP_NUM_WORDS(1U << ASID_MAX_BITS)];
+static uint asid_next = ASID_FIRST;
+
+/* the ASID each cpu last loaded, zero until it next switches after a
+ * rollover, and what it was at the last rollover */
+static uint64_t asid_active[SMP_MAX_CPUS];
+static uint64_t asid_reserved[SMP_MAX_CPUS];
+
+static inline uint64_t asid_mask(void) {
+    return (1ULL << asid_bits) - 1;
+}
+
+static inline uint asid_num(uint64_t asid) {
+    return asid & asid_mask();
+}
+
+static inline bool asid_is_current(uint64_t asid) {
+    return asid != 0 &&
+           (asid & ~asid_mask()) == __atomic_load_n(&asid_generation, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t asid_tcr_flags(void) {
+    return (asid_bits == 16) ? MMU_TCR_AS : 0;
+}
+
+/* Called once on the boot cpu before anything is switched to a user aspace */
+void arm64_mmu_early_init(void) {
+    uint64_t mmfr0 = ARM64_READ_SYSREG(id_aa64mmfr0_el1);
+
+    asid_bits = (BITS_SHIFT(mmfr0, 7, 4) == 2) ? 16 : 8;
+    asid_generation = 1ULL << asid_bits;
+
+    /* never hand out the reserved one, not even before the first rollover */
+    bitmap_set(asid_map, MMU_ARM64_USER_ASID);
+
+    LTRACEF("%u bit ASIDs\n", asid_bits);
+
+    arm64_mmu_init_percpu();
+}
+
+/* Switch the cpu to the ASID width picked at boot. Nothing non-global can be
+ * cached yet, but the TLB is flushed anyway since TCR.AS changes the tags. */
+void arm64_mmu_init_percpu(void) {
+    ARM64_WRITE_SYSREG(tcr_el1, MMU_TCR_FLAGS_KERNEL | asid_tcr_flags());
+    ISB;
+    ARM64_TLBI_NOADDR(vmalle1);
+    DSB;
+    ISB;
+}
+
+/* asid_lock held */
+static void asid_rollover(void) {
+    __atomic_store_n(&asid_generation, asid_generation + (1ULL << asid_bits), __ATOMIC_RELAXED);
+    memset(asid_map, 0, sizeof(asid_map));
+
+    /* keep whatever is loaded on the cpus right now, those aspaces get to
+     * keep their ASID in the new generation. A cpu that hasn't switched since
+     * the last rollover is still running its reserved one. */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        uint64_t asid = __atomic_exchange_n(&asid_active[cpu], 0, __ATOMIC_RELAXED);
+        if (asid == 0)
+            asid = asid_reserved[cpu];
+        asid_reserved[cpu] = asid;
+        if (asid)
+            bitmap_set(asid_map, asid_num(asid));
+    }
+    bitmap_set(asid_map, MMU_ARM64_USER_ASID);
+    asid_next = ASID_FIRST;
+
+    /* nothing tagged with a recycled ASID may survive in any TLB */
+    ARM64_TLBI_NOADDR(vmalle1is);
+    DSB;
+    ISB;
+
+    LTRACEF("generation %#llx\n", asid_generation >> asid_bits);
+}
+
+/* asid_lock held. Hand out an ASID of the current generation to an aspace
+ * that last ran with |old|. */
+static uint64_t asid_alloc(uint64_t old) {
+    if (old != 0) {
+        uint64_t renewed = asid_generation | asid_num(old);
+        bool reserved = false;
+
+        /* still live on a cpu since the rollover, carry it over */
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if (asid_reserved[cpu] == old) {
+                asid_reserved[cpu] = renewed;
+                reserved = true;
+            }
+        }
+        if (reserved)
+            return renewed;
+
+        /* nobody took the number in this generation yet, keep it */
+        if (!bitmap_test(asid_map, asid_num(old))) {
+            bitmap_set(asid_map, asid_num(old));
+            return renewed;
+        }
+    }
+
+    uint max = 1U << asid_bits;
+    int n = asid_next;
+    if (asid_next >= max || bitmap_test(asid_map, asid_next)) {
+        n = bitmap_ffz(asid_map, max);
+        if (n < 0) {
+            asid_rollover();
+            n = bitmap_ffz(asid_map, max);
+            DEBUG_ASSERT(n >= 0);
+        }
+    }
+
+    bitmap_set(asid_map, n);
+    asid_next = n + 1;
+
+    return asid_generation | n;
+}
+
 static inline bool is_valid_vaddr(arch_aspace_t *aspace, vaddr_t vaddr) {
     return (vaddr >= aspace->base && vaddr <= aspace->base + aspace->size - 1);
 }
@@ -204,13 +345,14 @@ status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, ui
     return 0;
 }
 
+/* returns a zeroed (all MMU_PTE_DESCRIPTOR_INVALID) table */
 static int alloc_page_table(paddr_t *paddrp, uint page_size_shift) {
     size_t size = 1U << page_size_shift;
 
     LTRACEF("page_size_shift %u\n", page_size_shift);
 
     if (size == PAGE_SIZE) {
-        vm_page_t *p = pmm_alloc_page();
+        vm_page_t *p = pmm_alloc_page_etc(PMM_ALLOC_FLAG_ZERO);
         if (!p) {
             return ERR_NO_MEMORY;
         }
@@ -220,6 +362,7 @@ static int alloc_page_table(paddr_t *paddrp, uint page_size_shift) {
         size_t ret = pmm_alloc_contiguous(count, page_size_shift, paddrp, NULL);
         if (ret != count)
             return ERR_NO_MEMORY;
+        memset(paddr_to_kvaddr(*paddrp), MMU_PTE_DESCRIPTOR_INVALID, size);
     } else {
         void *vaddr = memalign(size, size);
         if (!vaddr)
@@ -229,6 +372,7 @@ static int alloc_page_table(paddr_t *paddrp, uint page_size_shift) {
             free(vaddr);
             return ERR_NO_MEMORY;
         }
+        memset(vaddr, MMU_PTE_DESCRIPTOR_INVALID, size);
     }
 
     LTRACEF("allocated 0x%lx\n", *paddrp);
@@ -251,6 +395,149 @@ static void free_page_table(void *vaddr, paddr_t paddr, uint page_size_shift) {
     }
 }
 
+/*
+ * TLB invalidation batching
+ *
+ * map/unmap collect the span of the entries they clear and invalidate it in
+ * one go at the end, behind a single DSB. Range TLBIs are used when the cpu
+ * has FEAT_TLBIRANGE, one TLBI per page otherwise, and past
+ * ARM64_TLB_FLUSH_ALL_PAGES the whole ASID (all of EL1 for the kernel) is
+ * dropped instead. Page tables unlinked on the way are only freed after the
+ * invalidate so no walker can still be using them once they are reused.
+ */
+#ifndef ARM64_TLB_FLUSH_ALL_PAGES
+#define ARM64_TLB_FLUSH_ALL_PAGES 512
+#endif
+
+#define TLB_BATCH_MAX_TABLES 16
+
+/* most pages the range encoding reaches with one TLBI per SCALE 0-3 */
+#define TLBI_RANGE_MAX_PAGES ((1UL << (5 * 4 + 1)) - 1)
+
+struct tlb_batch {
+    uint asid;
+    uint page_size_shift;
+    vaddr_t start;
+    vaddr_t end;
+
+    uint table_count;
+    struct {
+        void *vaddr;
+        paddr_t paddr;
+    } tables[TLB_BATCH_MAX_TABLES];
+};
+
+static int tlbi_range_supported = -1;
+
+static bool arm64_has_tlbi_range(void) {
+    if (unlikely(tlbi_range_supported < 0)) {
+        uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+        tlbi_range_supported = (BITS_SHIFT(isar0, 59, 56) >= 2);
+    }
+    return tlbi_range_supported;
+}
+
+static void tlb_batch_init(struct tlb_batch *batch, uint asid, uint page_size_shift) {
+    batch->asid = asid;
+    batch->page_size_shift = page_size_shift;
+    batch->start = batch->end = 0;
+    batch->table_count = 0;
+}
+
+static void tlb_batch_add(struct tlb_batch *batch, vaddr_t vaddr, size_t size) {
+    if (batch->start == batch->end) {
+        batch->start = vaddr;
+        batch->end = vaddr + size;
+    } else {
+        batch->start = MIN(batch->start, vaddr);
+        batch->end = MAX(batch->end, vaddr + size);
+    }
+}
+
+static void tlb_batch_invalidate_page(struct tlb_batch *batch, vaddr_t vaddr) {
+    if (batch->asid == MMU_ARM64_GLOBAL_ASID)
+        ARM64_TLBI_NOSYNC(vaae1is, vaddr >> 12);
+    else
+        ARM64_TLBI_NOSYNC(vae1is, vaddr >> 12 | (vaddr_t)batch->asid << 48);
+}
+
+/* Cover |pages| pages from |vaddr| with range TLBIs. A range is
+ * (NUM + 1) << (5 * SCALE + 1) pages, odd leftovers go one page at a time. */
+static void tlb_batch_invalidate_range(struct tlb_batch *batch, vaddr_t vaddr, size_t pages) {
+    const uint64_t tg = (batch->page_size_shift - 10) / 2; /* 4K: 1, 16K: 2, 64K: 3 */
+    const uint64_t asid = (batch->asid == MMU_ARM64_GLOBAL_ASID) ? 0 : batch->asid;
+    uint scale = 0;
+
+    while (pages > 0) {
+        if (pages % 2) {
+            tlb_batch_invalidate_page(batch, vaddr);
+            vaddr += 1UL << batch->page_size_shift;
+            pages--;
+            continue;
+        }
+
+        uint64_t num = (pages >> (5 * scale + 1)) & 0x1f;
+        if (num > 0) {
+            uint64_t op = (asid << 48) | (tg << 46) | ((uint64_t)scale << 44) |
+                          ((num - 1) << 39) |
+                          ((vaddr >> batch->page_size_shift) & ((1ULL << 37) - 1));
+            if (batch->asid == MMU_ARM64_GLOBAL_ASID)
+                ARM64_TLBI_RVAAE1IS(op);
+            else
+                ARM64_TLBI_RVAE1IS(op);
+
+            size_t covered = num << (5 * scale + 1);
+            vaddr += covered << batch->page_size_shift;
+            pages -= covered;
+        }
+        scale++;
+    }
+}
+
+static void tlb_batch_flush(struct tlb_batch *batch) {
+    if (batch->start != batch->end) {
+        size_t pages = (batch->end - batch->start) >> batch->page_size_shift;
+        size_t limit = arm64_has_tlbi_range() ? TLBI_RANGE_MAX_PAGES : ARM64_TLB_FLUSH_ALL_PAGES;
+
+        LTRACEF("asid %#x range 0x%lx-0x%lx pages %zu\n", batch->asid, batch->start,
+                batch->end, pages);
+
+        /* make the cleared entries visible to the walkers first */
+        __asm__ volatile("dsb ishst" ::: "memory");
+
+        if (pages > limit) {
+            if (batch->asid == MMU_ARM64_GLOBAL_ASID)
+                __asm__ volatile("tlbi vmalle1is" ::: "memory");
+            else
+                ARM64_TLBI_NOSYNC(aside1is, (uint64_t)batch->asid << 48);
+        } else if (arm64_has_tlbi_range()) {
+            tlb_batch_invalidate_range(batch, batch->start, pages);
+        } else {
+            for (vaddr_t va = batch->start; va < batch->end; va += 1UL << batch->page_size_shift)
+                tlb_batch_invalidate_page(batch, va);
+        }
+
+        __asm__ volatile("dsb ish" ::: "memory");
+        ISB;
+
+        batch->start = batch->end = 0;
+    }
+
+    for (uint i = 0; i < batch->table_count; i++)
+        free_page_table(batch->tables[i].vaddr, batch->tables[i].paddr, batch->page_size_shift);
+    batch->table_count = 0;
+}
+
+/* hold on to an unlinked page table until the TLBs have forgotten it */
+static void tlb_batch_free_table(struct tlb_batch *batch, void *vaddr, paddr_t paddr) {
+    if (batch->table_count == TLB_BATCH_MAX_TABLES)
+        tlb_batch_flush(batch);
+
+    batch->tables[batch->table_count].vaddr = vaddr;
+    batch->tables[batch->table_count].paddr = paddr;
+    batch->table_count++;
+}
+
 static pte_t *arm64_mmu_get_page_table(vaddr_t index, uint page_size_shift, pte_t *page_table) {
     pte_t pte;
     paddr_t paddr;
@@ -268,7 +555,6 @@ static pte_t *arm64_mmu_get_page_table(vaddr_t index, uint page_size_shift, pte_
             vaddr = paddr_to_kvaddr(paddr);
 
             LTRACEF("allocated page table, vaddr %p, paddr 0x%lx\n", vaddr, paddr);
-            memset(vaddr, MMU_PTE_DESCRIPTOR_INVALID, 1U << page_size_shift);
 
             __asm__ volatile("dmb ishst" ::: "memory");
 
@@ -311,7 +597,7 @@ static bool page_table_is_clear(pte_t *page_table, uint page_size_shift) {
 static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
                                size_t size,
                                uint index_shift, uint page_size_shift,
-                               pte_t *page_table, uint asid) {
+                               pte_t *page_table, struct tlb_batch *batch) {
     pte_t *next_page_table;
     vaddr_t index;
     size_t chunk_size;
@@ -340,22 +626,18 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
             arm64_mmu_unmap_pt(vaddr, vaddr_rem, chunk_size,
                                index_shift - (page_size_shift - 3),
                                page_size_shift,
-                               next_page_table, asid);
+                               next_page_table, batch);
             if (chunk_size == block_size ||
                     page_table_is_clear(next_page_table, page_size_shift)) {
                 LTRACEF("pte %p[0x%lx] = 0 (was page table)\n", page_table, index);
                 page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-                __asm__ volatile("dmb ishst" ::: "memory");
-                free_page_table(next_page_table, page_table_paddr, page_size_shift);
+                tlb_batch_add(batch, vaddr, chunk_size);
+                tlb_batch_free_table(batch, next_page_table, page_table_paddr);
             }
         } else if (pte) {
             LTRACEF("pte %p[0x%lx] = 0\n", page_table, index);
             page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-            CF;
-            if (asid == MMU_ARM64_GLOBAL_ASID)
-                ARM64_TLBI(vaae1is, vaddr >> 12);
-            else
-                ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            tlb_batch_add(batch, vaddr, chunk_size);
         } else {
             LTRACEF("pte %p[0x%lx] already clear\n", page_table, index);
         }
@@ -369,7 +651,7 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
                             paddr_t paddr_in,
                             size_t size_in, pte_t attrs,
                             uint index_shift, uint page_size_shift,
-                            pte_t *page_table, uint asid) {
+                            pte_t *page_table, struct tlb_batch *batch) {
     int ret;
     pte_t *next_page_table;
     vaddr_t index;
@@ -409,7 +691,7 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
 
             ret = arm64_mmu_map_pt(vaddr, vaddr_rem, paddr, chunk_size, attrs,
                                    index_shift - (page_size_shift - 3),
-                                   page_size_shift, next_page_table, asid);
+                                   page_size_shift, next_page_table, batch);
             if (ret)
                 goto err;
         } else {
@@ -439,8 +721,7 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
 
 err:
     arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
-                       index_shift, page_size_shift, page_table, asid);
-    DSB;
+                       index_shift, page_size_shift, page_table, batch);
     return ERR_GENERIC;
 }
 
@@ -466,8 +747,12 @@ int arm64_mmu_map(vaddr_t vaddr, paddr_t paddr, size_t size, pte_t attrs,
         return ERR_INVALID_ARGS;
     }
 
+    /* only a failed map that has to be backed out invalidates anything */
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, asid, page_size_shift);
     ret = arm64_mmu_map_pt(vaddr, vaddr_rel, paddr, size, attrs,
-                           top_index_shift, page_size_shift, top_page_table, asid);
+                           top_index_shift, page_size_shift, top_page_table, &batch);
+    tlb_batch_flush(&batch);
     DSB;
     return ret;
 }
@@ -492,9 +777,11 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
         return ERR_INVALID_ARGS;
     }
 
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, asid, page_size_shift);
     arm64_mmu_unmap_pt(vaddr, vaddr_rel, size,
-                       top_index_shift, page_size_shift, top_page_table, asid);
-    DSB;
+                       top_index_shift, page_size_shift, top_page_table, &batch);
+    tlb_batch_flush(&batch);
     return 0;
 }
 
@@ -529,7 +816,7 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
                             mmu_flags_to_pte_attr(flags),
                             0, MMU_USER_SIZE_SHIFT,
                             MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
-                            aspace->tt_virt, MMU_ARM64_USER_ASID);
+                            aspace->tt_virt, asid_num(aspace->asid));
     }
 
     return ret;
@@ -558,11 +845,19 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count) {
                               aspace->tt_virt,
                               MMU_ARM64_GLOBAL_ASID);
     } else {
+        uint64_t asid = aspace->asid;
         ret = arm64_mmu_unmap(vaddr, count * PAGE_SIZE,
                               0, MMU_USER_SIZE_SHIFT,
                               MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
                               aspace->tt_virt,
-                              MMU_ARM64_USER_ASID);
+                              asid_num(asid));
+
+        /* the aspace was handed a new ASID by a rollover while we were at
+         * it, entries cached under that one may predate the unmap */
+        if (aspace->asid != asid) {
+            ARM64_TLBI(aside1is, (uint64_t)asid_num(aspace->asid) << 48);
+            DSB;
+        }
     }
 
     return ret;
@@ -593,17 +888,14 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
 
         aspace->base = base;
         aspace->size = size;
+        aspace->asid = 0;
 
-        pte_t *va = pmm_alloc_kpages(1, NULL);
-        if (!va)
+        vm_page_t *p = pmm_alloc_page_etc(PMM_ALLOC_FLAG_ZERO);
+        if (!p)
             return ERR_NO_MEMORY;
 
-        aspace->tt_virt = va;
-        aspace->tt_phys = vaddr_to_paddr(aspace->tt_virt);
-
-        /* zero the top level translation table */
-        /* XXX remove when PMM starts returning pre-zeroed pages */
-        memset(aspace->tt_virt, 0, PAGE_SIZE);
+        aspace->tt_phys = vm_page_to_paddr(p);
+        aspace->tt_virt = paddr_to_kvaddr(aspace->tt_phys);
     }
 
     LTRACEF("tt_phys 0x%lx tt_virt %p\n", aspace->tt_phys, aspace->tt_virt);
@@ -619,6 +911,17 @@ status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace) {
 
     // XXX make sure it's not mapped
 
+    /* give the ASID back once nothing is cached under it anymore */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&asid_lock, state);
+    if (asid_is_current(aspace->asid)) {
+        ARM64_TLBI(aside1is, (uint64_t)asid_num(aspace->asid) << 48);
+        DSB;
+        bitmap_clear(asid_map, asid_num(aspace->asid));
+    }
+    aspace->asid = 0;
+    spin_unlock_irqrestore(&asid_lock, state);
+
     vm_page_t *page = paddr_to_vm_page(aspace->tt_phys);
     DEBUG_ASSERT(page);
     pmm_free_page(page);
@@ -635,15 +938,35 @@ void arch_mmu_context_switch(arch_aspace_t *aspace) {
     if (aspace) {
         DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
 
-        tcr = MMU_TCR_FLAGS_USER;
-        ttbr = ((uint64_t)MMU_ARM64_USER_ASID << 48) | aspace->tt_phys;
+        /* called with interrupts disabled */
+        uint cpu = arch_curr_cpu_num();
+        uint64_t asid = __atomic_load_n(&aspace->asid, __ATOMIC_RELAXED);
+        uint64_t active = __atomic_load_n(&asid_active[cpu], __ATOMIC_RELAXED);
+
+        /* fast path, fails if a rollover zeroed the active slot meanwhile */
+        if (active == 0 || !asid_is_current(asid) ||
+                !__atomic_compare_exchange_n(&asid_active[cpu], &active, asid, false,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            spin_lock(&asid_lock);
+            asid = aspace->asid;
+            if (!asid_is_current(asid)) {
+                asid = asid_alloc(asid);
+                __atomic_store_n(&aspace->asid, asid, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&asid_active[cpu], asid, __ATOMIC_RELAXED);
+            spin_unlock(&asid_lock);
+        }
+
+        /* the ASID belongs to this aspace alone in the current generation,
+         * so whatever the TLB holds for it is still good */
+        tcr = MMU_TCR_FLAGS_USER | asid_tcr_flags();
+        ttbr = ((uint64_t)asid_num(asid) << 48) | aspace->tt_phys;
         ARM64_WRITE_SYSREG(ttbr0_el1, ttbr);
 
         if (TRACE_CONTEXT_SWITCH)
             TRACEF("ttbr 0x%llx, tcr 0x%llx\n", ttbr, tcr);
-        ARM64_TLBI(aside1, (uint64_t)MMU_ARM64_USER_ASID << 48);
     } else {
-        tcr = MMU_TCR_FLAGS_KERNEL;
+        tcr = MMU_TCR_FLAGS_KERNEL | asid_tcr_flags();
 
         if (TRACE_CONTEXT_SWITCH)
             TRACEF("tcr 0x%llx\n", tcr);
@@ -15,6 +15,8 @@
 
 #if WITH_DEV_INTERRUPT_ARM_GIC
 #include <dev/interrupt/arm_gic.h>
+#elif WITH_DEV_INTERRUPT_ARM_GIC_V3
+#include <dev/interrupt/arm_gic_v3.h>
 #elif PLATFORM_BCM28XX
 /* bcm28xx has a weird custom interrupt controller for MP */
 extern void bcm28xx_send_ipi(uint irq, uint cpu_mask);
@@ -38,6 +40,15 @@ status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi) {
         LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
         arm_gic_sgi(gic_ipi_num, ARM_GIC_SGI_FLAG_NS, target);
     }
+#elif WITH_DEV_INTERRUPT_ARM_GIC_V3
+    uint gic_ipi_num = ipi + GIC_IPI_BASE;
+
+    /* filter out targets outside of the range of cpus we care about */
+    target &= ((1UL << SMP_MAX_CPUS) - 1);
+    if (target != 0) {
+        LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
+        arm_gicv3_sgi(gic_ipi_num, target);
+    }
 #elif PLATFORM_BCM28XX
     /* filter out targets outside of the range of cpus we care about */
     target &= ((1UL << SMP_MAX_CPUS) - 1);
@@ -65,7 +76,13 @@ void arch_mp_init_percpu(void) {
     register_int_handler(MP_IPI_GENERIC + GIC_IPI_BASE, &arm_ipi_generic_handler, 0);
     register_int_handler(MP_IPI_RESCHEDULE + GIC_IPI_BASE, &arm_ipi_reschedule_handler, 0);
 
+#if WITH_DEV_INTERRUPT_ARM_GIC_V3
+    /* SGIs live in the banked redistributor enable registers on GICv3 */
+    unmask_interrupt(MP_IPI_GENERIC + GIC_IPI_BASE);
+    unmask_interrupt(MP_IPI_RESCHEDULE + GIC_IPI_BASE);
+#else
     //unmask_interrupt(MP_IPI_GENERIC + GIC_IPI_BASE);
     //unmask_interrupt(MP_IPI_RESCHEDULE + GIC_IPI_BASE);
+#endif
 }
 
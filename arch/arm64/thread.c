@@ -74,6 +74,10 @@ void arch_thread_initialize(thread_t *t) {
 
   // set the stack pointer
   t->arch.sp = (vaddr_t)frame;
+
+  // a new thread's fpu state isn't live in any cpu's registers, even if
+  // it reuses the memory of one that was
+  t->arch.fpstate.current_cpu = UINT_MAX;
 }
 
 void arch_context_switch(thread_t *oldthread, thread_t *newthread) {
@@ -91,4 +95,9 @@ void arch_dump_thread(thread_t *t) {
     dprintf(INFO, "\tarch: ");
     dprintf(INFO, "sp 0x%lx\n", t->arch.sp);
   }
+
+  const struct fpstate *fpstate = &t->arch.fpstate;
+  dprintf(INFO, "\tfpu: %s, saves %u (skipped %u), restores %u (skipped %u)\n",
+          fpstate->used ? "used" : "unused", fpstate->saves,
+          fpstate->skipped_saves, fpstate->restores, fpstate->skipped_restores);
 }
@@ -71,4 +71,25 @@ static inline uint arch_curr_cpu_num(void) {
     return 0;
 }
 
+#if ARCH_X86_64
+#define mb()        __asm__ volatile("mfence" : : : "memory")
+#define rmb()       __asm__ volatile("lfence" : : : "memory")
+#define wmb()       __asm__ volatile("sfence" : : : "memory")
+#else
+/* a locked instruction orders everything, also on cpus without the sse fences */
+#define mb()        __asm__ volatile("lock; addl $0,0(%%esp)" : : : "memory", "cc")
+#define rmb()       mb()
+#define wmb()       mb()
+#endif
+
+#ifdef WITH_SMP
+#define smp_mb()    mb()
+#define smp_rmb()   rmb()
+#define smp_wmb()   wmb()
+#else
+#define smp_mb()    CF
+#define smp_rmb()   CF
+#define smp_wmb()   CF
+#endif
+
 #endif // !ASSEMBLY
@@ -18,8 +18,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <lk/pow2.h>
 #include <platform/interrupts.h>
 
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
 #define LOCAL_TRACE 0
 
 namespace pci {
@@ -47,6 +52,8 @@ public:
 
     status_t allocate_irq(uint *irq);
     status_t allocate_msi(size_t num_requested, uint *msi_base);
+    status_t allocate_msix(size_t num_requested, uint *msix_base);
+    status_t free_msix();
     status_t load_bars();
 
     pci_location_t loc() const { return loc_; }
@@ -81,6 +88,19 @@ protected:
     list_node capability_list_ = LIST_INITIAL_VALUE(capability_list_);
     capability *msi_cap_ = nullptr;
     capability *msix_cap_ = nullptr;
+
+    // MSI-X table location, read out of the capability
+    uint16_t msix_table_size_ = 0;
+    uint8_t msix_table_bar_ = 0;
+    uint32_t msix_table_offset_ = 0;
+
+    // the mapped table and the vectors currently programmed into it
+    volatile uint32_t *msix_table_ = nullptr;
+    uint msix_vector_base_ = 0;
+    size_t msix_vector_count_ = 0;
+
+private:
+    uint32_t requester_id() const { return (loc_.bus << 8) | (loc_.dev << 3) | loc_.fn; }
 };
 
 // bridge device, holds a list of busses that it is responsible for
@@ -388,8 +408,19 @@ status_t device::init_msix_capability(capability *cap) {
     pci_read_config_word(loc(), cap->config_offset + 8, &cap_buf[2]);
     //hexdump(cap_buf, sizeof(cap_buf));
 
-    // TODO: we dont really support msi-x right now
-    return ERR_NOT_IMPLEMENTED;
+    // message control holds the table size - 1, the table offset shares a
+    // word with the BAR indicator
+    msix_table_size_ = ((cap_buf[0] >> 16) & 0x7ff) + 1;
+    msix_table_bar_ = cap_buf[1] & 0x7;
+    msix_table_offset_ = cap_buf[1] & ~0x7;
+
+    LTRACEF("MSI-X table size %u bar %u offset %#x\n", msix_table_size_, msix_table_bar_, msix_table_offset_);
+
+    if (msix_table_bar_ > 5) {
+        return ERR_NOT_VALID;
+    }
+
+    return NO_ERROR;
 }
 
 status_t device::allocate_irq(uint *irq) {
@@ -411,36 +442,37 @@ status_t device::allocate_irq(uint *irq) {
 status_t device::allocate_msi(size_t num_requested, uint *msi_base) {
     LTRACE_ENTRY;
 
-    DEBUG_ASSERT(num_requested == 1);
-
     if (!has_msi()) {
         return ERR_NOT_SUPPORTED;
     }
 
     DEBUG_ASSERT(msi_cap_ && msi_cap_->is_msi());
 
-    // ask the platform for interrupts
+    const uint16_t cap_offset = msi_cap_->config_offset;
+
+    uint16_t control;
+    pci_read_config_half(loc(), cap_offset + 2, &control);
+
+    // multiple message MSI hands out a power of two number of vectors, up to
+    // what the device says it can do
+    const uint max_log2 = (control >> 1) & 0x7;
+    if (num_requested == 0 || !ispow2(num_requested) || log2_uint(num_requested) > max_log2) {
+        return ERR_INVALID_ARGS;
+    }
+    const uint num_log2 = log2_uint(num_requested);
+
+    // ask the platform for interrupts and the message that raises them. The
+    // device ORs the vector number into the low bits of the data.
     uint vector_base;
-    status_t err = platform_allocate_interrupts(num_requested, 1, &vector_base);
+    uint64_t msi_address;
+    uint32_t msi_data;
+    status_t err = platform_allocate_msi(requester_id(), num_requested, num_log2,
+                                         &vector_base, &msi_address, &msi_data);
     if (err != NO_ERROR) {
         return err;
     }
 
-    // compute the MSI message to construct
-    uint64_t msi_address = 0;
-    uint16_t msi_data = 0;
-#if ARCH_X86
-    msi_data = (vector_base & 0xff) | (0<<15); // edge triggered
-    msi_address = 0xfee0'0000 | (0 << 12); // cpu 0
-#else
-    return ERR_NOT_SUPPORTED;
-#endif
-
     // program it into the capability
-    const uint16_t cap_offset = msi_cap_->config_offset;
-
-    uint16_t control;
-    pci_read_config_half(loc(), cap_offset + 2, &control);
     pci_write_config_half(loc(), cap_offset + 2, control & ~(0x1)); // disable MSI
     pci_write_config_word(loc(), cap_offset + 4, msi_address & 0xffff'ffff); // lower 32bits
     if (control & (1<<7)) {
@@ -452,7 +484,7 @@ status_t device::allocate_msi(size_t num_requested, uint *msi_base) {
     }
 
     // set up the control register and enable it
-    control = 1; // NME/NMI = 1, no per vector masking, keep 64bit flag, enable
+    control = (num_log2 << 4) | 1; // MME = number of vectors, no per vector masking, keep 64bit flag, enable
     pci_write_config_half(loc(), cap_offset + 2, control);
 
     // write it back to the pci config in the interrupt line offset
@@ -464,6 +496,125 @@ status_t device::allocate_msi(size_t num_requested, uint *msi_base) {
     return NO_ERROR;
 }
 
+status_t device::allocate_msix(size_t num_requested, uint *msix_base) {
+    LTRACE_ENTRY;
+
+    if (!has_msix()) {
+        return ERR_NOT_SUPPORTED;
+    }
+
+    DEBUG_ASSERT(msix_cap_ && msix_cap_->is_msix());
+
+    if (num_requested == 0 || num_requested > msix_table_size_) {
+        return ERR_INVALID_ARGS;
+    }
+
+    const pci_bar_t &bar = bars_[msix_table_bar_];
+    if (!bar.valid || bar.io) {
+        return ERR_NOT_VALID;
+    }
+
+    // map the table the first time around, each entry is 16 bytes: address low,
+    // address high, data and vector control
+    status_t err;
+    if (!msix_table_) {
+        const paddr_t table_pa = bar.addr + msix_table_offset_;
+        const size_t table_size = msix_table_size_ * 16;
+#if WITH_KERNEL_VM
+        const paddr_t map_pa = ROUNDDOWN(table_pa, PAGE_SIZE);
+        const size_t map_size = ROUNDUP(table_pa + table_size, PAGE_SIZE) - map_pa;
+        void *ptr;
+        char str[14];
+        err = vmm_alloc_physical(vmm_get_kernel_aspace(), pci_loc_string(loc(), str), map_size, &ptr, 0,
+                                 map_pa, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        msix_table_ = (volatile uint32_t *)((uintptr_t)ptr + (table_pa - map_pa));
+#else
+        msix_table_ = (volatile uint32_t *)table_pa;
+#endif
+    }
+
+    // asking again replaces the earlier vectors
+    if (msix_vector_count_ > 0) {
+        err = free_msix();
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+
+    // ask the platform for a vector and message per table entry
+    uint vector_base;
+    uint64_t msi_address;
+    uint32_t msi_data;
+    err = platform_allocate_msi(requester_id(), num_requested, 0,
+                                &vector_base, &msi_address, &msi_data);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    volatile uint32_t *table = msix_table_;
+
+    // hold off all vectors with the function mask while the table is filled in
+    const uint16_t cap_offset = msix_cap_->config_offset;
+    uint16_t control;
+    pci_read_config_half(loc(), cap_offset + 2, &control);
+    pci_write_config_half(loc(), cap_offset + 2, control | (1<<15) | (1<<14)); // enable, function mask
+
+    for (size_t i = 0; i < msix_table_size_; i++) {
+        volatile uint32_t *entry = &table[i * 4];
+        if (i < num_requested) {
+            entry[0] = msi_address & 0xffff'ffff;
+            entry[1] = msi_address >> 32;
+            entry[2] = msi_data + i;
+            entry[3] = 0; // unmasked
+        } else {
+            entry[3] = 1; // masked
+        }
+    }
+
+    // make sure legacy MSI is off before switching over
+    if (has_msi()) {
+        uint16_t msi_control;
+        pci_read_config_half(loc(), msi_cap_->config_offset + 2, &msi_control);
+        pci_write_config_half(loc(), msi_cap_->config_offset + 2, msi_control & ~(0x1));
+    }
+
+    pci_write_config_half(loc(), cap_offset + 2, (control | (1<<15)) & ~(1<<14)); // enable, unmask
+
+    msix_vector_base_ = vector_base;
+    msix_vector_count_ = num_requested;
+
+    // pass back the allocated irq to the caller
+    *msix_base = vector_base;
+
+    return NO_ERROR;
+}
+
+status_t device::free_msix() {
+    LTRACE_ENTRY;
+
+    if (msix_vector_count_ == 0) {
+        return ERR_NOT_FOUND;
+    }
+
+    // mask everything and turn MSI-X off before the messages go away
+    const uint16_t cap_offset = msix_cap_->config_offset;
+    uint16_t control;
+    pci_read_config_half(loc(), cap_offset + 2, &control);
+    pci_write_config_half(loc(), cap_offset + 2, (control | (1<<14)) & ~(1<<15)); // disable, function mask
+
+    for (size_t i = 0; i < msix_vector_count_; i++) {
+        msix_table_[i * 4 + 3] = 1; // masked
+    }
+
+    status_t err = platform_free_msi(msix_vector_base_, msix_vector_count_);
+    msix_vector_base_ = 0;
+    msix_vector_count_ = 0;
+
+    return err;
+}
+
 status_t device::load_bars() {
     if (header_type() == 0) {
         for (int i=0; i < 6; i++) {
@@ -839,6 +990,36 @@ status_t pci_bus_mgr_allocate_msi(const pci_location_t loc, size_t num_requested
     return d->allocate_msi(num_requested, irqbase);
 }
 
+status_t pci_bus_mgr_allocate_msix(const pci_location_t loc, size_t num_requested, uint *irqbase) {
+    char str[14];
+    LTRACEF("%s num_request %zu\n", pci_loc_string(loc, str), num_requested);
+
+    *irqbase = 0;
+
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return ERR_NOT_FOUND;
+    }
+
+    if (!d->has_msix()) {
+        return ERR_NO_RESOURCES;
+    }
+
+    return d->allocate_msix(num_requested, irqbase);
+}
+
+status_t pci_bus_mgr_free_msix(const pci_location_t loc) {
+    char str[14];
+    LTRACEF("%s\n", pci_loc_string(loc, str));
+
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return ERR_NOT_FOUND;
+    }
+
+    return d->free_msix();
+}
+
 status_t pci_bus_mgr_allocate_irq(const pci_location_t loc, uint *irqbase) {
     char str[14];
     LTRACEF("%s\n", pci_loc_string(loc, str));
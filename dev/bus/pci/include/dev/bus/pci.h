@@ -104,6 +104,14 @@ status_t pci_bus_mgr_read_bars(const pci_location_t loc, pci_bar_t bar[6]);
 // try to allocate one or more msi vectors for this device
 status_t pci_bus_mgr_allocate_msi(const pci_location_t loc, size_t num_requested, uint *irqbase);
 
+// try to allocate one msi-x vector per table entry for the first num_requested
+// entries, returned as a run of vectors starting at irqbase
+status_t pci_bus_mgr_allocate_msix(const pci_location_t loc, size_t num_requested, uint *irqbase);
+
+// mask and disable msi-x and give its vectors back, the handlers have to be
+// unregistered first
+status_t pci_bus_mgr_free_msix(const pci_location_t loc);
+
 // allocate a regular irq for this device and return it in irqbase
 status_t pci_bus_mgr_allocate_irq(const pci_location_t loc, uint *irqbase);
 
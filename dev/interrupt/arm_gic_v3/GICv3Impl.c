@@ -33,7 +33,9 @@ static BOOLEAN SourceIsSpi(IN UINTN Source) {
   return Source >= 32 && Source < 1020;
 }
 
-static UINTN GicGetCpuRedistributorBase(IN UINTN GicRedistributorBase) {
+UINTN
+EFIAPI
+GicGetCpuRedistributorBase(IN UINTN GicRedistributorBase) {
   UINTN MpId;
   UINTN CpuAffinity;
   UINTN Affinity;
@@ -19,12 +19,20 @@
 #include <platform/interrupts.h>
 #include <private/ArmGicLib.h>
 #include <private/IoHighLevel.h>
+#include <private/arm_gic_v3_its.h>
 
 #include <kernel/debug.h>
+#include <kernel/event.h>
 #include <kernel/thread.h>
 
+#include <arch/atomic.h>
 #include <arch/ops.h>
+#include <lk/console_cmd.h>
+#include <lk/list.h>
 #include <lk/trace.h>
+#include <platform/time.h>
+#include <stdio.h>
+#include <string.h>
 
 #if WITH_LIB_SM
 #error "Unsupported"
@@ -38,6 +46,30 @@
 #define GICV3_MAX_INT 1026
 #endif
 
+#ifndef SMP_CPU_CLUSTER_SHIFT
+#define SMP_CPU_CLUSTER_SHIFT 8
+#endif
+
+// ICC_BPR1_EL1 value. Priority bits above the binary point form the group
+// priority that decides preemption, 3 gives 32 preemption levels.
+#ifndef ARM_GIC_V3_BINARY_POINT
+#define ARM_GIC_V3_BINARY_POINT 3
+#endif
+
+#ifndef ARM_GIC_V3_IRQ_STATS
+#define ARM_GIC_V3_IRQ_STATS 1
+#endif
+
+// INTIDs 1020-1023 are special and mean there is nothing left to acknowledge
+#define GICV3_INTID_SPECIAL_START 1020
+#define GICV3_INTID_SPECIAL_END 1024
+
+// INTID field of ICC_IAR1_EL1, wide enough for LPIs
+#define GICV3_INTID_MASK 0xffffff
+
+// The per vector tables hold the SGIs, PPIs and SPIs followed by the LPIs
+#define GICV3_MAX_SLOTS (GICV3_MAX_INT + GICV3_MAX_LPIS)
+
 #define LOCAL_TRACE 0
 
 static spin_lock_t gicd_lock;
@@ -52,26 +84,104 @@ UINTN mGicRedistributorsBase;
 UINTN mGicNumInterrupts;
 
 static bool arm_gic_interrupt_change_allowed(int irq) { return true; }
+
+// Index of |vector| in the per vector tables, -1 if it is out of range
+static int gicv3_vector_slot(unsigned int vector) {
+  if (gicv3_is_lpi(vector))
+    return GICV3_MAX_INT + (vector - GICV3_LPI_BASE);
+  if (vector < GICV3_MAX_INT && vector < mGicNumInterrupts)
+    return vector;
+  return -1;
+}
+
+static unsigned int gicv3_slot_vector(uint slot) {
+  if (slot >= GICV3_MAX_INT)
+    return GICV3_LPI_BASE + (slot - GICV3_MAX_INT);
+  return slot;
+}
 static void suspend_resume_fiq(bool resume_gicc, bool resume_gicd) {}
 
 struct int_handler_struct {
   int_handler handler;
   void *arg;
+
+  // threaded handlers
+  int_top_half top_half;
+  int_bottom_half bottom_half;
+  unsigned int vector;
+  struct list_node pending_node; // queued for the bottom half thread
+};
+
+// Per cpu bottom half thread. A queued vector stays active until its bottom
+// half has run, so each handler is on at most one pending list at a time.
+struct irq_thread_state {
+  spin_lock_t lock;
+  struct list_node pending;
+  event_t event;
+  thread_t *thread;
 };
 
+static struct irq_thread_state irq_threads[SMP_MAX_CPUS];
+
 static struct int_handler_struct
     int_handler_table_per_cpu[ARM_GIC_MAX_PER_CPU_INT][SMP_MAX_CPUS];
 static struct int_handler_struct
-    int_handler_table_shared[GICV3_MAX_INT - ARM_GIC_MAX_PER_CPU_INT];
+    int_handler_table_shared[GICV3_MAX_SLOTS - ARM_GIC_MAX_PER_CPU_INT];
 
-static struct int_handler_struct *get_int_handler(unsigned int vector,
-                                                  uint cpu) {
-  if (vector < ARM_GIC_MAX_PER_CPU_INT)
-    return &int_handler_table_per_cpu[vector][cpu];
+static struct int_handler_struct *get_int_handler(uint slot, uint cpu) {
+  if (slot < ARM_GIC_MAX_PER_CPU_INT)
+    return &int_handler_table_per_cpu[slot][cpu];
   else
-    return &int_handler_table_shared[vector - ARM_GIC_MAX_PER_CPU_INT];
+    return &int_handler_table_shared[slot - ARM_GIC_MAX_PER_CPU_INT];
 }
 
+struct int_vector_config {
+  uint8_t priority;
+  bool preemptible;
+};
+
+static struct int_vector_config int_vector_config[GICV3_MAX_SLOTS] = {
+    [0 ... GICV3_MAX_SLOTS - 1] = {.priority = ARM_GIC_DEFAULT_PRIORITY},
+};
+
+// Interrupt nesting state. A reschedule requested by a nested handler is
+// deferred to the outermost level so only it ends up in thread_preempt().
+static struct {
+  uint depth;
+  bool resched;
+} __CPU_ALIGN irq_percpu[SMP_MAX_CPUS];
+
+#if ARM_GIC_V3_IRQ_STATS
+// log2 buckets of handler run time, bucket 0 is < 512ns and the last one
+// catches everything from 2ms up
+#define IRQ_STATS_BUCKETS 14
+#define IRQ_STATS_BUCKET_SHIFT 8
+
+struct int_stats {
+  uint32_t count[SMP_MAX_CPUS];
+  uint32_t max_ns;
+  int latency_hist[IRQ_STATS_BUCKETS];
+};
+
+static struct int_stats int_stats[GICV3_MAX_SLOTS];
+
+static void gicv3_account_irq(uint slot, uint cpu, lk_time_ns_t elapsed) {
+  struct int_stats *s = &int_stats[slot];
+  uint bucket = 0;
+
+  if (elapsed >= (1U << (IRQ_STATS_BUCKET_SHIFT + 1))) {
+    bucket = 63 - __builtin_clzll(elapsed) - IRQ_STATS_BUCKET_SHIFT;
+    if (bucket >= IRQ_STATS_BUCKETS)
+      bucket = IRQ_STATS_BUCKETS - 1;
+  }
+
+  s->count[cpu]++;
+  atomic_add(&s->latency_hist[bucket], 1);
+  if (elapsed > s->max_ns)
+    s->max_ns = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+}
+#endif
+
 static bool gicv3_disable_interrupt_source(IN UINTN Source) {
   if (Source >= mGicNumInterrupts) {
     PANIC_UNIMPLEMENTED;
@@ -82,19 +192,100 @@ static bool gicv3_disable_interrupt_source(IN UINTN Source) {
   return true;
 }
 
+// How long a redistributor gets to report its CPU interface awake
+#define GICR_WAKE_TIMEOUT_MS 10
+
+static status_t gicv3_wake_redistributor(UINTN GicCpuRedistributorBase) {
+  // Clear ProcessorSleep and wait until the redistributor reports that its
+  // interface to the CPU is awake. Firmware usually does this for the boot
+  // CPU, but secondaries started through PSCI come up with it asleep.
+  MmioAndThenOr32(GicCpuRedistributorBase + ARM_GICR_WAKER,
+                  ~ARM_GICR_WAKER_PROCESSORSLEEP, 0);
+
+  lk_time_t start = current_time();
+  while (MmioRead32(GicCpuRedistributorBase + ARM_GICR_WAKER) &
+         ARM_GICR_WAKER_CHILDRENASLEEP) {
+    if (current_time() - start > GICR_WAKE_TIMEOUT_MS)
+      return ERR_TIMED_OUT;
+  }
+
+  return NO_ERROR;
+}
+
+static void arm_gicv3_init_percpu(uint level) {
+  UINTN GicCpuRedistributorBase =
+      GicGetCpuRedistributorBase(mGicRedistributorsBase);
+
+  LTRACEF("cpu %u redistributor %#llx\n", arch_curr_cpu_num(),
+          GicCpuRedistributorBase);
+
+  if (gicv3_wake_redistributor(GicCpuRedistributorBase) < 0) {
+    // Without a CPU interface this cpu can't take interrupts, not even SGIs
+    printf("GICv3: cpu %u redistributor did not wake up\n",
+           arch_curr_cpu_num());
+    return;
+  }
+
+  // Reset the banked SGIs and PPIs of this redistributor
+  for (UINTN Index = 0; Index < ARM_GIC_MAX_PER_CPU_INT; Index++) {
+    gicv3_disable_interrupt_source(Index);
+    ArmGicSetInterruptPriority(mGicDistributorBase, mGicRedistributorsBase,
+                               Index, int_vector_config[Index].priority);
+  }
+
+  if ((MmioRead32(mGicDistributorBase + ARM_GIC_ICDDCR) & ARM_GIC_ICDDCR_DS) !=
+      0) {
+    // See arm_gicv3_init(): move the banked interrupts to non-secure Group 1
+    MmioWrite32(GicCpuRedistributorBase + ARM_GICR_CTLR_FRAME_SIZE +
+                    ARM_GIC_ICDISR,
+                0xffffffff);
+  }
+
+  // Use the system register interface
+  ArmGicV3SetControlSystemRegisterEnable(
+      ArmGicV3GetControlSystemRegisterEnable() | ICC_SRE_EL1_SRE);
+  ISB;
+
+  // Split EOI: writing EOIR drops the running priority right away and the
+  // interrupt is deactivated separately, possibly from a bottom half thread
+  ArmGicV3SetCpuInterfaceControl(ArmGicV3GetCpuInterfaceControl() |
+                                 ICC_CTLR_EL1_EOIMODE);
+
+  // Split the priority into group priority and subpriority. Handlers still
+  // run with interrupts masked unless their vector is marked preemptible.
+  ArmGicV3SetBinaryPointer(ARM_GIC_V3_BINARY_POINT);
+
+  // Set priority mask reg to 0xff to allow all priorities through
+  ArmGicV3SetPriorityMask(0xff);
+
+  // Enable gic cpu interface
+  ArmGicV3EnableInterruptInterface();
+}
+
+LK_INIT_HOOK_FLAGS(arm_gicv3_init_percpu, arm_gicv3_init_percpu,
+                   LK_INIT_LEVEL_PLATFORM_EARLY, LK_INIT_FLAG_SECONDARY_CPUS);
+
 void arm_gicv3_init(uint64_t distributorBase, uint64_t redistributorBase) {
   mGicDistributorBase = distributorBase;
   mGicRedistributorsBase = redistributorBase;
   mGicNumInterrupts = ArmGicGetMaxNumInterrupts(mGicDistributorBase);
   printf("GICv3: %ld interrupts available\n", mGicNumInterrupts);
 
+  for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+    irq_threads[cpu].lock = SPIN_LOCK_INITIAL_VALUE;
+    list_initialize(&irq_threads[cpu].pending);
+    event_init(&irq_threads[cpu].event, false, EVENT_FLAG_AUTOUNSIGNAL);
+  }
+
   // Drive it without compat mode
   MmioOr32(mGicDistributorBase + ARM_GIC_ICDDCR, ARM_GIC_ICDDCR_ARE);
   printf("GICv3: Configured without compat mode\n");
 
-  // Set Interrupt priority
+  // Set Interrupt priority. The banked SGIs and PPIs are reset per CPU in
+  // arm_gicv3_init_percpu().
   printf("GICv3: Reset all interrupt priority\n");
-  for (UINTN Index = 0; Index < mGicNumInterrupts; Index++) {
+  for (UINTN Index = ARM_GIC_MAX_PER_CPU_INT; Index < mGicNumInterrupts;
+       Index++) {
     gicv3_disable_interrupt_source(Index);
 
     // Set Priority
@@ -103,7 +294,6 @@ void arm_gicv3_init(uint64_t distributorBase, uint64_t redistributorBase) {
   }
 
   // Targets the interrupts to the Primary Cpu
-  printf("GICv3: Targeting all interrupts to this CPU (No MP)\n");
   uint64_t MpId = ARM64_READ_SYSREG(mpidr_el1);
   uint64_t CpuTarget =
       MpId & (ARM_CORE_AFF0 | ARM_CORE_AFF1 | ARM_CORE_AFF2 | ARM_CORE_AFF3);
@@ -116,38 +306,68 @@ void arm_gicv3_init(uint64_t distributorBase, uint64_t redistributorBase) {
     // and that no other firmware has performed any configuration on the GIC.
     // This means we need to reconfigure all interrupts to non-secure Group 1
     // first.
-
-    MmioWrite32(mGicRedistributorsBase + ARM_GICR_CTLR_FRAME_SIZE +
-                    ARM_GIC_ICDISR,
-                0xffffffff);
-
     for (UINTN Index = 32; Index < mGicNumInterrupts; Index += 32) {
       MmioWrite32(mGicDistributorBase + ARM_GIC_ICDISR + Index / 8, 0xffffffff);
     }
   }
 
-  // Route the SPIs to the primary CPU. SPIs start at the INTID 32
-  printf("GICv3: Routing SPIs to this CPU (No MP)\n");
+  // Route the SPIs to the boot CPU. SPIs start at the INTID 32. Secondary
+  // CPUs only take their own SGIs and PPIs.
+  printf("GICv3: Routing SPIs to the boot CPU\n");
   for (UINTN Index = 0; Index < (mGicNumInterrupts - 32); Index++) {
     MmioWrite64(mGicDistributorBase + ARM_GICD_IROUTER + (Index * 8),
                 CpuTarget);
   }
 
-  // Set binary point reg to 0x7 (no preemption)
-  printf("GICv3: Disable preemption\n");
-  ArmGicV3SetBinaryPointer(0x7);
-
-  // Set priority mask reg to 0xff to allow all priorities through
-  printf("GICv3: Setting priorities\n");
-  ArmGicV3SetPriorityMask(0xff);
-
-  // Enable gic cpu interface
-  printf("GICv3: Enable CPU interface\n");
-  ArmGicV3EnableInterruptInterface();
-
   // Enable gic distributor
   printf("GICv3: Enable GIC distributor\n");
   ArmGicEnableDistributor(mGicDistributorBase);
+
+  // Wake the redistributor and the CPU interface of the boot CPU
+  printf("GICv3: Enable CPU interface\n");
+  arm_gicv3_init_percpu(0);
+}
+
+status_t arm_gicv3_sgi(u_int irq, u_int cpu_mask) {
+  if (irq >= 16)
+    return ERR_INVALID_ARGS;
+
+  // Make the IPI payload (e.g. the mp reschedule mask) visible to the target
+  // CPUs before the SGI is raised.
+  __asm__ volatile("dsb ishst" ::: "memory");
+
+  // ICC_SGI1R_EL1 addresses up to 16 CPUs of one Aff2.Aff1 cluster (plus a
+  // range selector for Aff0 >= 16) per write, so batch targets that share
+  // those fields.
+  while (cpu_mask != 0) {
+    u_int cpu = __builtin_ctz(cpu_mask);
+    u_int cluster = cpu >> SMP_CPU_CLUSTER_SHIFT;
+    u_int range = (cpu & ((1U << SMP_CPU_CLUSTER_SHIFT) - 1)) >> 4;
+    uint64_t target_list = 0;
+
+    for (u_int mask = cpu_mask; mask != 0; mask &= mask - 1) {
+      u_int target = __builtin_ctz(mask);
+      u_int aff0 = target & ((1U << SMP_CPU_CLUSTER_SHIFT) - 1);
+
+      if ((target >> SMP_CPU_CLUSTER_SHIFT) != cluster || (aff0 >> 4) != range)
+        continue;
+
+      target_list |= 1U << (aff0 & 0xf);
+      cpu_mask &= ~(1U << target);
+    }
+
+    uint64_t val = (target_list & ARM_GICV3_SGIR_TARGETLIST_MASK) |
+                   ((uint64_t)(cluster & 0xff) << ARM_GICV3_SGIR_AFF1_SHIFT) |
+                   ((uint64_t)(irq & 0xf) << ARM_GICV3_SGIR_INTID_SHIFT) |
+                   ((uint64_t)((cluster >> 8) & 0xff)
+                    << ARM_GICV3_SGIR_AFF2_SHIFT) |
+                   ((uint64_t)range << ARM_GICV3_SGIR_RS_SHIFT);
+
+    LTRACEF("ICC_SGI1R_EL1: %#llx\n", val);
+    ArmGicV3SendGroup1Sgi(val);
+  }
+
+  return NO_ERROR;
 }
 
 void register_int_handler(unsigned int vector, int_handler handler, void *arg) {
@@ -156,22 +376,149 @@ void register_int_handler(unsigned int vector, int_handler handler, void *arg) {
 
   spin_lock_saved_state_t state;
 
-  if (vector >= GICV3_MAX_INT || vector >= mGicNumInterrupts) {
+  int slot = gicv3_vector_slot(vector);
+  if (slot < 0) {
     panic("register_int_handler: vector out of range %d\n", vector);
   }
 
   spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
 
   if (arm_gic_interrupt_change_allowed(vector)) {
-    h = get_int_handler(vector, cpu);
+    h = get_int_handler(slot, cpu);
     h->handler = handler;
     h->arg = arg;
+    h->top_half = NULL;
+    h->bottom_half = NULL;
   }
 
   spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
 }
 
+void register_int_handler_msi(unsigned int vector, int_handler handler,
+                              void *arg, bool edge) {
+  // MSIs arrive as LPIs, which are always edge triggered
+  register_int_handler(vector, handler, arg);
+}
+
+void register_threaded_int_handler(unsigned int vector, int_top_half top_half,
+                                   int_bottom_half bottom_half, void *arg) {
+  struct int_handler_struct *h;
+  uint cpu = arch_curr_cpu_num();
+
+  spin_lock_saved_state_t state;
+
+  int slot = gicv3_vector_slot(vector);
+  if (slot < 0) {
+    panic("register_threaded_int_handler: vector out of range %d\n", vector);
+  }
+  DEBUG_ASSERT(bottom_half);
+
+  spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+
+  if (arm_gic_interrupt_change_allowed(vector)) {
+    h = get_int_handler(slot, cpu);
+    h->handler = NULL;
+    h->arg = arg;
+    h->top_half = top_half;
+    h->bottom_half = bottom_half;
+    h->vector = vector;
+  }
+
+  spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
+}
+
+static int gicv3_irq_thread(void *arg) {
+  struct irq_thread_state *st = arg;
+
+  for (;;) {
+    event_wait(&st->event);
+
+    for (;;) {
+      spin_lock_saved_state_t state;
+      spin_lock_irqsave(&st->lock, state);
+      struct int_handler_struct *h = list_remove_head_type(
+          &st->pending, struct int_handler_struct, pending_node);
+      spin_unlock_irqrestore(&st->lock, state);
+
+      if (!h)
+        break;
+
+      h->bottom_half(h->arg);
+
+      // The thread is pinned to the cpu that acknowledged the interrupt, so
+      // this deactivates it on the right cpu interface and lets it fire again.
+      // LPIs have no active state and were masked instead.
+      if (gicv3_is_lpi(h->vector))
+        arm_gicv3_its_lpi_set_enable(h->vector, true);
+      else
+        ArmGicV3DeactivateInterrupt(h->vector);
+    }
+  }
+
+  return 0;
+}
+
+static void arm_gicv3_init_irq_thread(uint level) {
+  uint cpu = arch_curr_cpu_num();
+  char name[16];
+
+  snprintf(name, sizeof(name), "irq bh %u", cpu);
+  thread_t *t = thread_create(name, &gicv3_irq_thread, &irq_threads[cpu],
+                              HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+  if (!t) {
+    TRACEF("failed to create bottom half thread for cpu %u\n", cpu);
+    return;
+  }
+  thread_set_pinned_cpu(t, cpu);
+  irq_threads[cpu].thread = t;
+  thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK_FLAGS(arm_gicv3_init_irq_thread, arm_gicv3_init_irq_thread,
+                   LK_INIT_LEVEL_THREADING,
+                   LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_SECONDARY_CPUS);
+
+status_t arm_gicv3_set_priority(unsigned int vector, uint8_t priority) {
+  int slot = gicv3_vector_slot(vector);
+  if (slot < 0)
+    return ERR_INVALID_ARGS;
+
+  if (gicv3_is_lpi(vector)) {
+    // LPIs keep their priority in the ITS configuration table
+    int_vector_config[slot].priority = priority;
+    arm_gicv3_its_lpi_set_priority(vector, priority);
+    return NO_ERROR;
+  }
+
+  spin_lock_saved_state_t state;
+  spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+
+  // SGIs and PPIs are banked, the other cpus pick the value up in
+  // arm_gicv3_init_percpu()
+  int_vector_config[slot].priority = priority;
+  ArmGicSetInterruptPriority(mGicDistributorBase, mGicRedistributorsBase,
+                             vector, priority);
+
+  spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
+
+  return NO_ERROR;
+}
+
+status_t arm_gicv3_set_preemptible(unsigned int vector, bool preemptible) {
+  int slot = gicv3_vector_slot(vector);
+  if (slot < 0)
+    return ERR_INVALID_ARGS;
+
+  int_vector_config[slot].preemptible = preemptible;
+  return NO_ERROR;
+}
+
 status_t mask_interrupt(unsigned int vector) {
+  if (gicv3_is_lpi(vector)) {
+    arm_gicv3_its_lpi_set_enable(vector, false);
+    return NO_ERROR;
+  }
+
   if (vector >= mGicNumInterrupts) {
     PANIC_UNIMPLEMENTED;
     return ERR_NOT_VALID;
@@ -182,6 +529,11 @@ status_t mask_interrupt(unsigned int vector) {
 }
 
 status_t unmask_interrupt(unsigned int vector) {
+  if (gicv3_is_lpi(vector)) {
+    arm_gicv3_its_lpi_set_enable(vector, true);
+    return NO_ERROR;
+  }
+
   if (vector >= mGicNumInterrupts) {
     PANIC_UNIMPLEMENTED;
     return ERR_NOT_VALID;
@@ -191,45 +543,178 @@ status_t unmask_interrupt(unsigned int vector) {
   return NO_ERROR;
 }
 
-static enum handler_return __platform_irq(struct iframe *frame) {
-  UINT32 GicInterrupt;
-  GicInterrupt = ArmGicV3AcknowledgeInterrupt();
-
-  unsigned int vector = GicInterrupt & 0x3ff;
-  if (vector >= 0x3fe) {
-    // spurious
-    return INT_NO_RESCHEDULE;
-  }
-
+static enum handler_return gicv3_handle_irq(struct iframe *frame,
+                                            unsigned int vector, uint cpu) {
   THREAD_STATS_INC(interrupts);
   KEVLOG_IRQ_ENTER(vector);
 
-  uint cpu = arch_curr_cpu_num();
+  LTRACEF_LEVEL(2, "cpu %u currthread %p vector %d pc 0x%lx\n", cpu,
+                get_current_thread(), vector, (uintptr_t)IFRAME_PC(frame));
+
+  int slot = gicv3_vector_slot(vector);
+  bool lpi = gicv3_is_lpi(vector);
+  if (slot < 0) {
+    // an LPI beyond the ones we hand out, nobody is listening
+    ArmGicV3EndOfInterrupt(vector);
+    if (vector < GICV3_LPI_BASE)
+      ArmGicV3DeactivateInterrupt(vector);
+    KEVLOG_IRQ_EXIT(vector);
+    return INT_NO_RESCHEDULE;
+  }
 
-  LTRACEF_LEVEL(2, "iar 0x%x cpu %u currthread %p vector %d pc 0x%lx\n",
-                GicInterrupt, cpu, get_current_thread(), vector,
-                (uintptr_t)IFRAME_PC(frame));
+#if ARM_GIC_V3_IRQ_STATS
+  lk_time_ns_t start = current_time_ns();
+#endif
 
   // deliver the interrupt
-  enum handler_return ret;
+  enum handler_return ret = INT_NO_RESCHEDULE;
+  bool run_bottom_half = false;
+  struct int_handler_struct *handler = get_int_handler(slot, cpu);
+  if (handler->handler || handler->top_half) {
+    // The running priority is now that of this vector, so unmasking only
+    // lets interrupts with a higher group priority in. The handler has to
+    // take its locks with interrupts disabled for this to be safe.
+    bool preemptible = int_vector_config[slot].preemptible;
+    if (preemptible)
+      arch_enable_ints();
+    if (handler->handler)
+      ret = handler->handler(handler->arg);
+    else
+      run_bottom_half = handler->top_half(handler->arg);
+    if (preemptible)
+      arch_disable_ints();
+  } else if (handler->bottom_half) {
+    run_bottom_half = true;
+  }
+
+#if ARM_GIC_V3_IRQ_STATS
+  gicv3_account_irq(slot, cpu, current_time_ns() - start);
+#endif
 
-  ret = INT_NO_RESCHEDULE;
-  struct int_handler_struct *handler = get_int_handler(vector, cpu);
-  if (handler->handler)
-    ret = handler->handler(handler->arg);
+  // LPIs have no active state to hold them off while the bottom half is
+  // pending, so mask them before the priority drop
+  if (run_bottom_half && lpi)
+    arm_gicv3_its_lpi_set_enable(vector, false);
 
+  // priority drop
   ArmGicV3EndOfInterrupt(vector);
+
+  if (run_bottom_half) {
+    // leave the interrupt active, which keeps it from being delivered again,
+    // until the bottom half thread has run
+    struct irq_thread_state *st = &irq_threads[cpu];
+
+    spin_lock(&st->lock);
+    list_add_tail(&st->pending, &handler->pending_node);
+    spin_unlock(&st->lock);
+
+    event_signal(&st->event, false);
+    ret = INT_RESCHEDULE;
+  } else if (!lpi) {
+    ArmGicV3DeactivateInterrupt(vector);
+  }
+
   LTRACEF_LEVEL(2, "cpu %u exit %d\n", cpu, ret);
   KEVLOG_IRQ_EXIT(vector);
 
   return ret;
 }
 
+static enum handler_return __platform_irq(struct iframe *frame) {
+  uint cpu = arch_curr_cpu_num();
+  enum handler_return ret = INT_NO_RESCHEDULE;
+
+  irq_percpu[cpu].depth++;
+
+  // Keep acknowledging until the cpu interface has nothing pending for us so
+  // a burst of interrupts is handled with a single exception entry.
+  for (;;) {
+    UINT32 GicInterrupt = ArmGicV3AcknowledgeInterrupt();
+    unsigned int vector = GicInterrupt & GICV3_INTID_MASK;
+    if (vector >= GICV3_INTID_SPECIAL_START &&
+        vector < GICV3_INTID_SPECIAL_END) {
+      // spurious, we are done
+      break;
+    }
+
+    if (gicv3_handle_irq(frame, vector, cpu) == INT_RESCHEDULE)
+      ret = INT_RESCHEDULE;
+  }
+
+  if (--irq_percpu[cpu].depth > 0) {
+    // nested, let the outermost level reschedule on the way out
+    if (ret == INT_RESCHEDULE)
+      irq_percpu[cpu].resched = true;
+    return INT_NO_RESCHEDULE;
+  }
+
+  if (irq_percpu[cpu].resched) {
+    irq_percpu[cpu].resched = false;
+    ret = INT_RESCHEDULE;
+  }
+
+  return ret;
+}
+
 enum handler_return platform_irq(struct iframe *frame);
 enum handler_return platform_irq(struct iframe *frame) {
   return __platform_irq(frame);
 }
 
+#if ARM_GIC_V3_IRQ_STATS
+static int cmd_irqstats(int argc, const console_cmd_args *argv) {
+  if (argc > 1 && !strcmp(argv[1].str, "reset")) {
+    memset(int_stats, 0, sizeof(int_stats));
+    return NO_ERROR;
+  }
+
+  if (argc > 1) {
+    printf("usage:\n");
+    printf("%s          : dump per vector interrupt counts and latency\n",
+           argv[0].str);
+    printf("%s reset    : clear the counters\n", argv[0].str);
+    return ERR_INVALID_ARGS;
+  }
+
+  for (uint slot = 0; slot < GICV3_MAX_SLOTS; slot++) {
+    struct int_stats *s = &int_stats[slot];
+    uint64_t total = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+      total += s->count[cpu];
+    if (total == 0)
+      continue;
+
+    printf("irq %4u: prio %#04x%s total %llu max %u ns\n",
+           gicv3_slot_vector(slot), int_vector_config[slot].priority,
+           int_vector_config[slot].preemptible ? " preemptible" : "", total,
+           s->max_ns);
+
+    printf("\tcpu:");
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+      printf(" %u", s->count[cpu]);
+    printf("\n");
+
+    printf("\tns:");
+    for (uint i = 0; i < IRQ_STATS_BUCKETS; i++) {
+      if (s->latency_hist[i] == 0)
+        continue;
+      printf(" %s%u:%d", (i == 0) ? "<" : ">=",
+             1U << (IRQ_STATS_BUCKET_SHIFT + (i == 0 ? 1 : i)),
+             s->latency_hist[i]);
+    }
+    printf("\n");
+  }
+
+  return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("irqstats", "per vector interrupt counts and latency",
+               &cmd_irqstats)
+STATIC_COMMAND_END(gicv3);
+#endif
+
 void platform_fiq(struct iframe *frame);
 void platform_fiq(struct iframe *frame) {
   // TODO: The only possible case for FIQ right now is the timer
@@ -0,0 +1,758 @@
+/*
+ * Copyright (c) 2022 Bingxing Wang
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/list.h>
+#include <lk/pow2.h>
+#include <lk/trace.h>
+
+#include <dev/interrupt/arm_gic_v3.h>
+#include <platform/interrupts.h>
+#include <private/ArmGicLib.h>
+#include <private/IoHighLevel.h>
+#include <private/arm_gic_v3_its.h>
+
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+// ITS control frame
+#define GITS_CTLR 0x0000
+#define GITS_TYPER 0x0008
+#define GITS_CBASER 0x0080
+#define GITS_CWRITER 0x0088
+#define GITS_CREADR 0x0090
+#define GITS_BASER(n) (0x0100 + (n)*8)
+#define GITS_BASER_COUNT 8
+
+// ITS translation frame, the doorbell devices write their MSIs to
+#define GITS_TRANSLATER 0x10040
+
+#define GITS_CTLR_ENABLED (1U << 0)
+#define GITS_CTLR_QUIESCENT (1U << 31)
+
+#define GITS_TYPER_DEVBITS(t) ((((t) >> 13) & 0x1f) + 1)
+#define GITS_TYPER_PTA (1ULL << 19)
+
+#define GITS_CREADR_OFFSET_MASK 0xfffe0ULL
+
+#define GITS_BASER_VALID (1ULL << 63)
+#define GITS_BASER_TYPE(b) (((b) >> 56) & 0x7)
+#define GITS_BASER_TYPE_MASK (7ULL << 56)
+#define GITS_BASER_ENTRY_SIZE(b) ((((b) >> 48) & 0x1f) + 1)
+#define GITS_BASER_ENTRY_SIZE_MASK (0x1fULL << 48)
+#define GITS_BASER_PAGE_SIZE_MASK (3ULL << 8)
+#define GITS_BASER_PAGE_SIZE_4K (0ULL << 8)
+#define GITS_BASER_TYPE_DEVICE 1
+#define GITS_BASER_TYPE_COLLECTION 4
+
+// Memory attributes of the tables. The ITS registers and the redistributor
+// LPI registers place the inner cacheability at different bits.
+#define GITS_BASER_INNER_WAWB (7ULL << 59)
+#define GICR_BASER_INNER_WAWB (7ULL << 7)
+#define GIC_BASER_SHAREABILITY_INNER (1ULL << 10)
+#define GIC_BASER_ADDR_MASK 0x000ffffffffff000ULL
+
+// Redistributor LPI registers, in the control frame
+#define GICR_CTLR 0x0000
+#define GICR_CTLR_ENABLE_LPIS (1U << 0)
+#define GICR_PROPBASER 0x0070
+#define GICR_PENDBASER 0x0078
+#define GICR_PENDBASER_PTZ (1ULL << 62)
+#define GICR_INVLPIR 0x00a0
+#define GICR_SYNCR 0x00c0
+#define GICR_SYNCR_BUSY (1U << 0)
+
+#define GICD_TYPER_LPIS (1U << 17)
+#define GICD_TYPER_IDBITS(t) ((((t) >> 19) & 0x1f) + 1)
+
+// LPI configuration table entry
+#define LPI_PROP_ENABLE (1U << 0)
+#define LPI_PROP_RES1 (1U << 1)
+#define LPI_PROP_PRIORITY_MASK 0xfc
+
+// INTID bits covered by the LPI tables, enough for GICV3_MAX_LPIS LPIs
+#define ITS_LPI_ID_BITS 14
+#define ITS_LPI_TABLE_ENTRIES ((1U << ITS_LPI_ID_BITS) - GICV3_LPI_BASE)
+static_assert(GICV3_MAX_LPIS <= ITS_LPI_TABLE_ENTRIES, "");
+
+// Every device gets an ITT with room for this many event IDs
+#define ITS_EVENT_ID_BITS 8
+#define ITS_MAX_EVENTS (1U << ITS_EVENT_ID_BITS)
+#define ITS_ITT_ENTRY_SIZE(t) ((((t) >> 4) & 0xf) + 1)
+
+// PCI requester IDs are 16 bits, there is no point in a bigger device table
+#define ITS_MAX_DEVICE_ID_BITS 16
+
+// All LPIs are delivered to the boot cpu through collection 0
+#define ITS_COLLECTION_BOOT 0
+
+// command queue, one page of 32 byte commands
+#define ITS_CMD_QUEUE_SIZE PAGE_SIZE
+
+// How long to wait for the ITS or the redistributor to make progress before
+// giving up on it. Some of the waits happen with interrupts disabled.
+#define ITS_TIMEOUT_MS 10
+
+#define ITS_CMD_SYNC 0x05
+#define ITS_CMD_MAPD 0x08
+#define ITS_CMD_MAPC 0x09
+#define ITS_CMD_MAPTI 0x0a
+#define ITS_CMD_INV 0x0c
+#define ITS_CMD_INVALL 0x0d
+#define ITS_CMD_DISCARD 0x0f
+
+struct its_cmd {
+  uint64_t raw[4];
+};
+
+#define ITS_CMD_QUEUE_ENTRIES (ITS_CMD_QUEUE_SIZE / sizeof(struct its_cmd))
+
+struct its_device {
+  struct list_node node;
+  uint32_t device_id;
+  uint32_t next_event;
+  paddr_t itt;
+};
+
+struct its_lpi {
+  bool allocated;
+  uint32_t device_id;
+  uint32_t event_id;
+};
+
+static struct {
+  bool initialized;
+  vaddr_t base;
+  uint64_t typer;
+  paddr_t translater;
+
+  // target address of the boot cpu redistributor in MAPC and SYNC
+  uint64_t rdbase;
+
+  // control frame of the boot cpu redistributor, which all LPIs target, and
+  // whether it can invalidate LPI configuration without going through the ITS
+  UINTN rd;
+  bool direct_lpi;
+
+  // set once the ITS stopped consuming commands, nothing is queued after that
+  bool wedged;
+
+  // serializes the command queue, taken from interrupt context
+  spin_lock_t cmd_lock;
+  struct its_cmd *cmd_queue;
+  uint cmd_write;
+
+  // protects the device list and the LPI allocations
+  mutex_t alloc_lock;
+  struct list_node devices;
+
+  uint8_t *prop_table;
+  struct its_lpi lpis[GICV3_MAX_LPIS];
+} its = {
+    .cmd_lock = SPIN_LOCK_INITIAL_VALUE,
+    .alloc_lock = MUTEX_INITIAL_VALUE(its.alloc_lock),
+    .devices = LIST_INITIAL_VALUE(its.devices),
+};
+
+// Allocate physically contiguous, zeroed memory for one of the tables the
+// GIC reads. The tables are mapped inner shareable write-back, but clean
+// them anyway in case the GIC is not coherent with the cpus.
+static void *its_alloc_table(size_t size, uint align_log2, paddr_t *pa) {
+  uint count = ROUNDUP(size, PAGE_SIZE) / PAGE_SIZE;
+
+  if (align_log2 < PAGE_SIZE_SHIFT)
+    align_log2 = PAGE_SIZE_SHIFT;
+  if (pmm_alloc_contiguous(count, align_log2, pa, NULL) != count)
+    return NULL;
+
+  void *va = paddr_to_kvaddr(*pa);
+  memset(va, 0, count * PAGE_SIZE);
+  arch_clean_cache_range((addr_t)va, count * PAGE_SIZE);
+
+  return va;
+}
+
+static void its_free_table(paddr_t pa, size_t size) {
+  pmm_free_kpages(paddr_to_kvaddr(pa), ROUNDUP(size, PAGE_SIZE) / PAGE_SIZE);
+}
+
+static size_t its_itt_size(void) {
+  return ITS_MAX_EVENTS * ITS_ITT_ENTRY_SIZE(its.typer);
+}
+
+static uint its_cmd_read_index(void) {
+  return (MmioRead64(its.base + GITS_CREADR) & GITS_CREADR_OFFSET_MASK) /
+         sizeof(struct its_cmd);
+}
+
+static bool its_has_room(uint read_index, uint next) {
+  return read_index != next;
+}
+
+static bool its_reached(uint read_index, uint write_index) {
+  return read_index == write_index;
+}
+
+// cmd_lock held. Wait for the ITS to read far enough with a bound, so a
+// wedged ITS fails the command instead of hanging the cpu.
+static status_t its_wait_read_index(bool (*done)(uint read_index, uint arg),
+                                    uint arg) {
+  lk_time_t start = current_time();
+
+  while (!done(its_cmd_read_index(), arg)) {
+    if (current_time() - start > ITS_TIMEOUT_MS) {
+      if (!its.wedged)
+        printf("GICv3: ITS stopped processing commands, CREADR %#llx\n",
+               (unsigned long long)MmioRead64(its.base + GITS_CREADR));
+      its.wedged = true;
+      return ERR_TIMED_OUT;
+    }
+  }
+
+  return NO_ERROR;
+}
+
+// cmd_lock held
+static status_t its_send_cmd(const struct its_cmd *cmd) {
+  uint next = (its.cmd_write + 1) % ITS_CMD_QUEUE_ENTRIES;
+
+  if (its.wedged)
+    return ERR_TIMED_OUT;
+
+  // one slot always stays empty so a full queue can be told from an empty one
+  status_t err = its_wait_read_index(its_has_room, next);
+  if (err != NO_ERROR)
+    return err;
+
+  its.cmd_queue[its.cmd_write] = *cmd;
+  arch_clean_cache_range((addr_t)&its.cmd_queue[its.cmd_write],
+                         sizeof(struct its_cmd));
+
+  its.cmd_write = next;
+  DSB;
+  MmioWrite64(its.base + GITS_CWRITER,
+              (uint64_t)next * sizeof(struct its_cmd));
+
+  return NO_ERROR;
+}
+
+// cmd_lock held. Queue a SYNC and wait for the ITS to consume everything up
+// to and including it, after which the effects of the earlier commands are
+// visible to the redistributor.
+static status_t its_sync(void) {
+  struct its_cmd cmd = {{ITS_CMD_SYNC, 0, its.rdbase << 16, 0}};
+
+  status_t err = its_send_cmd(&cmd);
+  if (err != NO_ERROR)
+    return err;
+
+  return its_wait_read_index(its_reached, its.cmd_write);
+}
+
+// A MAPD without the valid bit unmaps the device, the ITT is ignored then
+static status_t its_cmd_mapd(uint32_t device_id, paddr_t itt, bool valid) {
+  struct its_cmd cmd = {{
+      ITS_CMD_MAPD | ((uint64_t)device_id << 32),
+      ITS_EVENT_ID_BITS - 1,
+      (valid ? GITS_BASER_VALID : 0) | (itt & 0x000fffffffffff00ULL),
+      0,
+  }};
+
+  return its_send_cmd(&cmd);
+}
+
+static status_t its_cmd_mapc(uint16_t collection) {
+  struct its_cmd cmd = {{
+      ITS_CMD_MAPC,
+      0,
+      GITS_BASER_VALID | (its.rdbase << 16) | collection,
+      0,
+  }};
+
+  return its_send_cmd(&cmd);
+}
+
+static status_t its_cmd_mapti(uint32_t device_id, uint32_t event_id,
+                             unsigned int vector, uint16_t collection) {
+  struct its_cmd cmd = {{
+      ITS_CMD_MAPTI | ((uint64_t)device_id << 32),
+      event_id | ((uint64_t)vector << 32),
+      collection,
+      0,
+  }};
+
+  return its_send_cmd(&cmd);
+}
+
+static status_t its_cmd_inv(uint32_t device_id, uint32_t event_id) {
+  struct its_cmd cmd = {{
+      ITS_CMD_INV | ((uint64_t)device_id << 32),
+      event_id,
+      0,
+      0,
+  }};
+
+  return its_send_cmd(&cmd);
+}
+
+static status_t its_cmd_invall(uint16_t collection) {
+  struct its_cmd cmd = {{ITS_CMD_INVALL, 0, collection, 0}};
+
+  return its_send_cmd(&cmd);
+}
+
+static status_t its_cmd_discard(uint32_t device_id, uint32_t event_id) {
+  struct its_cmd cmd = {{
+      ITS_CMD_DISCARD | ((uint64_t)device_id << 32),
+      event_id,
+      0,
+      0,
+  }};
+
+  return its_send_cmd(&cmd);
+}
+
+static status_t its_init_baser(uint n) {
+  uint64_t baser = MmioRead64(its.base + GITS_BASER(n));
+  uint type = GITS_BASER_TYPE(baser);
+  size_t entry_size = GITS_BASER_ENTRY_SIZE(baser);
+  size_t entries;
+
+  switch (type) {
+  case GITS_BASER_TYPE_DEVICE:
+    entries = 1U << MIN(GITS_TYPER_DEVBITS(its.typer), ITS_MAX_DEVICE_ID_BITS);
+    break;
+  case GITS_BASER_TYPE_COLLECTION:
+    entries = SMP_MAX_CPUS;
+    break;
+  default:
+    // unimplemented, or tables for vPEs which we do not use
+    return NO_ERROR;
+  }
+
+  // flat tables only, the size field counts up to 256 pages
+  size_t size = ROUNDUP(entries * entry_size, PAGE_SIZE);
+  if (size / PAGE_SIZE > 256)
+    return ERR_NO_RESOURCES;
+
+  paddr_t pa;
+  if (!its_alloc_table(size, PAGE_SIZE_SHIFT, &pa))
+    return ERR_NO_MEMORY;
+
+  uint64_t val = GITS_BASER_VALID | GITS_BASER_INNER_WAWB |
+                 (baser & (GITS_BASER_TYPE_MASK | GITS_BASER_ENTRY_SIZE_MASK)) |
+                 (pa & GIC_BASER_ADDR_MASK) | GIC_BASER_SHAREABILITY_INNER |
+                 GITS_BASER_PAGE_SIZE_4K | (size / PAGE_SIZE - 1);
+  MmioWrite64(its.base + GITS_BASER(n), val);
+
+  // the page size field is read only on ITSes that only do 64K pages
+  baser = MmioRead64(its.base + GITS_BASER(n));
+  if ((baser & GITS_BASER_PAGE_SIZE_MASK) != GITS_BASER_PAGE_SIZE_4K) {
+    TRACEF("GITS_BASER%u does not support 4K pages\n", n);
+    return ERR_NOT_SUPPORTED;
+  }
+
+  LTRACEF("GITS_BASER%u type %u entries %zu entry size %zu at %#lx\n", n, type,
+          entries, entry_size, pa);
+
+  return NO_ERROR;
+}
+
+static status_t its_enable_redistributor_lpis(paddr_t prop_pa) {
+  UINTN rd = GicGetCpuRedistributorBase(mGicRedistributorsBase);
+
+  if (MmioRead32(rd + GICR_CTLR) & GICR_CTLR_ENABLE_LPIS) {
+    // the tables can not be changed once LPIs are on
+    TRACEF("LPIs already enabled by firmware\n");
+    return ERR_ALREADY_STARTED;
+  }
+
+  // one pending bit per INTID, the table has to be 64K aligned
+  paddr_t pend_pa;
+  if (!its_alloc_table((1U << ITS_LPI_ID_BITS) / 8, 16, &pend_pa))
+    return ERR_NO_MEMORY;
+
+  MmioWrite64(rd + GICR_PROPBASER, (prop_pa & GIC_BASER_ADDR_MASK) |
+                                       GICR_BASER_INNER_WAWB |
+                                       GIC_BASER_SHAREABILITY_INNER |
+                                       (ITS_LPI_ID_BITS - 1));
+  MmioWrite64(rd + GICR_PENDBASER, (pend_pa & GIC_BASER_ADDR_MASK) |
+                                       GICR_BASER_INNER_WAWB |
+                                       GIC_BASER_SHAREABILITY_INNER |
+                                       GICR_PENDBASER_PTZ);
+  DSB;
+  MmioOr32(rd + GICR_CTLR, GICR_CTLR_ENABLE_LPIS);
+  DSB;
+
+  its.rd = rd;
+  its.direct_lpi = MmioRead64(rd + ARM_GICR_TYPER) & ARM_GICR_TYPER_DIRECTLPI;
+
+  // MAPC either names the redistributor by physical address or by its
+  // processor number
+  if (its.typer & GITS_TYPER_PTA)
+    its.rdbase = vaddr_to_paddr((void *)rd) >> 16;
+  else
+    its.rdbase = (MmioRead64(rd + ARM_GICR_TYPER) & ARM_GICR_TYPER_PROCNO) >> 8;
+
+  return NO_ERROR;
+}
+
+status_t arm_gicv3_its_init(vaddr_t its_base, paddr_t its_phys) {
+  LTRACEF("base %#lx phys %#lx\n", its_base, its_phys);
+
+  uint32_t gicd_typer = MmioRead32(mGicDistributorBase + ARM_GIC_ICDICTR);
+  if (!(gicd_typer & GICD_TYPER_LPIS) ||
+      GICD_TYPER_IDBITS(gicd_typer) < ITS_LPI_ID_BITS) {
+    printf("GICv3: no LPI support, not using the ITS\n");
+    return ERR_NOT_SUPPORTED;
+  }
+
+  its.base = its_base;
+  its.translater = its_phys + GITS_TRANSLATER;
+  its.typer = MmioRead64(its_base + GITS_TYPER);
+
+  // the ITS has to be disabled and quiescent while it is set up
+  MmioWrite32(its_base + GITS_CTLR, 0);
+  lk_time_t start = current_time();
+  while (!(MmioRead32(its_base + GITS_CTLR) & GITS_CTLR_QUIESCENT)) {
+    if (current_time() - start > ITS_TIMEOUT_MS) {
+      printf("GICv3: ITS did not become quiescent, not using it\n");
+      return ERR_TIMED_OUT;
+    }
+  }
+
+  paddr_t cmd_pa;
+  its.cmd_queue = its_alloc_table(ITS_CMD_QUEUE_SIZE, 16, &cmd_pa);
+  if (!its.cmd_queue)
+    return ERR_NO_MEMORY;
+
+  MmioWrite64(its_base + GITS_CBASER,
+              GITS_BASER_VALID | GITS_BASER_INNER_WAWB |
+                  (cmd_pa & GIC_BASER_ADDR_MASK) |
+                  GIC_BASER_SHAREABILITY_INNER |
+                  (ITS_CMD_QUEUE_SIZE / PAGE_SIZE - 1));
+  MmioWrite64(its_base + GITS_CWRITER, 0);
+  its.cmd_write = 0;
+
+  for (uint n = 0; n < GITS_BASER_COUNT; n++) {
+    status_t err = its_init_baser(n);
+    if (err != NO_ERROR)
+      return err;
+  }
+
+  // The configuration table is shared by all redistributors. LPIs start
+  // out disabled at the default priority.
+  paddr_t prop_pa;
+  its.prop_table = its_alloc_table(ITS_LPI_TABLE_ENTRIES, 12, &prop_pa);
+  if (!its.prop_table)
+    return ERR_NO_MEMORY;
+  memset(its.prop_table, ARM_GIC_DEFAULT_PRIORITY | LPI_PROP_RES1,
+         ITS_LPI_TABLE_ENTRIES);
+  arch_clean_cache_range((addr_t)its.prop_table, ITS_LPI_TABLE_ENTRIES);
+
+  status_t err = its_enable_redistributor_lpis(prop_pa);
+  if (err != NO_ERROR)
+    return err;
+
+  MmioWrite32(its_base + GITS_CTLR, GITS_CTLR_ENABLED);
+
+  spin_lock_saved_state_t state;
+  spin_lock_irqsave(&its.cmd_lock, state);
+  err = its_cmd_mapc(ITS_COLLECTION_BOOT);
+  if (err == NO_ERROR)
+    err = its_cmd_invall(ITS_COLLECTION_BOOT);
+  if (err == NO_ERROR)
+    err = its_sync();
+  spin_unlock_irqrestore(&its.cmd_lock, state);
+  if (err != NO_ERROR)
+    return err;
+
+  its.initialized = true;
+
+  printf("GICv3: ITS enabled, %u LPIs from %u%s\n", GICV3_MAX_LPIS,
+         GICV3_LPI_BASE, its.direct_lpi ? ", direct invalidation" : "");
+
+  return NO_ERROR;
+}
+
+// alloc_lock held, |dev| is not on the device list. Unmap the device and
+// free its ITT once the ITS is done with it.
+static void its_put_device(struct its_device *dev) {
+  spin_lock_saved_state_t state;
+  spin_lock_irqsave(&its.cmd_lock, state);
+  status_t err = its_cmd_mapd(dev->device_id, 0, false);
+  if (err == NO_ERROR)
+    err = its_sync();
+  spin_unlock_irqrestore(&its.cmd_lock, state);
+
+  // a wedged ITS may still walk the ITT, so it can't be reused
+  if (err == NO_ERROR)
+    its_free_table(dev->itt, its_itt_size());
+  else
+    printf("GICv3: could not unmap ITS device %#x, leaking its ITT\n",
+           dev->device_id);
+
+  free(dev);
+}
+
+// alloc_lock held
+static struct its_device *its_get_device(uint32_t device_id) {
+  struct its_device *dev;
+
+  list_for_every_entry(&its.devices, dev, struct its_device, node) {
+    if (dev->device_id == device_id)
+      return dev;
+  }
+
+  if (device_id >= (1U << MIN(GITS_TYPER_DEVBITS(its.typer),
+                              ITS_MAX_DEVICE_ID_BITS)))
+    return NULL;
+
+  dev = calloc(1, sizeof(*dev));
+  if (!dev)
+    return NULL;
+
+  if (!its_alloc_table(its_itt_size(), 8, &dev->itt)) {
+    free(dev);
+    return NULL;
+  }
+  dev->device_id = device_id;
+
+  spin_lock_saved_state_t state;
+  spin_lock_irqsave(&its.cmd_lock, state);
+  status_t err = its_cmd_mapd(device_id, dev->itt, true);
+  if (err == NO_ERROR)
+    err = its_sync();
+  spin_unlock_irqrestore(&its.cmd_lock, state);
+  if (err != NO_ERROR) {
+    its_put_device(dev);
+    return NULL;
+  }
+
+  list_add_tail(&its.devices, &dev->node);
+
+  return dev;
+}
+
+// alloc_lock held. Find |count| free LPIs in a row, starting at a multiple
+// of |align|.
+static int its_find_lpis(size_t count, size_t align) {
+  for (size_t first = 0; first + count <= GICV3_MAX_LPIS; first += align) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+      if (its.lpis[first + i].allocated)
+        break;
+    }
+    if (i == count)
+      return first;
+  }
+
+  return -1;
+}
+
+status_t platform_allocate_msi(uint32_t requester_id, size_t count,
+                               uint align_log2, unsigned int *vector_base,
+                               uint64_t *msi_address, uint32_t *msi_data_base) {
+  LTRACEF("requester %#x count %zu align %u\n", requester_id, count,
+          align_log2);
+
+  if (!its.initialized)
+    return ERR_NOT_SUPPORTED;
+  if (count == 0 || count > ITS_MAX_EVENTS ||
+      (1U << align_log2) > ITS_MAX_EVENTS)
+    return ERR_INVALID_ARGS;
+
+  status_t err = NO_ERROR;
+  mutex_acquire(&its.alloc_lock);
+
+  struct its_device *dev = its_get_device(requester_id);
+  if (!dev) {
+    err = ERR_NO_MEMORY;
+    goto out;
+  }
+
+  // Multi message MSI ORs the vector number into the low bits of the data,
+  // so the event IDs have to be aligned as well as the LPIs.
+  uint32_t event_base = ROUNDUP(dev->next_event, 1U << align_log2);
+  if (event_base + count > ITS_MAX_EVENTS) {
+    err = ERR_NO_RESOURCES;
+    goto out;
+  }
+
+  int first = its_find_lpis(count, 1U << align_log2);
+  if (first < 0) {
+    err = ERR_NO_RESOURCES;
+    goto out;
+  }
+
+  spin_lock_saved_state_t state;
+  spin_lock_irqsave(&its.cmd_lock, state);
+  for (size_t i = 0; i < count && err == NO_ERROR; i++) {
+    struct its_lpi *lpi = &its.lpis[first + i];
+
+    lpi->allocated = true;
+    lpi->device_id = requester_id;
+    lpi->event_id = event_base + i;
+    err = its_cmd_mapti(requester_id, event_base + i,
+                        GICV3_LPI_BASE + first + i, ITS_COLLECTION_BOOT);
+  }
+  if (err == NO_ERROR)
+    err = its_sync();
+  if (err != NO_ERROR) {
+    // the ITS stopped listening, there is nothing to unmap
+    for (size_t i = 0; i < count; i++)
+      its.lpis[first + i].allocated = false;
+  }
+  spin_unlock_irqrestore(&its.cmd_lock, state);
+  if (err != NO_ERROR)
+    goto out;
+
+  dev->next_event = event_base + count;
+
+  *vector_base = GICV3_LPI_BASE + first;
+  *msi_address = its.translater;
+  *msi_data_base = event_base;
+
+  LTRACEF("vectors %u-%u events %u-%u\n", *vector_base,
+          *vector_base + (uint)count - 1, event_base,
+          event_base + (uint)count - 1);
+
+out:
+  mutex_release(&its.alloc_lock);
+  return err;
+}
+
+status_t platform_free_msi(unsigned int vector_base, size_t count) {
+  LTRACEF("vectors %u-%u\n", vector_base, vector_base + (uint)count - 1);
+
+  if (!its.initialized)
+    return ERR_NOT_SUPPORTED;
+  if (count == 0 || !gicv3_is_lpi(vector_base) ||
+      !gicv3_is_lpi(vector_base + count - 1))
+    return ERR_INVALID_ARGS;
+
+  status_t err = NO_ERROR;
+  uint first = vector_base - GICV3_LPI_BASE;
+
+  mutex_acquire(&its.alloc_lock);
+
+  uint32_t device_id = its.lpis[first].device_id;
+  uint32_t event_base = its.lpis[first].event_id;
+
+  spin_lock_saved_state_t state;
+  spin_lock_irqsave(&its.cmd_lock, state);
+  for (size_t i = 0; i < count; i++) {
+    struct its_lpi *lpi = &its.lpis[first + i];
+    if (!lpi->allocated)
+      continue;
+
+    // drop the mapping along with anything still pending, and leave the LPI
+    // disabled for the next user
+    its.prop_table[first + i] &= ~LPI_PROP_ENABLE;
+    if (err == NO_ERROR)
+      err = its_cmd_discard(lpi->device_id, lpi->event_id);
+    lpi->allocated = false;
+  }
+  arch_clean_cache_range((addr_t)&its.prop_table[first], count);
+  if (err == NO_ERROR)
+    err = its_sync();
+  spin_unlock_irqrestore(&its.cmd_lock, state);
+
+  // event IDs are handed out in order, take them back if these were the last
+  // ones of the device so allocating again doesn't run out of them
+  struct its_device *dev;
+  list_for_every_entry(&its.devices, dev, struct its_device, node) {
+    if (dev->device_id == device_id)
+      break;
+  }
+  if (&dev->node != &its.devices) {
+    if (dev->next_event == event_base + count)
+      dev->next_event = event_base;
+
+    // tear the device down along with its last LPI
+    bool in_use = false;
+    for (size_t i = 0; i < GICV3_MAX_LPIS && !in_use; i++)
+      in_use = its.lpis[i].allocated && its.lpis[i].device_id == device_id;
+    if (!in_use && err == NO_ERROR) {
+      list_delete(&dev->node);
+      its_put_device(dev);
+    }
+  }
+
+  mutex_release(&its.alloc_lock);
+  return err;
+}
+
+// cmd_lock held. Make the redistributor reload the configuration of an LPI,
+// directly if it can, which avoids the round trip through the command queue.
+static status_t its_lpi_invalidate(uint idx) {
+  if (!its.direct_lpi) {
+    status_t err =
+        its_cmd_inv(its.lpis[idx].device_id, its.lpis[idx].event_id);
+    if (err != NO_ERROR)
+      return err;
+    return its_sync();
+  }
+
+  MmioWrite64(its.rd + GICR_INVLPIR, GICV3_LPI_BASE + idx);
+
+  lk_time_t start = current_time();
+  while (MmioRead32(its.rd + GICR_SYNCR) & GICR_SYNCR_BUSY) {
+    if (current_time() - start > ITS_TIMEOUT_MS)
+      return ERR_TIMED_OUT;
+  }
+
+  return NO_ERROR;
+}
+
+static void its_lpi_update(unsigned int vector, uint8_t mask, uint8_t bits) {
+  if (!its.initialized)
+    return;
+
+  uint idx = vector - GICV3_LPI_BASE;
+  spin_lock_saved_state_t state;
+  spin_lock_irqsave(&its.cmd_lock, state);
+
+  uint8_t *prop = &its.prop_table[idx];
+  uint8_t val = (*prop & ~mask) | bits;
+  if (val != *prop) {
+    *prop = val;
+    arch_clean_cache_range((addr_t)prop, 1);
+    DSB;
+
+    // the redistributor caches the configuration, have it reload it
+    if (its.lpis[idx].allocated && its_lpi_invalidate(idx) != NO_ERROR)
+      TRACEF("failed to invalidate LPI %u\n", vector);
+  }
+
+  spin_unlock_irqrestore(&its.cmd_lock, state);
+}
+
+void arm_gicv3_its_lpi_set_enable(unsigned int vector, bool enable) {
+  DEBUG_ASSERT(gicv3_is_lpi(vector));
+
+  its_lpi_update(vector, LPI_PROP_ENABLE, enable ? LPI_PROP_ENABLE : 0);
+}
+
+void arm_gicv3_its_lpi_set_priority(unsigned int vector, uint8_t priority) {
+  DEBUG_ASSERT(gicv3_is_lpi(vector));
+
+  its_lpi_update(vector, LPI_PROP_PRIORITY_MASK,
+                 priority & LPI_PROP_PRIORITY_MASK);
+}
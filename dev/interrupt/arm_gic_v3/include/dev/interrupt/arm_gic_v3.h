@@ -1,6 +1,26 @@
 #ifndef __GICV3_H__
 #define __GICV3_H__
 
+#include <sys/types.h>
+
 void arm_gicv3_init(uint64_t distributorBase, uint64_t redistributorBase);
 
+/* Raise SGI |irq| on every cpu set in |cpu_mask| through ICC_SGI1R_EL1 */
+status_t arm_gicv3_sgi(u_int irq, u_int cpu_mask);
+
+/* Set the priority of |vector|, lower values are more urgent. Only the bits
+ * above ARM_GIC_V3_BINARY_POINT decide whether one interrupt may preempt
+ * another. */
+status_t arm_gicv3_set_priority(unsigned int vector, uint8_t priority);
+
+/* Run the handler of |vector| with interrupts unmasked so higher priority
+ * interrupts can preempt it. The handler must only take spinlocks with
+ * interrupts disabled. */
+status_t arm_gicv3_set_preemptible(unsigned int vector, bool preemptible);
+
+/* Bring up the ITS at |its_base| (mapped) / |its_phys| and enable LPIs on
+ * the boot cpu. Afterwards platform_allocate_msi() hands out LPIs that are
+ * signaled through the ITS doorbell. */
+status_t arm_gicv3_its_init(vaddr_t its_base, paddr_t its_phys);
+
 #endif
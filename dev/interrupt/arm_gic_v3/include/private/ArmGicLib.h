@@ -62,6 +62,11 @@
 
 // GIC Redistributor Control frame
 #define ARM_GICR_TYPER 0x0008 // Redistributor Type Register
+#define ARM_GICR_WAKER 0x0014 // Redistributor Wake Register
+
+// GIC Redistributor WAKER bit assignments
+#define ARM_GICR_WAKER_PROCESSORSLEEP (1 << 1) // Processor Sleep
+#define ARM_GICR_WAKER_CHILDRENASLEEP (1 << 2) // Children Asleep
 
 // GIC Redistributor TYPER bit assignments
 #define ARM_GICR_TYPER_PLPIS (1 << 0)     // Physical LPIs
@@ -234,10 +239,21 @@ VOID EFIAPI ArmGicV2EndOfInterrupt(IN UINTN GicInterruptInterfaceBase,
 
 // GIC revision 3 specific declarations
 
+#define ICC_SRE_EL1_SRE (1 << 0)
 #define ICC_SRE_EL2_SRE (1 << 0)
 
+// ICC_CTLR_EL1: EOIR only drops the priority, ICC_DIR_EL1 deactivates
+#define ICC_CTLR_EL1_EOIMODE (1 << 1)
+
 #define ARM_GICD_IROUTER_IRM BIT31
 
+// ICC_SGI1R_EL1 field positions
+#define ARM_GICV3_SGIR_TARGETLIST_MASK 0xFFFF
+#define ARM_GICV3_SGIR_AFF1_SHIFT 16
+#define ARM_GICV3_SGIR_INTID_SHIFT 24
+#define ARM_GICV3_SGIR_AFF2_SHIFT 32
+#define ARM_GICV3_SGIR_RS_SHIFT 44
+
 UINT32
 EFIAPI
 ArmGicV3GetControlSystemRegisterEnable(VOID);
@@ -259,4 +275,16 @@ VOID ArmGicV3SetBinaryPointer(IN UINTN BinaryPoint);
 
 VOID ArmGicV3SetPriorityMask(IN UINTN Priority);
 
+VOID ArmGicV3SendGroup1Sgi(IN UINTN SgiValue);
+
+UINTN ArmGicV3GetCpuInterfaceControl(VOID);
+
+VOID ArmGicV3SetCpuInterfaceControl(IN UINTN Control);
+
+VOID ArmGicV3DeactivateInterrupt(IN UINTN Source);
+
+UINTN
+EFIAPI
+GicGetCpuRedistributorBase(IN UINTN GicRedistributorBase);
+
 #endif // ARMGIC_H_
@@ -0,0 +1,29 @@
+#ifndef __ARM_GIC_V3_ITS_H__
+#define __ARM_GIC_V3_ITS_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <private/Base.h>
+
+// LPIs start at INTID 8192, the first GICV3_MAX_LPIS of them are handed out
+// to MSI capable devices by the ITS
+#define GICV3_LPI_BASE 8192
+
+#ifndef GICV3_MAX_LPIS
+#define GICV3_MAX_LPIS 512
+#endif
+
+extern UINTN mGicDistributorBase;
+extern UINTN mGicRedistributorsBase;
+
+static inline bool gicv3_is_lpi(unsigned int vector) {
+  return vector >= GICV3_LPI_BASE && vector < GICV3_LPI_BASE + GICV3_MAX_LPIS;
+}
+
+// Update the LPI configuration table entry of |vector| and make the
+// redistributor pick it up. Safe to call from interrupt context.
+void arm_gicv3_its_lpi_set_enable(unsigned int vector, bool enable);
+void arm_gicv3_its_lpi_set_priority(unsigned int vector, uint8_t priority);
+
+#endif
@@ -4,6 +4,7 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arm_gic_v3.c \
+	$(LOCAL_DIR)/arm_gic_v3_its.c \
 	$(LOCAL_DIR)/GICv3Impl.c \
 	$(LOCAL_DIR)/GICv3Impl.S
 
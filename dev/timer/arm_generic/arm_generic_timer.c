@@ -115,6 +115,8 @@ static int timer_irq;
 struct fp_32_64 cntpct_per_ms;
 struct fp_32_64 ms_per_cntpct;
 struct fp_32_64 us_per_cntpct;
+struct fp_32_64 ns_per_cntpct;
+struct fp_32_64 cntpct_per_ns;
 
 static uint64_t lk_time_to_cntpct(lk_time_t lk_time) {
     return u64_mul_u32_fp32_64(lk_time, cntpct_per_ms);
@@ -128,6 +130,14 @@ static lk_bigtime_t cntpct_to_lk_bigtime(uint64_t cntpct) {
     return u64_mul_u64_fp32_64(cntpct, us_per_cntpct);
 }
 
+static lk_time_ns_t cntpct_to_lk_time_ns(uint64_t cntpct) {
+    return u64_mul_u64_fp32_64(cntpct, ns_per_cntpct);
+}
+
+static uint64_t lk_time_ns_to_cntpct(lk_time_ns_t lk_time_ns) {
+    return u64_mul_u64_fp32_64(lk_time_ns, cntpct_per_ns);
+}
+
 static uint32_t read_cntfrq(void) {
     uint32_t cntfrq;
 
@@ -190,6 +200,24 @@ status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg,
     return 0;
 }
 
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t deadline) {
+    ASSERT(arg == NULL);
+
+    t_callback = callback;
+
+    /* compare against the absolute counter value, a deadline that has already
+     * passed fires immediately. The extra count keeps rounding in the
+     * conversion from firing ahead of the deadline.
+     */
+    if (deadline == INFINITE_TIME_NS)
+        write_cntp_cval(UINT64_MAX);
+    else
+        write_cntp_cval(lk_time_ns_to_cntpct(deadline) + 1);
+    write_cntp_ctl(1);
+
+    return 0;
+}
+
 void platform_stop_timer(void) {
     write_cntp_ctl(0);
 }
@@ -202,6 +230,10 @@ lk_time_t current_time(void) {
     return cntpct_to_lk_time(read_cntpct());
 }
 
+lk_time_ns_t current_time_ns(void) {
+    return cntpct_to_lk_time_ns(read_cntpct());
+}
+
 static uint32_t abs_int32(int32_t a) {
     return (a > 0) ? a : -a;
 }
@@ -252,6 +284,15 @@ static void test_cntpct_to_lk_bigtime(uint32_t cntfrq, uint64_t expected_s) {
     LTRACEF_LEVEL(2, "cntpct_to_lk_bigtime(%llu): got %llu, expect %llu\n", cntpct, lk_bigtime, expected_lk_bigtime);
 }
 
+static void test_cntpct_to_lk_time_ns(uint32_t cntfrq, uint64_t expected_s) {
+    lk_time_ns_t expected_lk_time_ns = expected_s * 1000 * 1000 * 1000;
+    uint64_t cntpct = (uint64_t)cntfrq * expected_s;
+    lk_time_ns_t lk_time_ns = cntpct_to_lk_time_ns(cntpct);
+
+    test_time_conversion_check_result(lk_time_ns, expected_lk_time_ns, (1000 * 1000 * 1000 + cntfrq - 1) / cntfrq, false);
+    LTRACEF_LEVEL(2, "cntpct_to_lk_time_ns(%llu): got %llu, expect %llu\n", cntpct, lk_time_ns, expected_lk_time_ns);
+}
+
 static void test_time_conversions(uint32_t cntfrq) {
     test_lk_time_to_cntpct(cntfrq, 0);
     test_lk_time_to_cntpct(cntfrq, 1);
@@ -272,15 +313,23 @@ static void test_time_conversions(uint32_t cntfrq) {
     test_cntpct_to_lk_bigtime(cntfrq, 60 * 60 * 24 * 365);
     test_cntpct_to_lk_bigtime(cntfrq, 60 * 60 * 24 * (365 * 10 + 2));
     test_cntpct_to_lk_bigtime(cntfrq, 60ULL * 60 * 24 * (365 * 100 + 2));
+    test_cntpct_to_lk_time_ns(cntfrq, 0);
+    test_cntpct_to_lk_time_ns(cntfrq, 1);
+    test_cntpct_to_lk_time_ns(cntfrq, 60 * 60 * 24);
+    test_cntpct_to_lk_time_ns(cntfrq, 60 * 60 * 24 * 365);
+    test_cntpct_to_lk_time_ns(cntfrq, 60ULL * 60 * 24 * (365 * 100 + 2));
 }
 
 static void arm_generic_timer_init_conversion_factors(uint32_t cntfrq) {
     fp_32_64_div_32_32(&cntpct_per_ms, cntfrq, 1000);
     fp_32_64_div_32_32(&ms_per_cntpct, 1000, cntfrq);
     fp_32_64_div_32_32(&us_per_cntpct, 1000 * 1000, cntfrq);
+    fp_32_64_div_32_32(&ns_per_cntpct, 1000 * 1000 * 1000, cntfrq);
+    fp_32_64_div_32_32(&cntpct_per_ns, cntfrq, 1000 * 1000 * 1000);
     LTRACEF("cntpct_per_ms: %08x.%08x%08x\n", cntpct_per_ms.l0, cntpct_per_ms.l32, cntpct_per_ms.l64);
     LTRACEF("ms_per_cntpct: %08x.%08x%08x\n", ms_per_cntpct.l0, ms_per_cntpct.l32, ms_per_cntpct.l64);
     LTRACEF("us_per_cntpct: %08x.%08x%08x\n", us_per_cntpct.l0, us_per_cntpct.l32, us_per_cntpct.l64);
+    LTRACEF("ns_per_cntpct: %08x.%08x%08x\n", ns_per_cntpct.l0, ns_per_cntpct.l32, ns_per_cntpct.l64);
 }
 
 void arm_generic_timer_init(int irq, uint32_t freq_override) {
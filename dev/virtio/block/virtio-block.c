@@ -13,10 +13,11 @@
 #include <lk/trace.h>
 #include <lk/compiler.h>
 #include <lk/list.h>
+#include <lk/pow2.h>
 #include <lk/err.h>
+#include <stdio.h>
 #include <kernel/thread.h>
-#include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <lib/bio.h>
 
 #if WITH_KERNEL_VM
@@ -35,8 +36,25 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 };
-STATIC_ASSERT(sizeof(struct virtio_blk_config) == 24);
+/* 60 bytes on the device, the compiler pads the end out to 64 */
+STATIC_ASSERT(offsetof(struct virtio_blk_config, unused1) + 3 == 60);
 
 struct virtio_blk_req {
     uint32_t type;
@@ -45,6 +63,14 @@ struct virtio_blk_req {
 };
 STATIC_ASSERT(sizeof(struct virtio_blk_req) == 16);
 
+/* the payload of a discard or write zeroes request */
+struct virtio_blk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+STATIC_ASSERT(sizeof(struct virtio_blk_discard_write_zeroes) == 16);
+
 #define VIRTIO_BLK_F_BARRIER  (1<<0)
 #define VIRTIO_BLK_F_SIZE_MAX (1<<1)
 #define VIRTIO_BLK_F_SEG_MAX  (1<<2)
@@ -55,71 +81,136 @@ STATIC_ASSERT(sizeof(struct virtio_blk_req) == 16);
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_MQ       (1<<12)
+#define VIRTIO_BLK_F_DISCARD  (1<<13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (1<<14)
+
+/* the features the driver knows what to do with */
+#define VIRTIO_BLK_DRIVER_FEATURES \
+    (VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ | \
+     VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+#define VIRTIO_BLOCK_RING_LEN 256
+
+/* every request takes at least a header and a status descriptor, so this many
+ * slots are enough to fill the ring */
+#define VIRTIO_BLOCK_MAX_TXNS (VIRTIO_BLOCK_RING_LEN / 2)
+
+/* entries in the indirect table of each request, enough for 120KB in separate pages */
+#define VIRTIO_BLOCK_INDIRECT_MAX 32
+
+/* one queue per cpu, as far as the device and the transport go */
+#define VIRTIO_BLOCK_MAX_QUEUES MIN(MAX_VIRTIO_RINGS, SMP_MAX_CPUS)
+
+/* the part of a request the device reads and writes, aligned to its size so
+ * that no part of it ever crosses a page */
+struct virtio_block_txn {
+    struct virtio_blk_req req;
+    struct virtio_blk_discard_write_zeroes dwz;
+    uint8_t status;
+} __ALIGNED(64);
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
-static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
-static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
+
+/* a virtqueue with its own pool of transaction slots */
+struct virtio_block_queue {
+    /* protects everything below as well as the ring */
+    spin_lock_t lock;
+
+    /* ring index on the device */
+    uint index;
+
+    /* transaction slots, the request using each and where the device sees it */
+    struct virtio_block_txn *txns;
+    bio_request_t *txn_req[VIRTIO_BLOCK_MAX_TXNS];
+    paddr_t txn_phys[VIRTIO_BLOCK_MAX_TXNS];
+
+    /* stack of free slots */
+    uint8_t free_txns[VIRTIO_BLOCK_MAX_TXNS];
+    uint free_txn_count;
+
+    /* slot of the chain starting at each descriptor */
+    uint8_t desc_txn[VIRTIO_BLOCK_RING_LEN];
+
+    /* requests waiting for a slot or descriptors */
+    struct list_node pending;
+} __ALIGNED(CACHE_LINE);
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
-
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
+    /* features both sides agreed on */
+    uint32_t features;
+
+    /* device sectors are always 512 bytes */
+    uint sectors_per_block;
+
+    /* per request limits of discard and write zeroes, in sectors */
+    uint32_t max_discard_sectors;
+    uint32_t max_write_zeroes_sectors;
 
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    uint queue_count;
+    struct virtio_block_queue queues[VIRTIO_BLOCK_MAX_QUEUES];
 };
 
+static status_t virtio_block_init_queue(struct virtio_block_queue *q, uint index) {
+    q->lock = SPIN_LOCK_INITIAL_VALUE;
+    q->index = index;
+    list_initialize(&q->pending);
+
+    q->txns = memalign(sizeof(struct virtio_block_txn),
+                       sizeof(struct virtio_block_txn) * VIRTIO_BLOCK_MAX_TXNS);
+    if (!q->txns)
+        return ERR_NO_MEMORY;
+
+    for (uint i = 0; i < VIRTIO_BLOCK_MAX_TXNS; i++) {
+        q->txn_req[i] = NULL;
+#if WITH_KERNEL_VM
+        q->txn_phys[i] = vaddr_to_paddr(&q->txns[i]);
+#else
+        q->txn_phys[i] = (uint64_t)(uintptr_t)&q->txns[i];
+#endif
+        /* hand out the low slots first */
+        q->free_txns[i] = VIRTIO_BLOCK_MAX_TXNS - 1 - i;
+    }
+    q->free_txn_count = VIRTIO_BLOCK_MAX_TXNS;
+    LTRACEF("queue %u txns at %p (0x%lx phys)\n", index, q->txns, q->txn_phys[0]);
+
+    return NO_ERROR;
+}
+
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = memalign(CACHE_LINE, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_req_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
-
     /* make sure the device is reset */
     virtio_reset_device(dev);
 
     volatile struct virtio_blk_config *config = (struct virtio_blk_config *)dev->config_ptr;
+    uint64_t capacity = virtio_read_config64(dev, &config->capacity);
 
-    LTRACEF("capacity 0x%llx\n", config->capacity);
+    LTRACEF("capacity 0x%llx\n", capacity);
     LTRACEF("size_max 0x%x\n", config->size_max);
     LTRACEF("seg_max  0x%x\n", config->seg_max);
     LTRACEF("blk_size 0x%x\n", config->blk_size);
@@ -127,10 +218,58 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* only take on the features we handle, the core adds the ring features */
+    bdev->features = host_features & VIRTIO_BLK_DRIVER_FEATURES;
+    if (virtio_set_guest_features(dev, bdev->features) < 0) {
+        free(bdev);
+        dev->priv = NULL;
+        return ERR_NOT_SUPPORTED;
+    }
+    LTRACEF("features 0x%llx\n", (unsigned long long)dev->features);
+
+    /* requests address 512 byte sectors, a block has to be a whole power of two of them */
+    uint32_t blk_size = (bdev->features & VIRTIO_BLK_F_BLK_SIZE) ? config->blk_size : 512;
+    if (blk_size < 512 || !ispow2(blk_size)) {
+        printf("virtio-block: unusable block size %u, using 512\n", blk_size);
+        blk_size = 512;
+    }
+    bdev->sectors_per_block = blk_size / 512;
+
+    bdev->queue_count = 1;
+    if (bdev->features & VIRTIO_BLK_F_MQ)
+        bdev->queue_count = MAX(1, MIN(config->num_queues, VIRTIO_BLOCK_MAX_QUEUES));
+
+    bdev->max_discard_sectors = 0;
+    if (bdev->features & VIRTIO_BLK_F_DISCARD)
+        bdev->max_discard_sectors = config->max_discard_sectors;
+    bdev->max_write_zeroes_sectors = 0;
+    if (bdev->features & VIRTIO_BLK_F_WRITE_ZEROES)
+        bdev->max_write_zeroes_sectors = config->max_write_zeroes_sectors;
+
+    /* allocate the transaction slots and a virtio ring per queue */
+    status_t err = NO_ERROR;
+    uint q;
+    for (q = 0; q < bdev->queue_count; q++) {
+        err = virtio_block_init_queue(&bdev->queues[q], q);
+        if (err < 0)
+            break;
+
+        err = virtio_alloc_ring(dev, q, VIRTIO_BLOCK_RING_LEN);
+        if (err < 0) {
+            free(bdev->queues[q].txns);
+            break;
+        }
 
-    /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+        /* optional, requests use direct chains without it */
+        virtio_alloc_ring_indirect(dev, q, VIRTIO_BLOCK_INDIRECT_MAX);
+    }
+    if (err < 0) {
+        while (q-- > 0)
+            free(bdev->queues[q].txns);
+        free(bdev);
+        dev->priv = NULL;
+        return err;
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -143,25 +282,234 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     char buf[16];
     snprintf(buf, sizeof(buf), "virtio%u", found_index++);
     bio_initialize_bdev(&bdev->bdev, buf,
-                        config->blk_size, config->capacity,
+                        blk_size, capacity / bdev->sectors_per_block,
                         0, NULL, BIO_FLAGS_NONE);
 
-    /* override our block device hooks */
-    bdev->bdev.read_block = &virtio_bdev_read_block;
-    bdev->bdev.write_block = &virtio_bdev_write_block;
+    /* requests are native, the synchronous block calls wrap them. without
+     * indirect tables a single buffer request takes three descriptors */
+    bdev->bdev.submit = &virtio_bdev_submit;
+    if (virtio_ring_has_indirect(dev, 0))
+        bdev->bdev.queue_depth = bdev->queue_count * VIRTIO_BLOCK_MAX_TXNS;
+    else
+        bdev->bdev.queue_depth = bdev->queue_count * (VIRTIO_BLOCK_RING_LEN / 3);
 
     bio_register_device(&bdev->bdev);
 
-    printf("found virtio block device of size %lld\n", config->capacity * config->blk_size);
+    printf("found virtio block device of size %lld, %u queue%s\n",
+           capacity * 512, bdev->queue_count, (bdev->queue_count > 1) ? "s" : "");
 
     return NO_ERROR;
 }
 
+/* worst case number of descriptors a request takes: the header, the status and
+ * one per page of buffer, less if physical pages happen to be contiguous */
+static size_t virtio_block_desc_count(const bio_request_t *req) {
+    size_t count = 2;
+
+    switch (req->op) {
+        case BIO_OP_FLUSH:
+            return count;
+        case BIO_OP_DISCARD:
+        case BIO_OP_WRITE_ZEROES:
+            return count + 1;
+    }
+
+    for (uint i = 0; i < req->iov_count; i++) {
+#if WITH_KERNEL_VM
+        vaddr_t va = (vaddr_t)req->iov[i].iov_base;
+        count += (PAGE_ALIGN(va + req->iov[i].iov_len) - ROUNDDOWN(va, PAGE_SIZE)) / PAGE_SIZE;
+#else
+        count++;
+#endif
+    }
+
+    return count;
+}
+
+/* a descriptor chain under construction, either straight in the ring or in
+ * the indirect table of its head descriptor */
+struct virtio_block_chain {
+    struct virtio_device *dev;
+    uint ring;
+    uint16_t head;
+    struct vring_desc *table;
+    uint16_t count;
+    struct vring_desc *last;
+    bool last_is_buffer;
+};
+
+/* append a descriptor to the chain, merging buffers into the last one if physically contiguous */
+static void virtio_block_chain_add(struct virtio_block_chain *c, paddr_t pa, size_t len,
+                                   uint16_t flags, bool buffer) {
+    if (buffer && c->last_is_buffer && c->last->addr + c->last->len == pa) {
+        LTRACEF("extending last one by %zu bytes\n", len);
+        c->last->len += len;
+        return;
+    }
+
+    uint16_t i;
+    struct vring_desc *desc;
+    if (c->table) {
+        DEBUG_ASSERT(c->count < c->dev->ring[c->ring].indirect_max);
+        i = c->count;
+        desc = &c->table[i];
+    } else {
+        i = virtio_alloc_desc(c->dev, c->ring);
+        desc = virtio_desc_index_to_desc(c->dev, c->ring, i);
+    }
+
+    desc->addr = (uint64_t)pa;
+    desc->len = len;
+    desc->flags = flags;
+
+    if (c->last) {
+        c->last->flags |= VRING_DESC_F_NEXT;
+        c->last->next = i;
+    } else if (!c->table) {
+        c->head = i;
+    }
+
+    c->count++;
+    c->last = desc;
+    c->last_is_buffer = buffer;
+}
+
+/* whether a request goes through an indirect table, using up a single ring descriptor */
+static bool virtio_block_use_indirect(struct virtio_block_dev *bdev, struct virtio_block_queue *q,
+                                      const bio_request_t *req) {
+    if (!virtio_ring_has_indirect(bdev->dev, q->index))
+        return false;
+
+    return virtio_block_desc_count(req) <= bdev->dev->ring[q->index].indirect_max;
+}
+
+/* build the descriptor chain for a request in slot and hand it to the device */
+static void virtio_block_queue_txn(struct virtio_block_dev *bdev, struct virtio_block_queue *q,
+                                   uint slot, bio_request_t *req) {
+    struct virtio_device *dev = bdev->dev;
+    struct virtio_block_txn *txn = &q->txns[slot];
+    uint ring = q->index;
+    bool write = (req->op != BIO_OP_READ);
+
+    /* set up the request */
+    switch (req->op) {
+        case BIO_OP_READ:
+            txn->req.type = VIRTIO_BLK_T_IN;
+            break;
+        case BIO_OP_WRITE:
+            txn->req.type = VIRTIO_BLK_T_OUT;
+            break;
+        case BIO_OP_FLUSH:
+            txn->req.type = VIRTIO_BLK_T_FLUSH;
+            break;
+        case BIO_OP_DISCARD:
+            txn->req.type = VIRTIO_BLK_T_DISCARD;
+            break;
+        case BIO_OP_WRITE_ZEROES:
+            txn->req.type = VIRTIO_BLK_T_WRITE_ZEROES;
+            break;
+    }
+    txn->req.ioprio = 0;
+    txn->req.sector = (uint64_t)req->block * bdev->sectors_per_block;
+    txn->status = 0xff;
+    LTRACEF("queue %u slot %u type %u sector %llu\n", ring, slot, txn->req.type, txn->req.sector);
+
+    // XXX not cache safe.
+    // At the moment only tested on arm qemu, which doesn't emulate cache.
+
+    struct virtio_block_chain chain = {
+        .dev = dev,
+        .ring = ring,
+    };
+    if (virtio_block_use_indirect(bdev, q, req))
+        chain.table = virtio_alloc_indirect_desc(dev, ring, &chain.head);
+
+    /* the descriptor pointing to the header */
+    virtio_block_chain_add(&chain, q->txn_phys[slot] + offsetof(struct virtio_block_txn, req),
+                           sizeof(struct virtio_blk_req), 0, false);
+
+    if (req->op == BIO_OP_DISCARD || req->op == BIO_OP_WRITE_ZEROES) {
+        /* a single segment covering the whole range */
+        txn->dwz.sector = txn->req.sector;
+        txn->dwz.num_sectors = req->count * bdev->sectors_per_block;
+        txn->dwz.flags = 0;
+
+        virtio_block_chain_add(&chain, q->txn_phys[slot] + offsetof(struct virtio_block_txn, dwz),
+                               sizeof(txn->dwz), 0, false);
+    }
+
+    /* the buffers, split up where they aren't physically contiguous. mark
+     * them as write-only if its a block read */
+    uint16_t buf_flags = write ? 0 : VRING_DESC_F_WRITE;
+    for (uint i = 0; i < req->iov_count; i++) {
+        vaddr_t va = (vaddr_t)req->iov[i].iov_base;
+        size_t len = req->iov[i].iov_len;
+#if WITH_KERNEL_VM
+        while (len > 0) {
+            size_t chunk = MIN(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+            paddr_t pa = vaddr_to_paddr((void *)va);
+            LTRACEF("va 0x%lx pa 0x%lx len %zu\n", va, pa, chunk);
+
+            virtio_block_chain_add(&chain, pa, chunk, buf_flags, true);
+            va += chunk;
+            len -= chunk;
+        }
+#else
+        virtio_block_chain_add(&chain, (paddr_t)va, len, buf_flags, true);
+#endif
+    }
+
+    /* the descriptor pointing to the status */
+    virtio_block_chain_add(&chain, q->txn_phys[slot] + offsetof(struct virtio_block_txn, status),
+                           1, VRING_DESC_F_WRITE, false);
+
+    /* the device only needs to look at the part of the table in use */
+    if (chain.table)
+        virtio_desc_index_to_desc(dev, ring, chain.head)->len = chain.count * sizeof(struct vring_desc);
+
+    q->txn_req[slot] = req;
+    q->desc_txn[chain.head] = slot;
+
+    /* submit the transfer */
+    virtio_submit_chain(dev, ring, chain.head);
+}
+
+/* start as many pending requests as there are free slots and descriptors for */
+static void virtio_block_start_locked(struct virtio_block_dev *bdev, struct virtio_block_queue *q) {
+    struct vring *ring = &bdev->dev->ring[q->index];
+    bool kick = false;
+
+    bio_request_t *req;
+    while ((req = list_peek_head_type(&q->pending, bio_request_t, node))) {
+        if (q->free_txn_count == 0)
+            break;
+
+        /* keep the order, don't let smaller requests pass one that doesn't fit yet */
+        size_t needed = virtio_block_use_indirect(bdev, q, req) ? 1 : virtio_block_desc_count(req);
+        if (ring->free_count < needed)
+            break;
+
+        list_delete(&req->node);
+        uint slot = q->free_txns[--q->free_txn_count];
+        virtio_block_queue_txn(bdev, q, slot, req);
+        kick = true;
+    }
+
+    /* one notification for everything queued above */
+    if (kick)
+        virtio_kick(bdev->dev, q->index);
+}
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e) {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    struct virtio_block_queue *q = &bdev->queues[ring];
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    DEBUG_ASSERT(ring < bdev->queue_count);
+
+    spin_lock(&q->lock);
+
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
     for (;;) {
@@ -184,142 +532,95 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    /* release the slot and reuse it right away */
+    uint slot = q->desc_txn[e->id];
+    bio_request_t *req = q->txn_req[slot];
+    uint8_t status = q->txns[slot].status;
+    q->txn_req[slot] = NULL;
+    q->free_txns[q->free_txn_count++] = slot;
 
-    return INT_RESCHEDULE;
-}
+    virtio_block_start_locked(bdev, q);
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write) {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    spin_unlock(&q->lock);
 
-    uint16_t i;
-    struct vring_desc *desc;
+    LTRACEF("slot %u status 0x%hhx\n", slot, status);
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    DEBUG_ASSERT(req);
+    ssize_t result;
+    if (status == VIRTIO_BLK_S_OK)
+        result = (ssize_t)req->count * bdev->bdev.block_size;
+    else if (status == VIRTIO_BLK_S_UNSUPP)
+        result = ERR_NOT_SUPPORTED;
+    else
+        result = ERR_IO;
+    bio_request_complete(req, result);
 
-    mutex_acquire(&bdev->lock);
-
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
-
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
-
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
-
-    /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
-    desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
-
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    /* translate the first buffer */
-    vaddr_t va = (vaddr_t)buf;
-    paddr_t pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
-#endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
-
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
+    return INT_RESCHEDULE;
+}
 
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req) {
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
 
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
+    LTRACEF("dev %p, req %p, op %u, block 0x%x, count %u\n", bdev, req, req->op, req->block, req->count);
 
-            desc = next_desc;
-        }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
+    switch (req->op) {
+        case BIO_OP_FLUSH:
+            /* without the feature there is no cache to flush */
+            if (!(dev->features & VIRTIO_BLK_F_FLUSH)) {
+                bio_request_complete(req, 0);
+                return NO_ERROR;
+            }
+            break;
+        case BIO_OP_DISCARD:
+            if (!(dev->features & VIRTIO_BLK_F_DISCARD))
+                return ERR_NOT_SUPPORTED;
+            if ((uint64_t)req->count * dev->sectors_per_block > dev->max_discard_sectors)
+                return ERR_TOO_BIG;
+            break;
+        case BIO_OP_WRITE_ZEROES:
+            if (!(dev->features & VIRTIO_BLK_F_WRITE_ZEROES))
+                return ERR_NOT_SUPPORTED;
+            if ((uint64_t)req->count * dev->sectors_per_block > dev->max_write_zeroes_sectors)
+                return ERR_TOO_BIG;
+            break;
     }
-#endif
-
-    /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
 
-    /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+    /* a request that could never fit in the ring would stall the queue */
+    if (virtio_block_desc_count(req) > VIRTIO_BLOCK_RING_LEN)
+        return ERR_TOO_BIG;
 
-    /* kick it off */
-    virtio_kick(dev, 0);
+    /* stay on the queue of the current cpu, it doesn't matter if the thread
+     * moves before the lock is taken */
+    struct virtio_block_queue *q = &dev->queues[arch_curr_cpu_num() % dev->queue_count];
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+    list_add_tail(&q->pending, &req->node);
+    virtio_block_start_locked(dev, q);
 
-    mutex_release(&bdev->lock);
+    spin_unlock_irqrestore(&q->lock, state);
 
-    return len;
+    return NO_ERROR;
 }
 
-static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count) {
-    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
-
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write) {
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    if (virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, false) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
-}
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
 
-static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count) {
-    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+    iovec_t iov = {
+        .iov_base = buf,
+        .iov_len = len,
+    };
+    bio_request_t req;
+    bio_request_init(&req, write ? BIO_OP_WRITE : BIO_OP_READ,
+                     offset >> bdev->bdev.block_shift, len >> bdev->bdev.block_shift,
+                     &iov, 1, NULL, NULL);
 
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
+    status_t err = virtio_bdev_submit(&bdev->bdev, &req);
+    if (err < 0)
+        return err;
 
-    if (virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, true) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
+    return bio_request_wait(&req);
 }
-
@@ -436,6 +436,11 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features) {
     gdev->gpu_request = malloc(sizeof(struct virtio_gpu_resp_display_info)); // XXX get size better
     gdev->gpu_request_phys = (paddr_t)gdev->gpu_request;
 #endif
+    if (!gdev->gpu_request) {
+        dev->priv = NULL;
+        free(gdev);
+        return ERR_NO_MEMORY;
+    }
 
     /* make sure the device is reset */
     virtio_reset_device(dev);
@@ -446,10 +451,15 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features) {
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* no gpu features are used, only the ring features the core handles */
+    status_t err = virtio_set_guest_features(dev, 0);
+    if (err < 0)
+        goto fail;
 
-    /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 16);
+    /* allocate a virtio ring, the transport frees it if anything fails */
+    err = virtio_alloc_ring(dev, 0, 16);
+    if (err < 0)
+        goto fail;
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_gpu_irq_driver_callback;
@@ -464,6 +474,16 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features) {
     printf("found virtio gpu device\n");
 
     return NO_ERROR;
+
+fail:
+    dev->priv = NULL;
+#if WITH_KERNEL_VM
+    pmm_free_kpages(gdev->gpu_request, 1);
+#else
+    free(gdev->gpu_request);
+#endif
+    free(gdev);
+    return err;
 }
 
 static enum handler_return virtio_gpu_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e) {
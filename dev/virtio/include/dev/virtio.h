@@ -17,21 +17,34 @@
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[], size_t stride);
 
-#define MAX_VIRTIO_RINGS 4
+/* detect modern (virtio 1.x) devices on the pci bus, has to run after the bus
+ * manager is up. returns number of devices found */
+int virtio_pci_detect(void);
+
+#define MAX_VIRTIO_RINGS 8
 
 struct virtio_mmio_config;
+struct virtio_transport_ops;
 
 struct virtio_device {
     bool valid;
 
     uint index;
     uint irq;
+    uint device_id;
 
+    /* how the core talks to the device, mmio_config is only set for mmio */
+    const struct virtio_transport_ops *ops;
     volatile struct virtio_mmio_config *mmio_config;
     void *config_ptr;
 
     void *priv; /* a place for the driver to put private data */
 
+    /* features negotiated with the device, driver and core features together */
+    uint64_t features;
+
+    struct list_node node;
+
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
     enum handler_return (*config_change_callback)(struct virtio_device *dev);
 
@@ -44,9 +57,48 @@ void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
+/* the device follows the virtio 1.x spec instead of the legacy interface */
+#define VIRTIO_F_VERSION_1 32
+
+/* ring and transport features handled by the virtio core for every driver. the
+ * packed layout needs the upper feature bits, so only the pci transport offers it */
+#define VIRTIO_CORE_FEATURES \
+    ((1ull << VIRTIO_RING_F_INDIRECT_DESC) | (1ull << VIRTIO_RING_F_EVENT_IDX) | \
+     (1ull << VIRTIO_F_VERSION_1) | (1ull << VIRTIO_F_RING_PACKED))
+
+/* tell the device which of the features it offered the driver is using. the
+ * features the core handles are added to the driver's own, this has to
+ * happen before any ring is allocated */
+status_t virtio_set_guest_features(struct virtio_device *dev, uint32_t features);
+
+/* the device config space may change under the driver at any time. a read of
+ * more than 32 bits of it is only consistent if the generation is the same
+ * before and after it, transports without one always return 0 */
+uint32_t virtio_config_generation(struct virtio_device *dev);
+
+/* read a 64 bit field of the device config as two consistent 32 bit halves */
+uint64_t virtio_read_config64(struct virtio_device *dev, const volatile void *field);
+
+static inline bool virtio_has_feature(const struct virtio_device *dev, uint bit) {
+    return dev->features & (1ull << bit);
+}
+
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
 
+/* allocate indirect descriptor tables of up to max entries for the ring, fails
+ * with ERR_NOT_SUPPORTED unless VIRTIO_RING_F_INDIRECT_DESC was negotiated */
+status_t virtio_alloc_ring_indirect(struct virtio_device *dev, uint index, uint16_t max) __NONNULL();
+
+static inline bool virtio_ring_has_indirect(const struct virtio_device *dev, uint ring_index) {
+    return dev->ring[ring_index].indirect != NULL;
+}
+
+/* allocate a descriptor pointing to an indirect table of the ring's maximum
+ * size and return the table, NULL if out of descriptors. the caller fills in
+ * the table and trims the length of the descriptor to the entries used */
+struct vring_desc *virtio_alloc_indirect_desc(struct virtio_device *dev, uint ring_index, uint16_t *desc_index);
+
 /* add a descriptor at index desc_index to the free list on ring_index */
 void virtio_free_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
@@ -66,6 +118,7 @@ void virtio_dump_desc(const struct vring_desc *desc);
 /* submit a chain to the avail list */
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
+/* notify the device of new chains on the avail list, unless it said it doesn't need to be */
 void virtio_kick(struct virtio_device *dev, uint ring_idnex);
 
 
@@ -60,6 +60,25 @@
  * at the end of the used ring. Guest should ignore the used->flags field. */
 #define VIRTIO_RING_F_EVENT_IDX     29
 
+/* The packed layout: a single ring of descriptors the driver makes available
+ * and the device marks used in place, see the virtio 1.1 spec. */
+#define VIRTIO_F_RING_PACKED        34
+
+/* Packed descriptor flags, on top of NEXT, WRITE and INDIRECT. A descriptor
+ * is available when AVAIL matches the driver's wrap counter and USED does
+ * not, and used once both match the wrap counter. */
+#define VRING_PACKED_DESC_F_AVAIL   (1 << 7)
+#define VRING_PACKED_DESC_F_USED    (1 << 15)
+
+/* Event suppression flags, for when the other side wants to hear about new
+ * descriptors: always, never, or once it reaches the one in off_wrap. */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+#define VRING_PACKED_EVENT_FLAG_DESC    0x2
+
+/* The wrap counter is in the top bit of off_wrap. */
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
 /* Virtio ring descriptors: 16 bytes.  These can chain together via "next". */
 struct vring_desc {
     /* Address (guest-physical). */
@@ -72,6 +91,25 @@ struct vring_desc {
     uint16_t next;
 };
 
+/* Packed ring descriptors: 16 bytes as well, but chained by position. */
+struct vring_packed_desc {
+    /* Address (guest-physical). */
+    uint64_t addr;
+    /* Length. */
+    uint32_t len;
+    /* Buffer id, the same for every descriptor of a chain. */
+    uint16_t id;
+    /* The flags as indicated above. */
+    uint16_t flags;
+};
+
+struct vring_packed_desc_event {
+    /* Descriptor ring change event offset and wrap counter. */
+    uint16_t off_wrap;
+    /* Descriptor ring change event flags. */
+    uint16_t flags;
+};
+
 struct vring_avail {
     uint16_t flags;
     uint16_t idx;
@@ -99,13 +137,39 @@ struct vring {
     uint16_t free_list; /* head of a free list of descriptors per ring. 0xffff is NULL */
     uint16_t free_count;
 
-    uint16_t last_used;
+    uint16_t last_used; /* free running, like the used index */
+    uint16_t kicked_avail; /* avail index at the last notification check */
 
     struct vring_desc *desc;
 
     struct vring_avail *avail;
 
     struct vring_used *used;
+
+    /* indirect descriptor tables, indirect_max entries for every descriptor in the ring */
+    struct vring_desc *indirect;
+    uint64_t indirect_pa;
+    uint16_t indirect_max;
+
+    /* the packed layout, if VIRTIO_F_RING_PACKED was negotiated. desc is then
+     * a driver private table the chains are built in, submitting a chain
+     * copies it to the next free positions of packed_desc */
+    bool packed;
+    bool avail_wrap;
+    bool used_wrap;
+    uint16_t next_avail;
+    uint16_t next_used;
+    uint16_t num_added; /* descriptors made available since the last kick */
+    struct vring_packed_desc *packed_desc;
+    struct vring_packed_desc_event *driver_event;
+    struct vring_packed_desc_event *device_event;
+    uint16_t *chain_len; /* ring positions taken by each buffer id in flight */
+
+    /* notification counters */
+    uint32_t kicks;
+    uint32_t kicks_suppressed;
+    uint32_t interrupts;
+    uint32_t completions;
 };
 
 /* The standard layout for the ring is a continuous chunk of memory which looks
@@ -135,15 +199,34 @@ struct vring {
 /* We publish the used event index at the end of the available ring, and vice
  * versa. They are at the end for backwards compatibility. */
 #define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
-#define vring_avail_event(vr) (*(uint16_t *)&(vr)->used->ring[(vr)->num])
+#define vring_avail_event(vr) \
+    (*(uint16_t *)((uint8_t *)(vr)->used + sizeof(struct vring_used) + \
+                   (vr)->num * sizeof(struct vring_used_elem)))
 
-static inline void vring_init(struct vring *vr, unsigned int num, void *p,
-                              unsigned long align) {
+static inline void vring_init_common(struct vring *vr, unsigned int num) {
     vr->num = num;
     vr->num_mask = (1 << log2_uint(num)) - 1;
     vr->free_list = 0xffff;
     vr->free_count = 0;
     vr->last_used = 0;
+    vr->kicked_avail = 0;
+    vr->indirect = NULL;
+    vr->indirect_pa = 0;
+    vr->indirect_max = 0;
+    vr->packed = false;
+    vr->avail_wrap = vr->used_wrap = true;
+    vr->next_avail = vr->next_used = 0;
+    vr->num_added = 0;
+    vr->packed_desc = NULL;
+    vr->driver_event = vr->device_event = NULL;
+    vr->chain_len = NULL;
+    vr->kicks = vr->kicks_suppressed = 0;
+    vr->interrupts = vr->completions = 0;
+}
+
+static inline void vring_init(struct vring *vr, unsigned int num, void *p,
+                              unsigned long align) {
+    vring_init_common(vr, num);
     vr->desc = p;
     vr->avail = p + num*sizeof(struct vring_desc);
     vr->used = (void *)(((unsigned long)&vr->avail->ring[num] + sizeof(uint16_t)
@@ -156,6 +239,32 @@ static inline unsigned vring_size(unsigned int num, unsigned long align) {
            + sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * num;
 }
 
+/* The packed layout is the descriptor ring followed by the driver and the
+ * device event suppression structures. The driver keeps its own table of num
+ * split descriptors to build chains in, and the chain length of every buffer
+ * id right behind it. */
+static inline void vring_init_packed(struct vring *vr, unsigned int num, void *p,
+                                     void *shadow) {
+    vring_init_common(vr, num);
+    vr->packed = true;
+    vr->packed_desc = p;
+    vr->driver_event = (struct vring_packed_desc_event *)&vr->packed_desc[num];
+    vr->device_event = vr->driver_event + 1;
+    vr->desc = shadow;
+    vr->chain_len = (uint16_t *)&vr->desc[num];
+    vr->avail = NULL;
+    vr->used = NULL;
+}
+
+static inline unsigned vring_packed_size(unsigned int num) {
+    return sizeof(struct vring_packed_desc) * num
+           + sizeof(struct vring_packed_desc_event) * 2;
+}
+
+static inline unsigned vring_packed_shadow_size(unsigned int num) {
+    return (sizeof(struct vring_desc) + sizeof(uint16_t)) * num;
+}
+
 /* The following is used with USED_EVENT_IDX and AVAIL_EVENT_IDX */
 /* Assuming a given event_idx value from the other size, if
  * we have just incremented index from old to new_idx,
@@ -89,6 +89,9 @@ struct virtio_net_dev {
 
     uint tx_pending_count;
     struct list_node completed_rx_queue;
+
+    /* the header has a num_buffers field once VERSION_1 is negotiated */
+    size_t hdr_len;
 };
 
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
@@ -148,19 +151,39 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features) {
     // XXX check features bits and ack/nak them
     dump_feature_bits(host_features);
 
+    /* no net features are used yet, only the ring features the core handles */
+    status_t err = virtio_set_guest_features(dev, 0);
+    if (err < 0)
+        goto fail;
+
+    ndev->hdr_len = sizeof(struct virtio_net_hdr);
+    if (!virtio_has_feature(dev, VIRTIO_F_VERSION_1))
+        ndev->hdr_len -= 2;
+
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
 
+    /* allocate a pair of virtio rings, modern devices want them before DRIVER_OK.
+     * the transport frees the ones that made it if anything fails */
+    err = virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
+    if (err < 0)
+        goto fail;
+    err = virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
+    if (err < 0)
+        goto fail;
+
     /* set DRIVER_OK */
     virtio_status_driver_ok(dev);
 
-    /* allocate a pair of virtio rings */
-    virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
-    virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
-
     the_ndev = ndev;
 
     return NO_ERROR;
+
+fail:
+    dev->irq_driver_callback = NULL;
+    dev->priv = NULL;
+    free(ndev);
+    return err;
 }
 
 status_t virtio_net_start(void) {
@@ -196,7 +219,7 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
         return ERR_NO_MEMORY;
 
     /* point our header to the base of the first pktbuf */
-    struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
+    struct virtio_net_hdr *hdr = pktbuf_append(p, ndev->hdr_len);
     memset(hdr, 0, p->dlen);
 
     spin_lock_saved_state_t state;
@@ -281,9 +304,9 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p) {
     /* point our header to the base of the pktbuf */
     p->data = p->buffer;
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
+    memset(hdr, 0, ndev->hdr_len);
 
-    p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+    p->dlen = ndev->hdr_len + VIRTIO_NET_MSS;
 
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
@@ -344,7 +367,7 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
             LTRACEF("rx pktbuf %p filled\n", p);
 
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > (ndev->hdr_len + VIRTIO_NET_MSS)) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
@@ -400,7 +423,7 @@ static int virtio_net_rx_worker(void *arg) {
             LTRACEF("got packet len %u\n", p->dlen);
 
             /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
+            struct virtio_net_hdr *hdr = pktbuf_consume(p, ndev->hdr_len);
             if (hdr) {
                 /* call up into the stack */
                 minip_rx_driver_callback(p);
@@ -421,7 +444,14 @@ status_t virtio_net_get_mac_addr(uint8_t mac_addr[6]) {
     if (!the_ndev)
         return ERR_NOT_FOUND;
 
-    memcpy(mac_addr, the_ndev->config->mac, 6);
+    /* the six bytes are only consistent if the config didn't change meanwhile */
+    const volatile uint8_t *mac = the_ndev->config->mac;
+    uint32_t gen;
+    do {
+        gen = virtio_config_generation(the_ndev->dev);
+        for (uint i = 0; i < 6; i++)
+            mac_addr[i] = mac[i];
+    } while (gen != virtio_config_generation(the_ndev->dev));
 
     return NO_ERROR;
 }
@@ -18,6 +18,7 @@
 #include <string.h>
 #include <lk/pow2.h>
 #include <lk/init.h>
+#include <lk/console_cmd.h>
 #include <kernel/thread.h>
 #include <platform/interrupts.h>
 #if WITH_KERNEL_VM
@@ -40,6 +41,9 @@
 
 static struct virtio_device *devices;
 
+/* every device a driver picked up, over all transports */
+static struct list_node virtio_devices = LIST_INITIAL_VALUE(virtio_devices);
+
 static void dump_mmio_config(const volatile struct virtio_mmio_config *mmio) {
     printf("mmio at %p\n", mmio);
     printf("\tmagic 0x%x\n", mmio->magic);
@@ -63,6 +67,101 @@ void virtio_dump_desc(const struct vring_desc *desc) {
     printf("\tnext  0x%hhx\n", desc->next);
 }
 
+/* a packed descriptor is used once both its AVAIL and USED bits match the wrap counter */
+static bool virtio_packed_desc_used(const struct vring *ring, uint16_t pos, bool wrap) {
+    uint16_t flags = *(volatile uint16_t *)&ring->packed_desc[pos].flags;
+    bool avail = flags & VRING_PACKED_DESC_F_AVAIL;
+    bool used = flags & VRING_PACKED_DESC_F_USED;
+
+    return avail == used && used == wrap;
+}
+
+/* the device writes one descriptor per used chain, at the position its first one had */
+static enum handler_return virtio_process_ring_packed(struct virtio_device *dev, uint index) {
+    struct vring *ring = &dev->ring[index];
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    uint handled = 0;
+    while (virtio_packed_desc_used(ring, ring->next_used, ring->used_wrap)) {
+        /* the id and len are only valid once the flags say so */
+        rmb();
+
+        const struct vring_packed_desc *desc = &ring->packed_desc[ring->next_used];
+        struct vring_used_elem used_elem = {
+            .id = desc->id,
+            .len = desc->len,
+        };
+        LTRACEF("pos %u id %u, len %u\n", ring->next_used, used_elem.id, used_elem.len);
+        DEBUG_ASSERT(used_elem.id < ring->num);
+
+        /* skip the rest of the chain before the driver can reuse the id */
+        ring->next_used += ring->chain_len[used_elem.id];
+        if (ring->next_used >= ring->num) {
+            ring->next_used -= ring->num;
+            ring->used_wrap = !ring->used_wrap;
+        }
+
+        DEBUG_ASSERT(dev->irq_driver_callback);
+        ret |= dev->irq_driver_callback(dev, index, &used_elem);
+
+        handled++;
+    }
+
+    if (handled > 0) {
+        ring->interrupts++;
+        ring->completions += handled;
+    }
+
+    return ret;
+}
+
+/* hand everything the device put on the used ring to the driver */
+enum handler_return virtio_process_ring(struct virtio_device *dev, uint index) {
+    struct vring *ring = &dev->ring[index];
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    if (ring->packed)
+        return virtio_process_ring_packed(dev, index);
+
+    LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", index, ring->used->flags, ring->used->idx, ring->last_used);
+
+    uint handled = 0;
+    for (;;) {
+        uint16_t cur_idx = ring->used->idx;
+        while (ring->last_used != cur_idx) {
+            uint i = ring->last_used & ring->num_mask;
+            LTRACEF("looking at idx %u\n", i);
+
+            // process chain
+            struct vring_used_elem *used_elem = &ring->used->ring[i];
+            LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+
+            DEBUG_ASSERT(dev->irq_driver_callback);
+            ret |= dev->irq_driver_callback(dev, index, used_elem);
+
+            ring->last_used++;
+            handled++;
+        }
+
+        if (!virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+            break;
+
+        /* ask for an interrupt on the next used entry, then pick up
+         * anything the device added before it could have seen that */
+        vring_used_event(ring) = ring->last_used;
+        mb();
+        if (ring->used->idx == ring->last_used)
+            break;
+    }
+
+    if (handled > 0) {
+        ring->interrupts++;
+        ring->completions += handled;
+    }
+
+    return ret;
+}
+
 static enum handler_return virtio_mmio_irq(void *arg) {
     struct virtio_device *dev = (struct virtio_device *)arg;
     LTRACEF("dev %p, index %u\n", dev, dev->index);
@@ -80,22 +179,7 @@ static enum handler_return virtio_mmio_irq(void *arg) {
             if ((dev->active_rings_bitmap & (1<<r)) == 0)
                 continue;
 
-            struct vring *ring = &dev->ring[r];
-            LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
-
-            uint cur_idx = ring->used->idx;
-            for (uint i = ring->last_used; i != (cur_idx & ring->num_mask); i = (i + 1) & ring->num_mask) {
-                LTRACEF("looking at idx %u\n", i);
-
-                // process chain
-                struct vring_used_elem *used_elem = &ring->used->ring[i];
-                LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
-
-                DEBUG_ASSERT(dev->irq_driver_callback);
-                ret |= dev->irq_driver_callback(dev, r, used_elem);
-
-                ring->last_used = (ring->last_used + 1) & ring->num_mask;
-            }
+            ret |= virtio_process_ring(dev, r);
         }
     }
     if (irq_status & 0x2) { /* config change */
@@ -111,6 +195,142 @@ static enum handler_return virtio_mmio_irq(void *arg) {
     return ret;
 }
 
+static void virtio_mmio_reset(struct virtio_device *dev) {
+    dev->mmio_config->status = 0;
+}
+
+static uint8_t virtio_mmio_get_status(struct virtio_device *dev) {
+    return dev->mmio_config->status;
+}
+
+static void virtio_mmio_set_status(struct virtio_device *dev, uint8_t status) {
+    dev->mmio_config->status = status;
+}
+
+/* the legacy interface only has the low 32 feature bits */
+static uint64_t virtio_mmio_get_host_features(struct virtio_device *dev) {
+    dev->mmio_config->host_features_sel = 0;
+    return dev->mmio_config->host_features;
+}
+
+static status_t virtio_mmio_set_guest_features(struct virtio_device *dev, uint64_t features) {
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = (uint32_t)features;
+    return NO_ERROR;
+}
+
+/* the legacy interface finds the avail and used rings from the page aligned layout */
+static status_t virtio_mmio_setup_ring(struct virtio_device *dev, uint index, uint num,
+                                       paddr_t desc, paddr_t driver, paddr_t device) {
+    dev->mmio_config->guest_page_size = PAGE_SIZE;
+    dev->mmio_config->queue_sel = index;
+    dev->mmio_config->queue_num = num;
+    dev->mmio_config->queue_align = PAGE_SIZE;
+    dev->mmio_config->queue_pfn = desc / PAGE_SIZE;
+
+    return NO_ERROR;
+}
+
+static void virtio_mmio_notify(struct virtio_device *dev, uint index) {
+    dev->mmio_config->queue_notify = index;
+    mb();
+}
+
+static void virtio_mmio_unmask_irqs(struct virtio_device *dev) {
+    unmask_interrupt(dev->irq);
+}
+
+static const struct virtio_transport_ops virtio_mmio_ops = {
+    .name = "mmio",
+    .reset = virtio_mmio_reset,
+    .get_status = virtio_mmio_get_status,
+    .set_status = virtio_mmio_set_status,
+    .get_host_features = virtio_mmio_get_host_features,
+    .set_guest_features = virtio_mmio_set_guest_features,
+    .setup_ring = virtio_mmio_setup_ring,
+    .notify = virtio_mmio_notify,
+    .unmask_irqs = virtio_mmio_unmask_irqs,
+};
+
+/* whether a driver for this type of device is built in */
+bool virtio_has_driver(uint device_id) {
+    switch (device_id) {
+#if WITH_DEV_VIRTIO_BLOCK
+        case 2: // block device
+            return true;
+#endif
+#if WITH_DEV_VIRTIO_NET
+        case 1: // network device
+            return true;
+#endif
+#if WITH_DEV_VIRTIO_GPU
+        case 0x10: // virtio-gpu
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/* start the driver for the type of device, if there is one */
+status_t virtio_init_driver(struct virtio_device *dev, uint32_t host_features) {
+    status_t err = ERR_NOT_SUPPORTED;
+
+    switch (dev->device_id) {
+#if WITH_DEV_VIRTIO_BLOCK
+        case 2: // block device
+            LTRACEF("found block device\n");
+            err = virtio_block_init(dev, host_features);
+
+            // XXX quick test code, remove
+#if 0
+            if (err >= 0) {
+                uint8_t buf[512];
+                memset(buf, 0x99, sizeof(buf));
+                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
+                hexdump8_ex(buf, sizeof(buf), 0);
+
+                buf[0]++;
+                virtio_block_read_write(dev, buf, 0, sizeof(buf), true);
+
+                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
+                hexdump8_ex(buf, sizeof(buf), 0);
+            }
+#endif
+            break;
+#endif // WITH_DEV_VIRTIO_BLOCK
+#if WITH_DEV_VIRTIO_NET
+        case 1: // network device
+            LTRACEF("found net device\n");
+            err = virtio_net_init(dev, host_features);
+            break;
+#endif // WITH_DEV_VIRTIO_NET
+#if WITH_DEV_VIRTIO_GPU
+        case 0x10: // virtio-gpu
+            LTRACEF("found gpu device\n");
+            err = virtio_gpu_init(dev, host_features);
+            break;
+#endif // WITH_DEV_VIRTIO_GPU
+    }
+
+    if (err < 0)
+        return err;
+
+    // good device
+    dev->valid = true;
+    list_add_tail(&virtio_devices, &dev->node);
+
+    if (dev->irq_driver_callback)
+        dev->ops->unmask_irqs(dev);
+
+#if WITH_DEV_VIRTIO_GPU
+    if (dev->device_id == 0x10)
+        virtio_gpu_start(dev);
+#endif
+
+    return NO_ERROR;
+}
+
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[], size_t stride) {
     LTRACEF("ptr %p, count %u\n", ptr, count);
 
@@ -147,74 +367,16 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[], size_t stride)
         }
 #endif
 
-#if WITH_DEV_VIRTIO_BLOCK
-        if (mmio->device_id == 2) { // block device
-            LTRACEF("found block device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_block_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-
-                // XXX quick test code, remove
-#if 0
-                uint8_t buf[512];
-                memset(buf, 0x99, sizeof(buf));
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-
-                buf[0]++;
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), true);
-
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-#endif
-            }
-
-        }
-#endif // WITH_DEV_VIRTIO_BLOCK
-#if WITH_DEV_VIRTIO_NET
-        if (mmio->device_id == 1) { // network device
-            LTRACEF("found net device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_net_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_NET
-#if WITH_DEV_VIRTIO_GPU
-        if (mmio->device_id == 0x10) { // virtio-gpu
-            LTRACEF("found gpu device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_gpu_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
+        dev->ops = &virtio_mmio_ops;
+        dev->mmio_config = mmio;
+        dev->config_ptr = (void *)mmio->config;
+        dev->device_id = mmio->device_id;
 
-                virtio_gpu_start(dev);
-            }
+        if (dev->device_id != 0 && virtio_init_driver(dev, mmio->host_features) < 0) {
+            /* the legacy reset takes effect right away */
+            virtio_reset_device(dev);
+            virtio_free_rings(dev);
         }
-#endif // WITH_DEV_VIRTIO_GPU
 
         if (dev->valid)
             found++;
@@ -278,9 +440,76 @@ struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_
     return last;
 }
 
+/* rewrite an indirect table the driver built in the split format in place */
+static void virtio_packed_indirect(struct vring *ring, uint16_t desc_index, uint32_t len) {
+    struct vring_desc *table = &ring->indirect[desc_index * ring->indirect_max];
+
+    for (uint i = 0; i < len / sizeof(struct vring_desc); i++) {
+        /* entries follow each other, so NEXT goes away along with next */
+        struct vring_packed_desc pdesc = {
+            .addr = table[i].addr,
+            .len = table[i].len,
+            .id = 0,
+            .flags = table[i].flags & ~VRING_DESC_F_NEXT,
+        };
+        memcpy(&table[i], &pdesc, sizeof(pdesc));
+    }
+}
+
+/* copy the chain to the next free ring positions, all under the head's id */
+static void virtio_submit_chain_packed(struct vring *ring, uint16_t desc_index) {
+    uint16_t head_pos = ring->next_avail;
+    uint16_t head_flags = 0;
+    uint16_t pos = head_pos;
+    bool wrap = ring->avail_wrap;
+    uint16_t count = 0;
+
+    for (uint16_t i = desc_index;; i = ring->desc[i].next) {
+        const struct vring_desc *desc = &ring->desc[i];
+        struct vring_packed_desc *pdesc = &ring->packed_desc[pos];
+
+        if (desc->flags & VRING_DESC_F_INDIRECT)
+            virtio_packed_indirect(ring, i, desc->len);
+
+        pdesc->addr = desc->addr;
+        pdesc->len = desc->len;
+        pdesc->id = desc_index;
+
+        uint16_t flags = desc->flags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT);
+        flags |= wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+        if (count == 0)
+            head_flags = flags;
+        else
+            pdesc->flags = flags;
+        count++;
+
+        if (++pos == ring->num) {
+            pos = 0;
+            wrap = !wrap;
+        }
+
+        if (!(desc->flags & VRING_DESC_F_NEXT))
+            break;
+    }
+
+    ring->chain_len[desc_index] = count;
+    ring->next_avail = pos;
+    ring->avail_wrap = wrap;
+    ring->num_added += count;
+
+    /* the device may start on the chain as soon as the head is available */
+    wmb();
+    ring->packed_desc[head_pos].flags = head_flags;
+}
+
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index) {
     LTRACEF("dev %p, ring %u, desc %u\n", dev, ring_index, desc_index);
 
+    if (dev->ring[ring_index].packed) {
+        virtio_submit_chain_packed(&dev->ring[ring_index], desc_index);
+        return;
+    }
+
     /* add the chain to the available list */
     struct vring_avail *avail = dev->ring[ring_index].avail;
 
@@ -296,8 +525,48 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
 void virtio_kick(struct virtio_device *dev, uint ring_index) {
     LTRACEF("dev %p, ring %u\n", dev, ring_index);
 
-    dev->mmio_config->queue_notify = ring_index;
+    struct vring *ring = &dev->ring[ring_index];
+
+    /* the new avail index has to be visible before looking at what the device wants */
     mb();
+
+    bool notify;
+    if (ring->packed) {
+        /* positions are free running here, relative to the start of this lap */
+        uint16_t new_idx = ring->next_avail;
+        uint16_t old_idx = new_idx - ring->num_added;
+        ring->num_added = 0;
+
+        struct vring_packed_desc_event event = *(volatile struct vring_packed_desc_event *)ring->device_event;
+        if (event.flags == VRING_PACKED_EVENT_FLAG_DESC) {
+            uint16_t event_idx = event.off_wrap & ~(1u << VRING_PACKED_EVENT_F_WRAP_CTR);
+            bool event_wrap = event.off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR;
+
+            /* an event position on the previous lap counts from before this one */
+            if (event_wrap != ring->avail_wrap)
+                event_idx -= ring->num;
+            notify = vring_need_event(event_idx, new_idx, old_idx);
+        } else {
+            notify = event.flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+        }
+    } else {
+        uint16_t old_idx = ring->kicked_avail;
+        uint16_t new_idx = ring->avail->idx;
+        ring->kicked_avail = new_idx;
+
+        if (virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+            notify = vring_need_event(vring_avail_event(ring), new_idx, old_idx);
+        else
+            notify = !(ring->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+
+    if (!notify) {
+        ring->kicks_suppressed++;
+        return;
+    }
+
+    ring->kicks++;
+    dev->ops->notify(dev, ring_index);
 }
 
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) {
@@ -311,16 +580,27 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
         return ERR_INVALID_ARGS;
 
     struct vring *ring = &dev->ring[index];
+    bool packed = virtio_has_feature(dev, VIRTIO_F_RING_PACKED);
+
+    /* the driver builds chains in its own table with the packed layout */
+    void *shadow = NULL;
+    if (packed) {
+        shadow = calloc(1, vring_packed_shadow_size(len));
+        if (!shadow)
+            return ERR_NO_MEMORY;
+    }
 
     /* allocate a ring */
-    size_t size = vring_size(len, PAGE_SIZE);
+    size_t size = packed ? vring_packed_size(len) : vring_size(len, PAGE_SIZE);
     LTRACEF("need %zu bytes\n", size);
 
 #if WITH_KERNEL_VM
     void *vptr;
     status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_ring", size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
-    if (err < 0)
+    if (err < 0) {
+        free(shadow);
         return ERR_NO_MEMORY;
+    }
 
     LTRACEF("allocated virtio_ring at va %p\n", vptr);
 
@@ -328,24 +608,39 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     paddr_t pa;
     pa = vaddr_to_paddr(vptr);
     if (pa == 0) {
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)vptr);
+        free(shadow);
         return ERR_NO_MEMORY;
     }
 
     LTRACEF("virtio_ring at pa 0x%lx\n", pa);
 #else
+    status_t err;
     void *vptr = memalign(PAGE_SIZE, size);
-    if (!vptr)
+    if (!vptr) {
+        free(shadow);
         return ERR_NO_MEMORY;
+    }
 
     LTRACEF("ptr %p\n", vptr);
-    memset(vptr, 0, size);
 
     /* compute the physical address */
     paddr_t pa = (paddr_t)vptr;
 #endif
+    /* no packed descriptor may look available to the device yet */
+    memset(vptr, 0, size);
 
     /* initialize the ring */
-    vring_init(ring, len, vptr, PAGE_SIZE);
+    paddr_t driver, device;
+    if (packed) {
+        vring_init_packed(ring, len, vptr, shadow);
+        driver = pa + ((uintptr_t)ring->driver_event - (uintptr_t)vptr);
+        device = pa + ((uintptr_t)ring->device_event - (uintptr_t)vptr);
+    } else {
+        vring_init(ring, len, vptr, PAGE_SIZE);
+        driver = pa + ((uintptr_t)ring->avail - (uintptr_t)vptr);
+        device = pa + ((uintptr_t)ring->used - (uintptr_t)vptr);
+    }
     dev->ring[index].free_list = 0xffff;
     dev->ring[index].free_count = 0;
 
@@ -355,12 +650,17 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     }
 
     /* register the ring with the device */
-    DEBUG_ASSERT(dev->mmio_config);
-    dev->mmio_config->guest_page_size = PAGE_SIZE;
-    dev->mmio_config->queue_sel = index;
-    dev->mmio_config->queue_num = len;
-    dev->mmio_config->queue_align = PAGE_SIZE;
-    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+    err = dev->ops->setup_ring(dev, index, len, pa, driver, device);
+    if (err < 0) {
+#if WITH_KERNEL_VM
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)vptr);
+#else
+        free(vptr);
+#endif
+        free(shadow);
+        memset(ring, 0, sizeof(*ring));
+        return err;
+    }
 
     /* mark the ring active */
     dev->active_rings_bitmap |= (1 << index);
@@ -368,20 +668,164 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     return NO_ERROR;
 }
 
+status_t virtio_alloc_ring_indirect(struct virtio_device *dev, uint index, uint16_t max) {
+    LTRACEF("dev %p, index %u, max %u\n", dev, index, max);
+
+    DEBUG_ASSERT(index < MAX_VIRTIO_RINGS);
+    DEBUG_ASSERT(dev->active_rings_bitmap & (1 << index));
+    DEBUG_ASSERT(!dev->ring[index].indirect);
+
+    if (!virtio_has_feature(dev, VIRTIO_RING_F_INDIRECT_DESC))
+        return ERR_NOT_SUPPORTED;
+    if (max < 2)
+        return ERR_INVALID_ARGS;
+
+    struct vring *ring = &dev->ring[index];
+    size_t size = ROUNDUP((size_t)ring->num * max * sizeof(struct vring_desc), PAGE_SIZE);
+
+    /* one physically contiguous block, table i belongs to ring descriptor i */
+#if WITH_KERNEL_VM
+    void *vptr;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_indirect", size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0)
+        return ERR_NO_MEMORY;
+
+    paddr_t pa = vaddr_to_paddr(vptr);
+#else
+    void *vptr = memalign(PAGE_SIZE, size);
+    if (!vptr)
+        return ERR_NO_MEMORY;
+
+    paddr_t pa = (paddr_t)vptr;
+#endif
+    memset(vptr, 0, size);
+
+    LTRACEF("indirect tables at %p (0x%lx phys), %zu bytes\n", vptr, pa, size);
+
+    ring->indirect = vptr;
+    ring->indirect_pa = pa;
+    ring->indirect_max = max;
+
+    return NO_ERROR;
+}
+
+struct vring_desc *virtio_alloc_indirect_desc(struct virtio_device *dev, uint ring_index, uint16_t *desc_index) {
+    struct vring *ring = &dev->ring[ring_index];
+
+    DEBUG_ASSERT(ring->indirect);
+
+    uint16_t i = virtio_alloc_desc(dev, ring_index);
+    if (i == 0xffff)
+        return NULL;
+
+    struct vring_desc *desc = &ring->desc[i];
+    desc->addr = ring->indirect_pa + (uint64_t)i * ring->indirect_max * sizeof(struct vring_desc);
+    desc->len = ring->indirect_max * sizeof(struct vring_desc);
+    desc->flags = VRING_DESC_F_INDIRECT;
+
+    *desc_index = i;
+
+    return &ring->indirect[i * ring->indirect_max];
+}
+
+void virtio_free_rings(struct virtio_device *dev) {
+    for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+        if ((dev->active_rings_bitmap & (1 << r)) == 0)
+            continue;
+
+        struct vring *ring = &dev->ring[r];
+
+        /* with the packed layout desc is the driver's own table */
+        void *ring_mem = ring->packed ? (void *)ring->packed_desc : (void *)ring->desc;
+        if (ring->packed)
+            free(ring->desc);
+#if WITH_KERNEL_VM
+        if (ring->indirect)
+            vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ring->indirect);
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ring_mem);
+#else
+        free(ring->indirect);
+        free(ring_mem);
+#endif
+        memset(ring, 0, sizeof(*ring));
+    }
+
+    dev->active_rings_bitmap = 0;
+}
+
+uint32_t virtio_config_generation(struct virtio_device *dev) {
+    if (!dev->ops->config_generation)
+        return 0;
+
+    return dev->ops->config_generation(dev);
+}
+
+uint64_t virtio_read_config64(struct virtio_device *dev, const volatile void *field) {
+    const volatile uint32_t *half = field;
+    uint32_t gen;
+    uint64_t val;
+
+    do {
+        gen = virtio_config_generation(dev);
+        val = half[0] | ((uint64_t)half[1] << 32);
+    } while (gen != virtio_config_generation(dev));
+
+    return val;
+}
+
 void virtio_reset_device(struct virtio_device *dev) {
-    dev->mmio_config->status = 0;
+    dev->ops->reset(dev);
+    dev->features = 0;
 }
 
 void virtio_status_acknowledge_driver(struct virtio_device *dev) {
-    dev->mmio_config->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    dev->ops->set_status(dev, dev->ops->get_status(dev) | VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
 }
 
 void virtio_status_driver_ok(struct virtio_device *dev) {
-    dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
+    dev->ops->set_status(dev, dev->ops->get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+status_t virtio_set_guest_features(struct virtio_device *dev, uint32_t features) {
+    DEBUG_ASSERT(dev->active_rings_bitmap == 0);
+
+    uint64_t guest_features = features;
+    guest_features |= dev->ops->get_host_features(dev) & VIRTIO_CORE_FEATURES;
+
+    LTRACEF("dev %p, features 0x%llx\n", dev, (unsigned long long)guest_features);
+
+    dev->features = guest_features;
+
+    return dev->ops->set_guest_features(dev, guest_features);
 }
 
 static void virtio_init(uint level) {
 }
 
+#if LK_DEBUGLEVEL > 1
+static int cmd_virtio(int argc, const console_cmd_args *argv) {
+    struct virtio_device *dev;
+    list_for_every_entry(&virtio_devices, dev, struct virtio_device, node) {
+        printf("virtio %s %u: device id %u irq %u features 0x%llx\n",
+               dev->ops->name, dev->index, dev->device_id, dev->irq, (unsigned long long)dev->features);
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            if ((dev->active_rings_bitmap & (1<<r)) == 0)
+                continue;
+
+            const struct vring *ring = &dev->ring[r];
+            printf("\tring %u: %s num %u free %u indirect %u kicks %u suppressed %u interrupts %u completions %u\n",
+                   r, ring->packed ? "packed" : "split", ring->num, ring->free_count, ring->indirect_max,
+                   ring->kicks, ring->kicks_suppressed, ring->interrupts, ring->completions);
+        }
+    }
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("virtio", "virtio device and ring stats", &cmd_virtio)
+STATIC_COMMAND_END(virtio);
+#endif
+
 LK_INIT_HOOK(virtio, &virtio_init, LK_INIT_LEVEL_THREADING);
 
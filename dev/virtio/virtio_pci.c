@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <dev/virtio.h>
+#include <dev/virtio/virtio_ring.h>
+
+#include <arch/ops.h>
+#include <lk/debug.h>
+#include <assert.h>
+#include <lk/trace.h>
+#include <lk/compiler.h>
+#include <lk/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#include "virtio_priv.h"
+
+#if WITH_DEV_BUS_PCI
+#include <dev/bus/pci.h>
+
+#define LOCAL_TRACE 0
+
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+
+/* transitional devices, the type comes from the subsystem id */
+#define VIRTIO_PCI_DEVICE_ID_LEGACY_FIRST 0x1000
+#define VIRTIO_PCI_DEVICE_ID_LEGACY_LAST  0x103f
+/* modern devices, 0x1040 + type */
+#define VIRTIO_PCI_DEVICE_ID_MODERN_FIRST 0x1040
+#define VIRTIO_PCI_DEVICE_ID_MODERN_LAST  0x107f
+
+/* vendor specific capabilities describing where the structures live */
+#define PCI_CAP_ID_VENDOR 0x09
+
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+struct virtio_pci_cap {
+    uint8_t cap_vndr;
+    uint8_t cap_next;
+    uint8_t cap_len;
+    uint8_t cfg_type;
+    uint8_t bar;
+    uint8_t id;
+    uint8_t padding[2];
+    uint32_t offset;
+    uint32_t length;
+};
+STATIC_ASSERT(sizeof(struct virtio_pci_cap) == 16);
+
+/* the 64 bit queue addresses are written as two 32 bit halves */
+struct virtio_pci_common_cfg {
+    /* about the whole device */
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+
+    /* about the queue picked by queue_select */
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+};
+STATIC_ASSERT(sizeof(struct virtio_pci_common_cfg) == 0x38);
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+/* how long a device gets to read back zero after a reset */
+#define VIRTIO_PCI_RESET_TIMEOUT_MS 100
+
+/* an interrupt vector and what it is used for */
+struct virtio_pci_vector {
+    struct virtio_device *dev;
+    uint irq;
+    uint32_t ring_mask;
+    bool config;
+};
+
+struct virtio_pci_dev {
+    struct virtio_device dev;
+
+    pci_location_t loc;
+
+    volatile struct virtio_pci_common_cfg *common;
+    volatile uint8_t *isr;
+    volatile uint8_t *notify_base;
+    uint32_t notify_off_multiplier;
+    volatile uint16_t *notify[MAX_VIRTIO_RINGS];
+
+    /* the start of every region mapped for the structures above */
+    void *regions[4];
+    uint region_count;
+
+    /* msix vectors, vector 0 is for config changes and the rings share the
+     * rest. with a single one or a legacy interrupt everything shares it */
+    bool msix;
+    uint vector_count;
+    struct virtio_pci_vector vectors[MAX_VIRTIO_RINGS + 1];
+};
+
+static uint virtio_pci_count;
+
+static struct virtio_pci_dev *to_pci_dev(struct virtio_device *dev) {
+    return containerof(dev, struct virtio_pci_dev, dev);
+}
+
+static status_t virtio_pci_reset_wait(struct virtio_pci_dev *vp) {
+    vp->common->device_status = 0;
+
+    /* the reset is done once the device reads back zero */
+    lk_time_t start = current_time();
+    while (vp->common->device_status != 0) {
+        if (current_time() - start > VIRTIO_PCI_RESET_TIMEOUT_MS)
+            return ERR_TIMED_OUT;
+    }
+
+    return NO_ERROR;
+}
+
+static void virtio_pci_reset(struct virtio_device *dev) {
+    if (virtio_pci_reset_wait(to_pci_dev(dev)) < 0)
+        TRACEF("device %u did not finish resetting\n", dev->index);
+}
+
+static uint8_t virtio_pci_get_status(struct virtio_device *dev) {
+    return to_pci_dev(dev)->common->device_status;
+}
+
+static void virtio_pci_set_status(struct virtio_device *dev, uint8_t status) {
+    to_pci_dev(dev)->common->device_status = status;
+}
+
+static uint64_t virtio_pci_get_host_features(struct virtio_device *dev) {
+    volatile struct virtio_pci_common_cfg *common = to_pci_dev(dev)->common;
+
+    common->device_feature_select = 0;
+    uint64_t features = common->device_feature;
+    common->device_feature_select = 1;
+    features |= (uint64_t)common->device_feature << 32;
+
+    return features;
+}
+
+static status_t virtio_pci_set_guest_features(struct virtio_device *dev, uint64_t features) {
+    volatile struct virtio_pci_common_cfg *common = to_pci_dev(dev)->common;
+
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t)features;
+    common->driver_feature_select = 1;
+    common->driver_feature = (uint32_t)(features >> 32);
+
+    /* the device can still refuse the combination */
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        TRACEF("device refused features 0x%llx\n", (unsigned long long)features);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    return NO_ERROR;
+}
+
+/* the msix table entry the ring interrupts on */
+static uint virtio_pci_ring_vector(struct virtio_pci_dev *vp, uint index) {
+    if (vp->vector_count < 2)
+        return 0;
+
+    return 1 + index % (vp->vector_count - 1);
+}
+
+static status_t virtio_pci_setup_ring(struct virtio_device *dev, uint index, uint num,
+                                      paddr_t desc, paddr_t driver, paddr_t device) {
+    struct virtio_pci_dev *vp = to_pci_dev(dev);
+    volatile struct virtio_pci_common_cfg *common = vp->common;
+
+    common->queue_select = index;
+
+    /* the device says how large the ring may be, zero if it doesn't exist */
+    uint16_t max = common->queue_size;
+    LTRACEF("ring %u len %u max %u\n", index, num, max);
+    if (max == 0)
+        return ERR_NOT_FOUND;
+    if (num > max)
+        return ERR_NOT_SUPPORTED;
+
+    common->queue_size = num;
+    common->queue_desc_lo = (uint32_t)desc;
+    common->queue_desc_hi = (uint32_t)((uint64_t)desc >> 32);
+    common->queue_driver_lo = (uint32_t)driver;
+    common->queue_driver_hi = (uint32_t)((uint64_t)driver >> 32);
+    common->queue_device_lo = (uint32_t)device;
+    common->queue_device_hi = (uint32_t)((uint64_t)device >> 32);
+
+    if (vp->msix) {
+        uint vector = virtio_pci_ring_vector(vp, index);
+        common->queue_msix_vector = vector;
+        if (common->queue_msix_vector != vector) {
+            TRACEF("device refused msix vector %u for ring %u\n", vector, index);
+            return ERR_NO_RESOURCES;
+        }
+        vp->vectors[vector].ring_mask |= (1u << index);
+    } else {
+        vp->vectors[0].ring_mask |= (1u << index);
+    }
+
+    vp->notify[index] = (volatile uint16_t *)(vp->notify_base +
+                                              common->queue_notify_off * vp->notify_off_multiplier);
+
+    common->queue_enable = 1;
+
+    return NO_ERROR;
+}
+
+static void virtio_pci_notify(struct virtio_device *dev, uint index) {
+    struct virtio_pci_dev *vp = to_pci_dev(dev);
+
+    *vp->notify[index] = index;
+    mb();
+}
+
+static void virtio_pci_unmask_irqs(struct virtio_device *dev) {
+    struct virtio_pci_dev *vp = to_pci_dev(dev);
+
+    /* a reset forgets the config vector, so it is set up here and not at probe time */
+    if (vp->msix) {
+        vp->common->msix_config = 0;
+        if (vp->common->msix_config != 0)
+            TRACEF("device refused msix vector for config changes\n");
+    }
+
+    for (uint i = 0; i < vp->vector_count; i++)
+        unmask_interrupt(vp->vectors[i].irq);
+}
+
+static uint32_t virtio_pci_config_generation(struct virtio_device *dev) {
+    return to_pci_dev(dev)->common->config_generation;
+}
+
+static const struct virtio_transport_ops virtio_pci_ops = {
+    .name = "pci",
+    .reset = virtio_pci_reset,
+    .get_status = virtio_pci_get_status,
+    .set_status = virtio_pci_set_status,
+    .get_host_features = virtio_pci_get_host_features,
+    .set_guest_features = virtio_pci_set_guest_features,
+    .setup_ring = virtio_pci_setup_ring,
+    .notify = virtio_pci_notify,
+    .unmask_irqs = virtio_pci_unmask_irqs,
+    .config_generation = virtio_pci_config_generation,
+};
+
+/* an msix vector only has to look at its own rings */
+static enum handler_return virtio_pci_msix_irq(void *arg) {
+    struct virtio_pci_vector *v = (struct virtio_pci_vector *)arg;
+    struct virtio_device *dev = v->dev;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    LTRACEF("dev %p, irq %u\n", dev, v->irq);
+
+    uint32_t rings = v->ring_mask & dev->active_rings_bitmap;
+    for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+        if (rings & (1u << r))
+            ret |= virtio_process_ring(dev, r);
+    }
+
+    if (v->config && dev->config_change_callback)
+        ret |= dev->config_change_callback(dev);
+
+    return ret;
+}
+
+/* a legacy interrupt may be shared, the isr status says if it was us */
+static enum handler_return virtio_pci_intx_irq(void *arg) {
+    struct virtio_pci_vector *v = (struct virtio_pci_vector *)arg;
+    struct virtio_device *dev = v->dev;
+    struct virtio_pci_dev *vp = to_pci_dev(dev);
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    /* reading it acknowledges the interrupt */
+    uint8_t isr = *vp->isr;
+    LTRACEF("dev %p, isr 0x%hhx\n", dev, isr);
+
+    if (isr & 0x1) {
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            if (dev->active_rings_bitmap & (1u << r))
+                ret |= virtio_process_ring(dev, r);
+        }
+    }
+    if ((isr & 0x2) && dev->config_change_callback)
+        ret |= dev->config_change_callback(dev);
+
+    return ret;
+}
+
+/* map the part of a bar a capability points to */
+static void *virtio_pci_map_cap(struct virtio_pci_dev *vp, const pci_bar_t bars[6],
+                                const struct virtio_pci_cap *cap, const char *name) {
+    if (cap->bar > 5 || !bars[cap->bar].valid || bars[cap->bar].io)
+        return NULL;
+    if ((uint64_t)cap->offset + cap->length > bars[cap->bar].size)
+        return NULL;
+
+    paddr_t pa = bars[cap->bar].addr + cap->offset;
+#if WITH_KERNEL_VM
+    paddr_t map_pa = ROUNDDOWN(pa, PAGE_SIZE);
+    size_t map_size = ROUNDUP(pa + cap->length, PAGE_SIZE) - map_pa;
+
+    char str[32];
+    snprintf(str, sizeof(str), "virtio pci %u %s", vp->dev.index, name);
+
+    if (vp->region_count == countof(vp->regions))
+        return NULL;
+
+    void *ptr;
+    status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), str, map_size, &ptr, 0,
+                                      map_pa, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0)
+        return NULL;
+    vp->regions[vp->region_count++] = ptr;
+
+    return (uint8_t *)ptr + (pa - map_pa);
+#else
+    return (void *)(uintptr_t)pa;
+#endif
+}
+
+/* find and map the virtio structures through the vendor capabilities */
+static status_t virtio_pci_map_structures(struct virtio_pci_dev *vp) {
+    pci_bar_t bars[6];
+    status_t err = pci_bus_mgr_read_bars(vp->loc, bars);
+    if (err < 0)
+        return err;
+
+    uint16_t status;
+    pci_read_config_half(vp->loc, PCI_CONFIG_STATUS, &status);
+    if (!(status & PCI_STATUS_NEW_CAPS))
+        return ERR_NOT_FOUND;
+
+    uint8_t cap_ptr;
+    pci_read_config_byte(vp->loc, PCI_CONFIG_CAPABILITIES, &cap_ptr);
+    while (cap_ptr != 0) {
+        struct virtio_pci_cap cap;
+        uint32_t *words = (uint32_t *)&cap;
+        for (uint i = 0; i < sizeof(cap) / 4; i++)
+            pci_read_config_word(vp->loc, cap_ptr + i * 4, &words[i]);
+
+        if (cap.cap_vndr == PCI_CAP_ID_VENDOR) {
+            LTRACEF("virtio cap type %u bar %u offset %#x len %#x\n",
+                    cap.cfg_type, cap.bar, cap.offset, cap.length);
+
+            /* the first capability of each type is the preferred one */
+            switch (cap.cfg_type) {
+                case VIRTIO_PCI_CAP_COMMON_CFG:
+                    if (!vp->common && cap.length >= sizeof(struct virtio_pci_common_cfg))
+                        vp->common = virtio_pci_map_cap(vp, bars, &cap, "common");
+                    break;
+                case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                    if (!vp->notify_base) {
+                        pci_read_config_word(vp->loc, cap_ptr + sizeof(cap), &vp->notify_off_multiplier);
+                        vp->notify_base = virtio_pci_map_cap(vp, bars, &cap, "notify");
+                    }
+                    break;
+                case VIRTIO_PCI_CAP_ISR_CFG:
+                    if (!vp->isr)
+                        vp->isr = virtio_pci_map_cap(vp, bars, &cap, "isr");
+                    break;
+                case VIRTIO_PCI_CAP_DEVICE_CFG:
+                    if (!vp->dev.config_ptr)
+                        vp->dev.config_ptr = virtio_pci_map_cap(vp, bars, &cap, "device");
+                    break;
+            }
+        }
+
+        cap_ptr = cap.cap_next;
+    }
+
+    /* legacy only devices don't have the capabilities */
+    if (!vp->common || !vp->notify_base || !vp->isr)
+        return ERR_NOT_FOUND;
+
+    return NO_ERROR;
+}
+
+/* one msix vector per ring plus one for config changes if there are enough,
+ * falling back to fewer and finally to the legacy interrupt */
+static status_t virtio_pci_setup_irqs(struct virtio_pci_dev *vp) {
+    uint want = 1 + MIN(vp->common->num_queues, MAX_VIRTIO_RINGS);
+
+    uint irq_base;
+    status_t err;
+    for (uint count = want; count > 0; count--) {
+        err = pci_bus_mgr_allocate_msix(vp->loc, count, &irq_base);
+        if (err == NO_ERROR) {
+            vp->msix = true;
+            vp->vector_count = count;
+            break;
+        }
+    }
+
+    if (vp->msix) {
+        for (uint i = 0; i < vp->vector_count; i++) {
+            struct virtio_pci_vector *v = &vp->vectors[i];
+            v->dev = &vp->dev;
+            v->irq = irq_base + i;
+            v->config = (i == 0);
+            register_int_handler_msi(v->irq, &virtio_pci_msix_irq, v, true);
+        }
+    } else {
+        err = pci_bus_mgr_allocate_irq(vp->loc, &irq_base);
+        if (err < 0)
+            return err;
+
+        struct virtio_pci_vector *v = &vp->vectors[0];
+        v->dev = &vp->dev;
+        v->irq = irq_base;
+        v->config = true;
+        vp->vector_count = 1;
+        register_int_handler(v->irq, &virtio_pci_intx_irq, v);
+    }
+
+    vp->dev.irq = vp->vectors[0].irq;
+    LTRACEF("%s, %u vectors at %u\n", vp->msix ? "msix" : "intx", vp->vector_count, irq_base);
+
+    return NO_ERROR;
+}
+
+/* undo what the probe set up, the device must not be using its vectors anymore */
+static void virtio_pci_teardown(struct virtio_pci_dev *vp) {
+    for (uint i = 0; i < vp->vector_count; i++) {
+        struct virtio_pci_vector *v = &vp->vectors[i];
+        mask_interrupt(v->irq);
+        if (vp->msix)
+            register_int_handler_msi(v->irq, NULL, NULL, true);
+        else
+            register_int_handler(v->irq, NULL, NULL);
+    }
+    if (vp->msix)
+        pci_bus_mgr_free_msix(vp->loc);
+    vp->vector_count = 0;
+    vp->msix = false;
+
+#if WITH_KERNEL_VM
+    for (uint i = 0; i < vp->region_count; i++)
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)vp->regions[i]);
+#endif
+    vp->region_count = 0;
+}
+
+static status_t virtio_pci_probe(pci_location_t loc, uint device_type) {
+    char str[14];
+    LTRACEF("%s type %u\n", pci_loc_string(loc, str), device_type);
+
+    /* don't map or take vectors for a device nothing is going to drive */
+    if (!virtio_has_driver(device_type))
+        return ERR_NOT_SUPPORTED;
+
+    struct virtio_pci_dev *vp = calloc(1, sizeof(struct virtio_pci_dev));
+    if (!vp)
+        return ERR_NO_MEMORY;
+
+    vp->loc = loc;
+    vp->dev.index = virtio_pci_count;
+    vp->dev.device_id = device_type;
+    vp->dev.ops = &virtio_pci_ops;
+
+    status_t err = virtio_pci_map_structures(vp);
+    if (err < 0)
+        goto fail;
+
+    pci_bus_mgr_enable_device(loc);
+
+    err = virtio_pci_reset_wait(vp);
+    if (err < 0) {
+        TRACEF("%s did not finish resetting\n", pci_loc_string(loc, str));
+        goto fail;
+    }
+
+    err = virtio_pci_setup_irqs(vp);
+    if (err < 0)
+        goto fail;
+
+    /* the drivers only see the low feature bits, the rest belong to the core */
+    err = virtio_init_driver(&vp->dev, (uint32_t)virtio_pci_get_host_features(&vp->dev));
+    if (err < 0)
+        goto fail_reset;
+
+    virtio_pci_count++;
+
+    return NO_ERROR;
+
+fail_reset:
+    for (uint i = 0; i < vp->vector_count; i++)
+        mask_interrupt(vp->vectors[i].irq);
+    /* the vectors can only go once the device is quiet */
+    if (virtio_pci_reset_wait(vp) < 0) {
+        TRACEF("%s did not finish resetting, keeping it\n", pci_loc_string(loc, str));
+        return err;
+    }
+    virtio_pci_set_status(&vp->dev, VIRTIO_STATUS_FAILED);
+    virtio_free_rings(&vp->dev);
+fail:
+    LTRACEF("%s failed with %d\n", pci_loc_string(loc, str), err);
+    virtio_pci_teardown(vp);
+    free(vp);
+    return err;
+}
+
+int virtio_pci_detect(void) {
+    int found = 0;
+
+    for (size_t i = 0; ; i++) {
+        pci_location_t loc;
+        if (pci_bus_mgr_find_device(&loc, 0xffff, VIRTIO_PCI_VENDOR_ID, i) != NO_ERROR)
+            break;
+
+        uint16_t device_id;
+        pci_read_config_half(loc, PCI_CONFIG_DEVICE_ID, &device_id);
+
+        uint device_type;
+        if (device_id >= VIRTIO_PCI_DEVICE_ID_MODERN_FIRST && device_id <= VIRTIO_PCI_DEVICE_ID_MODERN_LAST) {
+            device_type = device_id - VIRTIO_PCI_DEVICE_ID_MODERN_FIRST;
+        } else if (device_id >= VIRTIO_PCI_DEVICE_ID_LEGACY_FIRST && device_id <= VIRTIO_PCI_DEVICE_ID_LEGACY_LAST) {
+            uint16_t subsys_id;
+            pci_read_config_half(loc, PCI_CONFIG_SUBSYS_ID, &subsys_id);
+            device_type = subsys_id;
+        } else {
+            continue;
+        }
+
+        if (virtio_pci_probe(loc, device_type) == NO_ERROR)
+            found++;
+    }
+
+    return found;
+}
+
+#else
+
+int virtio_pci_detect(void) {
+    return 0;
+}
+
+#endif // WITH_DEV_BUS_PCI
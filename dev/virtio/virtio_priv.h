@@ -9,6 +9,8 @@
 
 #include <lk/compiler.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <dev/virtio.h>
 
 struct virtio_mmio_config {
     /* 0x00 */  uint32_t magic;
@@ -48,3 +50,35 @@ STATIC_ASSERT(sizeof(struct virtio_mmio_config) == 0x100);
 #define VIRTIO_STATUS_FEATURES_OK (1<<3)
 #define VIRTIO_STATUS_DEVICE_NEEDS_RESET (1<<6)
 #define VIRTIO_STATUS_FAILED      (1<<7)
+
+/* the operations the core needs from a transport */
+struct virtio_transport_ops {
+    const char *name;
+
+    void (*reset)(struct virtio_device *dev);
+    uint8_t (*get_status)(struct virtio_device *dev);
+    void (*set_status)(struct virtio_device *dev, uint8_t status);
+
+    uint64_t (*get_host_features)(struct virtio_device *dev);
+    status_t (*set_guest_features)(struct virtio_device *dev, uint64_t features);
+
+    /* hand a freshly initialized ring of num entries to the device. desc,
+     * driver and device are the physical addresses of the descriptors, the
+     * avail ring or driver event area and the used ring or device event area */
+    status_t (*setup_ring)(struct virtio_device *dev, uint index, uint num,
+                           paddr_t desc, paddr_t driver, paddr_t device);
+    void (*notify)(struct virtio_device *dev, uint index);
+
+    /* let the device interrupt once the driver is set up */
+    void (*unmask_irqs)(struct virtio_device *dev);
+
+    /* optional, changes every time the device changes its config space */
+    uint32_t (*config_generation)(struct virtio_device *dev);
+};
+
+/* shared between the transports */
+bool virtio_has_driver(uint device_id);
+status_t virtio_init_driver(struct virtio_device *dev, uint32_t host_features);
+enum handler_return virtio_process_ring(struct virtio_device *dev, uint index);
+/* release the rings of a device, which has to be reset and quiet by now */
+void virtio_free_rings(struct virtio_device *dev);
@@ -78,6 +78,7 @@ static int cmd_threadstats(int argc, const console_cmd_args *argv) {
         printf("\treschedules: %lu\n", thread_stats[i].reschedules);
 #if WITH_SMP
         printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+        printf("\tsteals: %lu\n", thread_stats[i].steals);
 #endif
         printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
         printf("\tpreempts: %lu\n", thread_stats[i].preempts);
@@ -146,6 +147,7 @@ static int cmd_threadload(int argc, const console_cmd_args *argv) {
     if (showthreadload == false) {
         // start the display
         timer_initialize(&tltimer);
+        timer_set_slack(&tltimer, TIMER_COALESCE_SLACK_NS);
         timer_set_periodic(&tltimer, 1000, &threadload, NULL);
         showthreadload = true;
     } else {
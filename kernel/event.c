@@ -102,6 +102,38 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout) {
     return ret;
 }
 
+/**
+ * @brief  Wait for event to be signaled, up to an absolute deadline
+ *
+ * Same as event_wait_timeout() but the wait is bounded by a time on the
+ * current_time_ns() clock, so repeated waits do not accumulate drift.
+ *
+ * @param e         Event object
+ * @param deadline  Absolute deadline, in ns, or INFINITE_TIME_NS
+ *
+ * @return  0 on success, ERR_TIMED_OUT on timeout,
+ *         other values on other errors.
+ */
+status_t event_wait_deadline(event_t *e, lk_time_ns_t deadline) {
+    status_t ret = NO_ERROR;
+
+    DEBUG_ASSERT(e->magic == EVENT_MAGIC);
+
+    THREAD_LOCK(state);
+
+    if (e->signaled) {
+        if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
+            e->signaled = false;
+        }
+    } else {
+        ret = wait_queue_block_deadline(&e->wait, deadline);
+    }
+
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
 /**
  * @brief  Signal an event
  *
@@ -57,6 +57,10 @@ static inline int mp_is_cpu_idle(uint cpu) {
     return mp.idle_cpus & (1 << cpu);
 }
 
+static inline mp_cpu_mask_t mp_get_active_mask(void) {
+    return mp.active_cpus;
+}
+
 /* must be called with the thread lock held */
 static inline void mp_set_cpu_idle(uint cpu) {
     mp.idle_cpus |= 1UL << cpu;
@@ -91,6 +95,7 @@ static inline enum handler_return mp_mbx_reschedule_irq(void) { return INT_NO_RE
 // only one cpu exists in UP and if you're calling these functions, it's active...
 static inline int mp_is_cpu_active(uint cpu) { return 1; }
 static inline int mp_is_cpu_idle(uint cpu) { return (get_current_thread()->flags & THREAD_FLAG_IDLE) != 0; }
+static inline mp_cpu_mask_t mp_get_active_mask(void) { return 1; }
 
 static inline void mp_set_cpu_idle(uint cpu) {}
 static inline void mp_set_cpu_busy(uint cpu) {}
@@ -82,6 +82,7 @@ typedef struct thread {
 #if WITH_SMP
     int curr_cpu;
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+    int last_cpu; /* cpu the thread last ran on, placement hint */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
@@ -117,11 +118,13 @@ typedef struct thread {
 #define thread_pinned_cpu(t) ((t)->pinned_cpu)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
 #define thread_set_pinned_cpu(t, c) ((t)->pinned_cpu = (c))
+#define thread_set_last_cpu(t, c) ((t)->last_cpu = (c))
 #else
 #define thread_curr_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
 #define thread_set_curr_cpu(t,c) do {} while(0)
 #define thread_set_pinned_cpu(t, c) do {} while(0)
+#define thread_set_last_cpu(t, c) do {} while(0)
 #endif
 
 /* thread priority */
@@ -154,6 +157,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 status_t thread_resume(thread_t *);
 void thread_exit(int retcode) __NO_RETURN;
 void thread_sleep(lk_time_t delay);
+void thread_sleep_ns(lk_time_ns_t delay);
 status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
@@ -229,6 +233,7 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; /* threads taken from a sibling's run queue */
 #endif
 };
 
@@ -20,12 +20,28 @@ typedef enum handler_return (*timer_callback)(struct timer *, lk_time_t now, voi
 
 #define TIMER_MAGIC (0x74696D72)  //'timr'
 
+/* how far past its deadline a timer may be deferred so that it can expire
+ * together with its neighbours, in ns. Timers fire on time unless their
+ * owner opts in with timer_set_slack(), for example with
+ * TIMER_COALESCE_SLACK_NS if it doesn't care about the exact deadline. */
+#ifndef TIMER_DEFAULT_SLACK_NS
+#define TIMER_DEFAULT_SLACK_NS 0
+#endif
+#define TIMER_COALESCE_SLACK_NS 50000
+
 typedef struct timer {
     int magic;
-    struct list_node node;
+    struct list_node node; /* on the expired list while the callback is pending */
+
+    /* pairing heap links, valid while the timer is queued */
+    struct timer *heap_child;
+    struct timer *heap_next;
+    struct timer *heap_prev; /* left sibling, or the parent of a first child */
+    int queue_cpu; /* cpu whose timer queue holds the timer, -1 if none */
 
-    lk_time_t scheduled_time;
-    lk_time_t periodic_time;
+    lk_time_ns_t scheduled_time; /* absolute deadline */
+    lk_time_ns_t periodic_time;
+    lk_time_ns_t slack;
 
     timer_callback callback;
     void *arg;
@@ -35,8 +51,13 @@ typedef struct timer {
 { \
     .magic = TIMER_MAGIC, \
     .node = LIST_INITIAL_CLEARED_VALUE, \
+    .heap_child = NULL, \
+    .heap_next = NULL, \
+    .heap_prev = NULL, \
+    .queue_cpu = -1, \
     .scheduled_time = 0, \
     .periodic_time = 0, \
+    .slack = TIMER_DEFAULT_SLACK_NS, \
     .callback = NULL, \
     .arg = NULL, \
 }
@@ -45,11 +66,23 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Deadlines are kept in ns, platforms with a dynamic timer program the
+ *   hardware with the absolute deadline of the next timer, others dispatch
+ *   timers from a 10ms periodic tick
+ * - A timer may fire up to its slack late so it can share an interrupt with
+ *   other timers
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
+/* ns resolution variants, deadline is absolute on the current_time_ns() clock */
+void timer_set_oneshot_ns(timer_t *, lk_time_ns_t deadline, timer_callback, void *arg);
+void timer_set_periodic_ns(timer_t *, lk_time_ns_t period, timer_callback, void *arg);
+
+/* change the coalescing window for subsequent arms of the timer, 0 (the
+ * default) disables it */
+void timer_set_slack(timer_t *, lk_time_ns_t slack);
+
 __END_CDECLS
@@ -72,10 +72,14 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8;
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_BUDDY    (0x2) /* head of a free block, order is valid */
+#define VM_PAGE_FLAG_ZEROED   (0x4) /* sitting in the pre-zeroed pool */
+#define VM_PAGE_FLAG_SLAB     (0x8) /* backs a heap slab, see lib/heap */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -106,20 +110,30 @@ static inline bool is_user_address(vaddr_t va) {
 }
 
 /* physical allocator */
+
+/* free pages are kept in naturally aligned blocks of 1 << order pages,
+ * from a single page up to 1 << (PMM_MAX_ORDER - 1) pages.
+ */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 11
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
 
     uint flags;
     uint priority;
+    uint numa_node; /* node the memory is attached to, 0 if unknown */
 
     paddr_t base;
     size_t  size;
+    vaddr_t kvaddr; /* where a kmap arena is mapped, set by the vm */
 
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -127,6 +141,13 @@ typedef struct pmm_arena {
 /* Add a pre-filled memory arena to the physical allocator. */
 status_t pmm_add_arena(pmm_arena_t *arena) __NONNULL((1));
 
+/* Add an arena for memory not covered by the initial mappings. It starts out
+ * without PMM_ARENA_FLAG_KMAP and is mapped at virt in the kernel address space
+ * when the vm initializes, after which it behaves like any other kmap arena.
+ * Must be called before LK_INIT_LEVEL_VM.
+ */
+status_t pmm_add_highmem_arena(pmm_arena_t *arena, vaddr_t virt) __NONNULL((1));
+
 /* Allocate count pages of physical memory, adding to the tail of the passed list.
  * The list must be initialized.
  * Returns the number of pages allocated.
@@ -136,6 +157,13 @@ size_t pmm_alloc_pages(uint count, struct list_node *list) __NONNULL((2));
 /* Allocate a single page */
 vm_page_t *pmm_alloc_page(void);
 
+/* Allocate a single page, with PMM_ALLOC_FLAG_* controlling how.
+ * PMM_ALLOC_FLAG_ZERO returns a zero filled page, taken from a pool the pmm
+ * keeps filled in the background when possible.
+ */
+#define PMM_ALLOC_FLAG_ZERO (0x1)
+vm_page_t *pmm_alloc_page_etc(uint flags);
+
 /* Allocate a specific range of physical pages, adding to the tail of the passed list.
  * The list must be initialized.
  * Returns the number of pages allocated.
@@ -156,6 +184,26 @@ size_t pmm_free_page(vm_page_t *page) __NONNULL((1));
  */
 size_t pmm_alloc_contiguous(uint count, uint8_t align_log2, paddr_t *pa, struct list_node *list);
 
+/* NUMA
+ * Arenas are tagged with the node their memory is attached to and cpus with the
+ * node they sit on. The allocation routines above prefer arenas on the node of
+ * the calling cpu, the _node variants below on the passed node, and fall back
+ * to the other nodes when it runs out. PMM_NUMA_NODE_ANY walks the arenas in
+ * priority order only.
+ */
+#ifndef PMM_MAX_NUMA_NODES
+#define PMM_MAX_NUMA_NODES 8
+#endif
+#define PMM_NUMA_NODE_ANY (~0U)
+
+void pmm_set_cpu_numa_node(uint cpu, uint node);
+uint pmm_cpu_numa_node(uint cpu);
+
+size_t pmm_alloc_pages_node(uint count, struct list_node *list, uint node) __NONNULL((2));
+vm_page_t *pmm_alloc_page_node(uint node);
+size_t pmm_alloc_contiguous_node(uint count, uint8_t align_log2, paddr_t *pa,
+                                 struct list_node *list, uint node);
+
 /* Allocate a run of pages out of the kernel area and return the pointer in kernel space.
  * If the optional list is passed, append the allocate page structures to the tail of the list.
  */
@@ -166,6 +214,17 @@ static inline void *pmm_alloc_kpage(void) { return pmm_alloc_kpages(1, NULL); }
 
 size_t pmm_free_kpages(void *ptr, uint count);
 
+/* Caches built on top of the pmm can register a reclaimer to give pages back
+ * when an allocation is about to fail. reclaim() returns the number of pages
+ * freed and must not allocate.
+ */
+typedef struct pmm_reclaimer {
+    struct list_node node;
+    size_t (*reclaim)(struct pmm_reclaimer *reclaimer);
+} pmm_reclaimer_t;
+
+void pmm_add_reclaimer(pmm_reclaimer_t *reclaimer);
+
 /* physical to virtual */
 void *paddr_to_kvaddr(paddr_t pa);
 
@@ -181,6 +240,9 @@ paddr_t vm_page_to_paddr(const vm_page_t *page);
 /* paddr to vm_page_t */
 vm_page_t *paddr_to_vm_page(paddr_t addr);
 
+/* kernel virtual address in a kmap arena to vm_page_t, without walking the page tables */
+vm_page_t *kvaddr_to_vm_page(const void *va);
+
 /* virtual allocator */
 typedef struct vmm_aspace {
     struct list_node node;
@@ -208,6 +270,10 @@ typedef struct vmm_region {
     vaddr_t base;
     size_t  size;
 
+    /* number of ARCH_MMU_LARGE_PAGE_SHIFT sized chunks that are physically
+     * contiguous and aligned, which the arch maps with block descriptors */
+    size_t  large_page_count;
+
     struct list_node page_list;
 } vmm_region_t;
 
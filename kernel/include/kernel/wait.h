@@ -49,6 +49,13 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
  */
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 
+/*
+ * same as wait_queue_block() but gives up at an absolute time on the
+ * current_time_ns() clock. INFINITE_TIME_NS waits forever, a deadline
+ * already in the past immediately returns ERR_TIMED_OUT.
+ */
+status_t wait_queue_block_deadline(wait_queue_t *, lk_time_ns_t deadline);
+
 /*
  * release one or more threads from the wait queue.
  * reschedule = should the system reschedule if any is released.
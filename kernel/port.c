@@ -20,6 +20,7 @@
 #include <lk/err.h>
 #include <lk/list.h>
 #include <lk/pow2.h>
+#include <lib/object_cache.h>
 #include <malloc.h>
 #include <string.h>
 
@@ -76,11 +77,16 @@ typedef struct {
 
 static struct list_node write_port_list;
 
+// circular buffers come out of one cache per size.
+static object_cache_t buf_cache;
+static object_cache_t big_buf_cache;
+
+#define PORT_BUF_OBJECT_SIZE(count) \
+    (sizeof(port_buf_t) + (((count) - 1) * sizeof(port_packet_t)))
 
 static port_buf_t *make_buf(bool big) {
     uint pk_count = big ? PORT_BUFF_SIZE_BIG : PORT_BUFF_SIZE;
-    uint size = sizeof(port_buf_t) + ((pk_count - 1) * sizeof(port_packet_t));
-    port_buf_t *buf = (port_buf_t *) malloc(size);
+    port_buf_t *buf = object_cache_alloc(big ? &big_buf_cache : &buf_cache);
     if (!buf)
         return NULL;
     buf->log2 = log2_uint(pk_count);
@@ -89,6 +95,13 @@ static port_buf_t *make_buf(bool big) {
     return buf;
 }
 
+static void free_buf(port_buf_t *buf) {
+    if (!buf)
+        return;
+    bool big = valpow2(buf->log2) == PORT_BUFF_SIZE_BIG;
+    object_cache_free(big ? &big_buf_cache : &buf_cache, buf);
+}
+
 static inline bool buf_is_empty(port_buf_t *buf) {
     return buf->avail == valpow2(buf->log2);
 }
@@ -117,6 +130,11 @@ static status_t buf_read(port_buf_t *buf, port_result_t *pr) {
 // must be called before any use of ports.
 void port_init(void) {
     list_initialize(&write_port_list);
+
+    object_cache_init(&buf_cache, "port buf", PORT_BUF_OBJECT_SIZE(PORT_BUFF_SIZE),
+                      __alignof(port_buf_t), NULL, NULL, NULL);
+    object_cache_init(&big_buf_cache, "port big buf", PORT_BUF_OBJECT_SIZE(PORT_BUFF_SIZE_BIG),
+                      __alignof(port_buf_t), NULL, NULL, NULL);
 }
 
 status_t port_create(const char *name, port_mode_t mode, port_t *port) {
@@ -235,8 +253,7 @@ status_t port_open(const char *name, void *ctx, port_t *port) {
     }
     THREAD_UNLOCK(state);
 
-    if (buf)
-        free(buf);
+    free_buf(buf);
 
     if (rc == NO_ERROR) {
         *port = (void *)rp;
@@ -501,7 +518,7 @@ status_t port_destroy(port_t port) {
     wp->magic = 0;
     THREAD_UNLOCK(state);
 
-    free(buf);
+    free_buf(buf);
     free(wp);
     return NO_ERROR;
 }
@@ -561,7 +578,7 @@ status_t port_close(port_t port) {
 
     THREAD_UNLOCK(state);
 
-    free(buf);
+    free_buf(buf);
     free(port);
     return NO_ERROR;
 }
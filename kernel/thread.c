@@ -49,12 +49,17 @@ static struct list_node thread_list;
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues, one per cpu. all of them are protected by thread_lock */
+struct run_queue {
+    struct list_node list[NUM_PRIORITIES];
+    uint32_t bitmap;
+    uint count; /* number of ready threads queued across all priorities */
+};
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -75,43 +80,89 @@ static timer_t preempt_timer[SMP_MAX_CPUS];
 #endif
 
 /* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t) {
+static void insert_in_run_queue_head(uint cpu, thread_t *t) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    struct run_queue *rq = &run_queue[cpu];
+    list_add_head(&rq->list[t->priority], &t->queue_node);
+    rq->bitmap |= (1<<t->priority);
+    rq->count++;
 }
 
-static void insert_in_run_queue_tail(thread_t *t) {
+static void insert_in_run_queue_tail(uint cpu, thread_t *t) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    struct run_queue *rq = &run_queue[cpu];
+    list_add_tail(&rq->list[t->priority], &t->queue_node);
+    rq->bitmap |= (1<<t->priority);
+    rq->count++;
 }
 
-static void wakeup_cpu_for_thread(thread_t *t)
-{
-    /* Wake up the core to which this thread is pinned
-     * or wake up all if thread is unpinned */
+#if WITH_SMP
+/* a cpu's load is the number of threads it has queued plus the one it runs */
+static uint cpu_load(uint cpu) {
+    return run_queue[cpu].count + (mp_is_cpu_idle(cpu) ? 0 : 1);
+}
+#endif
+
+/* pick the run queue a thread that just became ready should be placed on */
+static uint select_cpu_for_thread(thread_t *t) {
+#if WITH_SMP
     int pinned_cpu = thread_pinned_cpu(t);
-    if (pinned_cpu < 0)
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-    else
-        mp_reschedule(1U << pinned_cpu, 0);
+    if (pinned_cpu >= 0)
+        return pinned_cpu;
+
+    /* start with the cpu the thread last ran on, since its cache may still be
+     * warm, and move it only if another cpu is strictly less loaded */
+    uint best_cpu = arch_curr_cpu_num();
+    if (t->last_cpu >= 0 && mp_is_cpu_active(t->last_cpu))
+        best_cpu = t->last_cpu;
+    uint best_load = cpu_load(best_cpu);
+
+    /* cpus running real time threads do not get kicked, avoid them */
+    mp_cpu_mask_t candidates = mp.active_cpus & ~mp_get_realtime_mask();
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS && best_load > 0; cpu++) {
+        if ((candidates & (1U << cpu)) == 0)
+            continue;
+
+        uint load = cpu_load(cpu);
+        if (load < best_load) {
+            best_cpu = cpu;
+            best_load = load;
+        }
+    }
+
+    return best_cpu;
+#else
+    return 0;
+#endif
+}
+
+/* queue a thread that just became ready and kick the cpu it was placed on */
+static void wakeup_cpu_for_thread(thread_t *t) {
+    uint cpu = select_cpu_for_thread(t);
+
+    insert_in_run_queue_head(cpu, t);
+
+    /* the local cpu picks it up at its next reschedule */
+    mp_reschedule(1U << cpu, 0);
 }
 
 static void init_thread_struct(thread_t *t, const char *name) {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
     thread_set_pinned_cpu(t, -1);
+    thread_set_last_cpu(t, -1);
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -280,13 +331,11 @@ status_t thread_resume(thread_t *t) {
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        wakeup_cpu_for_thread(t);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
     }
 
-    wakeup_cpu_for_thread(t);
-
     THREAD_UNLOCK(state);
 
     if (resched)
@@ -427,23 +476,25 @@ static void idle_thread_routine(void) {
         arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu) {
+/* remove the highest priority thread from rq that is allowed to run on cpu */
+static thread_t *run_queue_remove_top(struct run_queue *rq, int cpu) {
     thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    uint32_t local_run_queue_bitmap = rq->bitmap;
 
     while (local_run_queue_bitmap) {
         /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+        uint next_queue = sizeof(rq->bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
+        list_for_every_entry(&rq->list[next_queue], newthread, thread_t, queue_node) {
 #if WITH_SMP
             if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
 #endif
             {
                 list_delete(&newthread->queue_node);
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+                if (list_is_empty(&rq->list[next_queue]))
+                    rq->bitmap &= ~(1<<next_queue);
+                rq->count--;
 
                 return newthread;
             }
@@ -451,6 +502,51 @@ static thread_t *get_top_thread(int cpu) {
 
         local_run_queue_bitmap &= ~(1<<next_queue);
     }
+
+    return NULL;
+}
+
+#if WITH_SMP
+/* take work from the sibling with the most queued threads */
+static thread_t *steal_thread(int cpu) {
+    mp_cpu_mask_t tried = 1U << cpu;
+
+    for (;;) {
+        int victim = -1;
+        uint victim_count = 0;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if ((tried & (1U << i)) == 0 && run_queue[i].count > victim_count) {
+                victim = i;
+                victim_count = run_queue[i].count;
+            }
+        }
+        if (victim < 0)
+            return NULL;
+
+        thread_t *newthread = run_queue_remove_top(&run_queue[victim], cpu);
+        if (newthread) {
+            THREAD_STATS_INC(steals);
+            return newthread;
+        }
+
+        /* everything queued there is pinned elsewhere */
+        tried |= 1U << victim;
+    }
+}
+#endif
+
+static thread_t *get_top_thread(int cpu) {
+    thread_t *newthread = run_queue_remove_top(&run_queue[cpu], cpu);
+    if (newthread)
+        return newthread;
+
+#if WITH_SMP
+    /* nothing queued locally, see if a sibling has work to spare */
+    newthread = steal_thread(cpu);
+    if (newthread)
+        return newthread;
+#endif
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
@@ -497,6 +593,7 @@ void thread_resched(void) {
     /* mark the cpu ownership of the threads */
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
+    thread_set_last_cpu(newthread, cpu);
 
 #if WITH_SMP
     if (thread_is_idle(newthread)) {
@@ -616,7 +713,7 @@ void thread_yield(void) {
     current_thread->state = THREAD_READY;
     current_thread->remaining_quantum = 0;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-        insert_in_run_queue_tail(current_thread);
+        insert_in_run_queue_tail(arch_curr_cpu_num(), current_thread);
     }
     thread_resched();
 
@@ -657,9 +754,9 @@ void thread_preempt(void) {
     current_thread->state = THREAD_READY;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
         if (current_thread->remaining_quantum > 0)
-            insert_in_run_queue_head(current_thread);
+            insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
         else
-            insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+            insert_in_run_queue_tail(arch_curr_cpu_num(), current_thread); /* if we're out of quantum, go to the tail of the queue */
     }
     thread_resched();
 
@@ -695,7 +792,6 @@ void thread_unblock(thread_t *t, bool resched) {
     DEBUG_ASSERT(!thread_is_idle(t));
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
     wakeup_cpu_for_thread(t);
 
     if (resched)
@@ -726,7 +822,7 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     THREAD_LOCK(state);
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
+    wakeup_cpu_for_thread(t);
 
     THREAD_UNLOCK(state);
 
@@ -744,6 +840,19 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
  * be placed at the head of the run queue.
  */
 void thread_sleep(lk_time_t delay) {
+    if (delay == 0)
+        delay = 1;
+    thread_sleep_ns((lk_time_ns_t)delay * 1000000);
+}
+
+/**
+ * @brief  Put thread to sleep; delay specified in ns
+ *
+ * Same as thread_sleep() but with the resolution of the platform timer.
+ * The wakeup may be deferred by up to TIMER_DEFAULT_SLACK_NS so that it
+ * shares a timer interrupt with other sleepers.
+ */
+void thread_sleep_ns(lk_time_ns_t delay) {
     timer_t timer;
 
     thread_t *current_thread = get_current_thread();
@@ -755,7 +864,7 @@ void thread_sleep(lk_time_t delay) {
     timer_initialize(&timer);
 
     THREAD_LOCK(state);
-    timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
+    timer_set_oneshot_ns(&timer, current_time_ns() + delay, thread_sleep_handler, (void *)current_thread);
     current_thread->state = THREAD_SLEEPING;
     thread_resched();
     THREAD_UNLOCK(state);
@@ -772,8 +881,10 @@ void thread_init_early(void) {
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queue[cpu].list[i]);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -831,7 +942,7 @@ void thread_set_priority(int priority) {
     current_thread->priority = priority;
 
     current_thread->state = THREAD_READY;
-    insert_in_run_queue_head(current_thread);
+    insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
     thread_resched();
 
     THREAD_UNLOCK(state);
@@ -1056,6 +1167,26 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
  * value specified when the queue was woken by wait_queue_wake_one().
  */
 status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
+    if (timeout == 0)
+        return ERR_TIMED_OUT;
+
+    if (timeout == INFINITE_TIME)
+        return wait_queue_block_deadline(wait, INFINITE_TIME_NS);
+
+    return wait_queue_block_deadline(wait, current_time_ns() + (lk_time_ns_t)timeout * 1000000);
+}
+
+/**
+ * @brief  Block until a wait queue is notified or a deadline passes.
+ *
+ * @param  wait      The wait queue to enter
+ * @param  deadline  Absolute time, in ns on the current_time_ns() clock, at
+ *                   which to give up, or INFINITE_TIME_NS
+ *
+ * @return ERR_TIMED_OUT if the deadline passed, else returns the return
+ * value specified when the queue was woken by wait_queue_wake_one().
+ */
+status_t wait_queue_block_deadline(wait_queue_t *wait, lk_time_ns_t deadline) {
     timer_t timer;
 
     thread_t *current_thread = get_current_thread();
@@ -1065,7 +1196,7 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    if (timeout == 0)
+    if (deadline != INFINITE_TIME_NS && deadline <= current_time_ns())
         return ERR_TIMED_OUT;
 
     list_add_tail(&wait->list, &current_thread->queue_node);
@@ -1074,16 +1205,16 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
     current_thread->blocking_wait_queue = wait;
     current_thread->wait_queue_block_ret = NO_ERROR;
 
-    /* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
-    if (timeout != INFINITE_TIME) {
+    /* if the deadline is finite, set a callback to yank us out of the queue */
+    if (deadline != INFINITE_TIME_NS) {
         timer_initialize(&timer);
-        timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
+        timer_set_oneshot_ns(&timer, deadline, wait_queue_timeout_handler, (void *)current_thread);
     }
 
     thread_resched();
 
     /* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
-    if (timeout != INFINITE_TIME) {
+    if (deadline != INFINITE_TIME_NS) {
         timer_cancel(&timer);
     }
 
@@ -1128,10 +1259,17 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
          */
         if (reschedule) {
             current_thread->state = THREAD_READY;
-            insert_in_run_queue_head(current_thread);
+            insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
+        }
+
+        /* run the woken thread right here, ahead of the current one, unless
+         * it is pinned somewhere else and that cpu has to be kicked */
+        int pinned_cpu = thread_pinned_cpu(t);
+        if (reschedule && (pinned_cpu < 0 || (uint)pinned_cpu == arch_curr_cpu_num())) {
+            insert_in_run_queue_head(arch_curr_cpu_num(), t);
+        } else {
+            wakeup_cpu_for_thread(t);
         }
-        insert_in_run_queue_head(t);
-        wakeup_cpu_for_thread(t);
         if (reschedule) {
             thread_resched();
         }
@@ -1174,24 +1312,19 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
          * before the current one, but the current one doesn't get unnecessarilly punished.
          */
         current_thread->state = THREAD_READY;
-        insert_in_run_queue_head(current_thread);
+        insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
     }
 
-    /* pop all the threads off the wait queue into the run queue */
+    /* pop all the threads off the wait queue into the run queues */
     while ((t = list_remove_head_type(&wait->list, thread_t, queue_node))) {
         wait->count--;
         DEBUG_ASSERT(t->state == THREAD_BLOCKED);
         t->state = THREAD_READY;
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
-        int pinned_cpu = thread_pinned_cpu(t);
-        if (pinned_cpu < 0) {
-            /* assumes MP_CPU_ALL_BUT_LOCAL is defined as all bits on */
-            cpu_mask = MP_CPU_ALL_BUT_LOCAL;
-        } else {
-            cpu_mask |= (1U << pinned_cpu);
-        }
-        insert_in_run_queue_head(t);
+        uint cpu = select_cpu_for_thread(t);
+        cpu_mask |= (1U << cpu);
+        insert_in_run_queue_head(cpu, t);
         ret++;
     }
 
@@ -1250,7 +1383,6 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
     wakeup_cpu_for_thread(t);
 
     return NO_ERROR;
@@ -17,6 +17,15 @@
  *
  * Timer callback functions are called in interrupt context.
  *
+ * Each cpu keeps its pending timers in a pairing heap ordered by deadline,
+ * so arming is O(1) and cancelling or expiring a timer is O(log n) amortized
+ * regardless of how many timers are outstanding.
+ *
+ * Deadlines are absolute times on the current_time_ns() clock. A timer can
+ * carry a slack window; when it is armed its deadline is pushed back, at
+ * most by the slack, onto the next pending expiry or a slack aligned
+ * boundary so that timers armed around the same time share one interrupt.
+ *
  * @{
  */
 #include <kernel/timer.h>
@@ -29,6 +38,7 @@
 #include <lk/list.h>
 #include <lk/trace.h>
 #include <platform.h>
+#include <platform/time.h>
 #include <platform/timer.h>
 
 #define LOCAL_TRACE 0
@@ -36,13 +46,17 @@
 spin_lock_t timer_lock;
 
 struct timer_state {
-    struct list_node timer_queue;
+    timer_t *timer_queue; /* root of the heap, the earliest deadline */
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
 
 static enum handler_return timer_tick(void *arg, lk_time_t now);
 
+static inline lk_time_ns_t ms_to_ns(lk_time_t ms) {
+    return (lk_time_ns_t)ms * 1000000;
+}
+
 /**
  * @brief  Initialize a timer object
  */
@@ -50,54 +64,142 @@ void timer_initialize(timer_t *timer) {
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+static bool timer_is_pending(timer_t *timer) {
+    return timer->queue_cpu >= 0 || list_in_list(&timer->node);
+}
+
+/* link two sibling-less heaps together, returning the new root */
+static timer_t *timer_heap_meld(timer_t *a, timer_t *b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (b->scheduled_time < a->scheduled_time) {
+        timer_t *temp = a;
+        a = b;
+        b = temp;
+    }
+
+    /* b becomes the first child of a */
+    b->heap_prev = a;
+    b->heap_next = a->heap_child;
+    if (a->heap_child)
+        a->heap_child->heap_prev = b;
+    a->heap_child = b;
+
+    return a;
+}
+
+/* combine a list of sibling heaps into one using the standard two pass merge */
+static timer_t *timer_heap_merge_pairs(timer_t *first) {
+    timer_t *pairs = NULL;
+
+    /* meld siblings pairwise from the left, stacking the results */
+    while (first) {
+        timer_t *a = first;
+        timer_t *b = a->heap_next;
+        first = b ? b->heap_next : NULL;
+
+        a->heap_next = a->heap_prev = NULL;
+        if (b)
+            b->heap_next = b->heap_prev = NULL;
+
+        timer_t *melded = timer_heap_meld(a, b);
+        melded->heap_next = pairs;
+        pairs = melded;
+    }
+
+    /* then meld the stacked pairs back into a single heap */
+    timer_t *root = NULL;
+    while (pairs) {
+        timer_t *next = pairs->heap_next;
+        pairs->heap_next = NULL;
+        root = timer_heap_meld(root, pairs);
+        pairs = next;
+    }
+
+    return root;
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t *timer) {
-    timer_t *entry;
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(!timer_is_pending(timer));
+
+    LTRACEF("timer %p, cpu %u, scheduled %llu, periodic %llu\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+
+    timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+    timer->queue_cpu = cpu;
+    timers[cpu].timer_queue = timer_heap_meld(timers[cpu].timer_queue, timer);
+}
 
+static void remove_timer_from_queue(timer_t *timer) {
     DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(timer->queue_cpu >= 0 && timer->queue_cpu < SMP_MAX_CPUS);
 
-    LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+    struct timer_state *ts = &timers[timer->queue_cpu];
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
-            return;
-        }
+    if (ts->timer_queue == timer) {
+        ts->timer_queue = timer_heap_merge_pairs(timer->heap_child);
+    } else {
+        /* unhook it from its parent or left sibling and merge its subtree back in */
+        if (timer->heap_prev->heap_child == timer)
+            timer->heap_prev->heap_child = timer->heap_next;
+        else
+            timer->heap_prev->heap_next = timer->heap_next;
+        if (timer->heap_next)
+            timer->heap_next->heap_prev = timer->heap_prev;
+
+        ts->timer_queue = timer_heap_meld(ts->timer_queue, timer_heap_merge_pairs(timer->heap_child));
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+    timer->queue_cpu = -1;
 }
 
-static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg) {
-    lk_time_t now;
+/* pick the expiry inside [deadline, deadline + slack] most likely to be shared */
+static lk_time_ns_t timer_coalesce(uint cpu, lk_time_ns_t deadline, lk_time_ns_t slack) {
+    if (slack == 0 || deadline > INFINITE_TIME_NS - slack)
+        return deadline;
 
-    LTRACEF("timer %p, delay %u, period %u, callback %p, arg %p\n", timer, delay, period, callback, arg);
+    /* ride along with the next pending expiry if it is inside the window */
+    timer_t *head = timers[cpu].timer_queue;
+    if (head && head->scheduled_time >= deadline && head->scheduled_time - deadline <= slack)
+        return head->scheduled_time;
+
+    /* otherwise round up to a multiple of the slack, timers with the same
+     * slack armed close together end up on the same boundary */
+    return ((deadline + slack - 1) / slack) * slack;
+}
+
+static void timer_set(timer_t *timer, lk_time_ns_t deadline, lk_time_ns_t period, timer_callback callback, void *arg) {
+    LTRACEF("timer %p, deadline %llu, period %llu, callback %p, arg %p\n", timer, deadline, period, callback, arg);
 
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
-    if (list_in_list(&timer->node)) {
+    if (timer_is_pending(timer)) {
         panic("timer %p already in list\n", timer);
     }
 
-    now = current_time();
-    timer->scheduled_time = now + delay;
     timer->periodic_time = period;
     timer->callback = callback;
     timer->arg = arg;
 
-    LTRACEF("scheduled time %u\n", timer->scheduled_time);
-
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
 
     uint cpu = arch_curr_cpu_num();
+    timer->scheduled_time = timer_coalesce(cpu, deadline, timer->slack);
+
+    LTRACEF("scheduled time %llu\n", timer->scheduled_time);
+
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
+    if (timers[cpu].timer_queue == timer) {
         /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
+        LTRACEF("setting new timer for %llu ns\n", timer->scheduled_time);
+        platform_set_oneshot_timer_ns(timer_tick, NULL, timer->scheduled_time);
     }
 #endif
 
@@ -121,7 +223,20 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
 void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback, void *arg) {
     if (delay == 0)
         delay = 1;
-    timer_set(timer, delay, 0, callback, arg);
+    timer_set(timer, current_time_ns() + ms_to_ns(delay), 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once at an absolute time
+ *
+ * @param  timer The timer to use
+ * @param  deadline The time, in ns on the current_time_ns() clock, at which the
+ *         timer is executed. A deadline in the past fires as soon as possible.
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_ns(timer_t *timer, lk_time_ns_t deadline, timer_callback callback, void *arg) {
+    timer_set(timer, deadline, 0, callback, arg);
 }
 
 /**
@@ -141,7 +256,27 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
 void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callback, void *arg) {
     if (period == 0)
         period = 1;
-    timer_set(timer, period, period, callback, arg);
+    timer_set_periodic_ns(timer, ms_to_ns(period), callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes repeatedly with a period in ns
+ */
+void timer_set_periodic_ns(timer_t *timer, lk_time_ns_t period, timer_callback callback, void *arg) {
+    if (period == 0)
+        period = 1;
+    timer_set(timer, current_time_ns() + period, period, callback, arg);
+}
+
+/**
+ * @brief  Set how late, in ns, the timer may fire to share an interrupt
+ *
+ * Takes effect the next time the timer is armed.
+ */
+void timer_set_slack(timer_t *timer, lk_time_ns_t slack) {
+    DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+
+    timer->slack = slack;
 }
 
 /**
@@ -156,11 +291,13 @@ void timer_cancel(timer_t *timer) {
 #if PLATFORM_HAS_DYNAMIC_TIMER
     uint cpu = arch_curr_cpu_num();
 
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    timer_t *oldhead = timers[cpu].timer_queue;
 #endif
 
-    if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+    if (timer->queue_cpu >= 0)
+        remove_timer_from_queue(timer);
+    else if (list_in_list(&timer->node))
+        list_delete(&timer->node); /* expired, but its callback has not run yet */
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -171,21 +308,13 @@ void timer_cancel(timer_t *timer) {
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    timer_t *newhead = timers[cpu].timer_queue;
     if (newhead == NULL) {
         LTRACEF("clearing old hw timer, nothing in the queue\n");
         platform_stop_timer();
     } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
+        LTRACEF("setting new timer to %llu ns\n", newhead->scheduled_time);
+        platform_set_oneshot_timer_ns(timer_tick, NULL, newhead->scheduled_time);
     }
 #endif
 
@@ -203,66 +332,77 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 //  KEVLOG_TIMER_TICK(); // enable only if necessary
 
     uint cpu = arch_curr_cpu_num();
+    lk_time_ns_t now_ns = current_time_ns();
 
-    LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
+    LTRACEF("cpu %u now %u (%llu ns), sp %p\n", cpu, now, now_ns, __GET_FRAME());
 
     spin_lock(&timer_lock);
 
     for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
+        /* pull every timer that is due off the queue in one go */
+        struct list_node expired = LIST_INITIAL_VALUE(expired);
+        for (;;) {
+            timer = timers[cpu].timer_queue;
+            if (likely(timer == 0))
+                break;
+            LTRACEF("next item on timer queue %p at %llu now %llu (%p, arg %p)\n", timer, timer->scheduled_time, now_ns, timer->callback, timer->arg);
+            if (likely(now_ns < timer->scheduled_time))
+                break;
+
+            DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+            remove_timer_from_queue(timer);
+            list_add_tail(&expired, &timer->node);
+        }
+
+        if (list_is_empty(&expired))
             break;
 
-        /* process it */
-        LTRACEF("timer %p\n", timer);
-        DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+        /* a callback may cancel one of the timers still on the expired list,
+         * so pop them one at a time with the lock held */
+        while ((timer = list_remove_head_type(&expired, timer_t, node))) {
+            /* process it */
+            LTRACEF("timer %p\n", timer);
 
-        /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+            /* we pulled it off the list, release the list lock to handle it */
+            spin_unlock(&timer_lock);
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+            LTRACEF("dequeued timer %p, scheduled %llu periodic %llu\n", timer, timer->scheduled_time, timer->periodic_time);
 
-        THREAD_STATS_INC(timers);
+            THREAD_STATS_INC(timers);
 
-        bool periodic = timer->periodic_time > 0;
+            bool periodic = timer->periodic_time > 0;
 
-        LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
-        KEVLOG_TIMER_CALL(timer->callback, timer->arg);
-        if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
-            ret = INT_RESCHEDULE;
+            LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+            KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+            if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+                ret = INT_RESCHEDULE;
 
-        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
+            /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+            spin_lock(&timer_lock);
 
-        /* if it was a periodic timer and it hasn't been requeued
-         * by the callback put it back in the list
-         */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time += timer->periodic_time;
-            if (unlikely(TIME_LT(timer->scheduled_time, now))) {
-                timer->scheduled_time = now + timer->periodic_time;
+            /* if it was a periodic timer and it hasn't been requeued
+             * by the callback put it back in the list
+             */
+            if (periodic && !timer_is_pending(timer) && timer->periodic_time > 0) {
+                LTRACEF("periodic timer, period %llu\n", timer->periodic_time);
+                timer->scheduled_time += timer->periodic_time;
+                if (unlikely(timer->scheduled_time < now_ns)) {
+                    timer->scheduled_time = now_ns + timer->periodic_time;
+                }
+                insert_timer_in_queue(cpu, timer);
             }
-            insert_timer_in_queue(cpu, timer);
         }
     }
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    timer = timers[cpu].timer_queue;
     if (timer) {
         /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
+        DEBUG_ASSERT(timer->scheduled_time > now_ns);
 
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
+        LTRACEF("setting new timer for %llu ns for event %p\n", timer->scheduled_time, timer);
+        platform_set_oneshot_timer_ns(timer_tick, NULL, timer->scheduled_time);
     }
 
     /* we're done manipulating the timer queue */
@@ -283,7 +423,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 void timer_init(void) {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        timers[i].timer_queue = NULL;
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
@@ -8,9 +8,13 @@
 #include <kernel/vm.h>
 
 #include <assert.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
 #include <lk/console_cmd.h>
 #include <lk/err.h>
+#include <lk/init.h>
 #include <lk/list.h>
 #include <lk/pow2.h>
 #include <lk/trace.h>
@@ -24,6 +28,57 @@
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
+static void pcpu_cache_init(void);
+static size_t drain_page_caches(void);
+
+/* numa node of each cpu, and per node counts of pages handed out to requests
+ * preferring the node (hit) or another one (miss) */
+static uint cpu_numa_node[SMP_MAX_CPUS];
+static struct {
+    size_t hit;
+    size_t miss;
+} numa_stats[PMM_MAX_NUMA_NODES];
+
+static inline uint current_numa_node(void) {
+    return cpu_numa_node[arch_curr_cpu_num()];
+}
+
+/* the arenas on the preferred node go in the first pass, the rest in the second */
+static inline bool arena_in_pass(const pmm_arena_t *a, uint numa_node, uint pass) {
+    if (numa_node == PMM_NUMA_NODE_ANY)
+        return pass == 0;
+
+    return (a->numa_node == numa_node) == (pass == 0);
+}
+
+#define for_every_arena_by_node(a, numa_node, pass) \
+    for (pass = 0; pass < 2; pass++) \
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) \
+            if (arena_in_pass(a, numa_node, pass))
+
+static void numa_account(const pmm_arena_t *a, uint numa_node, size_t count) {
+    if (numa_node == PMM_NUMA_NODE_ANY || a->numa_node >= PMM_MAX_NUMA_NODES)
+        return;
+
+    if (a->numa_node == numa_node)
+        numa_stats[a->numa_node].hit += count;
+    else
+        numa_stats[a->numa_node].miss += count;
+}
+
+void pmm_set_cpu_numa_node(uint cpu, uint node) {
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+    DEBUG_ASSERT(node < PMM_MAX_NUMA_NODES);
+
+    cpu_numa_node[cpu] = node;
+}
+
+uint pmm_cpu_numa_node(uint cpu) {
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+    return cpu_numa_node[cpu];
+}
+
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
      ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
@@ -34,10 +89,168 @@ static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 #define ADDRESS_IN_ARENA(address, arena) \
     ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size - 1)
 
+#define PAGE_INDEX(page, arena) ((size_t)((page) - (arena)->page_array))
+
 static inline bool page_is_free(const vm_page_t *page) {
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+/* buddy allocator
+ *
+ * Each arena keeps its free pages in naturally aligned power of two blocks, one
+ * list per order. Blocks are aligned on the physical page frame number rather
+ * than the offset into the arena, so an order n block is always aligned to
+ * PAGE_SIZE << n and aligned allocations fall directly out of the order.
+ * Only the first page of a free block is on a list, it carries
+ * VM_PAGE_FLAG_BUDDY and the order of the block.
+ */
+static inline size_t arena_pfn(const pmm_arena_t *a, size_t index) {
+    return a->base / PAGE_SIZE + index;
+}
+
+static void buddy_add_block(pmm_arena_t *a, size_t index, uint order) {
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(order < PMM_MAX_ORDER);
+    DEBUG_ASSERT(IS_ALIGNED(arena_pfn(a, index), 1UL << order));
+    DEBUG_ASSERT(index + (1UL << order) <= a->size / PAGE_SIZE);
+
+    page->flags |= VM_PAGE_FLAG_BUDDY;
+    page->order = order;
+    list_add_head(&a->free_list[order], &page->node);
+}
+
+static void buddy_remove_block(vm_page_t *page) {
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_BUDDY);
+
+    list_delete(&page->node);
+    page->flags &= ~VM_PAGE_FLAG_BUDDY;
+}
+
+/* return a free block to the arena, merging it with its buddy for as long as
+ * the buddy is free as a whole.
+ */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order) {
+    size_t page_count = a->size / PAGE_SIZE;
+
+    a->free_count += 1UL << order;
+
+    while (order < PMM_MAX_ORDER - 1) {
+        size_t size = 1UL << order;
+        size_t buddy;
+
+        if (arena_pfn(a, index) & size) {
+            if (index < size)
+                break;
+            buddy = index - size;
+        } else {
+            buddy = index + size;
+            if (buddy >= page_count)
+                break;
+        }
+
+        vm_page_t *b = &a->page_array[buddy];
+        if (!(b->flags & VM_PAGE_FLAG_BUDDY) || b->order != order)
+            break;
+
+        buddy_remove_block(b);
+        index = MIN(index, buddy);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* free a run of pages, using the largest aligned blocks that fit */
+static void buddy_free_run(pmm_arena_t *a, size_t index, size_t count) {
+    while (count > 0) {
+        size_t pfn = arena_pfn(a, index);
+        uint order = 0;
+        while (order < PMM_MAX_ORDER - 1 &&
+                IS_ALIGNED(pfn, 2UL << order) && (2UL << order) <= count) {
+            order++;
+        }
+
+        for (size_t i = 0; i < (1UL << order); i++) {
+            a->page_array[index + i].flags &= ~VM_PAGE_FLAG_NONFREE;
+        }
+        buddy_free_block(a, index, order);
+
+        index += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/* allocate a block of 1 << order pages, splitting a larger one if needed */
+static vm_page_t *buddy_alloc_block(pmm_arena_t *a, uint order) {
+    for (uint o = order; o < PMM_MAX_ORDER; o++) {
+        vm_page_t *page = list_peek_head_type(&a->free_list[o], vm_page_t, node);
+        if (!page)
+            continue;
+
+        buddy_remove_block(page);
+
+        /* hand the upper halves back until we're down to the right size */
+        size_t index = PAGE_INDEX(page, a);
+        while (o > order) {
+            o--;
+            buddy_add_block(a, index + (1UL << o), o);
+        }
+
+        for (size_t i = 0; i < (1UL << order); i++) {
+            page[i].flags |= VM_PAGE_FLAG_NONFREE;
+        }
+        a->free_count -= 1UL << order;
+
+        return page;
+    }
+
+    return NULL;
+}
+
+/* find the head of the free block that contains the free page at index */
+static vm_page_t *buddy_find_block(pmm_arena_t *a, size_t index) {
+    size_t pfn = arena_pfn(a, index);
+
+    for (uint order = 0; order < PMM_MAX_ORDER; order++) {
+        size_t offset = pfn & ((1UL << order) - 1);
+        if (offset > index)
+            break;
+
+        vm_page_t *head = &a->page_array[index - offset];
+        if ((head->flags & VM_PAGE_FLAG_BUDDY) && head->order >= order)
+            return head;
+    }
+
+    return NULL;
+}
+
+/* carve a specific free page out of the block holding it */
+static void buddy_take_page(pmm_arena_t *a, size_t index) {
+    vm_page_t *head = buddy_find_block(a, index);
+    DEBUG_ASSERT(head);
+
+    size_t head_index = PAGE_INDEX(head, a);
+    uint order = head->order;
+
+    buddy_remove_block(head);
+
+    /* split the block, freeing the half that doesn't hold the page each time */
+    while (order > 0) {
+        order--;
+        size_t half = 1UL << order;
+        if (index < head_index + half) {
+            buddy_add_block(a, head_index + half, order);
+        } else {
+            buddy_add_block(a, head_index, order);
+            head_index += half;
+        }
+    }
+
+    a->page_array[index].flags |= VM_PAGE_FLAG_NONFREE;
+    a->free_count--;
+}
+
 paddr_t vm_page_to_paddr(const vm_page_t *page) {
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -59,6 +272,18 @@ vm_page_t *paddr_to_vm_page(paddr_t addr) {
     return NULL;
 }
 
+vm_page_t *kvaddr_to_vm_page(const void *va) {
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if ((a->flags & PMM_ARENA_FLAG_KMAP) && a->kvaddr &&
+                (vaddr_t)va - a->kvaddr < a->size) {
+            size_t index = ((vaddr_t)va - a->kvaddr) / PAGE_SIZE;
+            return &a->page_array[index];
+        }
+    }
+    return NULL;
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena) {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%zx\n", arena, arena->name, arena->base, arena->size);
 
@@ -66,6 +291,10 @@ status_t pmm_add_arena(pmm_arena_t *arena) {
     DEBUG_ASSERT(IS_PAGE_ALIGNED(arena->size));
     DEBUG_ASSERT(arena->size > 0);
 
+    /* a kmap arena is covered by one of the initial mappings */
+    if (arena->flags & PMM_ARENA_FLAG_KMAP)
+        arena->kvaddr = (vaddr_t)paddr_to_kvaddr(arena->base);
+
     /* walk the arena list and add arena based on priority order */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -79,10 +308,13 @@ status_t pmm_add_arena(pmm_arena_t *arena) {
     list_add_tail(&arena_list, &arena->node);
 
 done_add:
+    pcpu_cache_init();
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i < PMM_MAX_ORDER; i++) {
+        list_initialize(&arena->free_list[i]);
+    }
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -91,20 +323,18 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
-
-        arena->free_count++;
-    }
+    /* add them to the free lists */
+    buddy_free_run(arena, 0, page_count);
 
     return NO_ERROR;
 }
 
 size_t pmm_alloc_pages(uint count, struct list_node *list) {
-    LTRACEF("count %u\n", count);
+    return pmm_alloc_pages_node(count, list, current_numa_node());
+}
+
+size_t pmm_alloc_pages_node(uint count, struct list_node *list, uint numa_node) {
+    LTRACEF("count %u, node %u\n", count, numa_node);
 
     /* list must be initialized prior to calling this */
     DEBUG_ASSERT(list);
@@ -113,41 +343,41 @@ size_t pmm_alloc_pages(uint count, struct list_node *list) {
     if (count == 0)
         return 0;
 
+    bool drained = false;
+retry:
     mutex_acquire(&lock);
 
     /* walk the arenas in order, allocating as many pages as we can from each */
     pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+    uint pass;
+    for_every_arena_by_node(a, numa_node, pass) {
+        uint start = allocated;
         while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
+            vm_page_t *page = buddy_alloc_block(a, 0);
             if (!page)
-                goto done;
-
-            a->free_count--;
+                break;
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
             list_add_tail(list, &page->node);
 
             allocated++;
         }
+        numa_account(a, numa_node, allocated - start);
+
+        if (allocated == count)
+            goto done;
     }
 
 done:
     mutex_release(&lock);
-    return allocated;
-}
-
-vm_page_t *pmm_alloc_page(void) {
-    struct list_node list = LIST_INITIAL_VALUE(list);
 
-    size_t ret = pmm_alloc_pages(1, &list);
-    if (ret == 0) {
-        return NULL;
+    /* the rest may be sitting in the per cpu caches, pull them back and try again */
+    if (allocated < count && !drained) {
+        drained = true;
+        if (drain_page_caches() > 0)
+            goto retry;
     }
 
-    DEBUG_ASSERT(ret == 1);
-
-    return list_peek_head_type(&list, vm_page_t, node);
+    return allocated;
 }
 
 size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
@@ -161,6 +391,8 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
 
     address = ROUNDDOWN(address, PAGE_SIZE);
 
+    bool drained = false;
+retry:
     mutex_acquire(&lock);
 
     /* walk through the arenas, looking to see if the physical page belongs to it */
@@ -177,13 +409,9 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
+            buddy_take_page(a, index);
             list_add_tail(list, &page->node);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -193,6 +421,13 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
     }
 
     mutex_release(&lock);
+
+    if (allocated < count && !drained) {
+        drained = true;
+        if (drain_page_caches() > 0)
+            goto retry;
+    }
+
     return allocated;
 }
 
@@ -214,10 +449,9 @@ size_t pmm_free(struct list_node *list) {
         pmm_arena_t *a;
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
+                page->flags &= ~(VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_ZEROED);
 
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
+                buddy_free_block(a, PAGE_INDEX(page, a), 0);
                 count++;
                 break;
             }
@@ -228,15 +462,318 @@ size_t pmm_free(struct list_node *list) {
     return count;
 }
 
+/* per cpu page caches
+ *
+ * pmm_alloc_page() and pmm_free_page() go through a short list of pages per
+ * cpu so the common single page case stays off the arena mutex. Allocations
+ * and frees both use the head of the list, so the most recently freed and
+ * likely cache hot pages are reused first, while refills from the arena are
+ * added to and drains back to it are taken from the cold tail, in batches.
+ * Pages in a cache are still marked allocated as far as the arenas go.
+ *
+ * The lists are only touched with interrupts disabled, so both calls can be
+ * made with interrupts off as long as they don't have to go to the arena. In
+ * that case an empty cache fails the allocation and a full one is allowed to
+ * grow past its limit until the next free from thread context drains it.
+ */
+#ifndef PMM_PCPU_CACHE_BATCH
+#define PMM_PCPU_CACHE_BATCH 16
+#endif
+#define PMM_PCPU_CACHE_HIGH (PMM_PCPU_CACHE_BATCH * 4)
+
+static struct pmm_pcpu_cache {
+    spin_lock_t lock;
+    struct list_node pages;
+    size_t count;
+} pcpu_cache[SMP_MAX_CPUS];
+
+static void pcpu_cache_init(void) {
+    static bool inited;
+
+    if (inited)
+        return;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        spin_lock_init(&pcpu_cache[i].lock);
+        list_initialize(&pcpu_cache[i].pages);
+        pcpu_cache[i].count = 0;
+    }
+    inited = true;
+}
+
+/* disable interrupts and lock the cache of the cpu we end up on */
+static struct pmm_pcpu_cache *pcpu_cache_get(spin_lock_saved_state_t *state) {
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcpu_cache *cache = &pcpu_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+
+    return cache;
+}
+
+static void pcpu_cache_put(struct pmm_pcpu_cache *cache, spin_lock_saved_state_t state) {
+    spin_unlock(&cache->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* move up to count pages off the cold end of a locked cache */
+static void pcpu_cache_take_cold(struct pmm_pcpu_cache *cache, size_t count, struct list_node *list) {
+    while (count-- > 0) {
+        vm_page_t *page = list_remove_tail_type(&cache->pages, vm_page_t, node);
+        if (!page)
+            break;
+
+        cache->count--;
+        list_add_head(list, &page->node);
+    }
+}
+
+/* return every cached page on every cpu to the arenas */
+static size_t pcpu_cache_drain_all(void) {
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct pmm_pcpu_cache *cache = &pcpu_cache[i];
+        spin_lock_saved_state_t state;
+
+        spin_lock_irqsave(&cache->lock, state);
+        pcpu_cache_take_cold(cache, cache->count, &list);
+        spin_unlock_irqrestore(&cache->lock, state);
+    }
+
+    if (list_is_empty(&list))
+        return 0;
+
+    LTRACEF("draining %zu pages\n", list_length(&list));
+
+    return pmm_free(&list);
+}
+
+vm_page_t *pmm_alloc_page_node(uint numa_node) {
+    /* the per cpu caches are filled from the cpu's own node */
+    if (numa_node == PMM_NUMA_NODE_ANY || numa_node == current_numa_node())
+        return pmm_alloc_page();
+
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    if (pmm_alloc_pages_node(1, &list, numa_node) == 0)
+        return NULL;
+
+    return list_peek_head_type(&list, vm_page_t, node);
+}
+
+vm_page_t *pmm_alloc_page(void) {
+    bool ints_disabled = arch_ints_disabled();
+    spin_lock_saved_state_t state;
+
+    struct pmm_pcpu_cache *cache = pcpu_cache_get(&state);
+    vm_page_t *page = list_remove_head_type(&cache->pages, vm_page_t, node);
+    if (page)
+        cache->count--;
+    pcpu_cache_put(cache, state);
+
+    if (page || ints_disabled)
+        return page;
+
+    /* refill from the arenas, keeping one page for ourselves */
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    size_t count = pmm_alloc_pages(PMM_PCPU_CACHE_BATCH, &list);
+    if (count == 0)
+        return NULL;
+
+    page = list_remove_head_type(&list, vm_page_t, node);
+    count--;
+
+    cache = pcpu_cache_get(&state);
+    while (!list_is_empty(&list)) {
+        list_add_tail(&cache->pages, list_remove_head(&list));
+    }
+    cache->count += count;
+    pcpu_cache_put(cache, state);
+
+    return page;
+}
+
 size_t pmm_free_page(vm_page_t *page) {
-    struct list_node list;
-    list_initialize(&list);
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+    bool ints_disabled = arch_ints_disabled();
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    spin_lock_saved_state_t state;
+
+    struct pmm_pcpu_cache *cache = pcpu_cache_get(&state);
+    list_add_head(&cache->pages, &page->node);
+    cache->count++;
+    if (cache->count > PMM_PCPU_CACHE_HIGH && !ints_disabled)
+        pcpu_cache_take_cold(cache, cache->count - PMM_PCPU_CACHE_HIGH + PMM_PCPU_CACHE_BATCH, &list);
+    pcpu_cache_put(cache, state);
+
+    if (!list_is_empty(&list))
+        pmm_free(&list);
+
+    return 1;
+}
+
+/* pool of pre-zeroed pages
+ *
+ * A thread running just above idle priority keeps up to PMM_ZERO_POOL_TARGET
+ * zeroed pages around for pmm_alloc_page_etc(PMM_ALLOC_FLAG_ZERO), so page
+ * tables and other zero filled allocations don't pay for the memset on the
+ * allocation path. The thread is kicked whenever the pool drops below half
+ * full. Pool pages are marked VM_PAGE_FLAG_ZEROED and count as allocated.
+ */
+#ifndef PMM_ZERO_POOL_TARGET
+#define PMM_ZERO_POOL_TARGET 256
+#endif
+#define PMM_ZERO_POOL_LOW (PMM_ZERO_POOL_TARGET / 2)
+
+static spin_lock_t zero_pool_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node zero_pool = LIST_INITIAL_VALUE(zero_pool);
+static size_t zero_pool_count;
+static event_t zero_pool_event = EVENT_INITIAL_VALUE(zero_pool_event, true, EVENT_FLAG_AUTOUNSIGNAL);
+
+__WEAK void arch_zero_page(void *ptr) {
+    memset(ptr, 0, PAGE_SIZE);
+}
+
+/* zero a page through the kernel mapping, fails for pages outside the kmap arenas */
+static bool zero_page(vm_page_t *page) {
+    void *va = paddr_to_kvaddr(vm_page_to_paddr(page));
+    if (!va)
+        return false;
 
-    list_add_head(&list, &page->node);
+    arch_zero_page(va);
+    return true;
+}
+
+/* unlocked sum of the free pages in all arenas, good enough for a heuristic */
+static size_t arenas_free_count(void) {
+    size_t count = 0;
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        count += a->free_count;
+    }
+    return count;
+}
+
+static int zero_pool_thread(void *arg) {
+    for (;;) {
+        event_wait(&zero_pool_event);
+
+        /* leave the last pages in the arenas alone, otherwise an allocation
+         * falling short would drain the pool just for us to fill it again.
+         */
+        while (zero_pool_count < PMM_ZERO_POOL_TARGET &&
+                arenas_free_count() > PMM_ZERO_POOL_TARGET) {
+            /* take pages straight from the arenas, the per cpu caches hold the hot ones */
+            struct list_node list = LIST_INITIAL_VALUE(list);
+            if (pmm_alloc_pages(1, &list) == 0)
+                break;
+
+            vm_page_t *page = list_peek_head_type(&list, vm_page_t, node);
+            if (!zero_page(page)) {
+                pmm_free(&list);
+                break;
+            }
+
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&zero_pool_lock, state);
+            list_delete(&page->node);
+            page->flags |= VM_PAGE_FLAG_ZEROED;
+            list_add_head(&zero_pool, &page->node);
+            zero_pool_count++;
+            spin_unlock_irqrestore(&zero_pool_lock, state);
+        }
+    }
+
+    return 0;
+}
+
+static size_t zero_pool_drain(void) {
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&zero_pool_lock, state);
+    struct list_node *node;
+    while ((node = list_remove_head(&zero_pool))) {
+        list_add_tail(&list, node);
+    }
+    zero_pool_count = 0;
+    spin_unlock_irqrestore(&zero_pool_lock, state);
+
+    if (list_is_empty(&list))
+        return 0;
 
     return pmm_free(&list);
 }
 
+vm_page_t *pmm_alloc_page_etc(uint flags) {
+    if (!(flags & PMM_ALLOC_FLAG_ZERO))
+        return pmm_alloc_page();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&zero_pool_lock, state);
+    vm_page_t *page = list_remove_head_type(&zero_pool, vm_page_t, node);
+    if (page)
+        zero_pool_count--;
+    bool low = zero_pool_count < PMM_ZERO_POOL_LOW;
+    spin_unlock_irqrestore(&zero_pool_lock, state);
+
+    if (low)
+        event_signal(&zero_pool_event, false);
+
+    if (page) {
+        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_ZEROED);
+        page->flags &= ~VM_PAGE_FLAG_ZEROED;
+        return page;
+    }
+
+    /* the pool ran dry, zero one here */
+    page = pmm_alloc_page();
+    if (!page)
+        return NULL;
+
+    if (!zero_page(page)) {
+        pmm_free_page(page);
+        return NULL;
+    }
+
+    return page;
+}
+
+static void zero_pool_init(uint level) {
+    thread_t *t = thread_create("pmm zero", &zero_pool_thread, NULL, LOWEST_PRIORITY + 1, DEFAULT_STACK_SIZE);
+    thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK(pmm_zero_pool, &zero_pool_init, LK_INIT_LEVEL_THREADING);
+
+/* return pages held by the per cpu caches and the zero pool to the arenas */
+static struct list_node reclaimer_list = LIST_INITIAL_VALUE(reclaimer_list);
+static mutex_t reclaimer_lock = MUTEX_INITIAL_VALUE(reclaimer_lock);
+
+void pmm_add_reclaimer(pmm_reclaimer_t *reclaimer) {
+    mutex_acquire(&reclaimer_lock);
+    list_add_tail(&reclaimer_list, &reclaimer->node);
+    mutex_release(&reclaimer_lock);
+}
+
+static size_t run_reclaimers(void) {
+    size_t count = 0;
+
+    mutex_acquire(&reclaimer_lock);
+    pmm_reclaimer_t *r;
+    list_for_every_entry(&reclaimer_list, r, pmm_reclaimer_t, node) {
+        count += r->reclaim(r);
+    }
+    mutex_release(&reclaimer_lock);
+
+    return count;
+}
+
+static size_t drain_page_caches(void) {
+    return pcpu_cache_drain_all() + zero_pool_drain() + run_reclaimers();
+}
+
 /* physically allocate a run from arenas marked as KMAP */
 void *pmm_alloc_kpages(uint count, struct list_node *list) {
     LTRACEF("count %u\n", count);
@@ -264,6 +801,11 @@ size_t pmm_free_kpages(void *_ptr, uint count) {
 
     uint8_t *ptr = (uint8_t *)_ptr;
 
+    if (count == 1) {
+        vm_page_t *p = paddr_to_vm_page(vaddr_to_paddr(ptr));
+        return p ? pmm_free_page(p) : 0;
+    }
+
     struct list_node list;
     list_initialize(&list);
 
@@ -280,80 +822,124 @@ size_t pmm_free_kpages(void *_ptr, uint count) {
     return pmm_free(&list);
 }
 
+/* slow path for runs larger than the biggest buddy block: look for count free
+ * pages starting at an alignment boundary. Returns the index of the run or -1.
+ */
+static ssize_t arena_find_run(const pmm_arena_t *a, uint count, uint8_t alignment_log2) {
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < a->size / PAGE_SIZE) &&
+            ((start + count) <= a->size / PAGE_SIZE)) {
+        const vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        return start;
+    }
+
+    return -1;
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list) {
-    LTRACEF("count %u, align %u\n", count, alignment_log2);
+    return pmm_alloc_contiguous_node(count, alignment_log2, pa, list, current_numa_node());
+}
+
+size_t pmm_alloc_contiguous_node(uint count, uint8_t alignment_log2, paddr_t *pa,
+                                 struct list_node *list, uint numa_node) {
+    LTRACEF("count %u, align %u, node %u\n", count, alignment_log2, numa_node);
 
     if (count == 0)
         return 0;
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* the smallest block that holds the run at the requested alignment */
+    uint order = log2_uint(round_up_pow2_u32(count));
+    order = MAX(order, (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
+    bool drained = false;
+retry:
     mutex_acquire(&lock);
 
     pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+    uint pass;
+    for_every_arena_by_node(a, numa_node, pass) {
         // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        size_t start;
+        vm_page_t *p = NULL;
+        if (order < PMM_MAX_ORDER)
+            p = buddy_alloc_block(a, order);
+
+        if (p) {
+            /* give back whatever is past the end of the run */
+            start = PAGE_INDEX(p, a);
+            buddy_free_run(a, start + count, (1UL << order) - count);
+        } else if (order >= PMM_MAX_ORDER || count < (1UL << order)) {
+            /* too big for any block, or the rounded up block isn't there but
+             * a shorter run at the requested alignment still might be */
+            ssize_t run = arena_find_run(a, count, alignment_log2);
+            if (run < 0)
                 continue;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+            start = run;
+            for (size_t i = start; i < start + count; i++) {
+                buddy_take_page(a, i);
+            }
+        } else {
+            continue;
+        }
 
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
-
-                mutex_release(&lock);
-
-                return count;
+        LTRACEF("found run from pn %zu to %zu\n", start, start + count);
+        numa_account(a, numa_node, count);
+
+        if (list) {
+            for (size_t i = start; i < start + count; i++) {
+                list_add_tail(list, &a->page_array[i].node);
             }
         }
+
+        if (pa)
+            *pa = a->base + start * PAGE_SIZE;
+
+        mutex_release(&lock);
+
+        return count;
     }
 
     mutex_release(&lock);
 
+    if (!drained) {
+        drained = true;
+        if (drain_page_caches() > 0)
+            goto retry;
+    }
+
     LTRACEF("couldn't find run\n");
     return 0;
 }
@@ -362,11 +948,38 @@ static void dump_page(const vm_page_t *page) {
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
-    printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
-           arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
+static void dump_arena_fragmentation(pmm_arena_t *arena) {
+    size_t largest = 0;
+    size_t in_largest = 0;
+
+    printf("\tfree blocks by order:\n");
+    for (uint order = 0; order < PMM_MAX_ORDER; order++) {
+        size_t blocks = list_length(&arena->free_list[order]);
+        if (blocks == 0)
+            continue;
+
+        printf("\t\t%2u (%8zu bytes): %zu blocks, %zu pages\n",
+               order, (size_t)PAGE_SIZE << order, blocks, blocks << order);
+        largest = 1UL << order;
+        in_largest = blocks << order;
+    }
+
+    /* share of the free memory that can't be handed out as a block of the
+     * largest order currently available, 0 when it is all in the top order.
+     */
+    size_t frag = 0;
+    if (arena->free_count > 0)
+        frag = (arena->free_count - in_largest) * 100 / arena->free_count;
+    printf("\tlargest free block %zu pages, fragmentation %zu%%\n", largest, frag);
+}
+
+static void dump_arena(pmm_arena_t *arena, bool dump_pages) {
+    printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x node %u\n",
+           arena, arena->name, arena->base, arena->size, arena->priority, arena->flags,
+           arena->numa_node);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
+    dump_arena_fragmentation(arena);
 
     /* dump all of the pages */
     if (dump_pages) {
@@ -396,6 +1009,37 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
     }
 }
 
+static void dump_numa_nodes(void) {
+    mutex_acquire(&lock);
+    for (uint n = 0; n < PMM_MAX_NUMA_NODES; n++) {
+        size_t total = 0;
+        size_t free = 0;
+        uint arenas = 0;
+
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            if (a->numa_node == n) {
+                total += a->size / PAGE_SIZE;
+                free += a->free_count;
+                arenas++;
+            }
+        }
+
+        if (arenas == 0)
+            continue;
+
+        printf("node %u: %u arenas, %zu pages, %zu free, %zu used, %zu hit, %zu miss\n",
+               n, arenas, total, free, total - free, numa_stats[n].hit, numa_stats[n].miss);
+    }
+    mutex_release(&lock);
+
+    printf("cpu nodes:");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        printf(" %u", cpu_numa_node[i]);
+    }
+    printf("\n");
+}
+
 static int cmd_pmm(int argc, const console_cmd_args *argv) {
     if (argc < 2) {
 notenoughargs:
@@ -403,6 +1047,9 @@ notenoughargs:
 usage:
         printf("usage:\n");
         printf("%s arenas\n", argv[0].str);
+        printf("%s frag\n", argv[0].str);
+        printf("%s numa\n", argv[0].str);
+        printf("%s drain\n", argv[0].str);
         printf("%s alloc <count>\n", argv[0].str);
         printf("%s alloc_range <address> <count>\n", argv[0].str);
         printf("%s alloc_kpages <count>\n", argv[0].str);
@@ -419,6 +1066,26 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+    } else if (!strcmp(argv[1].str, "frag")) {
+        mutex_acquire(&lock);
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            printf("arena '%s': free_count %zu\n", a->name, a->free_count);
+            dump_arena_fragmentation(a);
+        }
+        mutex_release(&lock);
+
+        printf("per cpu caches:");
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            printf(" %zu", pcpu_cache[i].count);
+        }
+        printf(" pages\n");
+        printf("zero pool: %zu pages\n", zero_pool_count);
+    } else if (!strcmp(argv[1].str, "numa")) {
+        dump_numa_nodes();
+    } else if (!strcmp(argv[1].str, "drain")) {
+        size_t count = drain_page_caches();
+        printf("drained %zu pages from the per cpu caches, zero pool and reclaimers\n", count);
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
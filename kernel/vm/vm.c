@@ -23,6 +23,18 @@
 extern int _start;
 extern int _end;
 
+/* arenas outside of the initial mappings, given a kernel mapping once the vmm is up */
+#ifndef VM_MAX_HIGHMEM_ARENAS
+#define VM_MAX_HIGHMEM_ARENAS 8
+#endif
+
+static struct highmem_window {
+    pmm_arena_t *arena;
+    vaddr_t virt;
+    bool mapped;
+} highmem_windows[VM_MAX_HIGHMEM_ARENAS];
+static uint highmem_window_count;
+
 /* mark the physical pages backing a range of virtual as in use.
  * allocate the physical pages and throw them away */
 static void mark_pages_in_use(vaddr_t va, size_t len) {
@@ -71,6 +83,49 @@ static void vm_init_preheap(uint level) {
     }
 }
 
+status_t pmm_add_highmem_arena(pmm_arena_t *arena, vaddr_t virt) {
+    LTRACEF("arena '%s' base 0x%lx size 0x%zx virt 0x%lx\n", arena->name, arena->base, arena->size, virt);
+
+    if (highmem_window_count == VM_MAX_HIGHMEM_ARENAS)
+        return ERR_NO_RESOURCES;
+    if (!IS_PAGE_ALIGNED(virt))
+        return ERR_INVALID_ARGS;
+
+    /* not usable through paddr_to_kvaddr until the window is mapped */
+    arena->flags &= ~PMM_ARENA_FLAG_KMAP;
+
+    status_t err = pmm_add_arena(arena);
+    if (err < 0)
+        return err;
+
+    highmem_windows[highmem_window_count].arena = arena;
+    highmem_windows[highmem_window_count].virt = virt;
+    highmem_window_count++;
+
+    return NO_ERROR;
+}
+
+static void map_highmem_windows(void) {
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+
+    for (uint i = 0; i < highmem_window_count; i++) {
+        struct highmem_window *w = &highmem_windows[i];
+        pmm_arena_t *a = w->arena;
+
+        int err = arch_mmu_map(&aspace->arch_aspace, w->virt, a->base, a->size / PAGE_SIZE,
+                               ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+        if (err < 0) {
+            TRACEF("failed to map arena '%s' at 0x%lx, err %d\n", a->name, w->virt, err);
+            continue;
+        }
+
+        vmm_reserve_space(aspace, a->name, a->size, w->virt);
+        w->mapped = true;
+        a->kvaddr = w->virt;
+        a->flags |= PMM_ARENA_FLAG_KMAP;
+    }
+}
+
 static void vm_init_postheap(uint level) {
     LTRACE_ENTRY;
 
@@ -85,6 +140,9 @@ static void vm_init_postheap(uint level) {
 
         map++;
     }
+
+    /* now that the kernel address space is set up, map any high memory arenas */
+    map_highmem_windows();
 }
 
 void *kvaddr_get_range(size_t *size_return) {
@@ -103,6 +161,13 @@ void *paddr_to_kvaddr(paddr_t pa) {
         }
         map++;
     }
+
+    for (uint i = 0; i < highmem_window_count; i++) {
+        const struct highmem_window *w = &highmem_windows[i];
+        if (w->mapped && pa >= w->arena->base && pa <= w->arena->base + w->arena->size - 1) {
+            return (void *)(w->virt + (pa - w->arena->base));
+        }
+    }
     return NULL;
 }
 
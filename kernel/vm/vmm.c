@@ -24,6 +24,10 @@ vmm_aspace_t _kernel_aspace;
 static void dump_aspace(const vmm_aspace_t *a);
 static void dump_region(const vmm_region_t *r);
 
+#ifdef ARCH_MMU_LARGE_PAGE_SHIFT
+#define LARGE_PAGE_SIZE (1UL << ARCH_MMU_LARGE_PAGE_SHIFT)
+#endif
+
 void vmm_init_preheap(void) {
     /* initialize the kernel address space */
     strlcpy(_kernel_aspace.name, "kernel", sizeof(_kernel_aspace.name));
@@ -322,6 +326,42 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     return r ? NO_ERROR : ERR_NO_MEMORY;
 }
 
+/* how many large pages a physically contiguous run at va/pa can be mapped with */
+static size_t count_large_pages(vaddr_t va, paddr_t pa, size_t size) {
+#ifdef ARCH_MMU_LARGE_PAGE_SHIFT
+    if ((va ^ pa) & (LARGE_PAGE_SIZE - 1))
+        return 0;
+
+    vaddr_t start = ROUNDUP(va, LARGE_PAGE_SIZE);
+    vaddr_t end = ROUNDDOWN(va + size, LARGE_PAGE_SIZE);
+    return (end > start) ? (end - start) >> ARCH_MMU_LARGE_PAGE_SHIFT : 0;
+#else
+    return 0;
+#endif
+}
+
+/* map a physically contiguous run into a region in one go so the arch gets
+ * a chance to use block descriptors for it */
+static int map_run(vmm_aspace_t *aspace, vmm_region_t *r, vaddr_t va, paddr_t pa, size_t count) {
+    int err = arch_mmu_map(&aspace->arch_aspace, va, pa, count, r->arch_mmu_flags);
+    if (err >= 0)
+        r->large_page_count += count_large_pages(va, pa, count * PAGE_SIZE);
+    return err;
+}
+
+/* raise the alignment of allocations of at least a large page to a large page */
+static uint8_t large_page_align(size_t size, uint8_t align_pow2, uint vmm_flags, vaddr_t vaddr) {
+#ifdef ARCH_MMU_LARGE_PAGE_SHIFT
+    if (size < LARGE_PAGE_SIZE || align_pow2 >= ARCH_MMU_LARGE_PAGE_SHIFT)
+        return align_pow2;
+    if ((vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) && !IS_ALIGNED(vaddr, LARGE_PAGE_SIZE))
+        return align_pow2;
+    return ARCH_MMU_LARGE_PAGE_SHIFT;
+#else
+    return align_pow2;
+#endif
+}
+
 status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
                             void **ptr, uint8_t align_log2, paddr_t paddr, uint vmm_flags, uint arch_mmu_flags) {
     status_t ret;
@@ -369,7 +409,7 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         *ptr = (void *)r->base;
 
     /* map all of the pages */
-    int err = arch_mmu_map(&aspace->arch_aspace, r->base, paddr, size / PAGE_SIZE, arch_mmu_flags);
+    int err = map_run(aspace, r, r->base, paddr, size / PAGE_SIZE);
     LTRACEF("arch_mmu_map returns %d\n", err);
 
     ret = NO_ERROR;
@@ -412,8 +452,16 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     list_initialize(&page_list);
 
     paddr_t pa = 0;
-    /* allocate a run of physical pages */
-    size_t count = pmm_alloc_contiguous(size / PAGE_SIZE, align_pow2, &pa, &page_list);
+    /* allocate a run of physical pages, preferably lined up on a large page */
+    size_t count = 0;
+    uint8_t large_align = large_page_align(size, align_pow2, vmm_flags, vaddr);
+    if (large_align != align_pow2) {
+        count = pmm_alloc_contiguous(size / PAGE_SIZE, large_align, &pa, &page_list);
+        if (count == size / PAGE_SIZE)
+            align_pow2 = large_align;
+    }
+    if (count == 0)
+        count = pmm_alloc_contiguous(size / PAGE_SIZE, align_pow2, &pa, &page_list);
     if (count < size / PAGE_SIZE) {
         DEBUG_ASSERT(count == 0); /* check that the pmm didn't allocate a partial run */
         err = ERR_NO_MEMORY;
@@ -435,7 +483,7 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
         *ptr = (void *)r->base;
 
     /* map all of the pages */
-    arch_mmu_map(&aspace->arch_aspace, r->base, pa, size / PAGE_SIZE, arch_mmu_flags);
+    map_run(aspace, r, r->base, pa, size / PAGE_SIZE);
     // XXX deal with error mapping here
 
     vm_page_t *p;
@@ -482,12 +530,28 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     }
 
     /* allocate physical memory up front, in case it cant be satisfied */
-
-    /* allocate a random pile of pages */
     struct list_node page_list;
     list_initialize(&page_list);
+    size_t count = 0;
+
+#ifdef ARCH_MMU_LARGE_PAGE_SHIFT
+    /* back as much of it as the pmm can with naturally aligned large pages,
+     * which line up with the large page aligned virtual range below */
+    uint8_t large_align = large_page_align(size, align_pow2, vmm_flags, vaddr);
+    if (large_align != align_pow2) {
+        while (size - count * PAGE_SIZE >= LARGE_PAGE_SIZE) {
+            if (pmm_alloc_contiguous(LARGE_PAGE_SIZE / PAGE_SIZE, ARCH_MMU_LARGE_PAGE_SHIFT,
+                                     NULL, &page_list) == 0)
+                break;
+            count += LARGE_PAGE_SIZE / PAGE_SIZE;
+        }
+        if (count > 0)
+            align_pow2 = large_align;
+    }
+#endif
 
-    size_t count = pmm_alloc_pages(size / PAGE_SIZE, &page_list);
+    /* and the rest with a random pile of pages */
+    count += pmm_alloc_pages(size / PAGE_SIZE - count, &page_list);
     DEBUG_ASSERT(count <= size);
     if (count < size / PAGE_SIZE) {
         LTRACEF("failed to allocate enough pages (asked for %zu, got %zu)\n", size / PAGE_SIZE, count);
@@ -510,10 +574,12 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     if (ptr)
         *ptr = (void *)r->base;
 
-    /* map all of the pages */
-    /* XXX use smarter algorithm that tries to build runs */
+    /* map all of the pages, a physically contiguous run at a time */
     vm_page_t *p;
     vaddr_t va = r->base;
+    vaddr_t run_va = va;
+    paddr_t run_pa = 0;
+    size_t run_count = 0;
     DEBUG_ASSERT(IS_PAGE_ALIGNED(va));
     while ((p = list_remove_head_type(&page_list, vm_page_t, node))) {
         DEBUG_ASSERT(va <= r->base + r->size - 1);
@@ -521,13 +587,23 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         paddr_t pa = vm_page_to_paddr(p);
         DEBUG_ASSERT(IS_PAGE_ALIGNED(pa));
 
-        arch_mmu_map(&aspace->arch_aspace, va, pa, 1, arch_mmu_flags);
-        // XXX deal with error mapping here
+        if (run_count > 0 && pa != run_pa + run_count * PAGE_SIZE) {
+            map_run(aspace, r, run_va, run_pa, run_count);
+            // XXX deal with error mapping here
+            run_count = 0;
+        }
+        if (run_count == 0) {
+            run_va = va;
+            run_pa = pa;
+        }
+        run_count++;
 
         list_add_tail(&r->page_list, &p->node);
 
         va += PAGE_SIZE;
     }
+    if (run_count > 0)
+        map_run(aspace, r, run_va, run_pa, run_count);
 
     mutex_release(&vmm_lock);
     return NO_ERROR;
@@ -697,8 +773,36 @@ void vmm_set_active_aspace(vmm_aspace_t *aspace) {
 }
 
 static void dump_region(const vmm_region_t *r) {
-    printf("\tregion %p: name '%s' range 0x%lx - 0x%lx size 0x%zx flags 0x%x mmu_flags 0x%x\n",
-           r, r->name, r->base, r->base + r->size - 1, r->size, r->flags, r->arch_mmu_flags);
+    printf("\tregion %p: name '%s' range 0x%lx - 0x%lx size 0x%zx flags 0x%x mmu_flags 0x%x large pages %zu\n",
+           r, r->name, r->base, r->base + r->size - 1, r->size, r->flags, r->arch_mmu_flags,
+           r->large_page_count);
+}
+
+static void dump_mapping_stats(void) {
+    mutex_acquire(&vmm_lock);
+
+    vmm_aspace_t *a;
+    list_for_every_entry(&aspace_list, a, vmm_aspace_t, node) {
+        size_t large = 0;
+        size_t pages = 0;
+
+        vmm_region_t *r;
+        list_for_every_entry(&a->region_list, r, vmm_region_t, node) {
+            if (r->flags & VMM_REGION_FLAG_RESERVED)
+                continue;
+#ifdef ARCH_MMU_LARGE_PAGE_SHIFT
+            large += r->large_page_count;
+            pages += (r->size - r->large_page_count * LARGE_PAGE_SIZE) / PAGE_SIZE;
+#else
+            pages += r->size / PAGE_SIZE;
+#endif
+        }
+
+        printf("aspace %p '%s': %zu large page mappings, %zu page mappings\n",
+               a, a->name, large, pages);
+    }
+
+    mutex_release(&vmm_lock);
 }
 
 static void dump_aspace(const vmm_aspace_t *a) {
@@ -719,6 +823,7 @@ notenoughargs:
 usage:
         printf("usage:\n");
         printf("%s aspaces\n", argv[0].str);
+        printf("%s stats\n", argv[0].str);
         printf("%s alloc <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_physical <paddr> <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_contig <size> <align_pow2>\n", argv[0].str);
@@ -739,6 +844,8 @@ usage:
         list_for_every_entry(&aspace_list, a, vmm_aspace_t, node) {
             dump_aspace(a);
         }
+    } else if (!strcmp(argv[1].str, "stats")) {
+        dump_mapping_stats();
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 4) goto notenoughargs;
 
@@ -8,6 +8,7 @@
 #include <lib/acpi_lite.h>
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <string.h>
 #include <lk/compiler.h>
 #include <lk/debug.h>
@@ -21,6 +22,8 @@
 struct acpi_lite_state {
   const acpi_rsdp* rsdp;
   const acpi_rsdt_xsdt* sdt;
+  paddr_t rsdp_pa;
+  paddr_t sdt_pa;
   size_t num_tables;  // number of top level tables
   bool xsdt;          // are the pointers 64 or 32bit?
 } acpi;
@@ -124,19 +127,20 @@ static bool validate_sdt(const acpi_rsdt_xsdt* sdt, size_t* num_tables, bool* xs
   return true;
 }
 
+static paddr_t table_pa_at_index(size_t index) {
+  if (acpi.xsdt) {
+    return acpi.sdt->addr64[index];
+  } else {
+    return acpi.sdt->addr32[index];
+  }
+}
+
 const acpi_sdt_header* acpi_get_table_at_index(size_t index) {
   if (index >= acpi.num_tables) {
     return nullptr;
   }
 
-  paddr_t pa;
-  if (acpi.xsdt) {
-    pa = acpi.sdt->addr64[index];
-  } else {
-    pa = acpi.sdt->addr32[index];
-  }
-
-  return static_cast<const acpi_sdt_header*>(phys_to_ptr(pa));
+  return static_cast<const acpi_sdt_header*>(phys_to_ptr(table_pa_at_index(index)));
 }
 
 const acpi_sdt_header* acpi_get_table_by_sig(const char* sig) {
@@ -193,17 +197,22 @@ status_t acpi_lite_init(paddr_t rsdp_pa) {
 
   dprintf(SPEW, "ACPI LITE: RSDP checks out, found at %#lx\n", rsdp_pa);
 
+  acpi.rsdp_pa = rsdp_pa;
+
   // find the pointer to either the RSDT or XSDT
   acpi.sdt = nullptr;
   if (acpi.rsdp->revision < 2) {
     // v1 RSDP, pointing at a RSDT
-    acpi.sdt = static_cast<const acpi_rsdt_xsdt*>(phys_to_ptr(acpi.rsdp->rsdt_address));
+    acpi.sdt_pa = acpi.rsdp->rsdt_address;
+    acpi.sdt = static_cast<const acpi_rsdt_xsdt*>(phys_to_ptr(acpi.sdt_pa));
   } else {
     // v2+ RSDP, pointing at a XSDT
     // try to use the 64bit address first
-    acpi.sdt = static_cast<const acpi_rsdt_xsdt*>(phys_to_ptr(acpi.rsdp->xsdt_address));
+    acpi.sdt_pa = acpi.rsdp->xsdt_address;
+    acpi.sdt = static_cast<const acpi_rsdt_xsdt*>(phys_to_ptr(acpi.sdt_pa));
     if (!acpi.sdt) {
-      acpi.sdt = static_cast<const acpi_rsdt_xsdt*>(phys_to_ptr(acpi.rsdp->rsdt_address));
+      acpi.sdt_pa = acpi.rsdp->rsdt_address;
+      acpi.sdt = static_cast<const acpi_rsdt_xsdt*>(phys_to_ptr(acpi.sdt_pa));
     }
   }
 
@@ -242,6 +251,27 @@ void acpi_lite_dump_tables() {
   }
 }
 
+status_t acpi_process_table_ranges(const acpi_table_range_callback callback) {
+  if (!acpi.sdt) {
+    return ERR_NOT_FOUND;
+  }
+
+  // a v1 RSDP stops before the length field
+  callback(acpi.rsdp_pa, acpi.rsdp->revision < 2 ? offsetof(acpi_rsdp, length) : acpi.rsdp->length);
+  callback(acpi.sdt_pa, acpi.sdt->header.length);
+
+  for (size_t i = 0; i < acpi.num_tables; i++) {
+    const auto header = acpi_get_table_at_index(i);
+    if (!header) {
+      continue;
+    }
+
+    callback(table_pa_at_index(i), header->length);
+  }
+
+  return NO_ERROR;
+}
+
 status_t acpi_process_madt_entries_etc(const uint8_t search_type, const madt_entry_callback callback) {
   const acpi_madt_table* madt =
       reinterpret_cast<const acpi_madt_table*>(acpi_get_table_by_sig(ACPI_MADT_SIG));
@@ -267,3 +297,32 @@ status_t acpi_process_madt_entries_etc(const uint8_t search_type, const madt_ent
 
   return NO_ERROR;
 }
+
+status_t acpi_process_srat_entries_etc(const uint8_t search_type, const srat_entry_callback callback) {
+  const acpi_srat_table* srat =
+      reinterpret_cast<const acpi_srat_table*>(acpi_get_table_by_sig(ACPI_SRAT_SIG));
+  if (!srat) {
+    return ERR_NOT_FOUND;
+  }
+
+  // bytewise array of the same table
+  const uint8_t* srat_array = reinterpret_cast<const uint8_t*>(srat);
+
+  // walk the table off the end of the header, looking for the requested type
+  size_t off = sizeof(*srat);
+  while (off + 2 <= srat->header.length) {
+    uint8_t type = srat_array[off];
+    uint8_t length = srat_array[off + 1];
+    if (length == 0) {
+      break;
+    }
+
+    if (type == search_type) {
+      callback(static_cast<const void*>(&srat_array[off]), length);
+    }
+
+    off += length;
+  }
+
+  return NO_ERROR;
+}
@@ -25,4 +25,13 @@ const struct acpi_sdt_header* acpi_get_table_at_index(size_t index);
 typedef void (*madt_entry_callback)(const void* entry, size_t entry_len);
 status_t acpi_process_madt_entries_etc(uint8_t search_type, const madt_entry_callback);
 
+// Same as above, for the SRAT affinity entries
+typedef void (*srat_entry_callback)(const void* entry, size_t entry_len);
+status_t acpi_process_srat_entries_etc(uint8_t search_type, const srat_entry_callback);
+
+// Walk the physical ranges the tables live in: the RSDP, the RSDT/XSDT and every table it
+// points to. Used to keep the memory under them from being handed out.
+typedef void (*acpi_table_range_callback)(paddr_t pa, size_t len);
+status_t acpi_process_table_ranges(const acpi_table_range_callback);
+
 __END_CDECLS
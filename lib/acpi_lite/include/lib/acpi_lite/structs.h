@@ -183,6 +183,19 @@ struct acpi_srat_processor_x2apic_affinity_entry {
 } __PACKED;
 static_assert(sizeof(struct acpi_srat_processor_x2apic_affinity_entry) == 24, "");
 
+// Type 3: GICC affinity structure
+//
+// Reference: ACPI v6.3 Section 5.2.16.4.
+#define ACPI_SRAT_TYPE_GICC_AFFINITY 3
+struct acpi_srat_gicc_affinity_entry {
+  struct acpi_sub_table_header header;
+  uint32_t proximity_domain;
+  uint32_t acpi_processor_uid;
+  uint32_t flags;
+  uint32_t clock_domain;
+} __PACKED;
+static_assert(sizeof(struct acpi_srat_gicc_affinity_entry) == 18, "");
+
 // Multiple APIC Description Table (MADT) entries.
 
 // MADT entry type 0: Processor Local APIC (ACPI v6.3 Section 5.2.12.2)
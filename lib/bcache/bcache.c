@@ -6,85 +6,233 @@
  * https://opensource.org/licenses/MIT
  */
 #include <lk/list.h>
+#include <malloc.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/types.h>
+#include <arch/defines.h>
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
 
+/* the most dirty blocks written back with a single request */
+#define BCACHE_MAX_BATCH 16
+
 struct bcache_block {
     struct list_node node;
+    struct bcache_block *hash_next;
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    bool accessed;
     void *ptr;
 };
 
-struct bcache_stats {
-    uint32_t hits;
-    uint32_t depth;
-    uint32_t misses;
-    uint32_t reads;
-    uint32_t writes;
-};
-
 struct bcache {
     bdev_t *dev;
     size_t block_size;
     int count;
     struct bcache_stats stats;
 
+    /* blocks that don't hold anything */
     struct list_node free_list;
-    struct list_node lru_list;
+
+    /* blocks that do, hashed by block number */
+    struct bcache_block **hash;
+    uint hash_bits;
+
+    /* the next block the eviction sweep looks at */
+    int clock_hand;
 
     struct bcache_block *blocks;
+    void *data;
 };
 
+static uint hash_index(struct bcache *cache, bnum_t blocknum) {
+    return (blocknum * 0x9e3779b1U) >> (32 - cache->hash_bits);
+}
+
+static void hash_insert(struct bcache *cache, struct bcache_block *block) {
+    uint i = hash_index(cache, block->blocknum);
+
+    block->hash_next = cache->hash[i];
+    cache->hash[i] = block;
+}
+
+static void hash_remove(struct bcache *cache, struct bcache_block *block) {
+    struct bcache_block **prev = &cache->hash[hash_index(cache, block->blocknum)];
+
+    while (*prev != block) {
+        DEBUG_ASSERT(*prev);
+        prev = &(*prev)->hash_next;
+    }
+    *prev = block->hash_next;
+    block->hash_next = NULL;
+}
+
+/* look a block up without counting it as a use */
+static struct bcache_block *lookup_block(struct bcache *cache, bnum_t blocknum, uint32_t *depth) {
+    struct bcache_block *block;
+
+    for (block = cache->hash[hash_index(cache, blocknum)]; block; block = block->hash_next) {
+        if (depth)
+            (*depth)++;
+        if (block->blocknum == blocknum)
+            return block;
+    }
+
+    return NULL;
+}
+
+int bcache_blocks_for_size(bdev_t *dev, size_t block_size, uint64_t bytes) {
+    DEBUG_ASSERT(block_size > 0);
+
+    bytes = MAX(bytes, (uint64_t)BCACHE_MIN_SIZE);
+    bytes = MIN(bytes, (uint64_t)BCACHE_MAX_SIZE);
+
+    /* no larger than the device */
+    uint64_t dev_blocks = ((uint64_t)dev->block_count * dev->block_size) / block_size;
+    uint64_t block_count = MAX(bytes / block_size, 4U);
+    if (dev_blocks > 0 && block_count > dev_blocks)
+        block_count = dev_blocks;
+
+    return block_count;
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count) {
     struct bcache *cache;
 
-    cache = malloc(sizeof(struct bcache));
+    DEBUG_ASSERT(block_size > 0);
+
+    if (block_count <= 0)
+        block_count = bcache_blocks_for_size(dev, block_size, BCACHE_DEFAULT_SIZE);
+
+    cache = calloc(1, sizeof(struct bcache));
+    if (!cache)
+        return NULL;
 
     cache->dev = dev;
     cache->block_size = block_size;
     cache->count = block_count;
-    memset(&cache->stats, 0, sizeof(cache->stats));
 
     list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
 
-    cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
+    /* about one block per bucket */
+    cache->hash_bits = 1;
+    while ((1 << cache->hash_bits) < block_count)
+        cache->hash_bits++;
+
+    cache->hash = calloc(1U << cache->hash_bits, sizeof(struct bcache_block *));
+    cache->blocks = calloc(block_count, sizeof(struct bcache_block));
+    cache->data = memalign(CACHE_LINE, block_size * block_count);
+    if (!cache->hash || !cache->blocks || !cache->data) {
+        free(cache->hash);
+        free(cache->blocks);
+        free(cache->data);
+        free(cache);
+        return NULL;
+    }
+
     int i;
     for (i=0; i < block_count; i++) {
-        cache->blocks[i].ref_count = 0;
-        cache->blocks[i].is_dirty = false;
-        cache->blocks[i].ptr = malloc(block_size);
+        cache->blocks[i].ptr = (uint8_t *)cache->data + i * block_size;
         // add to the free list
-        list_add_head(&cache->free_list, &cache->blocks[i].node);
+        list_add_tail(&cache->free_list, &cache->blocks[i].node);
     }
 
+    LTRACEF("%d blocks of %zu bytes, %u hash buckets\n", block_count, block_size, 1U << cache->hash_bits);
+
     return (bcache_t)cache;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block) {
-    int rc;
+static void account_time(lk_bigtime_t *total, lk_bigtime_t *max, lk_bigtime_t start) {
+    lk_bigtime_t t = current_time_hires() - start;
 
-    rc = bio_write(cache->dev, block->ptr,
-                   (off_t)block->blocknum * cache->block_size,
-                   cache->block_size);
+    *total += t;
+    if (t > *max)
+        *max = t;
+}
+
+/* write a run of consecutive blocks with one request where the device allows it */
+static int write_blocks(struct bcache *cache, struct bcache_block **run, uint count) {
+    bdev_t *dev = cache->dev;
+    ssize_t rc;
+    uint i;
+
+    LTRACEF("blocknum %u, count %u\n", run[0]->blocknum, count);
+
+    lk_bigtime_t start = current_time_hires();
+
+    if (count > 1 && (cache->block_size % dev->block_size) == 0) {
+        uint ratio = cache->block_size / dev->block_size;
+        iovec_t iov[BCACHE_MAX_BATCH];
+        bio_request_t req;
+
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = run[i]->ptr;
+            iov[i].iov_len = cache->block_size;
+        }
+
+        bio_request_init(&req, BIO_OP_WRITE, run[0]->blocknum * ratio, count * ratio,
+                         iov, count, NULL, NULL);
+        rc = bio_submit(dev, &req);
+        if (rc >= 0)
+            rc = bio_request_wait(&req);
+        if (rc >= 0 && (size_t)rc != count * cache->block_size)
+            rc = ERR_IO;
+    } else {
+        rc = 0;
+        for (i = 0; i < count && rc >= 0; i++) {
+            rc = bio_write(dev, run[i]->ptr,
+                           (off_t)run[i]->blocknum * cache->block_size,
+                           cache->block_size);
+        }
+    }
     if (rc < 0)
-        goto exit;
+        return rc;
+
+    for (i = 0; i < count; i++)
+        run[i]->is_dirty = false;
 
-    block->is_dirty = false;
     cache->stats.writes++;
-    rc = 0;
-exit:
-    return (rc);
+    cache->stats.blocks_written += count;
+    account_time(&cache->stats.write_time, &cache->stats.write_time_max, start);
+
+    return 0;
+}
+
+/* write back a dirty block along with the dirty blocks next to it */
+static int flush_block(struct bcache *cache, struct bcache_block *block) {
+    struct bcache_block *run[BCACHE_MAX_BATCH];
+    struct bcache_block *b;
+    bnum_t first = block->blocknum;
+    uint count;
+
+    DEBUG_ASSERT(block->is_dirty);
+
+    /* back up to the start of the run, as far as a batch still reaches the block */
+    for (count = 1; count < BCACHE_MAX_BATCH && first > 0; count++) {
+        b = lookup_block(cache, first - 1, NULL);
+        if (!b || !b->is_dirty)
+            break;
+        first--;
+    }
+
+    for (count = 0; count < BCACHE_MAX_BATCH; count++) {
+        b = lookup_block(cache, first + count, NULL);
+        if (!b || !b->is_dirty)
+            break;
+        run[count] = b;
+    }
+    DEBUG_ASSERT(count > 0);
+
+    return write_blocks(cache, run, count);
 }
 
 void bcache_destroy(bcache_t _cache) {
@@ -97,10 +245,11 @@ void bcache_destroy(bcache_t _cache) {
         if (cache->blocks[i].is_dirty)
             printf("warning: freeing dirty block %u\n",
                    cache->blocks[i].blocknum);
-
-        free(cache->blocks[i].ptr);
     }
 
+    free(cache->data);
+    free(cache->blocks);
+    free(cache->hash);
     free(cache);
 }
 
@@ -111,53 +260,62 @@ static struct bcache_block *find_block(struct bcache *cache, uint blocknum) {
 
     LTRACEF("num %u\n", blocknum);
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
-
-        if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
-            return block;
-        }
+    block = lookup_block(cache, blocknum, &depth);
+    if (block) {
+        block->accessed = true;
+        cache->stats.hits++;
+        cache->stats.depth += depth;
+        return block;
     }
 
     cache->stats.misses++;
     return NULL;
 }
 
-/* allocate a new block */
+/*
+ * Allocate a new block, evicting one if needed. Eviction is a clock sweep that
+ * skips referenced blocks and gives blocks that were hit since the last pass
+ * another round. New blocks start out unmarked, so blocks only read once, like
+ * during a scan, go before the ones that keep getting hit.
+ */
 static struct bcache_block *alloc_block(struct bcache *cache) {
     int err;
+    int i;
     struct bcache_block *block;
 
     /* pop one off the free list if it's present */
     block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
     if (block) {
         block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
+        block->accessed = false;
         LTRACEF("found block %p on free list\n", block);
         return block;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+    /* two passes, the first one may only clear the accessed bits */
+    for (i = 0; i < cache->count * 2; i++) {
+        block = &cache->blocks[cache->clock_hand];
+        if (++cache->clock_hand == cache->count)
+            cache->clock_hand = 0;
+
         LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
-            }
-
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            return block;
+        if (block->ref_count > 0)
+            continue;
+        if (block->accessed) {
+            block->accessed = false;
+            continue;
         }
+
+        if (block->is_dirty) {
+            err = flush_block(cache, block);
+            if (err)
+                return NULL;
+            cache->stats.dirty_evictions++;
+        }
+
+        hash_remove(cache, block);
+        cache->stats.evictions++;
+        return block;
     }
 
     return NULL;
@@ -175,10 +333,13 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 
         /* allocate a new block and fill it */
         block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+        if (!block)
+            return NULL;
 
         LTRACEF("wasn't allocated, new block %p\n", block);
 
+        lk_bigtime_t start = current_time_hires();
+
         block->blocknum = blocknum;
         err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
         if (err < 0) {
@@ -187,7 +348,9 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
             return NULL;
         }
 
+        hash_insert(cache, block);
         cache->stats.reads++;
+        account_time(&cache->stats.read_time, &cache->stats.read_time_max, start);
     }
 
     DEBUG_ASSERT(block->blocknum == blocknum);
@@ -235,7 +398,7 @@ int bcache_put_block(bcache_t _cache, uint blocknum) {
 
     LTRACEF("blocknum %u\n", blocknum);
 
-    struct bcache_block *block = find_block(cache, blocknum);
+    struct bcache_block *block = lookup_block(cache, blocknum, NULL);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
@@ -251,7 +414,7 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum) {
     struct bcache *cache = priv;
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
+    block = lookup_block(cache, blocknum, NULL);
     if (!block) {
         err = -1;
         goto exit;
@@ -277,6 +440,7 @@ int bcache_zero_block(bcache_t priv, uint blocknum) {
         }
 
         block->blocknum = blocknum;
+        hash_insert(cache, block);
     }
 
     memset(block->ptr, 0, cache->block_size);
@@ -289,11 +453,12 @@ exit:
 int bcache_flush(bcache_t priv) {
     int err;
     struct bcache *cache = priv;
-    struct bcache_block *block;
+    int i;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
+    /* each write takes the whole run of dirty blocks around the one found */
+    for (i = 0; i < cache->count; i++) {
+        if (cache->blocks[i].is_dirty) {
+            err = flush_block(cache, &cache->blocks[i]);
             if (err)
                 goto exit;
         }
@@ -304,19 +469,40 @@ exit:
     return (err);
 }
 
+void bcache_get_stats(bcache_t priv, struct bcache_stats *stats) {
+    struct bcache *cache = priv;
+
+    *stats = cache->stats;
+}
+
 void bcache_dump(bcache_t priv, const char *name) {
     uint32_t finds;
     struct bcache *cache = priv;
+    struct bcache_stats *stats = &cache->stats;
 
-    finds = cache->stats.hits + cache->stats.misses;
+    finds = stats->hits + stats->misses;
 
+    printf("%s: %d blocks of %zu bytes, %u hash buckets\n",
+           name, cache->count, cache->block_size, 1U << cache->hash_bits);
     printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
            name,
-           cache->stats.hits,
-           finds ? (cache->stats.hits * 100) / finds : 0,
-           cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-           cache->stats.misses,
-           finds ? (cache->stats.misses * 100) / finds : 0,
-           cache->stats.reads,
-           cache->stats.writes);
+           stats->hits,
+           finds ? (stats->hits * 100) / finds : 0,
+           stats->hits ? stats->depth / stats->hits : 0,
+           stats->misses,
+           finds ? (stats->misses * 100) / finds : 0,
+           stats->reads,
+           stats->writes);
+    printf("%s: blocks written=%u (%u per write) evictions=%u dirty=%u\n",
+           name,
+           stats->blocks_written,
+           stats->writes ? stats->blocks_written / stats->writes : 0,
+           stats->evictions,
+           stats->dirty_evictions);
+    printf("%s: read latency avg %llu max %llu usecs, write latency avg %llu max %llu usecs\n",
+           name,
+           stats->reads ? stats->read_time / stats->reads : 0,
+           stats->read_time_max,
+           stats->writes ? stats->write_time / stats->writes : 0,
+           stats->write_time_max);
 }
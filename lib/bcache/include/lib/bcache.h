@@ -11,6 +11,41 @@
 
 typedef void *bcache_t;
 
+/* the size of a cache created without a block count */
+#ifndef BCACHE_DEFAULT_SIZE
+#define BCACHE_DEFAULT_SIZE (256 * 1024)
+#endif
+
+/* the range bcache_blocks_for_size() keeps a cache sized by its user in */
+#ifndef BCACHE_MIN_SIZE
+#define BCACHE_MIN_SIZE (64 * 1024)
+#endif
+#ifndef BCACHE_MAX_SIZE
+#define BCACHE_MAX_SIZE (4 * 1024 * 1024)
+#endif
+
+struct bcache_stats {
+    uint32_t hits;
+    uint32_t depth;
+    uint32_t misses;
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t blocks_written;
+    uint32_t evictions;
+    uint32_t dirty_evictions;
+    lk_bigtime_t read_time;
+    lk_bigtime_t read_time_max;
+    lk_bigtime_t write_time;
+    lk_bigtime_t write_time_max;
+};
+
+// the block count for a cache of about bytes, for users that size the cache
+// from what they keep on the device. bytes is clamped to BCACHE_MIN_SIZE and
+// BCACHE_MAX_SIZE, and the cache is never larger than the device.
+int bcache_blocks_for_size(bdev_t *dev, size_t block_size, uint64_t bytes);
+
+// a block_count of 0 sizes the cache by BCACHE_DEFAULT_SIZE, capped at the
+// size of the device. returns NULL if out of memory.
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count);
 void bcache_destroy(bcache_t);
 
@@ -21,6 +56,8 @@ int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 int bcache_mark_block_dirty(bcache_t priv, uint blocknum);
 int bcache_zero_block(bcache_t priv, uint blocknum);
+// write back all dirty blocks, runs of adjacent ones are written together
 int bcache_flush(bcache_t priv);
 void bcache_dump(bcache_t priv, const char *name);
+void bcache_get_stats(bcache_t priv, struct bcache_stats *stats);
 
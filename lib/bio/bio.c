@@ -271,12 +271,100 @@ static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len) {
     return erased;
 }
 
+/* submit a single buffer request and wait for it */
+static ssize_t bio_sync_request(struct bdev *dev, uint op, void *buf, bnum_t block, uint count) {
+    iovec_t iov = {
+        .iov_base = buf,
+        .iov_len = (size_t)count << dev->block_shift,
+    };
+    bio_request_t req;
+
+    bio_request_init(&req, op, block, count, &iov, 1, NULL, NULL);
+    status_t err = dev->submit(dev, &req);
+    if (err < 0)
+        return err;
+
+    return bio_request_wait(&req);
+}
+
+/* devices with a submit hook get their synchronous block calls for free */
 static ssize_t bio_default_read_block(struct bdev *dev, void *buf, bnum_t block, uint count) {
-    return ERR_NOT_SUPPORTED;
+    if (!dev->submit)
+        return ERR_NOT_SUPPORTED;
+
+    return bio_sync_request(dev, BIO_OP_READ, buf, block, count);
 }
 
 static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t block, uint count) {
-    return ERR_NOT_SUPPORTED;
+    if (!dev->submit)
+        return ERR_NOT_SUPPORTED;
+
+    return bio_sync_request(dev, BIO_OP_WRITE, (void *)buf, block, count);
+}
+
+/* write zeroes emulated with plain block writes */
+static ssize_t bio_default_write_zeroes(struct bdev *dev, bnum_t block, uint count) {
+    STACKBUF_DMA_ALIGN(zero_buf, dev->block_size);
+
+    memset(zero_buf, 0, dev->block_size);
+
+    ssize_t zeroed = 0;
+    for (uint i = 0; i < count; i++) {
+        ssize_t err = dev->write_block(dev, zero_buf, block + i, 1);
+        if (err < 0)
+            return err;
+        if ((size_t)err != dev->block_size)
+            return ERR_IO;
+
+        zeroed += err;
+    }
+
+    return zeroed;
+}
+
+/* and devices without one get requests run synchronously over the block hooks */
+static status_t bio_default_submit(struct bdev *dev, bio_request_t *req) {
+    bnum_t block = req->block;
+    ssize_t total = 0;
+    ssize_t err = 0;
+
+    switch (req->op) {
+        case BIO_OP_FLUSH:
+            /* nothing is cached below the block hooks */
+            bio_request_complete(req, 0);
+            return NO_ERROR;
+        case BIO_OP_DISCARD:
+            bio_request_complete(req, ERR_NOT_SUPPORTED);
+            return NO_ERROR;
+        case BIO_OP_WRITE_ZEROES:
+            bio_request_complete(req, bio_default_write_zeroes(dev, req->block, req->count));
+            return NO_ERROR;
+    }
+
+    for (uint i = 0; i < req->iov_count; i++) {
+        const iovec_t *iov = &req->iov[i];
+        uint count = iov->iov_len >> dev->block_shift;
+        if (count == 0)
+            continue;
+
+        if (req->op == BIO_OP_READ)
+            err = dev->read_block(dev, iov->iov_base, block, count);
+        else
+            err = dev->write_block(dev, iov->iov_base, block, count);
+        if (err < 0)
+            break;
+
+        total += err;
+        if ((size_t)err != iov->iov_len) {
+            err = ERR_IO;
+            break;
+        }
+        block += count;
+    }
+
+    bio_request_complete(req, (err < 0) ? err : total);
+
+    return NO_ERROR;
 }
 
 static void bdev_inc_ref(bdev_t *dev) {
@@ -424,6 +512,145 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len) {
     return dev->erase(dev, offset, len);
 }
 
+void bio_request_init(bio_request_t *req, uint op, bnum_t block, uint count,
+                      const iovec_t *iov, uint iov_count,
+                      bio_request_callback callback, void *arg) {
+    DEBUG_ASSERT(req);
+
+    req->op = op;
+    req->block = block;
+    req->count = count;
+    req->iov = iov;
+    req->iov_count = iov_count;
+    req->callback = callback;
+    req->arg = arg;
+    req->result = 0;
+    list_clear_node(&req->node);
+    event_init(&req->event, false, 0);
+}
+
+status_t bio_submit(bdev_t *dev, bio_request_t *req) {
+    LTRACEF("dev '%s', req %p, op %u, block %u, count %u, iov_count %u\n",
+            dev->name, req, req->op, req->block, req->count, req->iov_count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req);
+
+    switch (req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            break;
+        case BIO_OP_FLUSH:
+            /* applies to the whole device */
+            if (req->block != 0 || req->count != 0 || req->iov_count != 0)
+                return ERR_INVALID_ARGS;
+            goto submit;
+        case BIO_OP_DISCARD:
+        case BIO_OP_WRITE_ZEROES:
+            if (req->iov_count != 0)
+                return ERR_INVALID_ARGS;
+            break;
+        default:
+            return ERR_INVALID_ARGS;
+    }
+
+    /* unlike the synchronous calls the range isn't trimmed */
+    if (req->count == 0 || bio_trim_block_range(dev, req->block, req->count) != req->count)
+        return ERR_OUT_OF_RANGE;
+
+    /* the buffers have to add up to exactly the blocks, in whole blocks */
+    if (req->op == BIO_OP_READ || req->op == BIO_OP_WRITE) {
+        for (uint i = 0; i < req->iov_count; i++) {
+            if (!IS_ALIGNED(req->iov[i].iov_len, dev->block_size))
+                return ERR_INVALID_ARGS;
+        }
+        ssize_t len = iovec_size(req->iov, req->iov_count);
+        if (len < 0 || (size_t)len != ((size_t)req->count << dev->block_shift))
+            return ERR_INVALID_ARGS;
+    }
+
+submit:
+    if (dev->submit)
+        return dev->submit(dev, req);
+    else
+        return bio_default_submit(dev, req);
+}
+
+/* submit a request without buffers and wait for it */
+static ssize_t bio_sync_op(bdev_t *dev, uint op, bnum_t block, uint count) {
+    bio_request_t req;
+
+    bio_request_init(&req, op, block, count, NULL, 0, NULL, NULL);
+    status_t err = bio_submit(dev, &req);
+    if (err < 0)
+        return err;
+
+    return bio_request_wait(&req);
+}
+
+status_t bio_flush(bdev_t *dev) {
+    LTRACEF("dev '%s'\n", dev->name);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    ssize_t err = bio_sync_op(dev, BIO_OP_FLUSH, 0, 0);
+
+    return (err < 0) ? (status_t)err : NO_ERROR;
+}
+
+ssize_t bio_discard(bdev_t *dev, bnum_t block, uint count) {
+    LTRACEF("dev '%s', block %u, count %u\n", dev->name, block, count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    /* range check */
+    count = bio_trim_block_range(dev, block, count);
+    if (count == 0)
+        return 0;
+
+    return bio_sync_op(dev, BIO_OP_DISCARD, block, count);
+}
+
+ssize_t bio_write_zeroes(bdev_t *dev, bnum_t block, uint count) {
+    LTRACEF("dev '%s', block %u, count %u\n", dev->name, block, count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    /* range check */
+    count = bio_trim_block_range(dev, block, count);
+    if (count == 0)
+        return 0;
+
+    ssize_t err = bio_sync_op(dev, BIO_OP_WRITE_ZEROES, block, count);
+
+    /* devices that can't zero on their own still get the blocks written */
+    if (err == ERR_NOT_SUPPORTED)
+        err = bio_default_write_zeroes(dev, block, count);
+
+    return err;
+}
+
+ssize_t bio_request_wait(bio_request_t *req) {
+    DEBUG_ASSERT(req);
+    DEBUG_ASSERT(!req->callback);
+
+    event_wait(&req->event);
+
+    return req->result;
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t result) {
+    LTRACEF("req %p, result %zd\n", req, result);
+
+    req->result = result;
+
+    /* the request may be gone as soon as either of these runs */
+    if (req->callback)
+        req->callback(req);
+    else
+        event_signal(&req->event, false);
+}
+
 int bio_ioctl(bdev_t *dev, int request, void *argp) {
     LTRACEF("dev '%s', request %08x, argp %p\n", dev->name, request, argp);
 
@@ -458,6 +685,7 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->erase_byte = 0;
     dev->ref = 0;
     dev->flags = flags;
+    dev->queue_depth = 1;
 
 #if DEBUG
     // If we have been supplied information about our erase geometry, sanity
@@ -506,6 +734,7 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write = bio_default_write;
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
+    dev->submit = NULL;
     dev->close = NULL;
 }
 
@@ -540,8 +769,9 @@ void bio_dump_devices(void) {
     mutex_acquire(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 
-        printf("\t%s, size %lld, bsize %zd, ref %d",
-               entry->name, entry->total_size, entry->block_size, entry->ref);
+        printf("\t%s, size %lld, bsize %zd, ref %d, qdepth %u",
+               entry->name, entry->total_size, entry->block_size, entry->ref,
+               entry->queue_depth);
 
         if (!entry->geometry_count || !entry->geometry) {
             printf(" (no erase geometry)\n");
@@ -15,6 +15,9 @@
 #include <lib/bio.h>
 #include <platform.h>
 #include <kernel/thread.h>
+#include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
+#include <rand.h>
 
 #if WITH_LIB_CKSUM
 #include <lib/cksum.h>
@@ -30,6 +33,7 @@
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const console_cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench(bdev_t *dev, const char *mode, size_t bs, uint qdepth, uint64_t total);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -50,6 +54,10 @@ usage:
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s flush <device>\n", argv[0].str);
+        printf("%s discard <device> <block> <count>\n", argv[0].str);
+        printf("%s zero <device> <block> <count>\n", argv[0].str);
+        printf("%s bench <device> <read|write|randread|randwrite> <blocksize> <qdepth> <total len>\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -207,6 +215,53 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "flush")) {
+        if (argc < 3) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_flush(dev);
+        dprintf(INFO, "bio_flush returns %d\n", rc);
+
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "discard") || !strcmp(argv[1].str, "zero")) {
+        if (argc < 5) goto notenoughargs;
+
+        bnum_t block = argv[3].u;
+        uint count = argv[4].u;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        ssize_t err;
+        if (!strcmp(argv[1].str, "discard"))
+            err = bio_discard(dev, block, count);
+        else
+            err = bio_write_zeroes(dev, block, count);
+        dprintf(INFO, "%s returns %d\n", argv[1].str, (int)err);
+
+        bio_close(dev);
+
+        rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 7) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_bench(dev, argv[3].str, argv[4].u, argv[5].u, argv[6].u);
+
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
@@ -269,6 +324,191 @@ usage:
     return rc;
 }
 
+/* state shared with the completion callbacks of a benchmark run */
+struct bio_bench_state {
+    spin_lock_t lock;
+    struct list_node done;
+    semaphore_t sem;
+};
+
+struct bio_bench_req {
+    bio_request_t req;
+    iovec_t iov;
+    lk_bigtime_t start;
+    lk_bigtime_t latency;
+    struct bio_bench_state *state;
+};
+
+/* may run in interrupt context, hand the request back to the benchmark thread */
+static void bio_bench_callback(bio_request_t *req) {
+    struct bio_bench_req *r = (struct bio_bench_req *)req->arg;
+    struct bio_bench_state *state = r->state;
+
+    r->latency = current_time_hires() - r->start;
+
+    spin_lock_saved_state_t lock_state;
+    spin_lock_irqsave(&state->lock, lock_state);
+    list_add_tail(&state->done, &r->req.node);
+    spin_unlock_irqrestore(&state->lock, lock_state);
+
+    sem_post(&state->sem, false);
+}
+
+/*
+ * Keep qdepth requests of bs bytes in flight until total bytes have been
+ * transferred, resubmitting from this thread as they complete.
+ */
+static int bio_bench(bdev_t *dev, const char *mode, size_t bs, uint qdepth, uint64_t total) {
+    bool is_write, is_random;
+    if (!strcmp(mode, "read")) {
+        is_write = false;
+        is_random = false;
+    } else if (!strcmp(mode, "write")) {
+        is_write = true;
+        is_random = false;
+    } else if (!strcmp(mode, "randread")) {
+        is_write = false;
+        is_random = true;
+    } else if (!strcmp(mode, "randwrite")) {
+        is_write = true;
+        is_random = true;
+    } else {
+        printf("unknown mode '%s'\n", mode);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (bs == 0 || !IS_ALIGNED(bs, dev->block_size) || qdepth == 0 || total < bs) {
+        printf("block size has to be a multiple of %zu, qdepth and total length non zero\n", dev->block_size);
+        return ERR_INVALID_ARGS;
+    }
+
+    uint count = bs >> dev->block_shift;
+    if (count > dev->block_count) {
+        printf("block size larger than the device\n");
+        return ERR_INVALID_ARGS;
+    }
+    bnum_t span = dev->block_count - count + 1;
+    uint64_t ios = total / bs;
+    if (qdepth > ios)
+        qdepth = ios;
+
+    struct bio_bench_state state;
+    state.lock = SPIN_LOCK_INITIAL_VALUE;
+    list_initialize(&state.done);
+    sem_init(&state.sem, 0);
+
+    struct bio_bench_req *reqs = calloc(qdepth, sizeof(struct bio_bench_req));
+    if (!reqs)
+        return ERR_NO_MEMORY;
+
+    int err = NO_ERROR;
+    uint allocated;
+    for (allocated = 0; allocated < qdepth; allocated++) {
+        struct bio_bench_req *r = &reqs[allocated];
+        r->iov.iov_base = memalign(DMA_ALIGNMENT, bs);
+        if (!r->iov.iov_base) {
+            err = ERR_NO_MEMORY;
+            goto out;
+        }
+        r->iov.iov_len = bs;
+        r->state = &state;
+
+        /* write something other than zeroes in case the device special cases them */
+        memset(r->iov.iov_base, 0x5a + allocated, bs);
+    }
+
+    printf("%s %s: %llu x %zu bytes at queue depth %u\n", dev->name, mode,
+           (unsigned long long)ios, bs, qdepth);
+
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    lk_bigtime_t latency_total = 0;
+    lk_bigtime_t latency_max = 0;
+    bnum_t next_block = 0;
+
+    lk_bigtime_t start = current_time_hires();
+
+    /* everything starts out done, the loop below submits it */
+    for (uint i = 0; i < qdepth; i++) {
+        list_add_tail(&state.done, &reqs[i].req.node);
+        sem_post(&state.sem, false);
+    }
+
+    while (completed < submitted || submitted < ios) {
+        sem_wait(&state.sem);
+
+        spin_lock_saved_state_t lock_state;
+        spin_lock_irqsave(&state.lock, lock_state);
+        bio_request_t *req = list_remove_head_type(&state.done, bio_request_t, node);
+        spin_unlock_irqrestore(&state.lock, lock_state);
+        DEBUG_ASSERT(req);
+
+        struct bio_bench_req *r = containerof(req, struct bio_bench_req, req);
+
+        /* account for the request, unless it's a fresh one */
+        if (req->callback) {
+            completed++;
+            if (req->result != (ssize_t)bs)
+                failed++;
+            latency_total += r->latency;
+            latency_max = MAX(latency_max, r->latency);
+        }
+
+        if (submitted == ios)
+            continue;
+
+        bnum_t block;
+        if (is_random) {
+            block = (bnum_t)((((uint64_t)rand() << 16) ^ (uint64_t)rand()) % span);
+            block = ROUNDDOWN(block, count);
+        } else {
+            if (next_block >= span)
+                next_block = 0;
+            block = next_block;
+            next_block += count;
+        }
+
+        bio_request_init(req, is_write ? BIO_OP_WRITE : BIO_OP_READ, block, count,
+                         &r->iov, 1, &bio_bench_callback, r);
+        r->start = current_time_hires();
+        submitted++;
+
+        status_t serr = bio_submit(dev, req);
+        if (serr < 0) {
+            printf("bio_submit returns %d\n", serr);
+            err = serr;
+            /* pretend it completed so the in flight ones still get waited for */
+            submitted--;
+            ios = submitted;
+        }
+    }
+
+    lk_bigtime_t t = current_time_hires() - start;
+    if (t == 0)
+        t = 1;
+
+    uint64_t bytes = completed * bs;
+    printf("%llu ios (%llu failed), %llu bytes in %llu usecs\n",
+           (unsigned long long)completed, (unsigned long long)failed,
+           (unsigned long long)bytes, t);
+    printf("%llu KB/s, %llu iops, latency avg %llu max %llu usecs\n",
+           (unsigned long long)(bytes * 1000000 / 1024 / t),
+           (unsigned long long)(completed * 1000000 / t),
+           completed ? latency_total / completed : 0, latency_max);
+
+    if (failed)
+        err = ERR_IO;
+
+out:
+    for (uint i = 0; i < allocated; i++)
+        free(reqs[i].iov.iov_base);
+    free(reqs);
+    sem_destroy(&state.sem);
+
+    return err;
+}
+
 #endif
 
 // Returns the number of blocks that do not match the reference pattern.
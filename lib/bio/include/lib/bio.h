@@ -8,8 +8,10 @@
 #pragma once
 
 #include <assert.h>
+#include <iovec.h>
 #include <sys/types.h>
 #include <lk/list.h>
+#include <kernel/event.h>
 
 __BEGIN_CDECLS
 
@@ -26,6 +28,45 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bdev;
+
+#define BIO_OP_READ         0
+#define BIO_OP_WRITE        1
+#define BIO_OP_FLUSH        2 /* make completed writes durable, no range or buffers */
+#define BIO_OP_DISCARD      3 /* the device may drop the contents of the range, no buffers */
+#define BIO_OP_WRITE_ZEROES 4 /* zero the range, no buffers */
+
+typedef struct bio_request bio_request_t;
+typedef void (*bio_request_callback)(bio_request_t *req);
+
+/*
+ * An asynchronous block transfer between whole blocks of a device and a list
+ * of memory buffers. Each buffer has to be a multiple of the block size long.
+ * Flush, discard and write zeroes requests carry no buffers.
+ *
+ * Once submitted with bio_submit() the request belongs to the device until it
+ * completes. Completion either calls the callback, which may happen in
+ * interrupt context or before bio_submit() returns, or wakes up
+ * bio_request_wait() if there is no callback.
+ */
+struct bio_request {
+    /* filled in by bio_request_init() */
+    uint op;
+    bnum_t block;
+    uint count;
+    const iovec_t *iov;
+    uint iov_count;
+    bio_request_callback callback;
+    void *arg;
+
+    /* bytes transferred, discarded or zeroed or an error, valid after completion */
+    ssize_t result;
+
+    // Private:
+    struct list_node node; /* for use by the device while it owns the request */
+    event_t event;
+};
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -45,6 +86,10 @@ typedef struct bdev {
 
     uint32_t flags;
 
+    /* how many requests the device can work on at once, submitting more than
+     * this is fine but they will queue up behind the others */
+    uint queue_depth;
+
     /* function pointers */
     ssize_t (*read)(struct bdev *, void *buf, off_t offset, size_t len);
     ssize_t (*read_block)(struct bdev *, void *buf, bnum_t block, uint count);
@@ -52,6 +97,9 @@ typedef struct bdev {
     ssize_t (*write_block)(struct bdev *, const void *buf, bnum_t block, uint count);
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
+    /* asynchronous transfers, optional. if set, read_block and write_block
+     * default to waiting on a request */
+    status_t (*submit)(struct bdev *, bio_request_t *req);
     void (*close)(struct bdev *);
 } bdev_t;
 
@@ -65,6 +113,21 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* asynchronous api */
+void bio_request_init(bio_request_t *req, uint op, bnum_t block, uint count,
+                      const iovec_t *iov, uint iov_count,
+                      bio_request_callback callback, void *arg);
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+ssize_t bio_request_wait(bio_request_t *req);
+
+/* synchronous wrappers for the operations that don't move data */
+status_t bio_flush(bdev_t *dev);
+ssize_t bio_discard(bdev_t *dev, bnum_t block, uint count);
+ssize_t bio_write_zeroes(bdev_t *dev, bnum_t block, uint count);
+
+/* called by the device when it's done with a request */
+void bio_request_complete(bio_request_t *req, ssize_t result);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
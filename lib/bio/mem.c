@@ -6,6 +6,7 @@
  * https://opensource.org/licenses/MIT
  */
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
 #include <string.h>
 #include <stdlib.h>
@@ -31,16 +32,6 @@ static ssize_t mem_bdev_read(bdev_t *bdev, void *buf, off_t offset, size_t len)
     return len;
 }
 
-static ssize_t mem_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count) {
-    mem_bdev_t *mem = (mem_bdev_t *)bdev;
-
-    LTRACEF("bdev %s, buf %p, block %u, count %u\n", bdev->name, buf, block, count);
-
-    memcpy(buf, (uint8_t *)mem->ptr + block * BLOCKSIZE, count * BLOCKSIZE);
-
-    return count * BLOCKSIZE;
-}
-
 static ssize_t mem_bdev_write(bdev_t *bdev, const void *buf, off_t offset, size_t len) {
     mem_bdev_t *mem = (mem_bdev_t *)bdev;
 
@@ -51,14 +42,40 @@ static ssize_t mem_bdev_write(bdev_t *bdev, const void *buf, off_t offset, size_
     return len;
 }
 
-static ssize_t mem_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count) {
+static status_t mem_bdev_submit(struct bdev *bdev, bio_request_t *req) {
     mem_bdev_t *mem = (mem_bdev_t *)bdev;
 
-    LTRACEF("bdev %s, buf %p, block %u, count %u\n", bdev->name, buf, block, count);
-
-    memcpy((uint8_t *)mem->ptr + block * BLOCKSIZE, buf, count * BLOCKSIZE);
-
-    return count * BLOCKSIZE;
+    LTRACEF("bdev %s, op %u, block %u, count %u\n", bdev->name, req->op, req->block, req->count);
+
+    uint8_t *ptr = (uint8_t *)mem->ptr + req->block * BLOCKSIZE;
+    switch (req->op) {
+        case BIO_OP_FLUSH:
+            bio_request_complete(req, 0);
+            return NO_ERROR;
+        case BIO_OP_DISCARD:
+            /* leave the contents alone, that's as good as anything */
+            bio_request_complete(req, req->count * BLOCKSIZE);
+            return NO_ERROR;
+        case BIO_OP_WRITE_ZEROES:
+            memset(ptr, 0, req->count * BLOCKSIZE);
+            bio_request_complete(req, req->count * BLOCKSIZE);
+            return NO_ERROR;
+    }
+
+    for (uint i = 0; i < req->iov_count; i++) {
+        const iovec_t *iov = &req->iov[i];
+
+        if (req->op == BIO_OP_READ)
+            memcpy(iov->iov_base, ptr, iov->iov_len);
+        else
+            memcpy(ptr, iov->iov_base, iov->iov_len);
+        ptr += iov->iov_len;
+    }
+
+    /* memory never waits, complete it right away */
+    bio_request_complete(req, req->count * BLOCKSIZE);
+
+    return NO_ERROR;
 }
 
 int create_membdev(const char *name, void *ptr, size_t len) {
@@ -71,9 +88,8 @@ int create_membdev(const char *name, void *ptr, size_t len) {
     /* our bits */
     mem->ptr = ptr;
     mem->dev.read = mem_bdev_read;
-    mem->dev.read_block = mem_bdev_read_block;
     mem->dev.write = mem_bdev_write;
-    mem->dev.write_block = mem_bdev_write_block;
+    mem->dev.submit = mem_bdev_submit;
 
     /* register it */
     bio_register_device(&mem->dev);
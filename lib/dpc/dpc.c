@@ -5,73 +5,159 @@
  * license that can be found in the LICENSE file or at
  * https://opensource.org/licenses/MIT
  */
+#include <assert.h>
 #include <lk/debug.h>
 #include <stddef.h>
-#include <lk/list.h>
-#include <malloc.h>
+#include <stdio.h>
 #include <lk/err.h>
 #include <lib/dpc.h>
+#include <arch/atomic.h>
+#include <arch/defines.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <lk/console_cmd.h>
 #include <lk/init.h>
+#include <platform.h>
 
-struct dpc {
-    struct list_node node;
+/*
+ * Each cpu has its own queue and worker thread. Producers push onto the head
+ * of a singly linked stack with a compare and swap, which works from any
+ * context without a lock. The worker takes the whole stack at once with an
+ * atomic exchange and reverses it to run the dpcs in the order they came in.
+ * It's only woken up when a push finds the stack empty.
+ */
+struct dpc_queue {
+    struct dpc *head;
+    event_t event;
+    thread_t *thread;
+
+    /* statistics, updated without a lock so they may be slightly off */
+    volatile int depth;
+    int max_depth;
+    ulong queued;
+    ulong executed;
+    lk_bigtime_t total_latency;
+    lk_bigtime_t max_latency;
+} __ALIGNED(CACHE_LINE);
+
+static struct dpc_queue dpc_queues[SMP_MAX_CPUS];
+
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg) {
+    *dpc = (dpc_t)DPC_INITIAL_VALUE(cb, arg);
+}
 
-    dpc_callback cb;
-    void *arg;
-};
+status_t dpc_queue(dpc_t *dpc, uint flags) {
+    DEBUG_ASSERT(dpc);
+    DEBUG_ASSERT(dpc->cb);
 
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+    if (atomic_swap(&dpc->queued, 1))
+        return ERR_ALREADY_EXISTS;
 
-static int dpc_thread_routine(void *arg);
+    dpc->queue_time = current_time_hires();
 
-status_t dpc_queue(dpc_callback cb, void *arg, uint flags) {
-    struct dpc *dpc;
+    /* it doesn't matter if we migrate before the push, any queue will do */
+    struct dpc_queue *q = &dpc_queues[arch_curr_cpu_num()];
 
-    dpc = malloc(sizeof(struct dpc));
+    struct dpc *head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    do {
+        dpc->next = head;
+    } while (!__atomic_compare_exchange_n(&q->head, &head, dpc, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-    if (dpc == NULL)
-        return ERR_NO_MEMORY;
+    int depth = atomic_add(&q->depth, 1) + 1;
+    if (depth > q->max_depth)
+        q->max_depth = depth;
+    q->queued++;
 
-    dpc->cb = cb;
-    dpc->arg = arg;
-    enter_critical_section();
-    list_add_tail(&dpc_list, &dpc->node);
-    event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-    exit_critical_section();
+    if (!head)
+        event_signal(&q->event, (flags & DPC_FLAG_NORESCHED) ? false : true);
 
     return NO_ERROR;
 }
 
 static int dpc_thread_routine(void *arg) {
+    struct dpc_queue *q = arg;
+
     for (;;) {
-        event_wait(&dpc_event);
+        event_wait(&q->event);
+
+        struct dpc *list = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
 
-        enter_critical_section();
-        struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-        if (!dpc)
-            event_unsignal(&dpc_event);
-        exit_critical_section();
+        /* the stack is newest first */
+        struct dpc *fifo = NULL;
+        while (list) {
+            struct dpc *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+
+        while (fifo) {
+            struct dpc *dpc = fifo;
+            fifo = dpc->next;
+
+            dpc_callback cb = dpc->cb;
+            void *cb_arg = dpc->arg;
 
-        if (dpc) {
-//          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-            dpc->cb(dpc->arg);
+            lk_bigtime_t latency = current_time_hires() - dpc->queue_time;
+            q->total_latency += latency;
+            if (latency > q->max_latency)
+                q->max_latency = latency;
+            q->executed++;
+            atomic_add(&q->depth, -1);
 
-            free(dpc);
+            /* after this the dpc belongs to the caller again */
+            __atomic_store_n(&dpc->queued, 0, __ATOMIC_RELEASE);
+
+//          dprintf("dpc calling %p, arg %p\n", cb, cb_arg);
+            cb(cb_arg);
         }
     }
 
     return 0;
 }
 
-static void dpc_init(uint level) {
-    event_init(&dpc_event, false, 0);
+static void dpc_init_queues(uint level) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        event_init(&dpc_queues[i].event, false, EVENT_FLAG_AUTOUNSIGNAL);
+}
 
-    thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
+LK_INIT_HOOK(libdpc_queues, &dpc_init_queues, LK_INIT_LEVEL_KERNEL);
+
+/* dpcs queued before a cpu's worker is up wait for it */
+static void dpc_init_percpu(uint level) {
+    uint cpu = arch_curr_cpu_num();
+    struct dpc_queue *q = &dpc_queues[cpu];
+
+    char name[16];
+    snprintf(name, sizeof(name), "dpc %u", cpu);
+    q->thread = thread_create(name, &dpc_thread_routine, q, DPC_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!q->thread)
+        panic("failed to create dpc thread for cpu %u\n", cpu);
+    thread_set_pinned_cpu(q->thread, cpu);
+    thread_detach_and_resume(q->thread);
 }
 
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+LK_INIT_HOOK_FLAGS(libdpc, &dpc_init_percpu, LK_INIT_LEVEL_THREADING, LK_INIT_FLAG_ALL_CPUS);
+
+#if LK_DEBUGLEVEL > 1
+
+static int cmd_dpc(int argc, const console_cmd_args *argv) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct dpc_queue *q = &dpc_queues[i];
+        if (!q->thread)
+            continue;
+
+        printf("cpu %u: queued %lu executed %lu depth %d (max %d) latency avg %llu max %llu usecs\n",
+               i, q->queued, q->executed, q->depth, q->max_depth,
+               q->executed ? q->total_latency / q->executed : 0, q->max_latency);
+    }
+
+    return 0;
+}
 
+STATIC_COMMAND_START
+STATIC_COMMAND("dpc", "dpc queue statistics", &cmd_dpc)
+STATIC_COMMAND_END(dpc);
 
+#endif
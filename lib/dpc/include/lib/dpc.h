@@ -7,12 +7,46 @@
  */
 #pragma once
 
-#include <lk/list.h>
+#include <lk/compiler.h>
 #include <sys/types.h>
 
+__BEGIN_CDECLS
+
 typedef void (*dpc_callback)(void *arg);
 
+/*
+ * A deferred procedure call. The storage is owned by the caller, so queueing
+ * one never allocates and is safe from interrupt context. A queued dpc runs on
+ * the worker thread of the cpu it was queued on.
+ *
+ * Once the callback has started the dpc may be queued again, or freed.
+ */
+typedef struct dpc {
+    // Private:
+    struct dpc *next;
+    dpc_callback cb;
+    void *arg;
+    volatile int queued;
+    lk_bigtime_t queue_time;
+} dpc_t;
+
+#define DPC_INITIAL_VALUE(_cb, _arg) \
+{ \
+    .next = NULL, \
+    .cb = (_cb), \
+    .arg = (_arg), \
+    .queued = 0, \
+    .queue_time = 0, \
+}
+
 #define DPC_FLAG_NORESCHED 0x1
 
-status_t dpc_queue(dpc_callback, void *arg, uint flags);
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg);
+
+/*
+ * Queue the dpc on the current cpu. Returns ERR_ALREADY_EXISTS if it is still
+ * queued from an earlier call. Pass DPC_FLAG_NORESCHED from interrupt context.
+ */
+status_t dpc_queue(dpc_t *dpc, uint flags);
 
+__END_CDECLS
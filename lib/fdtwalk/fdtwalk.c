@@ -43,6 +43,43 @@ static void read_address_size_cells(const void *fdt, int offset, int depth,
     LTRACEF_LEVEL(3, "address-cells %u size-cells %u\n", address_cells[depth], size_cells[depth]);
 }
 
+/* read the numa-node-id property of a node, if it has one */
+static bool read_numa_node_id(const void *fdt, int offset, uint32_t *node) {
+    int len;
+    const void *prop_ptr = fdt_getprop(fdt, offset, "numa-node-id", &len);
+    if (!prop_ptr || len != 4) {
+        return false;
+    }
+
+    *node = fdt32_to_cpu(*(const uint32_t *)prop_ptr);
+    return true;
+}
+
+/* pull one address or size of 1 or 2 cells off the front of a reg property */
+static bool read_reg_cells(const uint8_t **prop_ptr, int *lenp, uint32_t cells, uint64_t *val) {
+    if (cells == 2 && *lenp >= 8) {
+        *val = fdt64_to_cpu(*(const uint64_t *)*prop_ptr);
+    } else if (cells == 1 && *lenp >= 4) {
+        *val = fdt32_to_cpu(*(const uint32_t *)*prop_ptr);
+    } else {
+        return false;
+    }
+    *prop_ptr += cells * 4;
+    *lenp -= cells * 4;
+    return true;
+}
+
+static void walk_memreserve(const void *fdt, const struct fdt_walk_callbacks *cb) {
+    int count = fdt_num_mem_rsv(fdt);
+    for (int i = 0; i < count; i++) {
+        uint64_t base, len;
+        if (fdt_get_mem_rsv(fdt, i, &base, &len) == 0 && len > 0) {
+            LTRACEF("calling reserved callback with base %#llx len %#llx\n", base, len);
+            cb->reserved(base, len, cb->reservedcookie);
+        }
+    }
+}
+
 status_t fdt_walk(const void *fdt, const struct fdt_walk_callbacks *cb) {
     int err = fdt_check_header(fdt);
     if (err != 0) {
@@ -52,6 +89,7 @@ status_t fdt_walk(const void *fdt, const struct fdt_walk_callbacks *cb) {
     /* walk the nodes */
     int depth = 0;
     int offset = 0;
+    bool in_reserved_memory = false;
     uint32_t address_cells[MAX_DEPTH];
     uint32_t size_cells[MAX_DEPTH];
 
@@ -59,6 +97,10 @@ status_t fdt_walk(const void *fdt, const struct fdt_walk_callbacks *cb) {
     address_cells[0] = size_cells[0] = 1;
     read_address_size_cells(fdt, offset, 0, address_cells, size_cells);
 
+    if (cb->reserved) {
+        walk_memreserve(fdt, cb);
+    }
+
     for (;;) {
         offset = fdt_next_node(fdt, offset, &depth);
         if (offset < 0 || depth < 0) {
@@ -95,28 +137,54 @@ status_t fdt_walk(const void *fdt, const struct fdt_walk_callbacks *cb) {
             if (prop_ptr) {
                 LTRACEF_LEVEL(2, "found '%s' reg prop len %d, ac %u, sc %u\n", name, lenp,
                               address_cells[depth], size_cells[depth]);
-                /* we're looking at a memory descriptor */
-                uint64_t base = 0;
-                uint64_t len = 0;
-                if (address_cells[depth] == 2 && lenp >= 8) {
-                    base = fdt64_to_cpu(*(const uint64_t *)prop_ptr);
-                    prop_ptr += 8;
-                    lenp -= 8;
-                } else {
-                    PANIC_UNIMPLEMENTED;
-                }
-                if (size_cells[depth] == 2 && lenp >= 8) {
-                    len = fdt64_to_cpu(*((const uint64_t *)prop_ptr));
-                    prop_ptr += 8;
-                    lenp -= 8;
-                } else {
-                    PANIC_UNIMPLEMENTED;
+                uint32_t numa_node;
+                bool has_numa_node = read_numa_node_id(fdt, offset, &numa_node);
+
+                /* we're looking at a memory descriptor, which may hold several ranges */
+                while (lenp > 0) {
+                    uint64_t base = 0;
+                    uint64_t len = 0;
+                    if (address_cells[depth] == 2 && lenp >= 8) {
+                        base = fdt64_to_cpu(*(const uint64_t *)prop_ptr);
+                        prop_ptr += 8;
+                        lenp -= 8;
+                    } else {
+                        PANIC_UNIMPLEMENTED;
+                    }
+                    if (size_cells[depth] == 2 && lenp >= 8) {
+                        len = fdt64_to_cpu(*((const uint64_t *)prop_ptr));
+                        prop_ptr += 8;
+                        lenp -= 8;
+                    } else {
+                        PANIC_UNIMPLEMENTED;
+                    }
+
+                    if (cb->mem) {
+                        LTRACEF("calling mem callback with base %#llx len %#llx\n", base, len);
+                        cb->mem(base, len, cb->memcookie);
+                    }
+                    if (cb->memnode && has_numa_node) {
+                        cb->memnode(base, len, numa_node, cb->memcookie);
+                    }
                 }
+            }
+        }
 
-                if (cb->mem) {
-                    LTRACEF("calling mem callback with base %#llx len %#llx\n", base, len);
-                    cb->mem(base, len, cb->memcookie);
+        /* the children of /reserved-memory with a fixed reg are carved out of ram */
+        if (depth == 1) {
+            in_reserved_memory = strcmp(name, "reserved-memory") == 0;
+        } else if (depth == 2 && in_reserved_memory && cb->reserved) {
+            int lenp;
+            const uint8_t *prop_ptr = fdt_getprop(fdt, offset, "reg", &lenp);
+            while (prop_ptr && lenp > 0) {
+                uint64_t base, len;
+                if (!read_reg_cells(&prop_ptr, &lenp, address_cells[depth - 1], &base) ||
+                    !read_reg_cells(&prop_ptr, &lenp, size_cells[depth - 1], &len)) {
+                    break;
                 }
+
+                LTRACEF("calling reserved callback with base %#llx len %#llx\n", base, len);
+                cb->reserved(base, len, cb->reservedcookie);
             }
         }
 
@@ -141,6 +209,11 @@ status_t fdt_walk(const void *fdt, const struct fdt_walk_callbacks *cb) {
                     LTRACEF("calling cpu callback with id %#x\n", id);
                     cb->cpu(id, cb->cpucookie);
                 }
+
+                uint32_t numa_node;
+                if (cb->cpunode && read_numa_node_id(fdt, offset, &numa_node)) {
+                    cb->cpunode(id, numa_node, cb->cpucookie);
+                }
             }
         }
 
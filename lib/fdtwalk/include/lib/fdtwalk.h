@@ -21,6 +21,13 @@ struct fdt_walk_callbacks {
     void *cpucookie;
     void (*pcie)(uint64_t ecam_base, size_t len, uint8_t bus_start, uint8_t bus_end, void *cookie);
     void *pciecookie;
+    /* optional, called with the numa-node-id of memory ranges and cpus that have one */
+    void (*memnode)(uint64_t base, uint64_t len, uint32_t node, void *cookie);
+    void (*cpunode)(uint64_t id, uint32_t node, void *cookie);
+    /* optional, called with the /memreserve/ entries and the reg of the
+     * /reserved-memory children, memory the OS must not hand out */
+    void (*reserved)(uint64_t base, uint64_t len, void *cookie);
+    void *reservedcookie;
 };
 
 status_t fdt_walk(const void *fdt, const struct fdt_walk_callbacks *);
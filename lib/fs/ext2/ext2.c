@@ -164,8 +164,18 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
         LTRACEF("\tused dirs %d\n", ext2->gd[i].bg_used_dirs_count);
     }
 
-    /* initialize the block cache */
-    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 4);
+    /* initialize the block cache, big enough for the bitmaps and inode tables
+     * but no more than a sixteenth of the device */
+    uint64_t table_bytes = (uint64_t)EXT2_INODES_PER_GROUP(ext2->sb) * EXT2_INODE_SIZE(ext2->sb);
+    uint64_t meta_bytes = (uint64_t)ext2->s_group_count *
+                          (2 * EXT2_BLOCK_SIZE(ext2->sb) + ROUNDUP(table_bytes, (uint64_t)EXT2_BLOCK_SIZE(ext2->sb)));
+    uint64_t cache_size = MIN(meta_bytes, (uint64_t)dev->total_size / 16);
+    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb),
+                                bcache_blocks_for_size(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), cache_size));
+    if (!ext2->cache) {
+        err = ERR_NO_MEMORY;
+        goto err;
+    }
 
     /* load the first inode */
     err = ext2_load_inode(ext2, EXT2_ROOT_INO, &ext2->root_inode);
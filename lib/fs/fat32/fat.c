@@ -149,7 +149,14 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie) {
     }
 
     fat->bytes_per_cluster = fat->sectors_per_cluster * fat->bytes_per_sector;
-    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, 4);
+    /* the cache only sees the FAT, so make it hold one copy of it */
+    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector,
+                               bcache_blocks_for_size(fat->dev, fat->bytes_per_sector,
+                                                      (uint64_t)fat->sectors_per_fat * fat->bytes_per_sector));
+    if (!fat->cache) {
+        result = ERR_NO_MEMORY;
+        goto end;
+    }
 
     *cookie = (fscookie *)fat;
 end:
@@ -16,6 +16,7 @@
 #include <lk/list.h>
 #include <kernel/spinlock.h>
 #include <lk/console_cmd.h>
+#include <lk/init.h>
 #include <lib/page_alloc.h>
 
 #define LOCAL_TRACE 0
@@ -116,6 +117,543 @@ static inline void HEAP_TRIM(void) { dlmalloc_trim(0); }
 #error need to select valid heap implementation or provide wrapper
 #endif
 
+/* alignment of slab objects, larger memalign() requests go to the heap */
+#define SLAB_ALIGN 16
+
+#if LK_HEAP_SLAB && WITH_KERNEL_VM
+/* slab front end
+ *
+ * Small allocations are carved out of single page slabs, one set per size
+ * class, instead of going to the heap and its lock. The header of a slab sits
+ * at the start of its page and the vm_page of the page is flagged so free()
+ * can tell slab objects from heap blocks.
+ *
+ * In front of the slabs every cpu keeps a loaded and a previous magazine of
+ * objects per class. Allocations and frees only touch the loaded one, swap it
+ * with the previous one when it runs dry or fills up, and after that trade
+ * whole magazines with the depot of the class, so the class lock is taken
+ * once per magazine worth of operations at most. The per cpu state is only
+ * touched with interrupts disabled and its own lock held, so heap_trim() can
+ * pull the magazines from every cpu.
+ */
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_DEPOT_MAX_FULL 8  /* full magazines kept in a depot, the rest go back to the slabs */
+#define SLAB_MAX_EMPTY 1       /* empty slabs kept around per class until heap_trim() */
+#define SLAB_MAX_SIZE 512
+
+struct slab_magazine {
+    struct slab_magazine *next;
+    uint rounds;
+    void *objs[SLAB_MAGAZINE_SIZE];
+};
+
+struct slab_class;
+
+struct slab {
+    struct list_node node;
+    struct slab_class *owner;
+    void *free_list;
+    uint inuse;
+};
+
+#define SLAB_HEADER_SIZE ROUNDUP(sizeof(struct slab), SLAB_ALIGN)
+
+struct slab_cpu {
+    spin_lock_t lock;
+    struct slab_magazine *loaded;
+    struct slab_magazine *prev;
+
+    /* served from or returned to a magazine */
+    size_t allocs;
+    size_t frees;
+} __ALIGNED(CACHE_LINE);
+
+static struct slab_class {
+    size_t size;
+    uint objs_per_slab;
+
+    spin_lock_t lock;
+    struct list_node partial; /* slabs with both used and free objects */
+    struct list_node empty;
+    size_t slab_count;
+    size_t empty_count;
+    size_t inuse;             /* objects handed out by the slabs, including ones in magazines */
+
+    /* served from or returned to the slabs directly */
+    size_t slab_allocs;
+    size_t slab_frees;
+
+    struct slab_magazine *depot_full;
+    struct slab_magazine *depot_empty;
+    uint depot_full_count;
+    uint depot_empty_count;
+
+    struct slab_cpu cpu[SMP_MAX_CPUS];
+} slab_classes[] = {
+    { .size = 16 }, { .size = 32 }, { .size = 48 }, { .size = 64 }, { .size = 96 },
+    { .size = 128 }, { .size = 192 }, { .size = 256 }, { .size = 384 }, { .size = 512 },
+};
+
+/* size class for every SLAB_ALIGN step up to SLAB_MAX_SIZE */
+static uint8_t slab_class_index[SLAB_MAX_SIZE / SLAB_ALIGN + 1];
+static bool slab_ready;
+
+static void slab_init(uint level) {
+    uint c = 0;
+    for (uint i = 1; i < countof(slab_class_index); i++) {
+        while (slab_classes[c].size < i * SLAB_ALIGN)
+            c++;
+        slab_class_index[i] = c;
+    }
+
+    for (uint i = 0; i < countof(slab_classes); i++) {
+        struct slab_class *sc = &slab_classes[i];
+
+        DEBUG_ASSERT(IS_ALIGNED(sc->size, SLAB_ALIGN));
+        sc->objs_per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / sc->size;
+        spin_lock_init(&sc->lock);
+        list_initialize(&sc->partial);
+        list_initialize(&sc->empty);
+        for (uint j = 0; j < SMP_MAX_CPUS; j++) {
+            spin_lock_init(&sc->cpu[j].lock);
+        }
+    }
+
+    /* slab pages are looked up through the vm, so hold off until it is up */
+    slab_ready = true;
+}
+
+LK_INIT_HOOK(heap_slab, &slab_init, LK_INIT_LEVEL_VM);
+
+static struct slab_class *slab_class_for_size(size_t size) {
+    if (!slab_ready || size == 0 || size > SLAB_MAX_SIZE)
+        return NULL;
+
+    return &slab_classes[slab_class_index[(size + SLAB_ALIGN - 1) / SLAB_ALIGN]];
+}
+
+/* the slab holding ptr, or NULL if it came from the heap */
+static struct slab *slab_from_ptr(void *ptr) {
+    /* objects never start at the beginning of a page, the header is there */
+    if (!slab_ready || IS_PAGE_ALIGNED((uintptr_t)ptr))
+        return NULL;
+
+    vm_page_t *page = kvaddr_to_vm_page(ptr);
+    if (!page || !(page->flags & VM_PAGE_FLAG_SLAB))
+        return NULL;
+
+    return (struct slab *)ROUNDDOWN((uintptr_t)ptr, PAGE_SIZE);
+}
+
+static struct slab *slab_create(struct slab_class *sc) {
+    struct slab *s = page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+    if (!s)
+        return NULL;
+
+    vm_page_t *page = kvaddr_to_vm_page(s);
+    if (!page) {
+        page_free(s, 1);
+        return NULL;
+    }
+
+    s->owner = sc;
+    s->inuse = 0;
+    s->free_list = NULL;
+
+    /* thread the free list so objects are handed out in address order */
+    uint8_t *obj = (uint8_t *)s + SLAB_HEADER_SIZE + (sc->objs_per_slab - 1) * sc->size;
+    for (uint i = 0; i < sc->objs_per_slab; i++, obj -= sc->size) {
+        *(void **)obj = s->free_list;
+        s->free_list = obj;
+    }
+
+    page->flags |= VM_PAGE_FLAG_SLAB;
+
+    return s;
+}
+
+static void slab_destroy(struct slab *s) {
+    DEBUG_ASSERT(s->inuse == 0);
+
+    vm_page_t *page = kvaddr_to_vm_page(s);
+    page->flags &= ~VM_PAGE_FLAG_SLAB;
+
+    page_free(s, 1);
+}
+
+static void slab_destroy_list(struct list_node *list) {
+    struct slab *s;
+    while ((s = list_remove_head_type(list, struct slab, node))) {
+        slab_destroy(s);
+    }
+}
+
+static void *slab_obj_alloc_locked(struct slab_class *sc) {
+    struct slab *s = list_peek_head_type(&sc->partial, struct slab, node);
+    if (!s) {
+        s = list_remove_head_type(&sc->empty, struct slab, node);
+        if (!s)
+            return NULL;
+
+        sc->empty_count--;
+        list_add_head(&sc->partial, &s->node);
+    }
+
+    void *obj = s->free_list;
+    s->free_list = *(void **)obj;
+    s->inuse++;
+    sc->inuse++;
+
+    /* full slabs are not on any list until something is freed back to them */
+    if (!s->free_list)
+        list_delete(&s->node);
+
+    return obj;
+}
+
+/* slabs that end up over the empty limit are moved to dead, to be destroyed
+ * once the lock is dropped */
+static void slab_obj_free_locked(struct slab_class *sc, void *obj, struct list_node *dead) {
+    struct slab *s = (struct slab *)ROUNDDOWN((uintptr_t)obj, PAGE_SIZE);
+
+    DEBUG_ASSERT(s->owner == sc);
+    DEBUG_ASSERT(s->inuse > 0);
+
+    if (!s->free_list)
+        list_add_head(&sc->partial, &s->node);
+
+    *(void **)obj = s->free_list;
+    s->free_list = obj;
+    s->inuse--;
+    sc->inuse--;
+
+    if (s->inuse == 0) {
+        list_delete(&s->node);
+        if (sc->empty_count < SLAB_MAX_EMPTY) {
+            list_add_head(&sc->empty, &s->node);
+            sc->empty_count++;
+        } else {
+            list_add_head(dead, &s->node);
+            sc->slab_count--;
+        }
+    }
+}
+
+/* return every object in a magazine to its slab */
+static void slab_magazine_flush_locked(struct slab_class *sc, struct slab_magazine *m,
+                                       struct list_node *dead) {
+    while (m->rounds > 0) {
+        slab_obj_free_locked(sc, m->objs[--m->rounds], dead);
+    }
+}
+
+static void *slab_alloc_slow(struct slab_class *sc) {
+    spin_lock_saved_state_t state;
+    struct slab *s = NULL;
+    void *obj;
+
+    for (;;) {
+        spin_lock_irqsave(&sc->lock, state);
+        if (s) {
+            list_add_head(&sc->empty, &s->node);
+            sc->empty_count++;
+            sc->slab_count++;
+        }
+        obj = slab_obj_alloc_locked(sc);
+        if (obj)
+            sc->slab_allocs++;
+        spin_unlock_irqrestore(&sc->lock, state);
+
+        if (obj || s)
+            return obj;
+
+        /* grow the class by a page and try again */
+        s = slab_create(sc);
+        if (!s)
+            return NULL;
+    }
+}
+
+static void slab_free_slow(struct slab_class *sc, void *obj) {
+    struct list_node dead = LIST_INITIAL_VALUE(dead);
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&sc->lock, state);
+    slab_obj_free_locked(sc, obj, &dead);
+    sc->slab_frees++;
+    spin_unlock_irqrestore(&sc->lock, state);
+
+    slab_destroy_list(&dead);
+}
+
+/* disable interrupts and lock the magazines of the cpu we end up on */
+static struct slab_cpu *slab_cpu_get(struct slab_class *sc, spin_lock_saved_state_t *state) {
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct slab_cpu *cpu = &sc->cpu[arch_curr_cpu_num()];
+    spin_lock(&cpu->lock);
+
+    return cpu;
+}
+
+static void slab_cpu_put(struct slab_cpu *cpu, spin_lock_saved_state_t state) {
+    spin_unlock(&cpu->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static void slab_cpu_swap(struct slab_cpu *cpu) {
+    struct slab_magazine *m = cpu->loaded;
+    cpu->loaded = cpu->prev;
+    cpu->prev = m;
+}
+
+static void *slab_alloc(struct slab_class *sc) {
+    spin_lock_saved_state_t state;
+    struct slab_cpu *cpu = slab_cpu_get(sc, &state);
+
+    if (!cpu->loaded || cpu->loaded->rounds == 0) {
+        if (cpu->prev && cpu->prev->rounds > 0) {
+            slab_cpu_swap(cpu);
+        } else if (sc->depot_full) {
+            /* trade the previous, empty magazine for a full one from the depot */
+            spin_lock(&sc->lock);
+            struct slab_magazine *m = sc->depot_full;
+            if (m) {
+                sc->depot_full = m->next;
+                sc->depot_full_count--;
+                if (cpu->prev) {
+                    cpu->prev->next = sc->depot_empty;
+                    sc->depot_empty = cpu->prev;
+                    sc->depot_empty_count++;
+                }
+                cpu->prev = cpu->loaded;
+                cpu->loaded = m;
+            }
+            spin_unlock(&sc->lock);
+        }
+    }
+
+    void *obj = NULL;
+    if (cpu->loaded && cpu->loaded->rounds > 0) {
+        obj = cpu->loaded->objs[--cpu->loaded->rounds];
+        cpu->allocs++;
+    }
+    slab_cpu_put(cpu, state);
+
+    if (!obj)
+        obj = slab_alloc_slow(sc);
+
+    return obj;
+}
+
+static void slab_free(struct slab *s, void *obj) {
+    struct slab_class *sc = s->owner;
+    struct list_node dead = LIST_INITIAL_VALUE(dead);
+    bool grown = false;
+
+retry:;
+    spin_lock_saved_state_t state;
+    struct slab_cpu *cpu = slab_cpu_get(sc, &state);
+
+    if (!cpu->loaded || cpu->loaded->rounds == SLAB_MAGAZINE_SIZE) {
+        if (cpu->prev && cpu->prev->rounds < SLAB_MAGAZINE_SIZE) {
+            slab_cpu_swap(cpu);
+        } else {
+            /* trade the previous, full magazine for an empty one from the depot,
+             * or empty it out into the slabs if the depot has enough full ones */
+            spin_lock(&sc->lock);
+            if (cpu->prev) {
+                if (sc->depot_full_count < SLAB_DEPOT_MAX_FULL) {
+                    cpu->prev->next = sc->depot_full;
+                    sc->depot_full = cpu->prev;
+                    sc->depot_full_count++;
+                    cpu->prev = NULL;
+                } else {
+                    slab_magazine_flush_locked(sc, cpu->prev, &dead);
+                }
+            }
+            if (!cpu->prev && sc->depot_empty) {
+                cpu->prev = sc->depot_empty;
+                sc->depot_empty = cpu->prev->next;
+                sc->depot_empty_count--;
+            }
+            spin_unlock(&sc->lock);
+
+            if (cpu->prev)
+                slab_cpu_swap(cpu);
+        }
+    }
+
+    bool done = false;
+    if (cpu->loaded && cpu->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+        cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+        cpu->frees++;
+        done = true;
+    }
+    slab_cpu_put(cpu, state);
+
+    slab_destroy_list(&dead);
+    if (done)
+        return;
+
+    /* no magazine to put it in, add an empty one to the depot and try once more */
+    struct slab_magazine *m = grown ? NULL : HEAP_MALLOC(sizeof(*m));
+    if (m) {
+        m->rounds = 0;
+
+        spin_lock_irqsave(&sc->lock, state);
+        m->next = sc->depot_empty;
+        sc->depot_empty = m;
+        sc->depot_empty_count++;
+        spin_unlock_irqrestore(&sc->lock, state);
+
+        grown = true;
+        goto retry;
+    }
+
+    slab_free_slow(sc, obj);
+}
+
+/* objects stay put as long as the new size fits their class */
+static void *slab_realloc(struct slab *s, void *ptr, size_t size) {
+    size_t old_size = s->owner->size;
+
+    if (size == 0) {
+        slab_free(s, ptr);
+        return NULL;
+    }
+    if (size <= old_size)
+        return ptr;
+
+    struct slab_class *sc = slab_class_for_size(size);
+    void *ptr2 = sc ? slab_alloc(sc) : HEAP_MALLOC(size);
+    if (ptr2) {
+        memcpy(ptr2, ptr, old_size);
+        slab_free(s, ptr);
+    }
+    return ptr2;
+}
+
+/* pull every magazine back to the slabs and release the empty slabs */
+static void slab_trim(void) {
+    if (!slab_ready)
+        return;
+
+    for (uint i = 0; i < countof(slab_classes); i++) {
+        struct slab_class *sc = &slab_classes[i];
+        struct slab_magazine *mags = NULL;
+        struct list_node dead = LIST_INITIAL_VALUE(dead);
+        spin_lock_saved_state_t state;
+
+        for (uint j = 0; j < SMP_MAX_CPUS; j++) {
+            struct slab_cpu *cpu = &sc->cpu[j];
+
+            spin_lock_irqsave(&cpu->lock, state);
+            struct slab_magazine *m[2] = { cpu->loaded, cpu->prev };
+            cpu->loaded = cpu->prev = NULL;
+            spin_unlock_irqrestore(&cpu->lock, state);
+
+            for (uint k = 0; k < countof(m); k++) {
+                if (m[k]) {
+                    m[k]->next = mags;
+                    mags = m[k];
+                }
+            }
+        }
+
+        /* take the depot too, everything gets emptied and freed */
+        spin_lock_irqsave(&sc->lock, state);
+        struct slab_magazine *depot[2] = { sc->depot_full, sc->depot_empty };
+        sc->depot_full = sc->depot_empty = NULL;
+        sc->depot_full_count = sc->depot_empty_count = 0;
+        for (uint k = 0; k < countof(depot); k++) {
+            while (depot[k]) {
+                struct slab_magazine *m = depot[k];
+                depot[k] = m->next;
+                m->next = mags;
+                mags = m;
+            }
+        }
+
+        for (struct slab_magazine *m = mags; m; m = m->next) {
+            slab_magazine_flush_locked(sc, m, &dead);
+        }
+
+        struct slab *s;
+        while ((s = list_remove_head_type(&sc->empty, struct slab, node))) {
+            list_add_head(&dead, &s->node);
+            sc->empty_count--;
+            sc->slab_count--;
+        }
+        spin_unlock_irqrestore(&sc->lock, state);
+
+        slab_destroy_list(&dead);
+        while (mags) {
+            struct slab_magazine *m = mags;
+            mags = m->next;
+            HEAP_FREE(m);
+        }
+    }
+}
+
+static void slab_dump(void) {
+    if (!slab_ready)
+        return;
+
+    printf("\tslab classes:\n");
+    printf("\t\t%5s %6s %8s %8s %10s %10s %10s %10s\n",
+           "size", "slabs", "inuse", "cached", "mag alloc", "mag free", "slab alloc", "slab free");
+    for (uint i = 0; i < countof(slab_classes); i++) {
+        struct slab_class *sc = &slab_classes[i];
+        size_t cached = 0;
+        size_t allocs = 0;
+        size_t frees = 0;
+        spin_lock_saved_state_t state;
+
+        for (uint j = 0; j < SMP_MAX_CPUS; j++) {
+            struct slab_cpu *cpu = &sc->cpu[j];
+
+            spin_lock_irqsave(&cpu->lock, state);
+            cached += cpu->loaded ? cpu->loaded->rounds : 0;
+            cached += cpu->prev ? cpu->prev->rounds : 0;
+            allocs += cpu->allocs;
+            frees += cpu->frees;
+            spin_unlock_irqrestore(&cpu->lock, state);
+        }
+
+        spin_lock_irqsave(&sc->lock, state);
+        for (struct slab_magazine *m = sc->depot_full; m; m = m->next) {
+            cached += m->rounds;
+        }
+        /* inuse counts what the slabs handed out, magazines included */
+        printf("\t\t%5zu %6zu %8zu %8zu %10zu %10zu %10zu %10zu\n",
+               sc->size, sc->slab_count, sc->inuse - MIN(cached, sc->inuse), cached,
+               allocs, frees, sc->slab_allocs, sc->slab_frees);
+        spin_unlock_irqrestore(&sc->lock, state);
+    }
+}
+
+#else
+struct slab_class;
+struct slab;
+
+static inline struct slab_class *slab_class_for_size(size_t size) { return NULL; }
+static inline struct slab *slab_from_ptr(void *ptr) { return NULL; }
+static inline void *slab_alloc(struct slab_class *sc) { return NULL; }
+static inline void slab_free(struct slab *s, void *ptr) {}
+static inline void *slab_realloc(struct slab *s, void *ptr, size_t size) { return NULL; }
+static inline void slab_trim(void) {}
+static inline void slab_dump(void) {}
+#endif
+
+static void heap_free(void *ptr) {
+    struct slab *s = slab_from_ptr(ptr);
+    if (s)
+        slab_free(s, ptr);
+    else
+        HEAP_FREE(ptr);
+}
+
 static void heap_free_delayed_list(void) {
     struct list_node list;
 
@@ -132,7 +670,7 @@ static void heap_free_delayed_list(void) {
 
     while ((node = list_remove_head(&list))) {
         LTRACEF("freeing node %p\n", node);
-        HEAP_FREE(node);
+        heap_free(node);
     }
 }
 
@@ -146,6 +684,7 @@ void heap_trim(void) {
         heap_free_delayed_list();
     }
 
+    slab_trim();
     HEAP_TRIM();
 }
 
@@ -157,7 +696,8 @@ void *malloc(size_t size) {
         heap_free_delayed_list();
     }
 
-    void *ptr = HEAP_MALLOC(size);
+    struct slab_class *sc = slab_class_for_size(size);
+    void *ptr = sc ? slab_alloc(sc) : HEAP_MALLOC(size);
     if (heap_trace)
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
     return ptr;
@@ -171,7 +711,9 @@ void *memalign(size_t boundary, size_t size) {
         heap_free_delayed_list();
     }
 
-    void *ptr = HEAP_MEMALIGN(boundary, size);
+    /* slab objects are only aligned to SLAB_ALIGN */
+    struct slab_class *sc = (boundary <= SLAB_ALIGN) ? slab_class_for_size(size) : NULL;
+    void *ptr = sc ? slab_alloc(sc) : HEAP_MEMALIGN(boundary, size);
     if (heap_trace)
         printf("caller %p memalign %zu, %zu -> %p\n", __GET_CALLER(), boundary, size, ptr);
     return ptr;
@@ -185,7 +727,20 @@ void *calloc(size_t count, size_t size) {
         heap_free_delayed_list();
     }
 
-    void *ptr = HEAP_CALLOC(count, size);
+    /* an overflowing product must not be mistaken for a small request */
+    size_t realsize;
+    if (unlikely(__builtin_mul_overflow(count, size, &realsize)))
+        return NULL;
+
+    void *ptr;
+    struct slab_class *sc = slab_class_for_size(realsize);
+    if (sc) {
+        ptr = slab_alloc(sc);
+        if (likely(ptr))
+            memset(ptr, 0, realsize);
+    } else {
+        ptr = HEAP_CALLOC(count, size);
+    }
     if (heap_trace)
         printf("caller %p calloc %zu, %zu -> %p\n", __GET_CALLER(), count, size, ptr);
     return ptr;
@@ -199,7 +754,13 @@ void *realloc(void *ptr, size_t size) {
         heap_free_delayed_list();
     }
 
-    void *ptr2 = HEAP_REALLOC(ptr, size);
+    void *ptr2;
+    struct slab *s = slab_from_ptr(ptr);
+    if (s) {
+        ptr2 = slab_realloc(s, ptr, size);
+    } else {
+        ptr2 = HEAP_REALLOC(ptr, size);
+    }
     if (heap_trace)
         printf("caller %p realloc %p, %zu -> %p\n", __GET_CALLER(), ptr, size, ptr2);
     return ptr2;
@@ -210,7 +771,7 @@ void free(void *ptr) {
     if (heap_trace)
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
 
-    HEAP_FREE(ptr);
+    heap_free(ptr);
 }
 
 /* critical section time delayed free */
@@ -229,6 +790,7 @@ void heap_delayed_free(void *ptr) {
 
 static void heap_dump(void) {
     HEAP_DUMP();
+    slab_dump();
 
     printf("\tdelayed free list:\n");
     spin_lock_saved_state_t state;
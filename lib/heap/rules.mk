@@ -24,4 +24,9 @@ endif
 
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
+# serve small allocations from per cpu magazines and slabs in front of the
+# heap, only used with the vm
+LK_HEAP_SLAB ?= 1
+MODULE_DEFINES += LK_HEAP_SLAB=$(LK_HEAP_SLAB)
+
 include make/module.mk
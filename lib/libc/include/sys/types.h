@@ -34,6 +34,10 @@ typedef uint32_t lk_time_t;
 typedef unsigned long long lk_bigtime_t;
 #define INFINITE_TIME UINT32_MAX
 
+/* nanoseconds since boot, does not wrap in any practical uptime */
+typedef unsigned long long lk_time_ns_t;
+#define INFINITE_TIME_NS UINT64_MAX
+
 #define TIME_GTE(a, b) ((int32_t)((a) - (b)) >= 0)
 #define TIME_LTE(a, b) ((int32_t)((a) - (b)) <= 0)
 #define TIME_GT(a, b) ((int32_t)((a) - (b)) > 0)
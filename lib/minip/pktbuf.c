@@ -18,7 +18,7 @@
 #include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
-#include <lib/pool.h>
+#include <lib/object_cache.h>
 #include <lk/init.h>
 
 #if WITH_KERNEL_VM
@@ -27,33 +27,29 @@
 
 #define LOCAL_TRACE 0
 
-static pool_t pktbuf_pool;
+/* pktbuf objects come out of an object cache that grows on demand, the
+ * semaphore still bounds how many can be out at once */
+static object_cache_t pktbuf_cache;
 static semaphore_t pktbuf_sem;
-static spin_lock_t lock;
 
 
 /* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
 static void *get_pool_object(void) {
-    pool_t *entry;
-    spin_lock_saved_state_t state;
+    pktbuf_pool_object_t *entry;
 
     sem_wait(&pktbuf_sem);
-    spin_lock_irqsave(&lock, state);
-    entry = pool_alloc(&pktbuf_pool);
-    spin_unlock_irqrestore(&lock, state);
-
-    return (pktbuf_pool_object_t *) entry;
+    entry = object_cache_alloc(&pktbuf_cache);
+    if (!entry)
+        sem_post(&pktbuf_sem, false);
 
+    return entry;
 }
 
 /* Return an object to thje pktbuf object pool. */
 static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule) {
     DEBUG_ASSERT(entry);
-    spin_lock_saved_state_t state;
 
-    spin_lock_irqsave(&lock, state);
-    pool_free(&pktbuf_pool, entry);
-    spin_unlock_irqrestore(&lock, state);
+    object_cache_free(&pktbuf_cache, entry);
     sem_post(&pktbuf_sem, reschedule);
 }
 
@@ -128,6 +124,9 @@ void pktbuf_reset(pktbuf_t *p, uint32_t header_sz) {
 
 pktbuf_t *pktbuf_alloc_empty(void) {
     pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    if (!p) {
+        return NULL;
+    }
 
     p->flags = PKTBUF_FLAG_EOF;
     return p;
@@ -204,26 +203,16 @@ void pktbuf_dump(pktbuf_t *p) {
 }
 
 static void pktbuf_init(uint level) {
-    void *slab;
-
 #if LK_DEBUGLEVEL > 0
-    printf("pktbuf: creating %u pktbuf entries of size %zu (total %zu)\n",
+    printf("pktbuf: up to %u pktbuf entries of size %zu (total %zu)\n",
            PKTBUF_POOL_SIZE, sizeof(struct pktbuf_pool_object),
            PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object));
 #endif
 
-#if WITH_KERNEL_VM
-    if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "pktbuf",
-                             PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object),
-                             &slab, 0, 0, ARCH_MMU_FLAG_CACHED) < 0) {
-        printf("Failed to initialize pktbuf hdr slab\n");
-        return;
-    }
-#else
-    slab = memalign(CACHE_LINE, PKTBUF_POOL_SIZE * sizeof(pktbuf_pool_object_t));
-#endif
-
-    pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
+    /* the cache grows by physically contiguous runs of pages, so the
+     * physical address of a buffer can be worked out from its start */
+    object_cache_init(&pktbuf_cache, "pktbuf", sizeof(struct pktbuf_pool_object), CACHE_LINE,
+                      NULL, NULL, NULL);
     sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
 }
 
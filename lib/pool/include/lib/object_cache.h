@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+/**
+ * A growable object cache on top of the pool allocator.
+ *
+ * Like a pool, a cache hands out objects of a fixed size and alignment in constant time, but it
+ * grows by pages from the page allocator on demand instead of working off a fixed storage buffer,
+ * keeps a short free list per cpu so the common case doesn't take the cache lock, and can give
+ * completely free pages back with object_cache_reclaim().
+ *
+ * An optional constructor is run on every object when the cache grows and the destructor when the
+ * pages are reclaimed, not on every alloc and free. Objects must be returned to the cache in their
+ * constructed state.
+ *
+ * Typical usage:
+ *
+ * static object_cache_t foo_cache;
+ *
+ * TYPED_OBJECT_CACHE_INIT(foo_t, &foo_cache, "foo", NULL, NULL, NULL);
+ *
+ * foo_t *foo = TYPED_OBJECT_CACHE_ALLOC(foo_t, &foo_cache);
+ * if (foo) {
+ *   ...
+ *   object_cache_free(&foo_cache, foo);
+ * }
+ *
+ * Objects can be freed with interrupts disabled. Allocations with interrupts disabled only
+ * succeed as long as the cache doesn't have to grow.
+ */
+
+#include <arch/defines.h>
+#include <kernel/spinlock.h>
+#include <lib/pool.h>
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* a failing constructor fails the allocation that made the cache grow */
+typedef status_t (*object_cache_ctor_t)(void *object, void *arg);
+typedef void (*object_cache_dtor_t)(void *object, void *arg);
+
+/**
+ * Object cache type.
+ */
+typedef struct object_cache {
+    // Private:
+    struct list_node node;
+    const char *name;
+
+    size_t object_size;
+    size_t stride;
+    size_t link_offset;
+    size_t chunk_header;
+    uint chunk_pages;
+    uint objects_per_chunk;
+
+    object_cache_ctor_t ctor;
+    object_cache_dtor_t dtor;
+    void *arg;
+
+    spin_lock_t lock;
+    pool_t free;
+    size_t free_count;
+    struct list_node chunks;
+    size_t chunk_count;
+
+    size_t grows;
+    size_t reclaims;
+    size_t failures;
+
+    struct object_cache_cpu {
+        spin_lock_t lock;
+        pool_t free;
+        uint count;
+        size_t allocs;
+        size_t frees;
+    } __ALIGNED(CACHE_LINE) cpu[SMP_MAX_CPUS];
+} object_cache_t;
+
+/**
+ * Initialize a cache for objects of the given size and alignment. No memory is allocated until
+ * the first object_cache_alloc().
+ */
+void object_cache_init(object_cache_t *cache, const char *name,
+                       size_t object_size, size_t object_align,
+                       object_cache_ctor_t ctor, object_cache_dtor_t dtor, void *arg);
+
+/**
+ * Release every page held by the cache. All objects must have been freed.
+ */
+void object_cache_destroy(object_cache_t *cache);
+
+/**
+ * Allocate an object from the cache, growing it if needed.
+ * Returns NULL if out of memory or if the constructor failed.
+ */
+void *object_cache_alloc(object_cache_t *cache);
+
+/**
+ * Free an object previously allocated with object_cache_alloc.
+ */
+void object_cache_free(object_cache_t *cache, void *object);
+
+/**
+ * Give the pages that only hold free objects back to the page allocator.
+ * Returns the number of pages released.
+ */
+size_t object_cache_reclaim(object_cache_t *cache);
+
+/**
+ * Reclaim from every cache in the system.
+ */
+size_t object_cache_reclaim_all(void);
+
+#define TYPED_OBJECT_CACHE_INIT(type, cache, name, ctor, dtor, arg) \
+    object_cache_init(cache, name, sizeof(type), __alignof(type), ctor, dtor, arg)
+
+#define TYPED_OBJECT_CACHE_ALLOC(type, cache) \
+    ((type*) object_cache_alloc(cache))
+
+__END_CDECLS
@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/object_cache.h>
+
+#include <assert.h>
+#include <kernel/mutex.h>
+#include <lib/page_alloc.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/init.h>
+#include <lk/pow2.h>
+#include <lk/trace.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/* objects per cpu free list before half of them go back to the cache */
+#define OBJECT_CACHE_CPU_HIGH 16
+#define OBJECT_CACHE_CPU_BATCH (OBJECT_CACHE_CPU_HIGH / 2)
+
+/* chunks are sized to hold at least this many objects */
+#define OBJECT_CACHE_MIN_OBJECTS 8
+
+/* header at the start of every run of pages the cache grows by, which is a power of
+ * two pages long and aligned to its size so any object finds it by rounding down */
+struct object_cache_chunk {
+    struct list_node node;
+    uint free; /* only valid during reclaim, zero otherwise */
+};
+
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+static mutex_t collect_lock = MUTEX_INITIAL_VALUE(collect_lock);
+
+/* The free lists link objects through a pointer sized cell. Without a
+ * constructor the cell is the start of the object, with one it sits past the
+ * end so the constructed state survives the trip through the free list. */
+static inline void *cell_to_object(const object_cache_t *cache, void *cell) {
+    return (uint8_t *)cell - cache->link_offset;
+}
+
+static inline void *object_to_cell(const object_cache_t *cache, void *object) {
+    return (uint8_t *)object + cache->link_offset;
+}
+
+static inline size_t chunk_size(const object_cache_t *cache) {
+    return cache->chunk_pages * PAGE_SIZE;
+}
+
+static inline void *chunk_object(const object_cache_t *cache, struct object_cache_chunk *chunk, uint i) {
+    return (uint8_t *)chunk + cache->chunk_header + i * cache->stride;
+}
+
+void object_cache_init(object_cache_t *cache, const char *name,
+                       size_t object_size, size_t object_align,
+                       object_cache_ctor_t ctor, object_cache_dtor_t dtor, void *arg) {
+    DEBUG_ASSERT(cache);
+    DEBUG_ASSERT(object_size > 0);
+
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->arg = arg;
+
+    size_t size = object_size;
+    if (ctor) {
+        cache->link_offset = ROUNDUP(object_size, sizeof(void *));
+        size = cache->link_offset + sizeof(void *);
+    }
+    size_t align = POOL_STORAGE_ALIGN(object_size, object_align);
+    cache->stride = POOL_PADDED_OBJECT_SIZE(size, object_align);
+    cache->chunk_header = ROUNDUP(sizeof(struct object_cache_chunk), align);
+
+    DEBUG_ASSERT(align <= PAGE_SIZE);
+
+    size_t chunk_bytes = cache->chunk_header + cache->stride * OBJECT_CACHE_MIN_OBJECTS;
+    cache->chunk_pages = round_up_pow2_u32(ROUNDUP(chunk_bytes, PAGE_SIZE) / PAGE_SIZE);
+    cache->objects_per_chunk = (chunk_size(cache) - cache->chunk_header) / cache->stride;
+
+    spin_lock_init(&cache->lock);
+    list_initialize(&cache->chunks);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        spin_lock_init(&cache->cpu[i].lock);
+    }
+
+    LTRACEF("cache '%s' size %zu stride %zu, %u objects in %u pages\n", name, object_size,
+            cache->stride, cache->objects_per_chunk, cache->chunk_pages);
+
+    mutex_acquire(&cache_list_lock);
+    list_add_tail(&cache_list, &cache->node);
+    mutex_release(&cache_list_lock);
+}
+
+static void chunk_destruct(object_cache_t *cache, struct object_cache_chunk *chunk, uint count) {
+    if (!cache->dtor)
+        return;
+
+    for (uint i = 0; i < count; i++) {
+        cache->dtor(chunk_object(cache, chunk, i), cache->arg);
+    }
+}
+
+static struct object_cache_chunk *chunk_alloc(object_cache_t *cache) {
+    if (cache->chunk_pages == 1)
+        return page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+
+#if WITH_KERNEL_VM
+    paddr_t pa;
+    if (pmm_alloc_contiguous(cache->chunk_pages, log2_uint(chunk_size(cache)), &pa, NULL) == 0)
+        return NULL;
+
+    return paddr_to_kvaddr(pa);
+#else
+    /* no aligned allocator without the vm, over allocate and trim the ends */
+    uint pages = cache->chunk_pages * 2 - 1;
+    uint8_t *base = page_alloc(pages, PAGE_ALLOC_ANY_ARENA);
+    if (!base)
+        return NULL;
+
+    uint8_t *chunk = (uint8_t *)ROUNDUP((uintptr_t)base, chunk_size(cache));
+    size_t head = (chunk - base) / PAGE_SIZE;
+    if (head > 0)
+        page_free(base, head);
+    if (pages - head > cache->chunk_pages)
+        page_free(chunk + chunk_size(cache), pages - head - cache->chunk_pages);
+
+    return (struct object_cache_chunk *)chunk;
+#endif
+}
+
+static inline struct object_cache_chunk *cell_to_chunk(const object_cache_t *cache, void *cell) {
+    return (struct object_cache_chunk *)ROUNDDOWN((uintptr_t)cell, chunk_size(cache));
+}
+
+/* add a chunk of constructed objects to the cache */
+static status_t object_cache_grow(object_cache_t *cache) {
+    struct object_cache_chunk *chunk = chunk_alloc(cache);
+    if (!chunk)
+        return ERR_NO_MEMORY;
+
+    chunk->free = 0;
+
+    pool_t cells = { NULL };
+    for (uint i = 0; i < cache->objects_per_chunk; i++) {
+        void *object = chunk_object(cache, chunk, i);
+
+        if (cache->ctor) {
+            status_t err = cache->ctor(object, cache->arg);
+            if (err < 0) {
+                chunk_destruct(cache, chunk, i);
+                page_free(chunk, cache->chunk_pages);
+                return err;
+            }
+        }
+
+        pool_free(&cells, object_to_cell(cache, object));
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    list_add_tail(&cache->chunks, &chunk->node);
+    cache->chunk_count++;
+    cache->grows++;
+
+    void *cell;
+    while ((cell = pool_alloc(&cells))) {
+        pool_free(&cache->free, cell);
+        cache->free_count++;
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    return NO_ERROR;
+}
+
+/* disable interrupts and lock the free list of the cpu we end up on */
+static struct object_cache_cpu *cache_cpu_get(object_cache_t *cache, spin_lock_saved_state_t *state) {
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct object_cache_cpu *cpu = &cache->cpu[arch_curr_cpu_num()];
+    spin_lock(&cpu->lock);
+
+    return cpu;
+}
+
+static void cache_cpu_put(struct object_cache_cpu *cpu, spin_lock_saved_state_t state) {
+    spin_unlock(&cpu->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* move up to count objects from a locked cpu free list to the cache, with its lock held */
+static void cache_cpu_flush_locked(object_cache_t *cache, struct object_cache_cpu *cpu, uint count) {
+    void *cell;
+    while (count-- > 0 && (cell = pool_alloc(&cpu->free))) {
+        cpu->count--;
+        pool_free(&cache->free, cell);
+        cache->free_count++;
+    }
+}
+
+void *object_cache_alloc(object_cache_t *cache) {
+    DEBUG_ASSERT(cache);
+
+    bool ints_disabled = arch_ints_disabled();
+    bool grown = false;
+
+    for (;;) {
+        spin_lock_saved_state_t state;
+        struct object_cache_cpu *cpu = cache_cpu_get(cache, &state);
+
+        void *cell = pool_alloc(&cpu->free);
+        if (!cell) {
+            /* refill a batch from the cache */
+            spin_lock(&cache->lock);
+            for (uint i = 0; i < OBJECT_CACHE_CPU_BATCH; i++) {
+                void *c = pool_alloc(&cache->free);
+                if (!c)
+                    break;
+
+                cache->free_count--;
+                pool_free(&cpu->free, c);
+                cpu->count++;
+            }
+            spin_unlock(&cache->lock);
+
+            cell = pool_alloc(&cpu->free);
+        }
+        if (cell) {
+            cpu->count--;
+            cpu->allocs++;
+        }
+        cache_cpu_put(cpu, state);
+
+        if (cell)
+            return cell_to_object(cache, cell);
+
+        /* growing takes the page allocator, which can't be done with interrupts off */
+        if (grown || ints_disabled || object_cache_grow(cache) < 0) {
+            spin_lock_irqsave(&cache->lock, state);
+            cache->failures++;
+            spin_unlock_irqrestore(&cache->lock, state);
+            return NULL;
+        }
+        grown = true;
+    }
+}
+
+void object_cache_free(object_cache_t *cache, void *object) {
+    DEBUG_ASSERT(cache);
+    DEBUG_ASSERT(object);
+
+    spin_lock_saved_state_t state;
+    struct object_cache_cpu *cpu = cache_cpu_get(cache, &state);
+
+    pool_free(&cpu->free, object_to_cell(cache, object));
+    cpu->count++;
+    cpu->frees++;
+
+    if (cpu->count > OBJECT_CACHE_CPU_HIGH) {
+        spin_lock(&cache->lock);
+        cache_cpu_flush_locked(cache, cpu, OBJECT_CACHE_CPU_BATCH);
+        spin_unlock(&cache->lock);
+    }
+
+    cache_cpu_put(cpu, state);
+}
+
+/* Pull the free objects of every cpu back to the cache and take the chunks
+ * where all of them are free off the cache. This is the slow path: the free
+ * list is taken off the cache and walked without its lock, once to count the
+ * free objects per chunk and once more to split it between the chunks being
+ * reclaimed and the ones that stay, so the lock is only ever held for a
+ * constant amount of work. Allocations that come in meanwhile grow the cache. */
+static void object_cache_collect(object_cache_t *cache, struct list_node *dead) {
+    spin_lock_saved_state_t state;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct object_cache_cpu *cpu = &cache->cpu[i];
+
+        spin_lock_irqsave(&cpu->lock, state);
+        spin_lock(&cache->lock);
+        cache_cpu_flush_locked(cache, cpu, cpu->count);
+        spin_unlock(&cache->lock);
+        spin_unlock_irqrestore(&cpu->lock, state);
+    }
+
+    /* the per chunk counts belong to one collection at a time */
+    mutex_acquire(&collect_lock);
+
+    spin_lock_irqsave(&cache->lock, state);
+    pool_t cells = cache->free;
+    cache->free.next_free = NULL;
+    cache->free_count = 0;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    for (void *cell = cells.next_free; cell; cell = *(void **)cell) {
+        cell_to_chunk(cache, cell)->free++;
+    }
+
+    /* every object of a fully counted chunk is in hand, nobody else can reach it */
+    pool_t keep = { NULL };
+    void *keep_tail = NULL;
+    size_t keep_count = 0;
+
+    void *cell;
+    while ((cell = pool_alloc(&cells))) {
+        struct object_cache_chunk *chunk = cell_to_chunk(cache, cell);
+
+        if (chunk->free == cache->objects_per_chunk) {
+            spin_lock_irqsave(&cache->lock, state);
+            list_delete(&chunk->node);
+            cache->chunk_count--;
+            cache->reclaims++;
+            spin_unlock_irqrestore(&cache->lock, state);
+
+            list_add_tail(dead, &chunk->node);
+            /* drop the rest of its objects as they come by */
+            chunk->free = UINT_MAX;
+        } else if (chunk->free == UINT_MAX) {
+            continue;
+        } else {
+            if (!keep_tail)
+                keep_tail = cell;
+            pool_free(&keep, cell);
+            keep_count++;
+        }
+    }
+
+    for (void *c = keep.next_free; c; c = *(void **)c) {
+        cell_to_chunk(cache, c)->free = 0;
+    }
+
+    /* splice the survivors back in front of whatever was freed meanwhile */
+    if (keep_tail) {
+        spin_lock_irqsave(&cache->lock, state);
+        *(void **)keep_tail = cache->free.next_free;
+        cache->free.next_free = keep.next_free;
+        cache->free_count += keep_count;
+        spin_unlock_irqrestore(&cache->lock, state);
+    }
+
+    mutex_release(&collect_lock);
+}
+
+static size_t object_cache_release(object_cache_t *cache, struct list_node *dead) {
+    size_t pages = 0;
+
+    struct object_cache_chunk *chunk;
+    while ((chunk = list_remove_head_type(dead, struct object_cache_chunk, node))) {
+        chunk_destruct(cache, chunk, cache->objects_per_chunk);
+        page_free(chunk, cache->chunk_pages);
+        pages += cache->chunk_pages;
+    }
+
+    return pages;
+}
+
+size_t object_cache_reclaim(object_cache_t *cache) {
+    DEBUG_ASSERT(cache);
+
+    struct list_node dead = LIST_INITIAL_VALUE(dead);
+    object_cache_collect(cache, &dead);
+
+    size_t pages = object_cache_release(cache, &dead);
+    LTRACEF("cache '%s' released %zu pages\n", cache->name, pages);
+
+    return pages;
+}
+
+size_t object_cache_reclaim_all(void) {
+    size_t pages = 0;
+
+    mutex_acquire(&cache_list_lock);
+    object_cache_t *cache;
+    list_for_every_entry(&cache_list, cache, object_cache_t, node) {
+        pages += object_cache_reclaim(cache);
+    }
+    mutex_release(&cache_list_lock);
+
+    return pages;
+}
+
+void object_cache_destroy(object_cache_t *cache) {
+    DEBUG_ASSERT(cache);
+
+    mutex_acquire(&cache_list_lock);
+    list_delete(&cache->node);
+    mutex_release(&cache_list_lock);
+
+    object_cache_reclaim(cache);
+
+    DEBUG_ASSERT(list_is_empty(&cache->chunks));
+}
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+
+/* hand back the free pages of every cache when the pmm runs dry */
+static size_t object_cache_pmm_reclaim(pmm_reclaimer_t *r) {
+    return object_cache_reclaim_all();
+}
+
+static pmm_reclaimer_t object_cache_reclaimer = {
+    .reclaim = object_cache_pmm_reclaim,
+};
+
+static void object_cache_register(uint level) {
+    pmm_add_reclaimer(&object_cache_reclaimer);
+}
+
+LK_INIT_HOOK(object_cache, &object_cache_register, LK_INIT_LEVEL_VM);
+#endif
+
+#if LK_DEBUGLEVEL > 1
+
+static int cmd_object_cache(int argc, const console_cmd_args *argv);
+
+STATIC_COMMAND_START
+STATIC_COMMAND("objcache", "object cache debug commands", &cmd_object_cache)
+STATIC_COMMAND_END(object_cache);
+
+static void object_cache_dump(object_cache_t *cache) {
+    size_t cpu_free = 0;
+    size_t allocs = 0;
+    size_t frees = 0;
+    spin_lock_saved_state_t state;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct object_cache_cpu *cpu = &cache->cpu[i];
+
+        spin_lock_irqsave(&cpu->lock, state);
+        cpu_free += cpu->count;
+        allocs += cpu->allocs;
+        frees += cpu->frees;
+        spin_unlock_irqrestore(&cpu->lock, state);
+    }
+
+    spin_lock_irqsave(&cache->lock, state);
+    size_t total = cache->chunk_count * cache->objects_per_chunk;
+    size_t free_count = cache->free_count + cpu_free;
+    printf("cache '%s': size %zu stride %zu, %zu chunks of %u pages, %zu objects, %zu used, "
+           "%zu free (%zu on cpus)\n",
+           cache->name, cache->object_size, cache->stride, cache->chunk_count, cache->chunk_pages,
+           total, total - MIN(free_count, total), free_count, cpu_free);
+    printf("\t%zu allocs, %zu frees, %zu grows, %zu chunks reclaimed, %zu failures\n",
+           allocs, frees, cache->grows, cache->reclaims, cache->failures);
+    spin_unlock_irqrestore(&cache->lock, state);
+}
+
+static int cmd_object_cache(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+        printf("not enough arguments\n");
+usage:
+        printf("usage:\n");
+        printf("\t%s info\n", argv[0].str);
+        printf("\t%s reclaim\n", argv[0].str);
+        return -1;
+    }
+
+    if (strcmp(argv[1].str, "info") == 0) {
+        mutex_acquire(&cache_list_lock);
+        object_cache_t *cache;
+        list_for_every_entry(&cache_list, cache, object_cache_t, node) {
+            object_cache_dump(cache);
+        }
+        mutex_release(&cache_list_lock);
+    } else if (strcmp(argv[1].str, "reclaim") == 0) {
+        size_t pages = object_cache_reclaim_all();
+        printf("reclaimed %zu pages\n", pages);
+    } else {
+        printf("unrecognized command\n");
+        goto usage;
+    }
+
+    return 0;
+}
+
+#endif
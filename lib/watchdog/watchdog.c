@@ -44,6 +44,7 @@ status_t watchdog_init(watchdog_t *dog, lk_time_t timeout, const char *name) {
     dog->enabled = false;
     dog->timeout = timeout;
     timer_initialize(&dog->expire_timer);
+    timer_set_slack(&dog->expire_timer, TIMER_COALESCE_SLACK_NS);
 
     return NO_ERROR;
 }
@@ -96,6 +97,7 @@ static enum handler_return hw_watchdog_timer_callback(struct timer *timer, lk_ti
 status_t watchdog_hw_init(lk_time_t timeout) {
     DEBUG_ASSERT(INFINITE_TIME != timeout);
     timer_initialize(&hw_watchdog_timer);
+    timer_set_slack(&hw_watchdog_timer, TIMER_COALESCE_SLACK_NS);
     return platform_watchdog_init(timeout, &hw_watchdog_pet_timeout);
 }
 
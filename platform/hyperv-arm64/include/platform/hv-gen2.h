@@ -7,7 +7,9 @@
  */
 #pragma once
 
-/*  Due to the current limitation, limit how much memory we can use.
+/*  The initial "memory" mapping only covers the System Memory below the low
+    MMIO range. RAM above 4GB is discovered from the firmware memory map and
+    mapped linearly at KERNEL_BASE + pa once the vm is up.
     Memory map dumped from SV2 machine:
 
     Hyper-V arm64 Full System Memory Map, left inclusive and right exclusive:
@@ -38,6 +40,10 @@
 #error "Only ARM64 is supported"
 #endif
 
+/* high memory window, limited to the first 1TB of physical address space */
+#define HIGHMEM_BASE_PHYS (0x100000000ULL)
+#define HIGHMEM_LIMIT_PHYS (0x10000000000ULL)
+
 /* Hyper-V has 512MB MMIO */
 #define PERIPHERAL_BASE_PHYS (0xE0000000)
 #define PERIPHERAL_BASE_SIZE (0x20000000UL) // 512MB
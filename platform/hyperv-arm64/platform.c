@@ -9,6 +9,7 @@
 #include <arch.h>
 
 #include <inttypes.h>
+#include <stdio.h>
 
 #include <lk/debug.h>
 #include <lk/err.h>
@@ -18,6 +19,9 @@
 #include <dev/timer/arm_generic.h>
 #include <dev/uart.h>
 
+#include <lib/acpi_lite.h>
+#include <lib/fdtwalk.h>
+#include <libfdt.h>
 #include <lk/init.h>
 
 #include <kernel/spinlock.h>
@@ -30,6 +34,12 @@
 #include "platform_p.h"
 
 extern int psci_call(ulong arg0, ulong arg1, ulong arg2, ulong arg3);
+extern ulong lk_boot_args[4];
+
+#define ARM_SMC_ID_PSCI_CPU_ON 0xC4000003 /* SMC64 */
+
+#define PSCI_RET_SUCCESS 0
+#define PSCI_RET_INVALID_PARAMETERS -2
 
 #if WITH_LIB_MINIP
 #include <lib/minip.h>
@@ -64,13 +74,270 @@ struct mmu_initial_mapping mmu_initial_mappings[] = {
     {0},
 };
 
-static pmm_arena_t arena = {
-    .name = "ram",
-    .base = MEMORY_BASE_PHYS,
-    .size = DEFAULT_MEMORY_SIZE,
-    .flags = PMM_ARENA_FLAG_KMAP,
+/* RAM ranges from the FDT /memory nodes, split into arenas */
+#define MAX_MEMORY_RANGES 8
+
+/* proximity domains of physical ranges, from the FDT or the ACPI SRAT. These
+ * describe locality only, they do not say the range is usable RAM. */
+#define MAX_NUMA_RANGES 16
+
+/* ranges inside RAM that the firmware still owns: the FDT blob and its
+ * reservations, or the ACPI tables */
+#define MAX_RESERVED_RANGES 64
+
+struct phys_range {
+  uint64_t base;
+  uint64_t len;
+  uint numa_node;
 };
 
+static struct phys_range memory_ranges[MAX_MEMORY_RANGES];
+static uint memory_range_count;
+static struct phys_range numa_ranges[MAX_NUMA_RANGES];
+static uint numa_range_count;
+static struct phys_range reserved_ranges[MAX_RESERVED_RANGES];
+static uint reserved_range_count;
+
+static pmm_arena_t arenas[MAX_MEMORY_RANGES * 4];
+static char arena_names[MAX_MEMORY_RANGES * 4][16];
+static uint arena_count;
+
+static void add_range(struct phys_range *ranges, uint *count, uint max,
+                      uint64_t base, uint64_t len, uint numa_node,
+                      const char *what) {
+  LTRACEF("%s base %#llx len %#llx node %u\n", what, base, len, numa_node);
+
+  if (*count == max) {
+    printf("MEM: too many %s ranges, ignoring %#llx size %#llx\n", what, base,
+           len);
+    return;
+  }
+
+  ranges[*count].base = base;
+  ranges[*count].len = len;
+  ranges[*count].numa_node = numa_node;
+  (*count)++;
+}
+
+static void add_memory_range(uint64_t base, uint64_t len) {
+  add_range(memory_ranges, &memory_range_count, MAX_MEMORY_RANGES, base, len, 0,
+            "memory");
+}
+
+static void add_reserved_range(uint64_t base, uint64_t len) {
+  add_range(reserved_ranges, &reserved_range_count, MAX_RESERVED_RANGES, base,
+            len, 0, "reserved");
+}
+
+/* proximity domains are used as pmm node numbers directly */
+static uint domain_to_numa_node(uint32_t domain) {
+  if (domain >= PMM_MAX_NUMA_NODES) {
+    printf("MEM: proximity domain %u out of range, using node 0\n", domain);
+    return 0;
+  }
+  return domain;
+}
+
+static void add_numa_range(uint64_t base, uint64_t len, uint32_t domain) {
+  add_range(numa_ranges, &numa_range_count, MAX_NUMA_RANGES, base, len,
+            domain_to_numa_node(domain), "numa");
+}
+
+/* note: assumes cpu numbers match MPIDR 0:0:0:N and the ACPI processor UIDs */
+static void set_cpu_node(uint64_t cpu, uint32_t domain) {
+  if (cpu < SMP_MAX_CPUS) {
+    pmm_set_cpu_numa_node(cpu, domain_to_numa_node(domain));
+  }
+}
+
+static void fdt_memcallback(uint64_t base, uint64_t len, void *cookie) {
+  add_memory_range(base, len);
+}
+
+static void fdt_memnodecallback(uint64_t base, uint64_t len, uint32_t node,
+                                void *cookie) {
+  add_numa_range(base, len, node);
+}
+
+static void fdt_cpunodecallback(uint64_t id, uint32_t node, void *cookie) {
+  set_cpu_node(id & 0xff, node);
+}
+
+static void fdt_reservedcallback(uint64_t base, uint64_t len, void *cookie) {
+  add_reserved_range(base, len);
+}
+
+static void srat_memcallback(const void *_entry, size_t entry_len) {
+  const struct acpi_srat_memory_affinity_entry *entry = _entry;
+
+  if (entry_len < sizeof(*entry) || !(entry->flags & ACPI_SRAT_FLAG_ENABLED)) {
+    return;
+  }
+
+  add_numa_range(
+      ((uint64_t)entry->base_address_high << 32) | entry->base_address_low,
+      ((uint64_t)entry->length_high << 32) | entry->length_low,
+      entry->proximity_domain);
+}
+
+static void srat_cpucallback(const void *_entry, size_t entry_len) {
+  const struct acpi_srat_gicc_affinity_entry *entry = _entry;
+
+  if (entry_len < sizeof(*entry) || !(entry->flags & ACPI_SRAT_FLAG_ENABLED)) {
+    return;
+  }
+
+  set_cpu_node(entry->acpi_processor_uid, entry->proximity_domain);
+}
+
+static void acpi_tablecallback(paddr_t pa, size_t len) {
+  add_reserved_range(pa, len);
+}
+
+/* The loader may hand us the physical address of a FDT or an ACPI RSDP in x0.
+ * Only the FDT carries a RAM map: its /memory nodes, less the blob itself and
+ * its reservations. The ACPI tables only supply the NUMA layout. */
+static bool find_memory_ranges(void) {
+  paddr_t tables = lk_boot_args[0];
+  if (!tables || !paddr_to_kvaddr(tables)) {
+    return false;
+  }
+
+  const void *fdt = paddr_to_kvaddr(tables);
+  struct fdt_walk_callbacks cb = {
+      .mem = fdt_memcallback,
+      .memnode = fdt_memnodecallback,
+      .cpunode = fdt_cpunodecallback,
+      .reserved = fdt_reservedcallback,
+  };
+  if (fdt_walk(fdt, &cb) == NO_ERROR && memory_range_count > 0) {
+    printf("MEM: using memory map from FDT at %#lx\n", tables);
+    add_reserved_range(tables, fdt_totalsize(fdt));
+    return true;
+  }
+
+  memory_range_count = numa_range_count = reserved_range_count = 0;
+  if (acpi_lite_init(tables) == NO_ERROR) {
+    acpi_process_table_ranges(acpi_tablecallback);
+    acpi_process_srat_entries_etc(ACPI_SRAT_TYPE_MEMORY_AFFINITY,
+                                  srat_memcallback);
+    acpi_process_srat_entries_etc(ACPI_SRAT_TYPE_GICC_AFFINITY,
+                                  srat_cpucallback);
+  }
+
+  return false;
+}
+
+static void add_arena(uint64_t base, uint64_t len, uint numa_node,
+                      bool highmem) {
+  uint64_t end = ROUNDDOWN(base + len, PAGE_SIZE);
+  base = ROUNDUP(base, PAGE_SIZE);
+  if (end <= base) {
+    return;
+  }
+
+  if (arena_count == countof(arenas)) {
+    printf("MEM: too many arenas, ignoring %#llx size %#llx\n", base,
+           end - base);
+    return;
+  }
+
+  pmm_arena_t *a = &arenas[arena_count];
+  snprintf(arena_names[arena_count], sizeof(arena_names[arena_count]),
+           "ram%u", arena_count);
+  a->name = arena_names[arena_count];
+  a->base = base;
+  a->size = end - base;
+  a->flags = PMM_ARENA_FLAG_KMAP;
+  a->numa_node = numa_node;
+  /* prefer the memory that is mapped from the start */
+  a->priority = highmem ? 1 : 0;
+
+  printf("MEM: arena '%s' base %#llx size %#llx node %u%s\n", a->name, base,
+         end - base, numa_node, highmem ? " (high memory)" : "");
+
+  status_t err = highmem ? pmm_add_highmem_arena(a, KERNEL_BASE + base)
+                         : pmm_add_arena(a);
+  if (err < 0) {
+    printf("MEM: failed to add arena '%s', err %d\n", a->name, err);
+    return;
+  }
+
+  arena_count++;
+}
+
+/* Split a RAM range between the initial "memory" mapping and the high memory
+ * window. RAM between the end of the aperture and 4GB sits under the
+ * peripheral mapping and is left alone. */
+static void add_arenas_for_range(uint64_t base, uint64_t end, uint numa_node) {
+  if (base < MEMORY_BASE_PHYS + MEMORY_APERTURE_SIZE) {
+    add_arena(base, MIN(end, MEMORY_BASE_PHYS + MEMORY_APERTURE_SIZE) - base,
+              numa_node, false);
+  }
+
+  base = MAX(base, HIGHMEM_BASE_PHYS);
+  end = MIN(end, HIGHMEM_LIMIT_PHYS);
+  if (end > base) {
+    add_arena(base, end - base, numa_node, true);
+  }
+}
+
+/* Cut a RAM range at the edges of the NUMA ranges so every arena sits in one
+ * node. RAM no NUMA range covers goes to node 0. */
+static void add_arenas_by_node(uint64_t base, uint64_t end) {
+  while (base < end) {
+    uint64_t next = end;
+    uint numa_node = 0;
+
+    for (uint i = 0; i < numa_range_count; i++) {
+      uint64_t nbase = numa_ranges[i].base;
+      uint64_t nend = nbase + numa_ranges[i].len;
+      if (base >= nbase && base < nend) {
+        numa_node = numa_ranges[i].numa_node;
+        next = MIN(next, nend);
+      } else if (nbase > base) {
+        next = MIN(next, nbase);
+      }
+    }
+
+    add_arenas_for_range(base, next, numa_node);
+    base = next;
+  }
+}
+
+/* Take every page of a range out of the arenas for good. Pages that are in no
+ * arena or already in use are stepped over. */
+static void reserve_range(uint64_t base, uint64_t len) {
+  paddr_t addr = ROUNDDOWN(base, PAGE_SIZE);
+  paddr_t end = ROUNDUP(base + len, PAGE_SIZE);
+  struct list_node list = LIST_INITIAL_VALUE(list);
+
+  LTRACEF("base %#llx len %#llx\n", base, len);
+
+  while (addr < end) {
+    size_t count = pmm_alloc_range(addr, (end - addr) / PAGE_SIZE, &list);
+    addr += (count + 1) * PAGE_SIZE;
+  }
+}
+
+static void add_memory_arenas(void) {
+  if (!find_memory_ranges()) {
+    printf("MEM: no firmware memory map, using %#llx bytes\n",
+           (uint64_t)DEFAULT_MEMORY_SIZE);
+    add_memory_range(MEMORY_BASE_PHYS, DEFAULT_MEMORY_SIZE);
+  }
+
+  for (uint i = 0; i < memory_range_count; i++) {
+    add_arenas_by_node(memory_ranges[i].base,
+                       memory_ranges[i].base + memory_ranges[i].len);
+  }
+
+  /* before anything can be allocated out of the new arenas */
+  for (uint i = 0; i < reserved_range_count; i++) {
+    reserve_range(reserved_ranges[i].base, reserved_ranges[i].len);
+  }
+}
+
 void platform_early_init(void) {
   /* GIC, Timer and then UART */
   uart_init_early();
@@ -82,11 +349,27 @@ void platform_early_init(void) {
   printf("Bring up Timer\n");
   arm_generic_timer_init(ARM_GENERIC_TIMER_VIRTUAL_INT, 0);
 
-  /* add the main memory arena */
-  pmm_add_arena(&arena);
+  /* add the memory arenas */
+  add_memory_arenas();
 
-  /* hardcoded */
+#if WITH_SMP
+  /* There is no FDT to count the cpus from, so ask PSCI to start every cpu we
+   * can schedule on. Firmware rejects MPIDRs that do not exist. */
+  int cpu_count = 1;
+  for (int cpuid = 1; cpuid < SMP_MAX_CPUS; cpuid++) {
+    /* note: assumes cpuids are numbered like MPIDR 0:0:0:N */
+    int ret = psci_call(ARM_SMC_ID_PSCI_CPU_ON, cpuid,
+                        MEMBASE + KERNEL_LOAD_OFFSET, cpuid);
+    if (ret == PSCI_RET_SUCCESS) {
+      cpu_count++;
+    } else if (ret != PSCI_RET_INVALID_PARAMETERS) {
+      printf("ERROR: psci CPU_ON for cpu %d returns %d\n", cpuid, ret);
+    }
+  }
+  printf("PSCI: started %d cpus\n", cpu_count);
+#else
   LTRACEF("booting %d cpus\n", 1);
+#endif
 }
 
 void platform_init(void) {
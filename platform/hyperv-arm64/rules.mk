@@ -12,8 +12,9 @@ ifeq ($(ARCH),arm64)
 ARM_CPU ?= cortex-a53
 endif
 
-# Intentionally
-WITH_SMP := 0
+# Secondary cpus are started through PSCI CPU_ON
+WITH_SMP ?= 1
+SMP_MAX_CPUS ?= 8
 
 LK_HEAP_IMPLEMENTATION ?= dlmalloc
 
@@ -28,7 +29,9 @@ MEMSIZE ?= 0xE0000000   # 3584MB memory
 KERNEL_LOAD_OFFSET := 0x04000000 # 64MB
 
 MODULE_DEPS += \
+    lib/acpi_lite \
     lib/cbuf \
+    lib/fdtwalk \
     dev/timer/arm_generic \
     dev/interrupt/arm_gic_v3
 
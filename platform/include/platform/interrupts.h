@@ -23,6 +23,16 @@ status_t unmask_interrupt(unsigned int vector);
 typedef enum handler_return (*int_handler)(void *arg);
 void register_int_handler(unsigned int vector, int_handler handler, void *arg);
 
+/* Register a threaded interrupt handler, where the interrupt controller supports it.
+ * The optional top half runs in interrupt context and returns true if the bottom
+ * half should run. The bottom half runs in a high priority kernel thread on the cpu
+ * that took the interrupt, and the vector is not delivered again until it returns.
+ */
+typedef bool (*int_top_half)(void *arg);
+typedef void (*int_bottom_half)(void *arg);
+void register_threaded_int_handler(unsigned int vector, int_top_half top_half,
+                                   int_bottom_half bottom_half, void *arg);
+
 /* Register a MSI interrupt handler. Basically the same as register_int_handler, except
  * interrupt controller may have additional setup.
  */
@@ -33,6 +43,20 @@ void register_int_handler_msi(unsigned int vector, int_handler handler, void *ar
  */
 status_t platform_allocate_interrupts(size_t count, uint align_log2, unsigned int *vector);
 
+/* Allocate a run of message signaled interrupts for the device with the given
+ * requester id (the PCI bus/device/function), starting at a multiple of
+ * 1 << align_log2. Vector vector_base + n is raised by writing msi_data_base + n
+ * to msi_address.
+ */
+status_t platform_allocate_msi(uint32_t requester_id, size_t count, uint align_log2,
+                               unsigned int *vector_base, uint64_t *msi_address,
+                               uint32_t *msi_data_base);
+
+/* Release a run of vectors from platform_allocate_msi(). The handlers have to be
+ * unregistered and the device must no longer send the messages.
+ */
+status_t platform_free_msi(unsigned int vector_base, size_t count);
+
 /* Map the incoming interrupt line number from the pci bus config to raw
  * vector number, usable in the above apis.
  */
@@ -22,5 +22,8 @@ lk_time_t current_time(void);
 /* Time in units of microseconds */
 lk_bigtime_t current_time_hires(void);
 
+/* Time in units of nanoseconds, defaults to current_time_hires() * 1000 */
+lk_time_ns_t current_time_ns(void);
+
 __END_CDECLS
 
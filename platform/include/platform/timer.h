@@ -29,5 +29,11 @@ status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg
 status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval);
 void     platform_stop_timer(void);
 
+/* Dynamic timer armed for an absolute deadline on the current_time_ns() clock.
+ * Platforms that do not implement it fall back to platform_set_oneshot_timer()
+ * with the interval rounded up to the next millisecond.
+ */
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t deadline);
+
 __END_CDECLS
 
@@ -8,6 +8,7 @@
 #include <lk/err.h>
 #include <lk/debug.h>
 #include <platform.h>
+#include <platform/interrupts.h>
 
 /*
  * default implementations of these routines, if the platform code
@@ -26,3 +27,13 @@ __WEAK void platform_init(void) {
 __WEAK void platform_quiesce(void) {
 }
 
+__WEAK status_t platform_allocate_msi(uint32_t requester_id, size_t count, uint align_log2,
+                                      unsigned int *vector_base, uint64_t *msi_address,
+                                      uint32_t *msi_data_base) {
+    return ERR_NOT_SUPPORTED;
+}
+
+__WEAK status_t platform_free_msi(unsigned int vector_base, size_t count) {
+    return ERR_NOT_SUPPORTED;
+}
+
@@ -172,23 +172,33 @@ status_t platform_pci_int_to_vector(unsigned int pci_int, unsigned int *vector)
 
 status_t platform_allocate_interrupts(size_t count, uint align_log2, unsigned int *vector) {
     LTRACEF("count %zu, align %u\n", count, align_log2);
-    if (align_log2 > 1) {
-        PANIC_UNIMPLEMENTED;
+    if (count == 0 || count > INT_VECTORS || align_log2 > 7) {
+        return ERR_INVALID_ARGS;
     }
 
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&lock, state);
 
-    // find a free interrupt
+    // find a run of free interrupts starting at the requested alignment
     status_t err = ERR_NOT_FOUND;
-    for (unsigned int i = 0; i < INT_VECTORS; i++) {
-        if (!int_table[i].flags.allocated) {
-            int_table[i].flags.allocated = true;
-            *vector = i;
-            LTRACEF("found irq %#x\n", i);
-            err = NO_ERROR;
-            break;
+    for (unsigned int i = 0; i + count <= INT_VECTORS; i += (1U << align_log2)) {
+        size_t j;
+        for (j = 0; j < count; j++) {
+            if (int_table[i + j].flags.allocated) {
+                break;
+            }
+        }
+        if (j < count) {
+            continue;
         }
+
+        for (j = 0; j < count; j++) {
+            int_table[i + j].flags.allocated = true;
+        }
+        *vector = i;
+        LTRACEF("found irq %#x\n", i);
+        err = NO_ERROR;
+        break;
     }
 
     spin_unlock_irqrestore(&lock, state);
@@ -196,3 +206,38 @@ status_t platform_allocate_interrupts(size_t count, uint align_log2, unsigned in
     return err;
 }
 
+status_t platform_allocate_msi(uint32_t requester_id, size_t count, uint align_log2,
+                               unsigned int *vector_base, uint64_t *msi_address,
+                               uint32_t *msi_data_base) {
+    status_t err = platform_allocate_interrupts(count, align_log2, vector_base);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    // the local apic decodes the message, the data is simply the vector
+    *msi_address = 0xfee00000 | (0 << 12); // cpu 0
+    *msi_data_base = (*vector_base & 0xff) | (0 << 15); // edge triggered
+
+    return NO_ERROR;
+}
+
+status_t platform_free_msi(unsigned int vector_base, size_t count) {
+    // only the dynamic range is ever handed out for msi
+    if (count == 0 || vector_base < INT_DYNAMIC_START || vector_base > INT_DYNAMIC_END ||
+            count > INT_DYNAMIC_END - vector_base + 1) {
+        return ERR_INVALID_ARGS;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock, state);
+
+    for (size_t i = 0; i < count; i++) {
+        int_table[vector_base + i].handler = NULL;
+        int_table[vector_base + i].arg = NULL;
+        int_table[vector_base + i].flags.allocated = false;
+    }
+
+    spin_unlock_irqrestore(&lock, state);
+
+    return NO_ERROR;
+}
@@ -29,6 +29,9 @@
 #if WITH_DEV_BUS_PCI
 #include <dev/bus/pci.h>
 #endif
+#if WITH_DEV_VIRTIO
+#include <dev/virtio.h>
+#endif
 #if WITH_LIB_MINIP
 #include <lib/minip.h>
 #endif
@@ -293,6 +296,10 @@ void platform_init(void) {
     if (!pci_initted) {
         pci_init_legacy();
     }
+
+#if WITH_DEV_VIRTIO
+    virtio_pci_detect();
+#endif
 #endif
 
     platform_init_mmu_mappings();
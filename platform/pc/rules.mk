@@ -14,6 +14,8 @@ MODULE_DEPS += \
 ifneq ($(CPU),legacy)
 MODULE_DEPS += dev/bus/pci
 MODULE_DEPS += dev/net/e1000
+MODULE_DEPS += dev/virtio/block
+MODULE_DEPS += dev/virtio/net
 endif
 
 MODULE_SRCS += \
@@ -11,5 +11,7 @@
 
 #define GICBASE(n) (CPUPRIV_BASE_VIRT)
 #define GICRBASE (PERIPHERAL_BASE_VIRT + 0x080A0000)
+#define GITSBASE (PERIPHERAL_BASE_VIRT + 0x08080000)
+#define GITSBASE_PHYS (PERIPHERAL_BASE_PHYS + 0x08080000)
 #define GICD_OFFSET (0x00000)
 #define GICC_OFFSET (0x10000)
@@ -7,6 +7,7 @@
  */
 #include <arch.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <lk/err.h>
 #include <lk/debug.h>
 #include <lk/trace.h>
@@ -64,37 +65,55 @@ struct mmu_initial_mapping mmu_initial_mappings[] = {
     { 0 }
 };
 
-static pmm_arena_t arena = {
-    .name = "ram",
-    .base = MEMORY_BASE_PHYS,
-    .size = DEFAULT_MEMORY_SIZE,
-    .flags = PMM_ARENA_FLAG_KMAP,
-};
+/* memory ranges found in the FDT, each one becomes an arena plus one for any
+ * part of it past the end of the initial mapping */
+#define MAX_MEMORY_RANGES 8
+
+static struct {
+    uint64_t base;
+    uint64_t len;
+    uint numa_node;
+} memory_ranges[MAX_MEMORY_RANGES];
+static uint memory_range_count;
+
+static pmm_arena_t arenas[MAX_MEMORY_RANGES * 2];
+static char arena_names[MAX_MEMORY_RANGES * 2][16];
+static uint arena_count;
 
 extern int psci_call(ulong arg0, ulong arg1, ulong arg2, ulong arg3);
 
 // callbacks to the fdt_walk routine
 static void memcallback(uint64_t base, uint64_t len, void *cookie) {
-    bool *found_mem = (bool *)cookie;
-
     LTRACEF("base %#llx len %#llx cookie %p\n", base, len, cookie);
 
-    /* add another novm arena */
-    if (!*found_mem) {
-        printf("FDT: found memory arena, base %#llx size %#llx\n", base, len);
+    if (memory_range_count == MAX_MEMORY_RANGES) {
+        printf("FDT: too many memory ranges, ignoring base %#llx size %#llx\n", base, len);
+        return;
+    }
+
+    printf("FDT: found memory arena, base %#llx size %#llx\n", base, len);
 
-        /* trim size on certain platforms */
-#if ARCH_ARM
-        if (len > 1024*1024*1024U) {
-            len = 1024*1024*1024; /* only use the first 1GB on ARM32 */
-            printf("trimming memory to 1GB\n");
-        }
-#endif
+    memory_ranges[memory_range_count].base = base;
+    memory_ranges[memory_range_count].len = len;
+    memory_ranges[memory_range_count].numa_node = 0;
+    memory_range_count++;
+}
 
-        /* set the size in the pmm arena */
-        arena.size = len;
+/* numa-node-id values are used as pmm node numbers directly */
+static uint fdt_numa_node(uint32_t node) {
+    if (node >= PMM_MAX_NUMA_NODES) {
+        printf("FDT: numa node %u out of range, using node 0\n", node);
+        return 0;
+    }
+    return node;
+}
+
+static void memnodecallback(uint64_t base, uint64_t len, uint32_t node, void *cookie) {
+    LTRACEF("base %#llx len %#llx node %u\n", base, len, node);
 
-        *found_mem = true; // stop searching after the first one
+    for (uint i = 0; i < memory_range_count; i++) {
+        if (memory_ranges[i].base == base)
+            memory_ranges[i].numa_node = fdt_numa_node(node);
     }
 }
 
@@ -106,6 +125,74 @@ static void cpucallback(uint64_t id, void *cookie) {
     (*cpu_count)++;
 }
 
+static void cpunodecallback(uint64_t id, uint32_t node, void *cookie) {
+    LTRACEF("id %#llx node %u\n", id, node);
+
+    /* note: assumes cpuids are numbered like MPIDR 0:0:0:N */
+    uint cpu = id & 0xff;
+    if (cpu < SMP_MAX_CPUS)
+        pmm_set_cpu_numa_node(cpu, fdt_numa_node(node));
+}
+
+static void add_arena(uint64_t base, uint64_t len, uint numa_node, bool highmem) {
+    pmm_arena_t *a = &arenas[arena_count];
+
+    snprintf(arena_names[arena_count], sizeof(arena_names[arena_count]), "ram%u", arena_count);
+    a->name = arena_names[arena_count];
+    a->base = base;
+    a->size = len;
+    a->flags = PMM_ARENA_FLAG_KMAP;
+    a->numa_node = numa_node;
+    /* prefer the memory that is mapped from the start */
+    a->priority = highmem ? 1 : 0;
+
+    status_t err;
+    if (highmem) {
+        printf("adding high memory arena, base %#llx size %#llx\n", base, len);
+        err = pmm_add_highmem_arena(a, KERNEL_BASE + (base - MEMORY_BASE_PHYS));
+    } else {
+        err = pmm_add_arena(a);
+    }
+    if (err < 0) {
+        printf("failed to add arena '%s', err %d\n", a->name, err);
+        return;
+    }
+
+    arena_count++;
+}
+
+static void add_memory_arenas(void) {
+    const uint64_t aperture_end = MEMORY_BASE_PHYS + MEMORY_APERTURE_SIZE;
+
+    if (memory_range_count == 0) {
+        memory_ranges[0].base = MEMORY_BASE_PHYS;
+        memory_ranges[0].len = DEFAULT_MEMORY_SIZE;
+        memory_range_count = 1;
+    }
+
+    for (uint i = 0; i < memory_range_count; i++) {
+        uint64_t base = ROUNDUP(memory_ranges[i].base, PAGE_SIZE);
+        uint64_t end = ROUNDDOWN(memory_ranges[i].base + memory_ranges[i].len, PAGE_SIZE);
+        if (end <= base || base < MEMORY_BASE_PHYS)
+            continue;
+
+        /* the part covered by the initial mapping */
+        if (base < aperture_end) {
+            add_arena(base, MIN(end, aperture_end) - base, memory_ranges[i].numa_node, false);
+        }
+
+        /* anything past it gets its own window in the kernel address space */
+        base = MAX(base, aperture_end);
+        if (end > base) {
+#if ARCH_ARM64
+            add_arena(base, end - base, memory_ranges[i].numa_node, true);
+#else
+            printf("trimming memory to %#llx\n", aperture_end);
+#endif
+        }
+    }
+}
+
 struct pcie_detect_state {
     uint64_t ecam_base;
     uint64_t ecam_len;
@@ -137,11 +224,11 @@ void platform_early_init(void) {
     uart_init_early();
 
     int cpu_count = 0;
-    bool found_mem = false;
     struct fdt_walk_callbacks cb = {
         .mem = memcallback,
-        .memcookie = &found_mem,
+        .memnode = memnodecallback,
         .cpu = cpucallback,
+        .cpunode = cpunodecallback,
         .cpucookie = &cpu_count,
         .pcie = pciecallback,
         .pciecookie = &pcie_state,
@@ -155,8 +242,8 @@ void platform_early_init(void) {
         printf("FDT: error finding FDT at %p, using default memory & cpu count\n", fdt);
     }
 
-    /* add the main memory arena */
-    pmm_add_arena(&arena);
+    /* add the memory arenas */
+    add_memory_arenas();
 
     /* reserve the first 64k of ram, which should be holding the fdt */
     struct list_node list = LIST_INITIAL_VALUE(list);
@@ -190,6 +277,11 @@ void platform_early_init(void) {
 void platform_init(void) {
     uart_init();
 
+#ifdef USE_GIC_V3
+    /* bring up the ITS so pci devices can use MSI and MSI-X */
+    arm_gicv3_its_init(GITSBASE, GITSBASE_PHYS);
+#endif
+
     /* detect pci */
 #if ARCH_ARM
     if (pcie_state.ecam_base > (1ULL << 32)) {
@@ -210,6 +302,9 @@ void platform_init(void) {
     }
 
     virtio_mmio_detect((void *)VIRTIO_BASE, NUM_VIRTIO_TRANSPORTS, virtio_irqs, 0x200);
+    if (pcie_state.ecam_len > 0) {
+        virtio_pci_detect();
+    }
 
 #if WITH_LIB_MINIP
     if (virtio_net_found() > 0) {
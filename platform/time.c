@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lk/compiler.h>
+#include <lk/err.h>
+#include <platform.h>
+#include <platform/time.h>
+#include <platform/timer.h>
+
+/*
+ * default implementations of the nanosecond time routines, if the platform code
+ * chooses not to implement.
+ */
+__WEAK lk_time_ns_t current_time_ns(void) {
+    return current_time_hires() * 1000;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+__WEAK status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t deadline) {
+    lk_time_ns_t now = current_time_ns();
+    lk_time_ns_t interval_ns = (deadline > now) ? deadline - now : 0;
+
+    /* round up so the timer never fires ahead of the deadline */
+    lk_time_ns_t interval = (interval_ns + 999999) / 1000000;
+    if (interval > UINT32_MAX - 1)
+        interval = UINT32_MAX - 1;
+
+    return platform_set_oneshot_timer(callback, arg, (lk_time_t)interval);
+}
+#endif